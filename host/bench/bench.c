@@ -0,0 +1,160 @@
+/*
+ * bench.c
+ *
+ *  Times the hot paths of the firmware on the host: the /jpg handler,
+ *  encoding a frame for the LED strips and answering a multicast
+ *  discovery. The fakes stand in for the camera, the network and the
+ *  RMT, so the numbers compare builds of the firmware with each other,
+ *  not with the device. --quick runs a few iterations as a smoke test.
+ */
+
+#include "host_fake.h"
+#include "boot.h"
+#include "settings.h"
+#include "LED.h"
+#include "mulmsg.h"
+#include <esp_timer.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defined by main.c
+void app_main(void);
+
+// Durations of one benchmark in us
+typedef struct {
+    const char *name;
+    int64_t *samples;
+    int count;
+} bench_t;
+
+static int compare_samples(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+// Prints the mean and percentiles of a benchmark
+static void bench_report(bench_t *bench) {
+    int64_t sum = 0;
+
+    qsort(bench->samples, bench->count, sizeof(int64_t), compare_samples);
+
+    for (int i = 0; i < bench->count; i++) {
+        sum += bench->samples[i];
+    }
+
+    printf("%-12s %6d %10.1f %10lld %10lld %10lld\n", bench->name, bench->count, (double) sum / bench->count,
+           (long long) bench->samples[bench->count / 2], (long long) bench->samples[bench->count * 99 / 100],
+           (long long) bench->samples[bench->count - 1]);
+}
+
+// GET /jpg at the camera's rate, the handler time without the network
+static void bench_jpg(bench_t *bench) {
+    fake_http_response_t response;
+
+    for (int i = 0; i < bench->count; i++) {
+        if (fake_httpd_get(80, "/jpg", NULL, &response) != ESP_OK || fake_http_status(&response) != 200) {
+            fprintf(stderr, "/jpg failed with %s\n", response.status);
+            exit(1);
+        }
+
+        bench->samples[i] = response.duration_us;
+        fake_http_response_free(&response);
+    }
+}
+
+// A full frame for all strips, from write_leds until it is latched with the RMT sending instantly
+static void bench_leds(bench_t *bench) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    struct led_state state;
+
+    fake_rmt_set_time_scale(0);
+
+    for (int i = 0; i < bench->count; i++) {
+        for (int led = 0; led < NUM_LEDS; led++) {
+            state.leds[led] = (i * 0x010203 + led * 0x0A0B0C) & 0xFFFFFF;
+        }
+
+        int64_t start = esp_timer_get_time();
+        write_leds_notify(&state, self);
+
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000)) == 0) {
+            fprintf(stderr, "LED frame not latched\n");
+            exit(1);
+        }
+
+        bench->samples[i] = esp_timer_get_time() - start;
+    }
+}
+
+// "Are You There?" from the controller until the "Here I Am!" answer arrives
+static void bench_mcast(bench_t *bench) {
+    struct sockaddr_in controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = inet_addr("10.0.0.1"),
+    };
+    char request[MULMSG_LEN] = {0};
+    char reply[64];
+    struct sockaddr_in to;
+    mulmsg *msg = mulmsg_wrap(request, MULMSG_LEN);
+
+    mulmsg_setSource(msg, 1);
+    mulmsg_setAlive(msg, 0);
+    mulmsg_setDeviceId(msg, 1);
+
+    for (int i = 0; i < bench->count; i++) {
+        int64_t start = esp_timer_get_time();
+        int len = -1;
+
+        fake_net_inject(CONFIG_MULTICAST_PORT, &controller, request, sizeof(request), 1000);
+
+        // The answer is followed by the v2 announcement, handshake requests to the group are skipped
+        while ((len = fake_net_receive(CONFIG_MULTICAST_PORT, &to, reply, sizeof(reply), 1000)) >= 0
+                && to.sin_addr.s_addr != controller.sin_addr.s_addr) {
+        }
+
+        if (len < 0) {
+            fprintf(stderr, "No answer to the discovery\n");
+            exit(1);
+        }
+
+        bench->samples[i] = esp_timer_get_time() - start;
+
+        // Drain what else the station sent before the next round
+        while (fake_net_receive(CONFIG_MULTICAST_PORT, &to, reply, sizeof(reply), 5) >= 0) {
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+    int count = quick ? 10 : 500;
+    bench_t benches[] = {
+            { .name = "jpg" },
+            { .name = "leds" },
+            { .name = "mcast" },
+    };
+    void (*runs[])(bench_t *) = { bench_jpg, bench_leds, bench_mcast };
+
+    // The camera is not the bottleneck, frames are ready at once
+    fake_camera_set_fps(1000);
+    app_main();
+    boot_wait(BOOT_CAMERA);
+    boot_wait(BOOT_NETWORK);
+
+    printf("%-12s %6s %10s %10s %10s %10s\n", "bench", "runs", "mean_us", "p50_us", "p99_us", "max_us");
+
+    for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        benches[i].count = count;
+        benches[i].samples = calloc(count, sizeof(int64_t));
+        runs[i](&benches[i]);
+        bench_report(&benches[i]);
+        free(benches[i].samples);
+    }
+
+    return 0;
+}
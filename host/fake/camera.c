@@ -0,0 +1,353 @@
+/*
+ * camera.c
+ *
+ *  esp32-camera driver producing synthetic JPEG frames at a fixed rate.
+ *  Each frame is FAKE_JPEG_HEADER_LEN bytes describing it, filler and an
+ *  end of image marker. Like the driver in continuous mode, sensor
+ *  settings only reach the frames started after the ones already queued.
+ */
+
+#include "fake.h"
+#include "host_fake.h"
+#include <esp_camera.h>
+#include <esp_log.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// The driver gives up on a frame after this long
+#define CAMERA_FB_TIMEOUT_MS 4000
+#define CAMERA_MAX_FB 8
+
+const resolution_info_t resolution[] = {
+        { 160, 120 },       // QQVGA
+        { 128, 160 },       // QQVGA2
+        { 176, 144 },       // QCIF
+        { 240, 176 },       // HQVGA
+        { 320, 240 },       // QVGA
+        { 400, 296 },       // CIF
+        { 640, 480 },       // VGA
+        { 800, 600 },       // SVGA
+        { 1024, 768 },      // XGA
+        { 1280, 1024 },     // SXGA
+        { 1600, 1200 },     // UXGA
+        { 2048, 1536 },     // QXGA
+};
+
+static const char *TAG = "camera";
+
+// Driver state, guarded by camera_lock
+static pthread_mutex_t camera_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t camera_cond;
+static int camera_ready = 0;
+static camera_fb_t fbs[CAMERA_MAX_FB];
+static int fb_taken[CAMERA_MAX_FB];
+static size_t fb_size[CAMERA_MAX_FB];   // allocated, buffers only grow like the driver's are fixed
+static int fb_count = 1;
+static uint32_t frames = 0;
+static int64_t last_frame_us = 0;
+// Settings of the frames produced and those waiting for apply_at
+static framesize_t framesize;
+static uint8_t quality;
+static framesize_t pending_framesize;
+static uint8_t pending_quality;
+static uint32_t apply_at = 0;
+static int settings_pending = 0;
+// Controls
+static int fps = 25;
+static uint8_t scene = 0;
+static size_t jpeg_len = 0;
+static int latency = -1;
+static int init_delay_ms = 0;
+static int fail_count = 0;
+static uint32_t sensor_writes = 0;
+static sensor_t sensor;
+
+// Queues new settings behind the frames already captured with the old ones
+static void settings_queue(void) {
+    int frames_late = latency >= 0 ? latency : fb_count - 1;
+
+    settings_pending = 1;
+    apply_at = frames + frames_late;
+}
+
+static int sensor_set_framesize(sensor_t *s, framesize_t size) {
+    if (size < 0 || size >= FRAMESIZE_INVALID) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&camera_lock);
+    pending_framesize = size;
+    sensor_writes++;
+    settings_queue();
+    s->status.framesize = size;
+    pthread_mutex_unlock(&camera_lock);
+    return 0;
+}
+
+static int sensor_set_quality(sensor_t *s, int q) {
+    if (q < 0 || q > 63) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&camera_lock);
+    pending_quality = q;
+    sensor_writes++;
+    settings_queue();
+    s->status.quality = q;
+    pthread_mutex_unlock(&camera_lock);
+    return 0;
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config) {
+    if (config->fb_count < 1 || config->fb_count > CAMERA_MAX_FB || config->frame_size >= FRAMESIZE_INVALID) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (init_delay_ms > 0) {
+        fake_sleep_us(init_delay_ms * 1000LL);
+    }
+
+    pthread_mutex_lock(&camera_lock);
+
+    if (camera_ready) {
+        pthread_mutex_unlock(&camera_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    fake_cond_init(&camera_cond);
+    fb_count = config->fb_count;
+    framesize = pending_framesize = config->frame_size;
+    quality = pending_quality = config->jpeg_quality;
+    sensor = (sensor_t) {
+            .pixformat = config->pixel_format,
+            .status = {
+                    .framesize = config->frame_size,
+                    .quality = config->jpeg_quality,
+            },
+            .set_framesize = sensor_set_framesize,
+            .set_quality = sensor_set_quality,
+    };
+    camera_ready = 1;
+    pthread_mutex_unlock(&camera_lock);
+
+    ESP_LOGI(TAG, "Fake camera with %d frame buffers", fb_count);
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_deinit(void) {
+    pthread_mutex_lock(&camera_lock);
+    camera_ready = 0;
+    pthread_mutex_unlock(&camera_lock);
+    return ESP_OK;
+}
+
+// Writes a synthetic frame of the current settings into a buffer, caller holds the lock
+static void frame_fill(int index) {
+    camera_fb_t *fb = &fbs[index];
+    const resolution_info_t *res = &resolution[framesize];
+    size_t len = jpeg_len;
+
+    if (len == 0) {
+        len = (size_t) res->width * res->height * 2 / (quality + 12) + FAKE_JPEG_HEADER_LEN;
+    }
+
+    if (len < FAKE_JPEG_HEADER_LEN + 2) {
+        len = FAKE_JPEG_HEADER_LEN + 2;
+    }
+
+    if (len > fb_size[index]) {
+        fb->buf = realloc(fb->buf, len);
+        fb_size[index] = len;
+    }
+
+    uint8_t *buf = fb->buf;
+    uint32_t counter = frames;
+
+    buf[0] = 0xFF;
+    buf[1] = 0xD8;
+    buf[2] = 'F';
+    buf[3] = 'J';
+    buf[4] = res->width & 0xFF;
+    buf[5] = res->width >> 8;
+    buf[6] = res->height & 0xFF;
+    buf[7] = res->height >> 8;
+    buf[8] = quality;
+    buf[9] = scene;
+    buf[10] = framesize;
+    buf[11] = 0;
+    memcpy(buf + 12, &counter, sizeof(counter));
+    memset(buf + FAKE_JPEG_HEADER_LEN, 0x55, len - FAKE_JPEG_HEADER_LEN - 2);
+    buf[len - 2] = 0xFF;
+    buf[len - 1] = 0xD9;
+
+    fb->len = len;
+    fb->width = res->width;
+    fb->height = res->height;
+    fb->format = PIXFORMAT_JPEG;
+    gettimeofday(&fb->timestamp, NULL);
+}
+
+camera_fb_t *esp_camera_fb_get(void) {
+    struct timespec deadline = fake_deadline_us(CAMERA_FB_TIMEOUT_MS * 1000LL);
+    int index = -1;
+
+    pthread_mutex_lock(&camera_lock);
+
+    if (!camera_ready) {
+        pthread_mutex_unlock(&camera_lock);
+        return NULL;
+    }
+
+    if (fail_count > 0) {
+        fail_count--;
+        pthread_mutex_unlock(&camera_lock);
+        ESP_LOGE(TAG, "Timeout waiting for VSYNC");
+        return NULL;
+    }
+
+    while (index < 0) {
+        for (int i = 0; i < fb_count && index < 0; i++) {
+            if (!fb_taken[i]) {
+                index = i;
+            }
+        }
+
+        if (index < 0 && fake_cond_wait(&camera_cond, &camera_lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&camera_lock);
+            ESP_LOGE(TAG, "Failed to get the frame on time!");
+            return NULL;
+        }
+    }
+
+    fb_taken[index] = 1;
+
+    // Frames complete every period. The continuous mode hands out the next one, a single buffer is only
+    // filled from the next VSYNC on, so it takes a whole frame more
+    int64_t period = 1000000 / (fps > 0 ? fps : 1);
+    int64_t now = fake_time_us();
+    int64_t next = (now / period + 1) * period;
+
+    if (fb_count == 1) {
+        next += period;
+    } else if (next < last_frame_us + period) {
+        next = last_frame_us + period;
+    }
+
+    if (next > now) {
+        pthread_mutex_unlock(&camera_lock);
+        fake_sleep_us(next - now);
+        pthread_mutex_lock(&camera_lock);
+        now = next;
+    }
+
+    last_frame_us = now;
+
+    if (settings_pending && frames >= apply_at) {
+        framesize = pending_framesize;
+        quality = pending_quality;
+        settings_pending = 0;
+    }
+
+    frame_fill(index);
+    frames++;
+    pthread_mutex_unlock(&camera_lock);
+    return &fbs[index];
+}
+
+void esp_camera_fb_return(camera_fb_t *fb) {
+    pthread_mutex_lock(&camera_lock);
+    fb_taken[fb - fbs] = 0;
+    pthread_cond_broadcast(&camera_cond);
+    pthread_mutex_unlock(&camera_lock);
+}
+
+sensor_t *esp_camera_sensor_get(void) {
+    return camera_ready ? &sensor : NULL;
+}
+
+// Frames per second the camera produces, 25 by default
+void fake_camera_set_fps(int value) {
+    pthread_mutex_lock(&camera_lock);
+    fps = value;
+    pthread_mutex_unlock(&camera_lock);
+}
+
+// Scene of the following frames, every pixel changes with it
+void fake_camera_set_scene(uint8_t value) {
+    pthread_mutex_lock(&camera_lock);
+    scene = value;
+    pthread_mutex_unlock(&camera_lock);
+}
+
+// Length of the following frames, 0 to derive it from the frame size and quality like the sensor does
+void fake_camera_set_jpeg_len(size_t len) {
+    pthread_mutex_lock(&camera_lock);
+    jpeg_len = len;
+    pthread_mutex_unlock(&camera_lock);
+}
+
+// Frames captured with the old settings after a switch, fb_count - 1 by default like the continuous mode
+void fake_camera_set_latency(int value) {
+    pthread_mutex_lock(&camera_lock);
+    latency = value;
+    pthread_mutex_unlock(&camera_lock);
+}
+
+// Makes esp_camera_init take this long, like probing a slow sensor
+void fake_camera_set_init_delay_ms(int ms) {
+    init_delay_ms = ms;
+}
+
+// Settings written to the sensor since boot
+uint32_t fake_camera_sensor_writes(void) {
+    pthread_mutex_lock(&camera_lock);
+    uint32_t writes = sensor_writes;
+    pthread_mutex_unlock(&camera_lock);
+    return writes;
+}
+
+// Makes the next count calls of esp_camera_fb_get fail
+void fake_camera_fail_next(int count) {
+    pthread_mutex_lock(&camera_lock);
+    fail_count = count;
+    pthread_mutex_unlock(&camera_lock);
+}
+
+// Returns whether len bytes at buf lie in a frame buffer the camera handed out
+int fake_camera_owns(const void *buf, size_t len) {
+    const uint8_t *start = (const uint8_t *) buf;
+    int owned = 0;
+
+    pthread_mutex_lock(&camera_lock);
+
+    for (int i = 0; i < fb_count && !owned; i++) {
+        owned = fb_taken[i] && start >= fbs[i].buf && start + len <= fbs[i].buf + fbs[i].len;
+    }
+
+    pthread_mutex_unlock(&camera_lock);
+    return owned;
+}
+
+// Frames handed out by esp_camera_fb_get
+uint32_t fake_camera_frames(void) {
+    pthread_mutex_lock(&camera_lock);
+    uint32_t count = frames;
+    pthread_mutex_unlock(&camera_lock);
+    return count;
+}
+
+// Frame buffers currently taken
+int fake_camera_taken(void) {
+    int taken = 0;
+
+    pthread_mutex_lock(&camera_lock);
+
+    for (int i = 0; i < fb_count; i++) {
+        taken += fb_taken[i];
+    }
+
+    pthread_mutex_unlock(&camera_lock);
+    return taken;
+}
@@ -0,0 +1,114 @@
+/*
+ * esp_log.c
+ *
+ *  Logger writing to stderr with levels per tag, or to a capture
+ *  function of a test.
+ */
+
+#include "fake.h"
+#include "host_fake.h"
+#include <esp_log.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_MAX_TAGS 32
+
+// Level of a tag, the tag strings are the statics of the modules and are kept by pointer
+typedef struct {
+    const char *tag;
+    esp_log_level_t level;
+} log_tag_t;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_tag_t log_tags[LOG_MAX_TAGS];
+static int log_tag_count = 0;
+static esp_log_level_t log_default = ESP_LOG_WARN;
+static int log_default_read = 0;
+static fake_log_capture_t log_capture = NULL;
+
+// Reads ESP_LOG_LEVEL, a number from 0 for none to 5 for verbose
+static void log_read_env(void) {
+    const char *env = getenv("ESP_LOG_LEVEL");
+
+    if (env != NULL && *env >= '0' && *env <= '5') {
+        log_default = (esp_log_level_t) (*env - '0');
+    }
+
+    log_default_read = 1;
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    pthread_mutex_lock(&log_lock);
+
+    if (!log_default_read) {
+        log_read_env();
+    }
+
+    if (strcmp(tag, "*") == 0) {
+        log_default = level;
+        log_tag_count = 0;
+    } else {
+        int i = 0;
+
+        while (i < log_tag_count && strcmp(log_tags[i].tag, tag) != 0) {
+            i++;
+        }
+
+        if (i < LOG_MAX_TAGS) {
+            log_tags[i].tag = tag;
+            log_tags[i].level = level;
+            log_tag_count += i == log_tag_count;
+        }
+    }
+
+    pthread_mutex_unlock(&log_lock);
+}
+
+int esp_log_enabled(esp_log_level_t level, const char *tag) {
+    pthread_mutex_lock(&log_lock);
+
+    if (!log_default_read) {
+        log_read_env();
+    }
+
+    esp_log_level_t max = log_default;
+
+    for (int i = 0; i < log_tag_count; i++) {
+        if (strcmp(log_tags[i].tag, tag) == 0) {
+            max = log_tags[i].level;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&log_lock);
+    return level <= max;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    fake_log_capture_t capture = __atomic_load_n(&log_capture, __ATOMIC_RELAXED);
+    va_list args;
+
+    va_start(args, format);
+
+    if (capture != NULL) {
+        char line[256];
+
+        vsnprintf(line, sizeof(line), format, args);
+        capture(level, tag, line);
+    } else {
+        vfprintf(stderr, format, args);
+    }
+
+    va_end(args);
+}
+
+// Hands every line written from now on to fn instead of stderr, NULL to write to stderr again
+void fake_log_set_capture(fake_log_capture_t fn) {
+    __atomic_store_n(&log_capture, fn, __ATOMIC_RELAXED);
+}
+
+uint32_t esp_log_timestamp(void) {
+    return (uint32_t) (fake_time_us() / 1000);
+}
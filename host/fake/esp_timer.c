@@ -0,0 +1,168 @@
+/*
+ * esp_timer.c
+ *
+ *  esp_timer on a thread that runs the callbacks in deadline order.
+ */
+
+#include "fake.h"
+#include <esp_timer.h>
+#include <errno.h>
+#include <stdlib.h>
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    int armed;
+    int64_t deadline;       // esp_timer time of the next call
+    uint64_t period;        // 0 for one-shot timers
+    struct esp_timer *next;
+};
+
+// All timers, guarded by timers_lock
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timers_cond;
+static struct esp_timer *timers = NULL;
+static pthread_t timer_thread;
+static int timer_thread_started = 0;
+
+int64_t esp_timer_get_time(void) {
+    return fake_time_us();
+}
+
+// Calls the callbacks of expired timers, one at a time and without the lock held
+static void *timer_main(void *arg) {
+    fake_task_adopt("esp_timer");
+    pthread_mutex_lock(&timers_lock);
+
+    for (;;) {
+        struct esp_timer *next = NULL;
+
+        for (struct esp_timer *timer = timers; timer != NULL; timer = timer->next) {
+            if (timer->armed && (next == NULL || timer->deadline < next->deadline)) {
+                next = timer;
+            }
+        }
+
+        if (next == NULL) {
+            pthread_cond_wait(&timers_cond, &timers_lock);
+            continue;
+        }
+
+        int64_t now = fake_time_us();
+
+        if (next->deadline > now) {
+            struct timespec deadline = fake_deadline_us(next->deadline - now);
+            pthread_cond_timedwait(&timers_cond, &timers_lock, &deadline);
+            continue;
+        }
+
+        if (next->period > 0) {
+            next->deadline += next->period;
+
+            // Skip the calls a slow callback missed rather than running them back to back
+            if (next->deadline < now) {
+                next->deadline = now + next->period;
+            }
+        } else {
+            next->armed = 0;
+        }
+
+        esp_timer_cb_t callback = next->callback;
+        void *callback_arg = next->arg;
+        pthread_mutex_unlock(&timers_lock);
+        callback(callback_arg);
+        pthread_mutex_lock(&timers_lock);
+    }
+
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    struct esp_timer *timer = calloc(1, sizeof(*timer));
+
+    if (timer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->name = args->name;
+
+    pthread_mutex_lock(&timers_lock);
+
+    if (!timer_thread_started) {
+        fake_cond_init(&timers_cond);
+        pthread_create(&timer_thread, NULL, timer_main, NULL);
+        pthread_detach(timer_thread);
+        timer_thread_started = 1;
+    }
+
+    timer->next = timers;
+    timers = timer;
+    pthread_mutex_unlock(&timers_lock);
+
+    *handle = timer;
+    return ESP_OK;
+}
+
+// Arms a timer, fails like esp_timer if it already is
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us) {
+    esp_err_t res = ESP_OK;
+
+    pthread_mutex_lock(&timers_lock);
+
+    if (timer->armed) {
+        res = ESP_ERR_INVALID_STATE;
+    } else {
+        timer->armed = 1;
+        timer->deadline = fake_time_us() + timeout_us;
+        timer->period = period_us;
+        pthread_cond_signal(&timers_cond);
+    }
+
+    pthread_mutex_unlock(&timers_lock);
+    return res;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    return timer_start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    esp_err_t res = ESP_OK;
+
+    pthread_mutex_lock(&timers_lock);
+
+    if (!timer->armed) {
+        res = ESP_ERR_INVALID_STATE;
+    }
+
+    timer->armed = 0;
+    pthread_mutex_unlock(&timers_lock);
+    return res;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&timers_lock);
+
+    if (timer->armed) {
+        pthread_mutex_unlock(&timers_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (struct esp_timer **link = &timers; *link != NULL; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&timers_lock);
+    free(timer);
+    return ESP_OK;
+}
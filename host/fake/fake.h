@@ -0,0 +1,49 @@
+/*
+ * fake.h
+ *
+ *  Helpers shared by the fake ESP-IDF layers, not used by the firmware.
+ */
+
+#ifndef HOST_FAKE_FAKE_H_
+#define HOST_FAKE_FAKE_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Microseconds of CLOCK_MONOTONIC since the process started, the clock of esp_timer
+int64_t fake_time_us(void);
+
+// Sets up a condition variable timed by CLOCK_MONOTONIC
+void fake_cond_init(pthread_cond_t *cond);
+
+// Absolute CLOCK_MONOTONIC time us from now
+struct timespec fake_deadline_us(int64_t us);
+
+// Absolute deadline of a FreeRTOS timeout, returns 0 for portMAX_DELAY which never expires
+int fake_deadline_ticks(TickType_t ticks, struct timespec *deadline);
+
+// Waits on cond until the deadline, forever if deadline is NULL, returns ETIMEDOUT once it passed
+int fake_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *deadline);
+
+// Sleeps for us microseconds
+void fake_sleep_us(int64_t us);
+
+// Registers the calling thread as a task, for threads of the fakes that call into the firmware
+TaskHandle_t fake_task_adopt(const char *name);
+
+// Returns whether len bytes at buf lie in a frame buffer the camera handed out
+int fake_camera_owns(const void *buf, size_t len);
+
+// Takes what the firmware writes to a connection of a fake HTTP server
+typedef ssize_t (*fake_socket_writer_t)(void *ctx, const struct iovec *iov, int count);
+
+// Routes the writes to a socket to a writer until fake_net_detach
+void fake_net_attach(int fd, fake_socket_writer_t writer, void *ctx);
+void fake_net_detach(int fd);
+
+#endif /* HOST_FAKE_FAKE_H_ */
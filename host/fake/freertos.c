@@ -0,0 +1,747 @@
+/*
+ * freertos.c
+ *
+ *  FreeRTOS tasks, notifications, semaphores, queues and event groups on
+ *  pthreads.
+ */
+
+#define _GNU_SOURCE
+#include "fake.h"
+#include "host_fake.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Task, a detached thread, or a thread of the fakes or the test registered on first use
+struct host_task {
+    pthread_t thread;
+    char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+    TaskFunction_t fn;
+    void *arg;
+    uint32_t stack;
+    UBaseType_t priority;
+    BaseType_t core;
+    UBaseType_t number;
+    int alive;
+    // Notification state, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify_value;
+    int notified;
+    struct host_task *next;
+};
+
+struct host_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t *items;
+};
+
+// Task blocked in xEventGroupWaitBits
+struct event_waiter {
+    EventBits_t bits;
+    int all;
+    int clear;
+    int done;
+    EventBits_t result;     // bits that unblocked it
+    struct event_waiter *next;
+};
+
+struct host_event_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    EventBits_t bits;
+    struct event_waiter *waiters;
+};
+
+// All tasks, guarded by tasks_lock
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host_task *tasks = NULL;
+static UBaseType_t task_count = 0;
+// Task of the calling thread
+static __thread struct host_task *current = NULL;
+// Critical sections of all spinlocks, they nest
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+// CLOCK_MONOTONIC at start
+static struct timespec started;
+
+// Takes the start time before main runs
+__attribute__((constructor)) static void clock_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+// Starts esp_timer time at 0 again, for a station in a process forked by a test, before the firmware runs
+void fake_clock_restart(void) {
+    clock_start();
+}
+
+// Microseconds of CLOCK_MONOTONIC since the process started, the clock of esp_timer
+int64_t fake_time_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) * 1000000LL + (now.tv_nsec - started.tv_nsec) / 1000;
+}
+
+// Sets up a condition variable timed by CLOCK_MONOTONIC
+void fake_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Absolute CLOCK_MONOTONIC time us from now
+struct timespec fake_deadline_us(int64_t us) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    return ts;
+}
+
+// Absolute deadline of a FreeRTOS timeout, returns 0 for portMAX_DELAY which never expires
+int fake_deadline_ticks(TickType_t ticks, struct timespec *deadline) {
+    if (ticks == portMAX_DELAY) {
+        return 0;
+    }
+
+    *deadline = fake_deadline_us((int64_t) ticks * portTICK_PERIOD_MS * 1000);
+    return 1;
+}
+
+// Waits on cond until the deadline, forever if deadline is NULL, returns ETIMEDOUT once it passed
+int fake_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *deadline) {
+    if (deadline == NULL) {
+        return pthread_cond_wait(cond, lock);
+    }
+
+    return pthread_cond_timedwait(cond, lock, deadline);
+}
+
+// Sleeps for us microseconds
+void fake_sleep_us(int64_t us) {
+    struct timespec ts = fake_deadline_us(us);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// Aborts like a failed configASSERT on the device
+void vAssertCalled(const char *file, int line) {
+    fprintf(stderr, "assert failed at %s:%d\n", file, line);
+    abort();
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux) {
+    pthread_mutex_lock(&critical_lock);
+    mux->owner++;
+}
+
+void vPortExitCritical(portMUX_TYPE *mux) {
+    mux->owner--;
+    pthread_mutex_unlock(&critical_lock);
+}
+
+// Creates the bookkeeping of a task and lists it
+static struct host_task *task_new(const char *name, uint32_t stack, UBaseType_t priority, BaseType_t core) {
+    struct host_task *task = calloc(1, sizeof(*task));
+
+    if (task == NULL) {
+        return NULL;
+    }
+
+    strncpy(task->name, name, sizeof(task->name) - 1);
+    task->stack = stack;
+    task->priority = priority;
+    task->core = core;
+    task->alive = 1;
+    pthread_mutex_init(&task->lock, NULL);
+    fake_cond_init(&task->cond);
+
+    pthread_mutex_lock(&tasks_lock);
+    task->number = ++task_count;
+    task->next = tasks;
+    tasks = task;
+    pthread_mutex_unlock(&tasks_lock);
+    return task;
+}
+
+// Registers the calling thread as a task, for threads of the fakes that call into the firmware
+TaskHandle_t fake_task_adopt(const char *name) {
+    if (current == NULL) {
+        current = task_new(name, 0, 0, tskNO_AFFINITY);
+        current->thread = pthread_self();
+    }
+
+    return current;
+}
+
+// Runs a task function on its thread, tasks must delete themselves instead of returning
+static void *task_main(void *arg) {
+    struct host_task *task = (struct host_task *) arg;
+
+    current = task;
+    task->fn(task->arg);
+    fprintf(stderr, "FreeRTOS task %s returned from its function\n", task->name);
+    abort();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+    struct host_task *task = task_new(name, stack, priority, core);
+    pthread_attr_t attr;
+
+    if (task == NULL) {
+        return pdFAIL;
+    }
+
+    task->fn = fn;
+    task->arg = arg;
+
+    if (handle != NULL) {
+        *handle = task;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&task->thread, &attr, task_main, task);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+        task->alive = 0;
+        return pdFAIL;
+    }
+
+    pthread_setname_np(task->thread, task->name);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle) {
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, priority, handle, tskNO_AFFINITY);
+}
+
+// Only tasks deleting themselves are supported, threads cannot be stopped from outside safely
+void vTaskDelete(TaskHandle_t task) {
+    if (task != NULL && task != xTaskGetCurrentTaskHandle()) {
+        fprintf(stderr, "vTaskDelete of another task is not supported on the host\n");
+        abort();
+    }
+
+    current->alive = 0;
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    if (ticks == 0) {
+        sched_yield();
+        return;
+    }
+
+    fake_sleep_us((int64_t) ticks * portTICK_PERIOD_MS * 1000);
+}
+
+void vTaskDelayUntil(TickType_t *previous, TickType_t increment) {
+    *previous += increment;
+    int64_t wake = (int64_t) *previous * portTICK_PERIOD_MS * 1000;
+    int64_t now = fake_time_us();
+
+    if (wake > now) {
+        fake_sleep_us(wake - now);
+    }
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (fake_time_us() / 1000 / portTICK_PERIOD_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return fake_task_adopt("main");
+}
+
+char *pcTaskGetTaskName(TaskHandle_t task) {
+    return task == NULL ? xTaskGetCurrentTaskHandle()->name : task->name;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void) {
+    UBaseType_t count = 0;
+
+    pthread_mutex_lock(&tasks_lock);
+
+    for (struct host_task *task = tasks; task != NULL; task = task->next) {
+        count += task->alive;
+    }
+
+    pthread_mutex_unlock(&tasks_lock);
+    return count;
+}
+
+// The stack headroom is the declared stack, threads get far larger ones, the run time is the thread's CPU time
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t count, uint32_t *run_time) {
+    UBaseType_t n = 0;
+
+    pthread_mutex_lock(&tasks_lock);
+
+    for (struct host_task *task = tasks; task != NULL && n < count; task = task->next) {
+        clockid_t clock;
+        struct timespec cpu = {0};
+
+        if (!task->alive) {
+            continue;
+        }
+
+        if (pthread_getcpuclockid(task->thread, &clock) == 0) {
+            clock_gettime(clock, &cpu);
+        }
+
+        status[n] = (TaskStatus_t) {
+                .xHandle = task,
+                .pcTaskName = task->name,
+                .xTaskNumber = task->number,
+                .eCurrentState = task == current ? eRunning : eBlocked,
+                .uxCurrentPriority = task->priority,
+                .uxBasePriority = task->priority,
+                .ulRunTimeCounter = (uint32_t) (cpu.tv_sec * 1000000LL + cpu.tv_nsec / 1000),
+                .usStackHighWaterMark = task->stack,
+                .xCoreID = task->core,
+        };
+        n++;
+    }
+
+    pthread_mutex_unlock(&tasks_lock);
+
+    if (run_time != NULL) {
+        *run_time = (uint32_t) fake_time_us();
+    }
+
+    return n;
+}
+
+// Returns the handle of a task created by the firmware, NULL if there is none by that name
+TaskHandle_t fake_task_find(const char *name) {
+    struct host_task *found = NULL;
+
+    pthread_mutex_lock(&tasks_lock);
+
+    for (struct host_task *task = tasks; task != NULL && found == NULL; task = task->next) {
+        if (task->alive && strcmp(task->name, name) == 0) {
+            found = task;
+        }
+    }
+
+    pthread_mutex_unlock(&tasks_lock);
+    return found;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+    BaseType_t res = pdPASS;
+
+    pthread_mutex_lock(&task->lock);
+
+    switch (action) {
+        case eSetBits:
+            task->notify_value |= value;
+            break;
+        case eIncrement:
+            task->notify_value++;
+            break;
+        case eSetValueWithOverwrite:
+            task->notify_value = value;
+            break;
+        case eSetValueWithoutOverwrite:
+            if (task->notified) {
+                res = pdFAIL;
+            } else {
+                task->notify_value = value;
+            }
+            break;
+        case eNoAction:
+            break;
+    }
+
+    task->notified = 1;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return res;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    return xTaskNotify(task, 0, eIncrement);
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks) {
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline;
+    int timed = fake_deadline_ticks(ticks, &deadline);
+    BaseType_t res = pdFALSE;
+
+    pthread_mutex_lock(&task->lock);
+
+    if (!task->notified) {
+        task->notify_value &= ~clear_on_entry;
+    }
+
+    while (!task->notified && ticks > 0
+            && fake_cond_wait(&task->cond, &task->lock, timed ? &deadline : NULL) != ETIMEDOUT) {
+    }
+
+    if (value != NULL) {
+        *value = task->notify_value;
+    }
+
+    if (task->notified) {
+        task->notify_value &= ~clear_on_exit;
+        task->notified = 0;
+        res = pdTRUE;
+    }
+
+    pthread_mutex_unlock(&task->lock);
+    return res;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) {
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline;
+    int timed = fake_deadline_ticks(ticks, &deadline);
+
+    pthread_mutex_lock(&task->lock);
+
+    while (task->notify_value == 0 && ticks > 0
+            && fake_cond_wait(&task->cond, &task->lock, timed ? &deadline : NULL) != ETIMEDOUT) {
+    }
+
+    uint32_t value = task->notify_value;
+
+    if (value != 0) {
+        task->notify_value = clear_on_exit ? 0 : value - 1;
+    }
+
+    task->notified = 0;
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) {
+    struct host_semaphore *sem = calloc(1, sizeof(*sem));
+
+    if (sem == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&sem->lock, NULL);
+    fake_cond_init(&sem->cond);
+    sem->count = initial;
+    sem->max = max;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    struct timespec deadline;
+    int timed = fake_deadline_ticks(ticks, &deadline);
+    BaseType_t res = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+
+    while (sem->count == 0 && ticks > 0
+            && fake_cond_wait(&sem->cond, &sem->lock, timed ? &deadline : NULL) != ETIMEDOUT) {
+    }
+
+    if (sem->count > 0) {
+        sem->count--;
+        res = pdTRUE;
+    }
+
+    pthread_mutex_unlock(&sem->lock);
+    return res;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    BaseType_t res = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+
+    if (sem->count < sem->max) {
+        sem->count++;
+        res = pdTRUE;
+        pthread_cond_signal(&sem->cond);
+    }
+
+    pthread_mutex_unlock(&sem->lock);
+    return res;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    pthread_mutex_destroy(&sem->lock);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct host_queue *queue = calloc(1, sizeof(*queue));
+
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->items = malloc((size_t) length * item_size);
+
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    fake_cond_init(&queue->cond);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+// Adds an item at the back or front, waiting for space up to ticks
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks, int front) {
+    struct timespec deadline;
+    int timed = fake_deadline_ticks(ticks, &deadline);
+    BaseType_t res = pdFALSE;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == queue->length && ticks > 0
+            && fake_cond_wait(&queue->cond, &queue->lock, timed ? &deadline : NULL) != ETIMEDOUT) {
+    }
+
+    if (queue->count < queue->length) {
+        UBaseType_t index;
+
+        if (front) {
+            queue->head = (queue->head + queue->length - 1) % queue->length;
+            index = queue->head;
+        } else {
+            index = (queue->head + queue->count) % queue->length;
+        }
+
+        memcpy(queue->items + (size_t) index * queue->item_size, item, queue->item_size);
+        queue->count++;
+        res = pdTRUE;
+        pthread_cond_broadcast(&queue->cond);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return res;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    return queue_send(queue, item, ticks, 0);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    return queue_send(queue, item, ticks, 0);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    return queue_send(queue, item, ticks, 1);
+}
+
+// Only meant for queues of length one, like on the device
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item) {
+    pthread_mutex_lock(&queue->lock);
+    memcpy(queue->items + (size_t) queue->head * queue->item_size, item, queue->item_size);
+    queue->count = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    struct timespec deadline;
+    int timed = fake_deadline_ticks(ticks, &deadline);
+    BaseType_t res = pdFALSE;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == 0 && ticks > 0
+            && fake_cond_wait(&queue->cond, &queue->lock, timed ? &deadline : NULL) != ETIMEDOUT) {
+    }
+
+    if (queue->count > 0) {
+        memcpy(item, queue->items + (size_t) queue->head * queue->item_size, queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        res = pdTRUE;
+        pthread_cond_broadcast(&queue->cond);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return res;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->items);
+    free(queue);
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    struct host_event_group *group = calloc(1, sizeof(*group));
+
+    if (group == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&group->lock, NULL);
+    fake_cond_init(&group->cond);
+    return group;
+}
+
+// Checks whether bits satisfy a wait for all or any of wanted
+static int bits_match(EventBits_t bits, EventBits_t wanted, int all) {
+    return all ? (bits & wanted) == wanted : (bits & wanted) != 0;
+}
+
+// Waiters are released while the bits are set, so a set followed by a clear still wakes them like on FreeRTOS
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    EventBits_t clear = 0;
+
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+
+    for (struct event_waiter **link = &group->waiters; *link != NULL;) {
+        struct event_waiter *waiter = *link;
+
+        if (bits_match(group->bits, waiter->bits, waiter->all)) {
+            waiter->done = 1;
+            waiter->result = group->bits;
+
+            if (waiter->clear) {
+                clear |= waiter->bits;
+            }
+
+            *link = waiter->next;
+        } else {
+            link = &waiter->next;
+        }
+    }
+
+    group->bits &= ~clear;
+    EventBits_t result = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t bits = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks) {
+    struct timespec deadline;
+    int timed = fake_deadline_ticks(ticks, &deadline);
+    struct event_waiter waiter = {
+            .bits = bits,
+            .all = wait_for_all,
+            .clear = clear_on_exit,
+    };
+    EventBits_t result;
+
+    pthread_mutex_lock(&group->lock);
+
+    if (bits_match(group->bits, bits, wait_for_all)) {
+        result = group->bits;
+
+        if (clear_on_exit) {
+            group->bits &= ~bits;
+        }
+
+        pthread_mutex_unlock(&group->lock);
+        return result;
+    }
+
+    if (ticks == 0) {
+        result = group->bits;
+        pthread_mutex_unlock(&group->lock);
+        return result;
+    }
+
+    waiter.next = group->waiters;
+    group->waiters = &waiter;
+
+    while (!waiter.done && fake_cond_wait(&group->cond, &group->lock, timed ? &deadline : NULL) != ETIMEDOUT) {
+    }
+
+    if (waiter.done) {
+        result = waiter.result;
+    } else {
+        for (struct event_waiter **link = &group->waiters; *link != NULL; link = &(*link)->next) {
+            if (*link == &waiter) {
+                *link = waiter.next;
+                break;
+            }
+        }
+
+        result = group->bits;
+    }
+
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->cond);
+    free(group);
+}
@@ -0,0 +1,881 @@
+/*
+ * httpd.c
+ *
+ *  HTTP server without sockets. Connections are socket pairs so the
+ *  firmware can tune and write to them, requests are handed over by
+ *  fake_httpd_request_on and everything a handler sends is collected in
+ *  a fake_http_response_t. Like the server task, a server runs one
+ *  request or queued work item at a time, closes a connection whose
+ *  handler failed and purges the least recently used connection when
+ *  a new one exceeds max_open_sockets. What other tasks write to a
+ *  connection goes to the test's end of the socket pair.
+ */
+
+#define _GNU_SOURCE
+#include "fake.h"
+#include "host_fake.h"
+#include <esp_http_server.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HTTPD_MAX_SERVERS 4
+#define HTTPD_MAX_SESSIONS 16
+
+struct fake_server;
+
+// Request being handled, the aux of httpd_req_t
+typedef struct {
+    struct fake_session *session;
+    const fake_http_request_t *request;
+    fake_http_response_t *response;
+    size_t received;        // body bytes handed out by httpd_req_recv
+    int timeouts;           // timeouts left before the body arrives
+    size_t sent;            // body bytes sent, counted against send_limit
+    int failed;             // a send failed, the connection is gone
+    int headers_sent;
+    // Headers set so far, the strings are read when the headers go out like on the server
+    const char *header_names[FAKE_HTTP_MAX_HEADERS];
+    const char *header_values[FAKE_HTTP_MAX_HEADERS];
+    int header_count;
+} request_ctx_t;
+
+typedef struct fake_session {
+    int used;
+    int fd;                 // end of the firmware
+    int client;             // end of the test
+    int busy;               // a request runs on it
+    int closing;            // closed once the request finished
+    uint64_t last_used;
+    struct fake_server *server;
+    request_ctx_t *ctx;
+} fake_session_t;
+
+// Work queued with httpd_queue_work
+typedef struct work_item {
+    httpd_work_fn_t fn;
+    void *arg;
+    struct work_item *next;
+} work_item_t;
+
+typedef struct fake_server {
+    int used;
+    httpd_config_t config;
+    pthread_mutex_t task_lock;      // held while a request or work item runs, like the server task
+    pthread_mutex_t state_lock;     // guards the sessions and the work queue
+    httpd_uri_t *handlers;
+    int handler_count;
+    fake_session_t sessions[HTTPD_MAX_SESSIONS];
+    uint64_t requests;
+    uint64_t sent_fb;               // bytes sent straight from camera frame buffers
+    uint64_t sent_other;            // bytes sent from anywhere else
+    work_item_t *work;
+    int default_client;             // connection of fake_httpd_request, -1 if none
+} fake_server_t;
+
+static pthread_mutex_t servers_lock = PTHREAD_MUTEX_INITIALIZER;
+static fake_server_t servers[HTTPD_MAX_SERVERS];
+// Request the calling thread runs the handler of, NULL on other threads
+static __thread request_ctx_t *handling;
+
+// Returns the started server on a port
+static fake_server_t *server_find(uint16_t port) {
+    fake_server_t *found = NULL;
+
+    pthread_mutex_lock(&servers_lock);
+
+    for (int i = 0; i < HTTPD_MAX_SERVERS && found == NULL; i++) {
+        if (servers[i].used && servers[i].config.server_port == port) {
+            found = &servers[i];
+        }
+    }
+
+    pthread_mutex_unlock(&servers_lock);
+    return found;
+}
+
+// Returns the open session of a test side socket, the caller holds no lock
+static fake_session_t *session_of_client(int client) {
+    for (int i = 0; i < HTTPD_MAX_SERVERS; i++) {
+        fake_server_t *server = &servers[i];
+
+        if (!server->used) {
+            continue;
+        }
+
+        pthread_mutex_lock(&server->state_lock);
+
+        for (int j = 0; j < HTTPD_MAX_SESSIONS; j++) {
+            if (server->sessions[j].used && server->sessions[j].client == client) {
+                pthread_mutex_unlock(&server->state_lock);
+                return &server->sessions[j];
+            }
+        }
+
+        pthread_mutex_unlock(&server->state_lock);
+    }
+
+    return NULL;
+}
+
+// Closes the server side of a connection, deferred while a request runs on it, caller holds state_lock
+static void session_close(fake_session_t *session) {
+    fake_server_t *server = session->server;
+
+    if (session->busy) {
+        session->closing = 1;
+        return;
+    }
+
+    if (server->config.close_fn != NULL) {
+        server->config.close_fn(server, session->fd);
+    }
+
+    fake_net_detach(session->fd);
+    close(session->fd);
+    session->used = 0;
+    session->closing = 0;
+}
+
+// Runs the queued work items, caller holds task_lock
+static void work_run(fake_server_t *server) {
+    for (;;) {
+        pthread_mutex_lock(&server->state_lock);
+        work_item_t *item = server->work;
+
+        if (item != NULL) {
+            server->work = item->next;
+        }
+
+        pthread_mutex_unlock(&server->state_lock);
+
+        if (item == NULL) {
+            return;
+        }
+
+        item->fn(item->arg);
+        free(item);
+    }
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+    fake_server_t *server = NULL;
+
+    if (server_find(config->server_port) != NULL) {
+        return ESP_ERR_HTTPD_TASK;
+    }
+
+    pthread_mutex_lock(&servers_lock);
+
+    for (int i = 0; i < HTTPD_MAX_SERVERS && server == NULL; i++) {
+        if (!servers[i].used) {
+            server = &servers[i];
+        }
+    }
+
+    if (server == NULL || config->max_open_sockets > HTTPD_MAX_SESSIONS) {
+        pthread_mutex_unlock(&servers_lock);
+        return ESP_ERR_HTTPD_TASK;
+    }
+
+    *server = (fake_server_t) {
+            .used = 1,
+            .config = *config,
+            .handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t)),
+            .default_client = -1,
+    };
+    pthread_mutex_init(&server->task_lock, NULL);
+    pthread_mutex_init(&server->state_lock, NULL);
+    pthread_mutex_unlock(&servers_lock);
+
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+    fake_server_t *server = (fake_server_t *) handle;
+
+    pthread_mutex_lock(&server->task_lock);
+    pthread_mutex_lock(&server->state_lock);
+
+    for (int i = 0; i < HTTPD_MAX_SESSIONS; i++) {
+        if (server->sessions[i].used) {
+            session_close(&server->sessions[i]);
+        }
+    }
+
+    for (work_item_t *item = server->work, *next; item != NULL; item = next) {
+        next = item->next;
+        free(item);
+    }
+
+    pthread_mutex_unlock(&server->state_lock);
+
+    if (server->config.global_user_ctx_free_fn != NULL) {
+        server->config.global_user_ctx_free_fn(server->config.global_user_ctx);
+    }
+
+    free(server->handlers);
+    pthread_mutex_unlock(&server->task_lock);
+
+    pthread_mutex_lock(&servers_lock);
+    server->used = 0;
+    pthread_mutex_unlock(&servers_lock);
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler) {
+    fake_server_t *server = (fake_server_t *) handle;
+
+    for (int i = 0; i < server->handler_count; i++) {
+        if (server->handlers[i].method == uri_handler->method && strcmp(server->handlers[i].uri, uri_handler->uri) == 0) {
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+
+    if (server->handler_count >= server->config.max_uri_handlers) {
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+
+    server->handlers[server->handler_count++] = *uri_handler;
+    return ESP_OK;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg) {
+    fake_server_t *server = (fake_server_t *) handle;
+    work_item_t *item = calloc(1, sizeof(*item));
+
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+
+    item->fn = work;
+    item->arg = arg;
+
+    pthread_mutex_lock(&server->state_lock);
+    work_item_t **link = &server->work;
+
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+
+    *link = item;
+    pthread_mutex_unlock(&server->state_lock);
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) {
+    fake_server_t *server = (fake_server_t *) handle;
+    esp_err_t res = ESP_ERR_NOT_FOUND;
+
+    pthread_mutex_lock(&server->state_lock);
+
+    for (int i = 0; i < HTTPD_MAX_SESSIONS; i++) {
+        if (server->sessions[i].used && server->sessions[i].fd == sockfd) {
+            session_close(&server->sessions[i]);
+            res = ESP_OK;
+        }
+    }
+
+    pthread_mutex_unlock(&server->state_lock);
+    return res;
+}
+
+void *httpd_get_global_user_ctx(httpd_handle_t handle) {
+    return ((fake_server_t *) handle)->config.global_user_ctx;
+}
+
+// Appends bytes to the body of a response
+static void response_append(fake_http_response_t *response, const void *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    response->body = realloc(response->body, response->len + len);
+    memcpy(response->body + response->len, data, len);
+    response->len += len;
+}
+
+// Counts bytes against the send limit of the request, returns 0 once the connection broke
+static int request_send(request_ctx_t *ctx, size_t len) {
+    size_t limit = ctx->request->send_limit;
+
+    if (ctx->failed || (limit > 0 && ctx->sent + len > limit)) {
+        ctx->failed = 1;
+        return 0;
+    }
+
+    ctx->sent += len;
+    return 1;
+}
+
+// Counts sent bytes by where they come from
+static void server_count(fake_server_t *server, const void *data, size_t len) {
+    uint64_t *counter = fake_camera_owns(data, len) ? &server->sent_fb : &server->sent_other;
+
+    __atomic_fetch_add(counter, len, __ATOMIC_RELAXED);
+}
+
+// Takes what the firmware writes to the socket of a connection directly
+static ssize_t session_write(void *arg, const struct iovec *iov, int count) {
+    fake_session_t *session = (fake_session_t *) arg;
+    request_ctx_t *ctx = handling != NULL && handling->session == session ? handling : NULL;
+    size_t len = 0;
+
+    // Another task writing to a connection handed to it, straight to the client like on the device
+    if (ctx == NULL) {
+        struct msghdr msg = {
+                .msg_iov = (struct iovec *) iov,
+                .msg_iovlen = count,
+        };
+        ssize_t sent = sendmsg(session->fd, &msg, MSG_NOSIGNAL);
+
+        for (int i = 0; i < count && sent > 0; i++) {
+            server_count(session->server, iov[i].iov_base, MIN(iov[i].iov_len, (size_t) sent - len));
+            len += MIN(iov[i].iov_len, (size_t) sent - len);
+        }
+
+        return sent;
+    }
+
+    for (int i = 0; i < count; i++) {
+        len += iov[i].iov_len;
+    }
+
+    if (!request_send(ctx, len)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        server_count(session->server, iov[i].iov_base, iov[i].iov_len);
+        response_append(ctx->response, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    ctx->response->raw = 1;
+    return (ssize_t) len;
+}
+
+// Opens a connection to the server on a port, returns its socket or -1
+int fake_httpd_connect(uint16_t port) {
+    fake_server_t *server = server_find(port);
+    fake_session_t *session = NULL;
+    int fds[2];
+
+    if (server == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&server->state_lock);
+    int open = 0;
+    fake_session_t *oldest = NULL;
+
+    for (int i = 0; i < HTTPD_MAX_SESSIONS; i++) {
+        fake_session_t *entry = &server->sessions[i];
+
+        if (entry->used) {
+            open++;
+
+            if (!entry->busy && !entry->closing && (oldest == NULL || entry->last_used < oldest->last_used)) {
+                oldest = entry;
+            }
+        }
+    }
+
+    if (open >= server->config.max_open_sockets) {
+        if (!server->config.lru_purge_enable || oldest == NULL) {
+            pthread_mutex_unlock(&server->state_lock);
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+
+        session_close(oldest);
+    }
+
+    for (int i = 0; i < HTTPD_MAX_SESSIONS && session == NULL; i++) {
+        if (!server->sessions[i].used) {
+            session = &server->sessions[i];
+        }
+    }
+
+    *session = (fake_session_t) {
+            .used = 1,
+            .fd = fds[0],
+            .client = fds[1],
+            .last_used = server->requests,
+            .server = server,
+    };
+    fake_net_attach(fds[0], session_write, session);
+
+    if (server->config.open_fn != NULL && server->config.open_fn(server, fds[0]) != ESP_OK) {
+        fake_net_detach(fds[0]);
+        session->used = 0;
+        pthread_mutex_unlock(&server->state_lock);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&server->state_lock);
+    return fds[1];
+}
+
+// Closes a connection from the client side
+void fake_httpd_disconnect(int fd) {
+    fake_session_t *session = session_of_client(fd);
+
+    // Writes of the firmware fail from now on, like after the peer's reset
+    shutdown(fd, SHUT_RDWR);
+
+    if (session != NULL) {
+        pthread_mutex_lock(&session->server->state_lock);
+
+        if (session->used && session->client == fd) {
+            session_close(session);
+        }
+
+        pthread_mutex_unlock(&session->server->state_lock);
+    }
+
+    close(fd);
+}
+
+// Returns whether the server still keeps a connection open
+int fake_httpd_is_open(int fd) {
+    fake_session_t *session = session_of_client(fd);
+
+    return session != NULL && !session->closing;
+}
+
+// Returns the handler of a request path and method
+static const httpd_uri_t *handler_find(fake_server_t *server, const char *uri, size_t path_len, httpd_method_t method) {
+    for (int i = 0; i < server->handler_count; i++) {
+        const httpd_uri_t *handler = &server->handlers[i];
+
+        if (handler->method == method && strlen(handler->uri) == path_len && strncmp(handler->uri, uri, path_len) == 0) {
+            return handler;
+        }
+    }
+
+    return NULL;
+}
+
+// Runs a request on a connection, handler and queued work run on the calling thread
+esp_err_t fake_httpd_request_on(int fd, const fake_http_request_t *request, fake_http_response_t *response) {
+    fake_session_t *session = session_of_client(fd);
+
+    *response = (fake_http_response_t) {
+            .result = ESP_FAIL,
+            .status = HTTPD_200,
+            .type = HTTPD_TYPE_TEXT,
+    };
+
+    if (session == NULL || strlen(request->uri) > HTTPD_MAX_URI_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    fake_server_t *server = session->server;
+
+    pthread_mutex_lock(&server->task_lock);
+    work_run(server);
+    pthread_mutex_lock(&server->state_lock);
+
+    // Work like the idle sweep may have closed the connection meanwhile
+    if (!session->used || session->client != fd || session->closing) {
+        pthread_mutex_unlock(&server->state_lock);
+        pthread_mutex_unlock(&server->task_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    request_ctx_t ctx = {
+            .session = session,
+            .request = request,
+            .response = response,
+            .timeouts = request->recv_timeouts,
+    };
+
+    session->busy = 1;
+    session->ctx = &ctx;
+    session->last_used = ++server->requests;
+    pthread_mutex_unlock(&server->state_lock);
+
+    httpd_req_t req = {
+            .handle = server,
+            .method = request->method,
+            .content_len = request->body_len,
+            .aux = &ctx,
+    };
+    const char *query = strchr(request->uri, '?');
+    size_t path_len = query != NULL ? (size_t) (query - request->uri) : strlen(request->uri);
+    const httpd_uri_t *handler = handler_find(server, request->uri, path_len, request->method);
+    int64_t start = fake_time_us();
+
+    strcpy((char *) req.uri, request->uri);
+
+    if (handler == NULL) {
+        httpd_resp_send_err(&req, HTTPD_404_NOT_FOUND, NULL);
+        response->result = ESP_ERR_NOT_FOUND;
+    } else {
+        req.user_ctx = handler->user_ctx;
+        handling = &ctx;
+        response->result = handler->handler(&req);
+        handling = NULL;
+    }
+
+    response->duration_us = fake_time_us() - start;
+
+    if (req.free_ctx != NULL && req.sess_ctx != NULL) {
+        req.free_ctx(req.sess_ctx);
+    }
+
+    pthread_mutex_lock(&server->state_lock);
+    session->busy = 0;
+    session->ctx = NULL;
+
+    // A failing handler makes the server close the connection
+    if (response->result != ESP_OK || session->closing) {
+        session_close(session);
+    }
+
+    pthread_mutex_unlock(&server->state_lock);
+    pthread_mutex_unlock(&server->task_lock);
+    return response->result;
+}
+
+// Runs a request on a connection of its own that stays open for the next request on the port
+esp_err_t fake_httpd_request(uint16_t port, const fake_http_request_t *request, fake_http_response_t *response) {
+    fake_server_t *server = server_find(port);
+
+    if (server == NULL) {
+        *response = (fake_http_response_t) { .result = ESP_FAIL };
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (server->default_client < 0 || !fake_httpd_is_open(server->default_client)) {
+        if (server->default_client >= 0) {
+            close(server->default_client);
+        }
+
+        server->default_client = fake_httpd_connect(port);
+    }
+
+    return fake_httpd_request_on(server->default_client, request, response);
+}
+
+// Shorthand for a GET without body
+esp_err_t fake_httpd_get(uint16_t port, const char *uri, const char *headers, fake_http_response_t *response) {
+    fake_http_request_t request = {
+            .method = HTTP_GET,
+            .uri = uri,
+            .headers = headers,
+    };
+
+    return fake_httpd_request(port, &request, response);
+}
+
+// Runs the work queued with httpd_queue_work on the server of a port, like its task does between requests
+void fake_httpd_run_work(uint16_t port) {
+    fake_server_t *server = server_find(port);
+
+    if (server != NULL) {
+        pthread_mutex_lock(&server->task_lock);
+        work_run(server);
+        pthread_mutex_unlock(&server->task_lock);
+    }
+}
+
+// Bytes the handlers and the tasks writing to connections of the server on a port sent so far
+void fake_httpd_sent(uint16_t port, uint64_t *from_fb, uint64_t *other) {
+    fake_server_t *server = server_find(port);
+
+    *from_fb = server != NULL ? __atomic_load_n(&server->sent_fb, __ATOMIC_RELAXED) : 0;
+    *other = server != NULL ? __atomic_load_n(&server->sent_other, __ATOMIC_RELAXED) : 0;
+}
+
+// Returns a response header or NULL
+const char *fake_http_header(const fake_http_response_t *response, const char *name) {
+    for (int i = 0; i < response->header_count; i++) {
+        if (strcasecmp(response->headers[i].name, name) == 0) {
+            return response->headers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the numeric status, 200 unless the handler set another one
+int fake_http_status(const fake_http_response_t *response) {
+    return atoi(response->status);
+}
+
+// Frees the body of a response
+void fake_http_response_free(fake_http_response_t *response) {
+    for (int i = 0; i < response->header_count; i++) {
+        free((void *) response->headers[i].name);
+        free((void *) response->headers[i].value);
+    }
+
+    free(response->body);
+    response->body = NULL;
+    response->len = 0;
+    response->header_count = 0;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r) {
+    return ((request_ctx_t *) r->aux)->session->fd;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+    request_ctx_t *ctx = (request_ctx_t *) r->aux;
+
+    if (ctx->timeouts > 0) {
+        ctx->timeouts--;
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    }
+
+    size_t len = MIN(buf_len, ctx->request->body_len - ctx->received);
+
+    if (ctx->request->recv_max > 0) {
+        len = MIN(len, ctx->request->recv_max);
+    }
+
+    memcpy(buf, (const uint8_t *) ctx->request->body + ctx->received, len);
+    ctx->received += len;
+    return (int) len;
+}
+
+// Finds the value of a request header, skipping the spaces after the colon
+static const char *header_value(httpd_req_t *r, const char *field, size_t *len) {
+    const char *line = ((request_ctx_t *) r->aux)->request->headers;
+    size_t field_len = strlen(field);
+
+    while (line != NULL && *line != '\0') {
+        const char *end = strstr(line, "\r\n");
+        const char *colon = strchr(line, ':');
+
+        if (end == NULL) {
+            end = line + strlen(line);
+        }
+
+        if (colon != NULL && colon < end && (size_t) (colon - line) == field_len
+                && strncasecmp(line, field, field_len) == 0) {
+            const char *value = colon + 1;
+
+            while (value < end && *value == ' ') {
+                value++;
+            }
+
+            *len = end - value;
+            return value;
+        }
+
+        line = *end != '\0' ? end + 2 : end;
+    }
+
+    return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field) {
+    size_t len = 0;
+
+    return header_value(r, field, &len) != NULL ? len : 0;
+}
+
+// Copies a value into a buffer, ESP_ERR_HTTPD_RESULT_TRUNC if it had to be cut
+static esp_err_t copy_value(const char *value, size_t len, char *buf, size_t buf_size) {
+    if (buf == NULL || buf_size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t copy = MIN(len, buf_size - 1);
+
+    memcpy(buf, value, copy);
+    buf[copy] = '\0';
+    return copy < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size) {
+    size_t len;
+    const char *value = header_value(r, field, &len);
+
+    if (value == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return copy_value(value, len, val, val_size);
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r) {
+    const char *query = strchr(r->uri, '?');
+
+    return query != NULL ? strlen(query + 1) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len) {
+    const char *query = strchr(r->uri, '?');
+
+    if (query == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return copy_value(query + 1, strlen(query + 1), buf, buf_len);
+}
+
+// Parses like the server does, a parameter without '=' ends the search
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size) {
+    const char *pair = qry;
+
+    if (qry == NULL || key == NULL || val == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (*pair != '\0') {
+        const char *value = strchr(pair, '=');
+
+        if (value == NULL) {
+            break;
+        }
+
+        if ((size_t) (value - pair) != strlen(key) || strncasecmp(pair, key, value - pair) != 0) {
+            pair = strchr(value, '&');
+
+            if (pair == NULL) {
+                break;
+            }
+
+            pair++;
+            continue;
+        }
+
+        value++;
+        const char *end = strchr(value, '&');
+
+        if (end == NULL) {
+            end = value + strlen(value);
+        }
+
+        return copy_value(value, end - value, val, val_size);
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+// Copies the status line fields and headers into the response when the first byte goes out
+static void headers_send(request_ctx_t *ctx) {
+    if (ctx->headers_sent) {
+        return;
+    }
+
+    for (int i = 0; i < ctx->header_count; i++) {
+        ctx->response->headers[i].name = strdup(ctx->header_names[i]);
+        ctx->response->headers[i].value = strdup(ctx->header_values[i]);
+    }
+
+    ctx->response->header_count = ctx->header_count;
+    ctx->headers_sent = 1;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    request_ctx_t *ctx = (request_ctx_t *) r->aux;
+    size_t len = buf_len < 0 ? (buf != NULL ? strlen(buf) : 0) : (size_t) buf_len;
+
+    headers_send(ctx);
+
+    if (!request_send(ctx, len)) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+
+    server_count(ctx->session->server, buf, len);
+    response_append(ctx->response, buf, len);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    request_ctx_t *ctx = (request_ctx_t *) r->aux;
+    size_t len = buf_len < 0 ? (buf != NULL ? strlen(buf) : 0) : (size_t) buf_len;
+
+    headers_send(ctx);
+
+    if (!request_send(ctx, len)) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+
+    if (len > 0) {
+        ctx->response->chunks++;
+        server_count(ctx->session->server, buf, len);
+        response_append(ctx->response, buf, len);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+    request_ctx_t *ctx = (request_ctx_t *) r->aux;
+
+    strncpy(ctx->response->status, status, sizeof(ctx->response->status) - 1);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+    request_ctx_t *ctx = (request_ctx_t *) r->aux;
+
+    strncpy(ctx->response->type, type, sizeof(ctx->response->type) - 1);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value) {
+    request_ctx_t *ctx = (request_ctx_t *) r->aux;
+
+    if (ctx->header_count >= ctx->session->server->config.max_resp_headers
+            || ctx->header_count >= FAKE_HTTP_MAX_HEADERS) {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+
+    ctx->header_names[ctx->header_count] = field;
+    ctx->header_values[ctx->header_count] = value;
+    ctx->header_count++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+    static const struct {
+        const char *status;
+        const char *msg;
+    } errors[HTTPD_ERR_CODE_MAX] = {
+            [HTTPD_500_INTERNAL_SERVER_ERROR] = { "500 Internal Server Error", "Server has encountered an unexpected error" },
+            [HTTPD_501_METHOD_NOT_IMPLEMENTED] = { "501 Method Not Implemented", "Request method is not supported by server" },
+            [HTTPD_505_VERSION_NOT_SUPPORTED] = { "505 Version Not Supported", "HTTP version not supported by server" },
+            [HTTPD_400_BAD_REQUEST] = { "400 Bad Request", "Server unable to understand request due to invalid syntax" },
+            [HTTPD_404_NOT_FOUND] = { "404 Not Found", "This URI does not exist" },
+            [HTTPD_405_METHOD_NOT_ALLOWED] = { "405 Method Not Allowed", "Request method for this URI is not handled by server" },
+            [HTTPD_408_REQ_TIMEOUT] = { "408 Request Timeout", "Server closed this connection" },
+            [HTTPD_411_LENGTH_REQUIRED] = { "411 Length Required", "Chunked encoding not supported" },
+            [HTTPD_414_URI_TOO_LONG] = { "414 URI Too Long", "URI is too long for server to interpret" },
+            [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = { "431 Request Header Fields Too Large", "Header fields are too long for server to interpret" },
+    };
+
+    if (error < 0 || error >= HTTPD_ERR_CODE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    httpd_resp_set_status(req, errors[error].status);
+    httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+    return httpd_resp_send(req, msg != NULL ? msg : errors[error].msg, -1);
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t *r) {
+    return httpd_resp_send_err(r, HTTPD_404_NOT_FOUND, NULL);
+}
+
+esp_err_t httpd_resp_send_408(httpd_req_t *r) {
+    return httpd_resp_send_err(r, HTTPD_408_REQ_TIMEOUT, NULL);
+}
+
+esp_err_t httpd_resp_send_500(httpd_req_t *r) {
+    return httpd_resp_send_err(r, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+}
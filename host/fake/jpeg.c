@@ -0,0 +1,143 @@
+/*
+ * jpeg.c
+ *
+ *  JPEG decoder and encoder of the synthetic frames. The decoder hands
+ *  out grey pixels derived from the scene of a camera frame, or the
+ *  pixels stored in an image the encoder wrote.
+ */
+
+#include "fake.h"
+#include "host_fake.h"
+#include <esp_jpg_decode.h>
+#include <esp_log.h>
+#include <img_converters.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Block size of the decoder at full scale, a 4:2:0 MCU
+#define JPEG_MCU 16
+// Bytes the encoder hands to its callback at once
+#define JPEG_OUT_CHUNK 1024
+
+static const char *TAG = "esp_jpg_decode";
+
+// Reads the header of a synthetic frame or re-encoded image, returns 0 if it is one
+int fake_jpeg_parse(const uint8_t *buf, size_t len, fake_jpeg_info_t *info) {
+    if (len < FAKE_JPEG_HEADER_LEN + 2 || buf[0] != 0xFF || buf[1] != 0xD8 || buf[2] != 'F'
+            || (buf[3] != 'J' && buf[3] != 'R') || buf[len - 2] != 0xFF || buf[len - 1] != 0xD9) {
+        return -1;
+    }
+
+    info->encoded = buf[3] == 'R';
+    info->width = buf[4] | (buf[5] << 8);
+    info->height = buf[6] | (buf[7] << 8);
+    info->quality = buf[8];
+    info->scene = buf[9];
+    info->framesize = (framesize_t) buf[10];
+    memcpy(&info->frame, buf + 12, sizeof(info->frame));
+    return 0;
+}
+
+// Luma of a full resolution pixel of a scene, the decoder outputs it as grey
+uint8_t fake_jpeg_pixel(uint8_t scene, int x, int y) {
+    return (uint8_t) (scene * 37 + (x / 64) * 11 + (y / 64) * 7);
+}
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void *arg) {
+    uint8_t header[FAKE_JPEG_HEADER_LEN + 2];
+    fake_jpeg_info_t info;
+
+    // Like the real decoder the image is read through the reader as needed, nothing is allocated
+    if (len < sizeof(header) || reader(arg, 0, header, FAKE_JPEG_HEADER_LEN) != FAKE_JPEG_HEADER_LEN
+            || reader(arg, len - 2, header + FAKE_JPEG_HEADER_LEN, 2) != 2
+            || fake_jpeg_parse(header, sizeof(header), &info) != 0) {
+        ESP_LOGE(TAG, "JPG Header Parse Failed!");
+        return ESP_FAIL;
+    }
+
+    // Re-encoded images carry RGB888 pixels, or whatever the encoder got, after the header
+    if (info.encoded && len < FAKE_JPEG_HEADER_LEN + 2 + (size_t) info.width * info.height * 3) {
+        ESP_LOGE(TAG, "JPG Data Too Short!");
+        return ESP_FAIL;
+    }
+
+    int step = 1 << scale;
+    int block = JPEG_MCU >> scale;
+    uint16_t out_w = info.width >> scale;
+    uint16_t out_h = info.height >> scale;
+    uint8_t rgb[JPEG_MCU * JPEG_MCU * 3];
+    esp_err_t res = ESP_OK;
+
+    if (!writer(arg, 0, 0, out_w, out_h, NULL)) {
+        res = ESP_FAIL;
+    }
+
+    for (int by = 0; res == ESP_OK && by < out_h; by += block) {
+        for (int bx = 0; res == ESP_OK && bx < out_w; bx += block) {
+            int w = MIN(block, out_w - bx);
+            int h = MIN(block, out_h - by);
+
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    uint8_t *px = rgb + (y * w + x) * 3;
+                    int sx = (bx + x) * step;
+                    int sy = (by + y) * step;
+
+                    if (info.encoded) {
+                        reader(arg, FAKE_JPEG_HEADER_LEN + ((size_t) sy * info.width + sx) * 3, px, 3);
+                    } else {
+                        memset(px, fake_jpeg_pixel(info.scene, sx, sy), 3);
+                    }
+                }
+            }
+
+            if (!writer(arg, bx, by, w, h, rgb)) {
+                res = ESP_FAIL;
+            }
+        }
+    }
+
+    if (res == ESP_OK) {
+        writer(arg, out_w, out_h, 0, 0, NULL);
+    } else {
+        ESP_LOGE(TAG, "JPG Decompression Failed!");
+    }
+
+    return res;
+}
+
+// Hands data to the output callback in encoder sized chunks, returns false once it takes less
+static bool encode_out(jpg_out_cb cb, void *arg, size_t *index, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t chunk = MIN(len, JPEG_OUT_CHUNK);
+
+        if (cb(arg, *index, data, chunk) != chunk) {
+            return false;
+        }
+
+        *index += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                uint8_t quality, jpg_out_cb cb, void *arg) {
+    uint8_t header[FAKE_JPEG_HEADER_LEN] = {
+            0xFF, 0xD8, 'F', 'R',
+            width & 0xFF, width >> 8, height & 0xFF, height >> 8,
+            quality, 0, FRAMESIZE_INVALID, format,
+    };
+    static const uint8_t eoi[] = { 0xFF, 0xD9 };
+    size_t index = 0;
+
+    return encode_out(cb, arg, &index, header, sizeof(header)) && encode_out(cb, arg, &index, src, src_len)
+            && encode_out(cb, arg, &index, eoi, sizeof(eoi));
+}
+
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg) {
+    return fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, cb, arg);
+}
@@ -0,0 +1,332 @@
+/*
+ * net.c
+ *
+ *  lwIP sockets. UDP sockets are one end of a datagram socket pair the
+ *  tests hold the other end of, every datagram is prefixed with the
+ *  address it was sent to or came from. Connections of the fake HTTP
+ *  servers hand their writes to the server, other sockets are the host's
+ *  with the TCP send buffer of lwIP.
+ */
+
+#include "fake.h"
+#include "host_fake.h"
+#include <lwip/sockets.h>
+#include <poll.h>
+#include <string.h>
+
+// The lwIP names map to the functions below, the host's are needed here
+#undef socket
+#undef bind
+#undef connect
+#undef setsockopt
+#undef send
+#undef sendto
+#undef recvfrom
+#undef shutdown
+#undef close
+#undef inet_aton
+
+#define NET_MAX_FD 1024
+// Largest datagram with its address prefix
+#define NET_MAX_DATAGRAM (sizeof(struct sockaddr_in) + 1500)
+
+typedef enum {
+    SOCKET_HOST,
+    SOCKET_UDP,
+    SOCKET_SESSION,
+} socket_kind_t;
+
+typedef struct {
+    socket_kind_t kind;
+    int peer;               // UDP: the end the tests use
+    uint16_t port;          // UDP: bound port in host byte order, 0 before bind
+    fake_socket_writer_t writer;
+    void *ctx;
+} socket_state_t;
+
+// Sockets by descriptor, guarded by net_lock
+static pthread_mutex_t net_lock = PTHREAD_MUTEX_INITIALIZER;
+static socket_state_t sockets[NET_MAX_FD];
+
+// Returns a copy of the state of a socket
+static socket_state_t socket_get(int s) {
+    socket_state_t state = { .kind = SOCKET_HOST };
+
+    if (s >= 0 && s < NET_MAX_FD) {
+        pthread_mutex_lock(&net_lock);
+        state = sockets[s];
+        pthread_mutex_unlock(&net_lock);
+    }
+
+    return state;
+}
+
+// Routes the writes to a socket to a writer until fake_net_detach
+void fake_net_attach(int fd, fake_socket_writer_t writer, void *ctx) {
+    pthread_mutex_lock(&net_lock);
+    sockets[fd] = (socket_state_t) {
+            .kind = SOCKET_SESSION,
+            .writer = writer,
+            .ctx = ctx,
+    };
+    pthread_mutex_unlock(&net_lock);
+}
+
+void fake_net_detach(int fd) {
+    pthread_mutex_lock(&net_lock);
+    sockets[fd] = (socket_state_t) { .kind = SOCKET_HOST };
+    pthread_mutex_unlock(&net_lock);
+}
+
+int lwip_socket(int domain, int type, int protocol) {
+    int fds[2];
+
+    if (type != SOCK_DGRAM) {
+        int fd = socket(domain, type, protocol);
+        int sndbuf = CONFIG_TCP_SND_BUF_DEFAULT;
+
+        // The send buffer of lwIP instead of the host's, which grows to megabytes and hides a slow peer
+        if (fd >= 0 && type == SOCK_STREAM) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        }
+
+        return fd;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0) {
+        return -1;
+    }
+
+    if (fds[0] >= NET_MAX_FD || fds[1] >= NET_MAX_FD) {
+        close(fds[0]);
+        close(fds[1]);
+        errno = EMFILE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&net_lock);
+    sockets[fds[0]] = (socket_state_t) {
+            .kind = SOCKET_UDP,
+            .peer = fds[1],
+    };
+    pthread_mutex_unlock(&net_lock);
+    return fds[0];
+}
+
+// A second UDP socket on a bound port fails like without SO_REUSEADDR
+int lwip_bind(int s, const struct sockaddr *name, socklen_t namelen) {
+    if (socket_get(s).kind != SOCKET_UDP) {
+        return bind(s, name, namelen);
+    }
+
+    uint16_t port = ntohs(((const struct sockaddr_in *) name)->sin_port);
+
+    pthread_mutex_lock(&net_lock);
+
+    for (int fd = 0; fd < NET_MAX_FD; fd++) {
+        if (sockets[fd].kind == SOCKET_UDP && sockets[fd].port == port) {
+            pthread_mutex_unlock(&net_lock);
+            errno = EADDRINUSE;
+            return -1;
+        }
+    }
+
+    sockets[s].port = port;
+    pthread_mutex_unlock(&net_lock);
+    return 0;
+}
+
+int lwip_connect(int s, const struct sockaddr *name, socklen_t namelen) {
+    return connect(s, name, namelen);
+}
+
+// Multicast options have no effect on the fake network, TCP options none on the socket pairs of HTTP connections
+int lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen) {
+    socket_kind_t kind = socket_get(s).kind;
+
+    if ((kind == SOCKET_UDP && level == IPPROTO_IP) || (kind == SOCKET_SESSION && level == IPPROTO_TCP)) {
+        return 0;
+    }
+
+    return setsockopt(s, level, optname, optval, optlen);
+}
+
+ssize_t lwip_writev(int s, const struct iovec *iov, int iovcnt) {
+    socket_state_t state = socket_get(s);
+
+    if (state.kind == SOCKET_SESSION) {
+        return state.writer(state.ctx, iov, iovcnt);
+    }
+
+    return writev(s, iov, iovcnt);
+}
+
+ssize_t lwip_send(int s, const void *data, size_t size, int flags) {
+    socket_state_t state = socket_get(s);
+
+    if (state.kind == SOCKET_SESSION) {
+        struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+        return state.writer(state.ctx, &iov, 1);
+    }
+
+    return send(s, data, size, flags | MSG_NOSIGNAL);
+}
+
+ssize_t lwip_sendto(int s, const void *data, size_t size, int flags, const struct sockaddr *to, socklen_t tolen) {
+    if (socket_get(s).kind != SOCKET_UDP) {
+        return sendto(s, data, size, flags | MSG_NOSIGNAL, to, tolen);
+    }
+
+    struct sockaddr_in addr = {0};
+    struct iovec iov[] = {
+            { .iov_base = &addr, .iov_len = sizeof(addr) },
+            { .iov_base = (void *) data, .iov_len = size },
+    };
+    struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+    };
+
+    memcpy(&addr, to, tolen < sizeof(addr) ? tolen : sizeof(addr));
+    ssize_t sent = sendmsg(s, &msg, flags);
+    return sent < 0 ? sent : sent - (ssize_t) sizeof(addr);
+}
+
+ssize_t lwip_recvfrom(int s, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    if (socket_get(s).kind != SOCKET_UDP) {
+        return recvfrom(s, mem, len, flags, from, fromlen);
+    }
+
+    struct sockaddr_in addr;
+    struct iovec iov[] = {
+            { .iov_base = &addr, .iov_len = sizeof(addr) },
+            { .iov_base = mem, .iov_len = len },
+    };
+    struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+    };
+
+    ssize_t received = recvmsg(s, &msg, flags);
+
+    if (received < (ssize_t) sizeof(addr)) {
+        return received < 0 ? received : 0;
+    }
+
+    if (from != NULL && fromlen != NULL) {
+        socklen_t copy = *fromlen < sizeof(addr) ? *fromlen : sizeof(addr);
+        memcpy(from, &addr, copy);
+        *fromlen = sizeof(addr);
+    }
+
+    return received - (ssize_t) sizeof(addr);
+}
+
+int lwip_shutdown(int s, int how) {
+    if (socket_get(s).kind == SOCKET_UDP) {
+        return 0;
+    }
+
+    return shutdown(s, how);
+}
+
+int lwip_close(int s) {
+    socket_state_t state = socket_get(s);
+
+    if (state.kind == SOCKET_UDP) {
+        pthread_mutex_lock(&net_lock);
+        sockets[s] = (socket_state_t) { .kind = SOCKET_HOST };
+        pthread_mutex_unlock(&net_lock);
+        close(state.peer);
+    }
+
+    return close(s);
+}
+
+int lwip_inet_aton(const char *cp, void *addr) {
+    return inet_aton(cp, (struct in_addr *) addr);
+}
+
+// Returns the test end of the UDP socket bound to a port, waits up to timeout_ms for the firmware to bind it
+static int peer_of(uint16_t port, int timeout_ms) {
+    int64_t until = fake_time_us() + timeout_ms * 1000LL;
+
+    for (;;) {
+        pthread_mutex_lock(&net_lock);
+
+        for (int fd = 0; fd < NET_MAX_FD; fd++) {
+            if (sockets[fd].kind == SOCKET_UDP && sockets[fd].port == port) {
+                int peer = sockets[fd].peer;
+                pthread_mutex_unlock(&net_lock);
+                return peer;
+            }
+        }
+
+        pthread_mutex_unlock(&net_lock);
+
+        if (fake_time_us() >= until) {
+            return -1;
+        }
+
+        fake_sleep_us(1000);
+    }
+}
+
+// Delivers a datagram from an address to the UDP socket bound to a port, waits up to timeout_ms for one
+int fake_net_inject(uint16_t port, const struct sockaddr_in *from, const void *data, size_t len, int timeout_ms) {
+    int peer = peer_of(port, timeout_ms);
+
+    if (peer < 0) {
+        return -1;
+    }
+
+    struct iovec iov[] = {
+            { .iov_base = (void *) from, .iov_len = sizeof(*from) },
+            { .iov_base = (void *) data, .iov_len = len },
+    };
+    struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+    };
+
+    return sendmsg(peer, &msg, 0) < 0 ? -1 : 0;
+}
+
+// Takes the next datagram the socket bound to a port sent, returns its length or -1 after timeout_ms
+int fake_net_receive(uint16_t port, struct sockaddr_in *to, void *data, size_t len, int timeout_ms) {
+    int64_t until = fake_time_us() + timeout_ms * 1000LL;
+    int peer = peer_of(port, timeout_ms);
+
+    if (peer < 0) {
+        return -1;
+    }
+
+    int64_t left = until - fake_time_us();
+    struct pollfd pfd = { .fd = peer, .events = POLLIN };
+
+    if (poll(&pfd, 1, left > 0 ? (int) (left / 1000) : 0) <= 0 || !(pfd.revents & POLLIN)) {
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    struct iovec iov[] = {
+            { .iov_base = &addr, .iov_len = sizeof(addr) },
+            { .iov_base = data, .iov_len = len },
+    };
+    struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+    };
+
+    ssize_t received = recvmsg(peer, &msg, MSG_DONTWAIT);
+
+    if (received < (ssize_t) sizeof(addr)) {
+        return -1;
+    }
+
+    if (to != NULL) {
+        *to = addr;
+    }
+
+    return (int) (received - sizeof(addr));
+}
@@ -0,0 +1,245 @@
+/*
+ * rmt.c
+ *
+ *  RMT transmitter keeping a copy of the last transmission per channel.
+ *  A transmission lasts as long as its items take on the wire, the next
+ *  one on the channel waits for it like in the driver. Each channel
+ *  drives a WS2812 strip that latches the colours it was sent, and the
+ *  items of a transmission are compared with their source once it is
+ *  over to find buffers changed while they were still being sent.
+ */
+
+#include "fake.h"
+#include "host_fake.h"
+#include <driver/rmt.h>
+#include <stdlib.h>
+#include <string.h>
+
+// APB clock the RMT divides down
+#define RMT_APB_HZ 80000000
+
+typedef struct {
+    int configured;
+    int installed;
+    uint8_t clk_div;
+    int gpio;
+    int mem_blocks;
+    rmt_item32_t *items;
+    int count;
+    uint32_t writes;
+    int64_t busy_until;     // esp_timer time the last transmission ends
+    const rmt_item32_t *source; // items of the last transmission until they were compared
+    uint32_t torn;
+    uint32_t strip[FAKE_RMT_STRIP_LEDS];
+    int strip_len;
+} rmt_channel_state_t;
+
+static pthread_mutex_t rmt_lock = PTHREAD_MUTEX_INITIALIZER;
+static rmt_channel_state_t channels[RMT_CHANNEL_MAX];
+static float time_scale = 1;
+static fake_rmt_observer_t observer = NULL;
+
+// Compares a finished transmission with the buffer it came from, called with rmt_lock held
+static void check_source(rmt_channel_state_t *state) {
+    if (state->source != NULL && fake_time_us() >= state->busy_until) {
+        if (memcmp(state->source, state->items, state->count * sizeof(rmt_item32_t)) != 0) {
+            state->torn++;
+        }
+
+        state->source = NULL;
+    }
+}
+
+// Shifts the bits of a transmission into the strip, a 1 is the longer high pulse, called with rmt_lock held
+static void strip_latch(rmt_channel_state_t *state) {
+    int led = 0;
+
+    for (int i = 0; i + 24 <= state->count && led < FAKE_RMT_STRIP_LEDS; i += 24, led++) {
+        uint32_t bits = 0;
+
+        for (int bit = 0; bit < 24; bit++) {
+            const rmt_item32_t *item = &state->items[i + bit];
+            bits = (bits << 1) | (item->level0 && item->duration0 > item->duration1);
+        }
+
+        state->strip[led] = bits;
+    }
+
+    if (led > state->strip_len) {
+        state->strip_len = led;
+    }
+}
+
+esp_err_t rmt_config(const rmt_config_t *config) {
+    if (config->channel >= RMT_CHANNEL_MAX || config->rmt_mode != RMT_MODE_TX || config->clk_div == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&rmt_lock);
+    channels[config->channel].configured = 1;
+    channels[config->channel].clk_div = config->clk_div;
+    channels[config->channel].gpio = config->gpio_num;
+    channels[config->channel].mem_blocks = config->mem_block_num;
+    pthread_mutex_unlock(&rmt_lock);
+    return ESP_OK;
+}
+
+esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags) {
+    if (channel >= RMT_CHANNEL_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&rmt_lock);
+    esp_err_t res = channels[channel].installed ? ESP_ERR_INVALID_STATE : ESP_OK;
+    channels[channel].installed = 1;
+    pthread_mutex_unlock(&rmt_lock);
+    return res;
+}
+
+// Sleeps until the transmission on a channel ended or the deadline passed, returns 0 on timeout
+static int wait_idle(rmt_channel_t channel, int64_t deadline) {
+    pthread_mutex_lock(&rmt_lock);
+    int64_t until = channels[channel].busy_until;
+    check_source(&channels[channel]);
+    pthread_mutex_unlock(&rmt_lock);
+
+    int64_t now = fake_time_us();
+
+    if (until <= now) {
+        return 1;
+    }
+
+    if (deadline < until) {
+        if (deadline > now) {
+            fake_sleep_us(deadline - now);
+        }
+
+        return 0;
+    }
+
+    fake_sleep_us(until - now);
+    pthread_mutex_lock(&rmt_lock);
+    check_source(&channels[channel]);
+    pthread_mutex_unlock(&rmt_lock);
+    return 1;
+}
+
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *items, int item_num, bool wait_tx_done) {
+    if (channel >= RMT_CHANNEL_MAX || items == NULL || item_num <= 0 || !channels[channel].installed) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    wait_idle(channel, INT64_MAX);
+
+    uint64_t ticks = 0;
+
+    for (int i = 0; i < item_num; i++) {
+        ticks += items[i].duration0 + items[i].duration1;
+    }
+
+    pthread_mutex_lock(&rmt_lock);
+    rmt_channel_state_t *state = &channels[channel];
+
+    state->items = realloc(state->items, item_num * sizeof(rmt_item32_t));
+    memcpy(state->items, items, item_num * sizeof(rmt_item32_t));
+    state->count = item_num;
+    state->writes++;
+    state->busy_until = fake_time_us() + (int64_t) (ticks * state->clk_div * 1e6 / RMT_APB_HZ * time_scale);
+    state->source = items;
+    strip_latch(state);
+    fake_rmt_observer_t notify = observer;
+    pthread_mutex_unlock(&rmt_lock);
+
+    if (notify != NULL) {
+        notify(channel, items, item_num);
+    }
+
+    if (wait_tx_done) {
+        wait_idle(channel, INT64_MAX);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t rmt_wait_tx_done(rmt_channel_t channel, TickType_t wait_time) {
+    if (channel >= RMT_CHANNEL_MAX || !channels[channel].installed) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int64_t deadline = wait_time == portMAX_DELAY ? INT64_MAX
+            : fake_time_us() + (int64_t) wait_time * portTICK_PERIOD_MS * 1000;
+
+    return wait_idle(channel, deadline) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+// Items of the last transmission on a channel, NULL before the first, count may be NULL
+const rmt_item32_t *fake_rmt_items(rmt_channel_t channel, int *count) {
+    pthread_mutex_lock(&rmt_lock);
+    const rmt_item32_t *items = channels[channel].items;
+
+    if (count != NULL) {
+        *count = channels[channel].count;
+    }
+
+    pthread_mutex_unlock(&rmt_lock);
+    return items;
+}
+
+// Transmissions started on a channel
+uint32_t fake_rmt_writes(rmt_channel_t channel) {
+    pthread_mutex_lock(&rmt_lock);
+    uint32_t writes = channels[channel].writes;
+    pthread_mutex_unlock(&rmt_lock);
+    return writes;
+}
+
+// Returns whether a channel is configured and installed
+int fake_rmt_installed(rmt_channel_t channel) {
+    pthread_mutex_lock(&rmt_lock);
+    int installed = channels[channel].configured && channels[channel].installed;
+    pthread_mutex_unlock(&rmt_lock);
+    return installed;
+}
+
+// GPIO and memory blocks a channel was configured with, returns 0 if it was not
+int fake_rmt_config(rmt_channel_t channel, int *gpio, int *mem_blocks) {
+    pthread_mutex_lock(&rmt_lock);
+    int configured = channels[channel].configured;
+
+    *gpio = channels[channel].gpio;
+    *mem_blocks = channels[channel].mem_blocks;
+    pthread_mutex_unlock(&rmt_lock);
+    return configured;
+}
+
+// Transmissions whose items changed in their buffer before they were sent completely
+uint32_t fake_rmt_torn(rmt_channel_t channel) {
+    pthread_mutex_lock(&rmt_lock);
+    uint32_t torn = channels[channel].torn;
+    pthread_mutex_unlock(&rmt_lock);
+    return torn;
+}
+
+// Copies the 24 bit words the strip on a channel latched, in the order they were sent, returns how many it has
+int fake_rmt_strip(rmt_channel_t channel, uint32_t *words, int max) {
+    pthread_mutex_lock(&rmt_lock);
+    int count = channels[channel].strip_len;
+
+    memcpy(words, channels[channel].strip, (count < max ? count : max) * sizeof(uint32_t));
+    pthread_mutex_unlock(&rmt_lock);
+    return count;
+}
+
+// Calls fn with the items of every transmission when it starts, on the task writing them, NULL to stop
+void fake_rmt_set_observer(fake_rmt_observer_t fn) {
+    pthread_mutex_lock(&rmt_lock);
+    observer = fn;
+    pthread_mutex_unlock(&rmt_lock);
+}
+
+// Scales the simulated wire time of every transmission, 1 by default, 0 sends instantly
+void fake_rmt_set_time_scale(float scale) {
+    pthread_mutex_lock(&rmt_lock);
+    time_scale = scale;
+    pthread_mutex_unlock(&rmt_lock);
+}
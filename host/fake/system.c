@@ -0,0 +1,305 @@
+/*
+ * system.c
+ *
+ *  Error names, NVS, heap, random numbers, the WiFi station and the
+ *  legacy event loop.
+ */
+
+#include "fake.h"
+#include "host_fake.h"
+#include <esp_err.h>
+#include <esp_event_loop.h>
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <esp_wifi.h>
+#include <freertos/queue.h>
+#include <nvs_flash.h>
+#include <tcpip_adapter.h>
+#include <lwip/sockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Stack and queue length of the event task
+#define EVENT_TASK_STACK 4096
+#define EVENT_QUEUE_LEN 16
+
+// Free heap after boot of an ESP32 with 4MB PSRAM
+static size_t heap_free_internal = 160 * 1024;
+static size_t heap_free_spiram = 4 * 1024 * 1024;
+
+// Station state, guarded by wifi_lock
+static pthread_mutex_t wifi_lock = PTHREAD_MUTEX_INITIALIZER;
+static system_event_cb_t event_cb = NULL;
+static void *event_ctx = NULL;
+static QueueHandle_t event_queue = NULL;
+static int wifi_started = 0;
+static int wifi_connected = 0;
+static int associate_ms = 0;
+static ip4_addr_t wifi_ip = { .addr = 0 };
+
+static uint32_t random_state = 0x2545F491;
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_NVS_NO_FREE_PAGES: return "ESP_ERR_NVS_NO_FREE_PAGES";
+        case ESP_ERR_NVS_NEW_VERSION_FOUND: return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+esp_err_t nvs_flash_init(void) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    return ESP_OK;
+}
+
+// xorshift32, the same sequence every run
+uint32_t esp_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+void esp_restart(void) {
+    fprintf(stderr, "esp_restart called\n");
+    exit(1);
+}
+
+// Free bytes reported for a heap, the default heap is the internal one
+static size_t heap_free(uint32_t caps) {
+    return (caps & MALLOC_CAP_SPIRAM) ? heap_free_spiram : heap_free_internal;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    if (size > heap_free(caps)) {
+        return NULL;
+    }
+
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+    if (size != 0 && n > heap_free(caps) / size) {
+        return NULL;
+    }
+
+    return calloc(n, size);
+}
+
+void heap_caps_free(void *ptr) {
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return heap_free(caps);
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return heap_free(caps);
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return heap_free(caps);
+}
+
+// Free bytes heap_caps_get_free_size reports for one of MALLOC_CAP_INTERNAL or MALLOC_CAP_SPIRAM
+void fake_heap_set_free(uint32_t caps, size_t bytes) {
+    if (caps & MALLOC_CAP_SPIRAM) {
+        heap_free_spiram = bytes;
+    } else {
+        heap_free_internal = bytes;
+    }
+}
+
+char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen) {
+    const uint8_t *bytes = (const uint8_t *) &addr->addr;
+
+    if (snprintf(buf, buflen, "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]) >= buflen) {
+        return NULL;
+    }
+
+    return buf;
+}
+
+char *ip4addr_ntoa(const ip4_addr_t *addr) {
+    static char buf[16];
+
+    return ip4addr_ntoa_r(addr, buf, sizeof(buf));
+}
+
+void tcpip_adapter_init(void) {
+}
+
+esp_err_t tcpip_adapter_get_ip_info(tcpip_adapter_if_t tcpip_if, tcpip_adapter_ip_info_t *ip_info) {
+    *ip_info = (tcpip_adapter_ip_info_t) {0};
+
+    pthread_mutex_lock(&wifi_lock);
+
+    if (tcpip_if == TCPIP_ADAPTER_IF_STA && wifi_connected) {
+        ip_info->ip = wifi_ip;
+        ip_info->netmask.addr = htonl(0xFFFFFF00);
+        ip_info->gw.addr = (wifi_ip.addr & ip_info->netmask.addr) | htonl(1);
+    }
+
+    pthread_mutex_unlock(&wifi_lock);
+    return ESP_OK;
+}
+
+// Delivers events to the callback, like the event task of ESP-IDF
+static void event_task(void *arg) {
+    system_event_t event;
+
+    for (;;) {
+        if (xQueueReceive(event_queue, &event, portMAX_DELAY) == pdTRUE && event_cb != NULL) {
+            event_cb(event_ctx, &event);
+        }
+    }
+}
+
+// Queues an event for the event task
+static void event_post(system_event_id_t id) {
+    system_event_t event = { .event_id = id };
+
+    if (id == SYSTEM_EVENT_STA_GOT_IP) {
+        tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &event.event_info.got_ip.ip_info);
+    }
+
+    xQueueSend(event_queue, &event, portMAX_DELAY);
+}
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx) {
+    if (event_queue != NULL) {
+        return ESP_FAIL;
+    }
+
+    event_cb = cb;
+    event_ctx = ctx;
+    event_queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(system_event_t));
+    xTaskCreate(event_task, "eventTask", EVENT_TASK_STACK, NULL, 20, NULL);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+    if (wifi_ip.addr == 0) {
+        fake_wifi_set_ip("10.0.0.2");
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(esp_interface_t interface, wifi_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    pthread_mutex_lock(&wifi_lock);
+    wifi_started = 1;
+    pthread_mutex_unlock(&wifi_lock);
+
+    event_post(SYSTEM_EVENT_STA_START);
+    return ESP_OK;
+}
+
+// Connects to the access point, the address comes with the connection
+static void wifi_associate(void) {
+    pthread_mutex_lock(&wifi_lock);
+    int was_connected = wifi_connected;
+    wifi_connected = 1;
+    pthread_mutex_unlock(&wifi_lock);
+
+    if (!was_connected) {
+        event_post(SYSTEM_EVENT_STA_CONNECTED);
+        event_post(SYSTEM_EVENT_STA_GOT_IP);
+    }
+}
+
+// Associates after the delay set by fake_wifi_set_associate_delay_ms
+static void *wifi_associate_later(void *arg) {
+    usleep((intptr_t) arg * 1000);
+    wifi_associate();
+    return NULL;
+}
+
+// The access point is always in reach
+esp_err_t esp_wifi_connect(void) {
+    pthread_mutex_lock(&wifi_lock);
+    int started = wifi_started;
+    int delay = associate_ms;
+    pthread_mutex_unlock(&wifi_lock);
+
+    if (!started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (delay > 0) {
+        pthread_t thread;
+
+        pthread_create(&thread, NULL, wifi_associate_later, (void *) (intptr_t) delay);
+        pthread_detach(thread);
+    } else {
+        wifi_associate();
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+    pthread_mutex_lock(&wifi_lock);
+    int was_connected = wifi_connected;
+    wifi_connected = 0;
+    pthread_mutex_unlock(&wifi_lock);
+
+    if (was_connected) {
+        event_post(SYSTEM_EVENT_STA_DISCONNECTED);
+    }
+
+    return ESP_OK;
+}
+
+// Makes association take this long, like an access point that answers slowly
+void fake_wifi_set_associate_delay_ms(int ms) {
+    pthread_mutex_lock(&wifi_lock);
+    associate_ms = ms;
+    pthread_mutex_unlock(&wifi_lock);
+}
+
+// Address the station gets when it connects, 10.0.0.2 by default
+void fake_wifi_set_ip(const char *ip) {
+    pthread_mutex_lock(&wifi_lock);
+    inet_pton(AF_INET, ip, &wifi_ip.addr);
+    pthread_mutex_unlock(&wifi_lock);
+}
+
+// Drops the connection to the access point, the station reconnects on its own
+void fake_wifi_disconnect(void) {
+    esp_wifi_disconnect();
+}
+
+// Returns whether the station has an address
+int fake_wifi_connected(void) {
+    pthread_mutex_lock(&wifi_lock);
+    int connected = wifi_connected;
+    pthread_mutex_unlock(&wifi_lock);
+    return connected;
+}
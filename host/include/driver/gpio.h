@@ -0,0 +1,12 @@
+/*
+ * driver/gpio.h
+ *
+ *  Host stand-in for the GPIO driver types.
+ */
+
+#ifndef HOST_DRIVER_GPIO_H_
+#define HOST_DRIVER_GPIO_H_
+
+typedef int gpio_num_t;
+
+#endif /* HOST_DRIVER_GPIO_H_ */
@@ -0,0 +1,28 @@
+/*
+ * driver/ledc.h
+ *
+ *  Host stand-in for the LED PWM controller, the camera clock source.
+ */
+
+#ifndef HOST_DRIVER_LEDC_H_
+#define HOST_DRIVER_LEDC_H_
+
+typedef enum {
+    LEDC_TIMER_0,
+    LEDC_TIMER_1,
+    LEDC_TIMER_2,
+    LEDC_TIMER_3,
+} ledc_timer_t;
+
+typedef enum {
+    LEDC_CHANNEL_0,
+    LEDC_CHANNEL_1,
+    LEDC_CHANNEL_2,
+    LEDC_CHANNEL_3,
+    LEDC_CHANNEL_4,
+    LEDC_CHANNEL_5,
+    LEDC_CHANNEL_6,
+    LEDC_CHANNEL_7,
+} ledc_channel_t;
+
+#endif /* HOST_DRIVER_LEDC_H_ */
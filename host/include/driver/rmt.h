@@ -0,0 +1,84 @@
+/*
+ * driver/rmt.h
+ *
+ *  Host stand-in for the RMT transmitter. Written items are kept per
+ *  channel for tests, and a transmission takes as long as the durations
+ *  of its items at the configured clock, see fake_rmt_* in host_fake.h.
+ */
+
+#ifndef HOST_DRIVER_RMT_H_
+#define HOST_DRIVER_RMT_H_
+
+#include "gpio.h"
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    RMT_CHANNEL_0,
+    RMT_CHANNEL_1,
+    RMT_CHANNEL_2,
+    RMT_CHANNEL_3,
+    RMT_CHANNEL_4,
+    RMT_CHANNEL_5,
+    RMT_CHANNEL_6,
+    RMT_CHANNEL_7,
+    RMT_CHANNEL_MAX,
+} rmt_channel_t;
+
+typedef enum {
+    RMT_MODE_TX,
+    RMT_MODE_RX,
+    RMT_MODE_MAX,
+} rmt_mode_t;
+
+typedef enum {
+    RMT_CARRIER_LEVEL_LOW,
+    RMT_CARRIER_LEVEL_HIGH,
+} rmt_carrier_level_t;
+
+typedef enum {
+    RMT_IDLE_LEVEL_LOW,
+    RMT_IDLE_LEVEL_HIGH,
+} rmt_idle_level_t;
+
+typedef struct {
+    union {
+        struct {
+            uint32_t duration0 :15;
+            uint32_t level0 :1;
+            uint32_t duration1 :15;
+            uint32_t level1 :1;
+        };
+        uint32_t val;
+    };
+} rmt_item32_t;
+
+typedef struct {
+    bool loop_en;
+    uint32_t carrier_freq_hz;
+    uint8_t carrier_duty_percent;
+    rmt_carrier_level_t carrier_level;
+    bool carrier_en;
+    rmt_idle_level_t idle_level;
+    bool idle_output_en;
+} rmt_tx_config_t;
+
+typedef struct {
+    rmt_mode_t rmt_mode;
+    rmt_channel_t channel;
+    uint8_t clk_div;
+    gpio_num_t gpio_num;
+    uint8_t mem_block_num;
+    union {
+        rmt_tx_config_t tx_config;
+    };
+} rmt_config_t;
+
+esp_err_t rmt_config(const rmt_config_t *config);
+esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags);
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *items, int item_num, bool wait_tx_done);
+esp_err_t rmt_wait_tx_done(rmt_channel_t channel, TickType_t wait_time);
+
+#endif /* HOST_DRIVER_RMT_H_ */
@@ -0,0 +1,61 @@
+/*
+ * esp_camera.h
+ *
+ *  Host stand-in for the esp32-camera driver. Frames are synthetic JPEG
+ *  stand-ins produced at a configurable rate, see fake_camera_* in
+ *  host_fake.h for their content and size.
+ */
+
+#ifndef HOST_ESP_CAMERA_H_
+#define HOST_ESP_CAMERA_H_
+
+#include "sensor.h"
+#include <driver/ledc.h>
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+typedef struct {
+    int pin_pwdn;
+    int pin_reset;
+    int pin_xclk;
+    int pin_sscb_sda;
+    int pin_sscb_scl;
+    int pin_d7;
+    int pin_d6;
+    int pin_d5;
+    int pin_d4;
+    int pin_d3;
+    int pin_d2;
+    int pin_d1;
+    int pin_d0;
+    int pin_vsync;
+    int pin_href;
+    int pin_pclk;
+    int xclk_freq_hz;
+    ledc_timer_t ledc_timer;
+    ledc_channel_t ledc_channel;
+    pixformat_t pixel_format;
+    framesize_t frame_size;
+    int jpeg_quality;
+    size_t fb_count;
+} camera_config_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t width;
+    size_t height;
+    pixformat_t format;
+    struct timeval timestamp;
+} camera_fb_t;
+
+esp_err_t esp_camera_init(const camera_config_t *config);
+esp_err_t esp_camera_deinit(void);
+// Waits for the next frame, NULL if all frame buffers are taken for too long
+camera_fb_t *esp_camera_fb_get(void);
+void esp_camera_fb_return(camera_fb_t *fb);
+sensor_t *esp_camera_sensor_get(void);
+
+#endif /* HOST_ESP_CAMERA_H_ */
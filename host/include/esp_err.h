@@ -0,0 +1,44 @@
+/*
+ * esp_err.h
+ *
+ *  Host stand-in for the ESP-IDF error codes, values as in ESP-IDF 3.3.
+ */
+
+#ifndef HOST_ESP_ERR_H_
+#define HOST_ESP_ERR_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_NOT_SUPPORTED   0x106
+#define ESP_ERR_TIMEOUT         0x107
+
+#define ESP_ERR_NVS_BASE                0x1100
+#define ESP_ERR_NVS_NO_FREE_PAGES       (ESP_ERR_NVS_BASE + 0x0d)
+#define ESP_ERR_NVS_NEW_VERSION_FOUND   (ESP_ERR_NVS_BASE + 0x10)
+
+// Returns the name of an error code
+const char *esp_err_to_name(esp_err_t code);
+
+// Aborts with the failed expression like the device does
+#define ESP_ERROR_CHECK(x) do {                                                                     \
+        esp_err_t __err_rc = (x);                                                                   \
+        if (__err_rc != ESP_OK) {                                                                   \
+            fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d\nexpression: %s\n", \
+                    (int) __err_rc, esp_err_to_name(__err_rc), __FILE__, __LINE__, #x);             \
+            abort();                                                                                \
+        }                                                                                           \
+    } while (0)
+
+#endif /* HOST_ESP_ERR_H_ */
@@ -0,0 +1,45 @@
+/*
+ * esp_event_loop.h
+ *
+ *  Host stand-in for the legacy system event loop of ESP-IDF 3.3. Events
+ *  are delivered on an event thread, see fake_wifi_* in host_fake.h.
+ */
+
+#ifndef HOST_ESP_EVENT_LOOP_H_
+#define HOST_ESP_EVENT_LOOP_H_
+
+#include "esp_err.h"
+#include "tcpip_adapter.h"
+
+typedef enum {
+    SYSTEM_EVENT_WIFI_READY,
+    SYSTEM_EVENT_SCAN_DONE,
+    SYSTEM_EVENT_STA_START,
+    SYSTEM_EVENT_STA_STOP,
+    SYSTEM_EVENT_STA_CONNECTED,
+    SYSTEM_EVENT_STA_DISCONNECTED,
+    SYSTEM_EVENT_STA_AUTHMODE_CHANGE,
+    SYSTEM_EVENT_STA_GOT_IP,
+    SYSTEM_EVENT_STA_LOST_IP,
+    SYSTEM_EVENT_MAX,
+} system_event_id_t;
+
+typedef struct {
+    tcpip_adapter_ip_info_t ip_info;
+    int ip_changed;
+} system_event_sta_got_ip_t;
+
+typedef union {
+    system_event_sta_got_ip_t got_ip;
+} system_event_info_t;
+
+typedef struct {
+    system_event_id_t event_id;
+    system_event_info_t event_info;
+} system_event_t;
+
+typedef esp_err_t (*system_event_cb_t)(void *ctx, system_event_t *event);
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx);
+
+#endif /* HOST_ESP_EVENT_LOOP_H_ */
@@ -0,0 +1,32 @@
+/*
+ * esp_jpg_decode.h
+ *
+ *  Host stand-in for the esp32-camera JPEG decoder. It decodes the
+ *  synthetic frames of the fake camera and calls the writer the way the
+ *  real decoder does: once with NULL data announcing the output size,
+ *  then once per block of 16x16 pixels at full scale in row order, then
+ *  once with NULL data at the end.
+ */
+
+#ifndef HOST_ESP_JPG_DECODE_H_
+#define HOST_ESP_JPG_DECODE_H_
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    JPG_SCALE_NONE,
+    JPG_SCALE_2X,
+    JPG_SCALE_4X,
+    JPG_SCALE_8X,
+    JPG_SCALE_MAX = JPG_SCALE_8X
+} jpg_scale_t;
+
+typedef size_t (*jpg_reader_cb)(void *arg, size_t index, uint8_t *buf, size_t len);
+typedef bool (*jpg_writer_cb)(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data);
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void *arg);
+
+#endif /* HOST_ESP_JPG_DECODE_H_ */
@@ -0,0 +1,51 @@
+/*
+ * esp_log.h
+ *
+ *  Host stand-in for the ESP-IDF logger, writes to stderr. The level of
+ *  every tag starts at ESP_LOG_WARN, so tests and benchmarks are not
+ *  slowed down by the info lines of the hot paths, and can be raised
+ *  with esp_log_level_set or the ESP_LOG_LEVEL environment variable.
+ */
+
+#ifndef HOST_ESP_LOG_H_
+#define HOST_ESP_LOG_H_
+
+#include <sdkconfig.h>
+#include <stdint.h>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+// Sets the level of a tag, "*" for all tags without a level of their own
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+// Returns whether a message of the given level and tag is written
+int esp_log_enabled(esp_log_level_t level, const char *tag);
+
+// Writes a formatted message
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+        __attribute__((format(printf, 3, 4)));
+
+// Milliseconds since start, the timestamp of the log lines
+uint32_t esp_log_timestamp(void);
+
+#define ESP_LOG_LEVEL_LOCAL(level, letter, tag, format, ...) do {                                    \
+        if (esp_log_enabled(level, tag)) {                                                          \
+            esp_log_write(level, tag, letter " (%u) %s: " format "\n", esp_log_timestamp(), tag,    \
+                          ##__VA_ARGS__);                                                           \
+        }                                                                                           \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#endif /* HOST_ESP_LOG_H_ */
@@ -0,0 +1,12 @@
+/*
+ * esp_now.h
+ *
+ *  Host stand-in for ESP-NOW, only included by the firmware.
+ */
+
+#ifndef HOST_ESP_NOW_H_
+#define HOST_ESP_NOW_H_
+
+#include "esp_err.h"
+
+#endif /* HOST_ESP_NOW_H_ */
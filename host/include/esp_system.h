@@ -0,0 +1,19 @@
+/*
+ * esp_system.h
+ *
+ *  Host stand-in for the ESP-IDF system functions.
+ */
+
+#ifndef HOST_ESP_SYSTEM_H_
+#define HOST_ESP_SYSTEM_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// Random number, from a fixed seed on the host so runs repeat
+uint32_t esp_random(void);
+
+// Exits the process
+void esp_restart(void) __attribute__((noreturn));
+
+#endif /* HOST_ESP_SYSTEM_H_ */
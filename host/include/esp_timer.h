@@ -0,0 +1,39 @@
+/*
+ * esp_timer.h
+ *
+ *  Host stand-in for esp_timer. Time is CLOCK_MONOTONIC since start and
+ *  callbacks run one after another on a timer thread, like on the
+ *  esp_timer task of the device.
+ */
+
+#ifndef HOST_ESP_TIMER_H_
+#define HOST_ESP_TIMER_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+} esp_timer_create_args_t;
+
+// Microseconds since start
+int64_t esp_timer_get_time(void);
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *timer);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us);
+// Returns ESP_ERR_INVALID_STATE if the timer is not running
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+esp_err_t esp_timer_delete(esp_timer_handle_t timer);
+
+#endif /* HOST_ESP_TIMER_H_ */
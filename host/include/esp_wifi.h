@@ -0,0 +1,54 @@
+/*
+ * esp_wifi.h
+ *
+ *  Host stand-in for the WiFi driver. A started station connects at once
+ *  and gets the address set with fake_wifi_set_ip.
+ */
+
+#ifndef HOST_ESP_WIFI_H_
+#define HOST_ESP_WIFI_H_
+
+#include "esp_err.h"
+#include <stdint.h>
+
+typedef struct {
+    int magic;
+} wifi_init_config_t;
+
+#define WIFI_INIT_CONFIG_DEFAULT() { .magic = 0x1F2F3F4F }
+
+typedef enum {
+    WIFI_STORAGE_FLASH,
+    WIFI_STORAGE_RAM,
+} wifi_storage_t;
+
+typedef enum {
+    WIFI_MODE_NULL,
+    WIFI_MODE_STA,
+    WIFI_MODE_AP,
+    WIFI_MODE_APSTA,
+} wifi_mode_t;
+
+typedef enum {
+    ESP_IF_WIFI_STA,
+    ESP_IF_WIFI_AP,
+} esp_interface_t;
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t password[64];
+} wifi_sta_config_t;
+
+typedef union {
+    wifi_sta_config_t sta;
+} wifi_config_t;
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config);
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_set_config(esp_interface_t interface, wifi_config_t *config);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_connect(void);
+esp_err_t esp_wifi_disconnect(void);
+
+#endif /* HOST_ESP_WIFI_H_ */
@@ -0,0 +1,60 @@
+/*
+ * freertos/FreeRTOS.h
+ *
+ *  Host stand-in for the FreeRTOS kernel types, implemented on pthreads
+ *  in fake/freertos.c.
+ */
+
+#ifndef HOST_FREERTOS_FREERTOS_H_
+#define HOST_FREERTOS_FREERTOS_H_
+
+#include <sdkconfig.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define configMAX_PRIORITIES 25
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t) ((uint64_t) (ms) * configTICK_RATE_HZ / 1000))
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+#define BIT0 0x00000001
+#define BIT1 0x00000002
+#define BIT2 0x00000004
+#define BIT3 0x00000008
+#define BIT4 0x00000010
+#define BIT5 0x00000020
+#define BIT6 0x00000040
+#define BIT7 0x00000080
+
+#define configASSERT(x) do { if (!(x)) { vAssertCalled(__FILE__, __LINE__); } } while (0)
+
+// Spinlock of a critical section, all of them share one recursive mutex on the host
+typedef struct {
+    int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) vPortExitCritical(mux)
+#define portYIELD_FROM_ISR() do { } while (0)
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+void vAssertCalled(const char *file, int line);
+
+#endif /* HOST_FREERTOS_FREERTOS_H_ */
@@ -0,0 +1,23 @@
+/*
+ * freertos/event_groups.h
+ *
+ *  Host stand-in for FreeRTOS event groups.
+ */
+
+#ifndef HOST_FREERTOS_EVENT_GROUPS_H_
+#define HOST_FREERTOS_EVENT_GROUPS_H_
+
+#include "FreeRTOS.h"
+
+typedef struct host_event_group *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks);
+void vEventGroupDelete(EventGroupHandle_t group);
+
+#endif /* HOST_FREERTOS_EVENT_GROUPS_H_ */
@@ -0,0 +1,220 @@
+/*
+ * host_fake.h
+ *
+ *  Controls of the fake ESP-IDF layers the host build links the firmware
+ *  against. Tests and benchmarks use them to drive the camera, issue
+ *  HTTP requests, read what went out on the RMT channels and exchange
+ *  multicast datagrams with the station.
+ *
+ *  Every fake keeps its state in statics, like the drivers it stands in
+ *  for, so a process runs one station.
+ */
+
+#ifndef HOST_HOST_FAKE_H_
+#define HOST_HOST_FAKE_H_
+
+#include <driver/rmt.h>
+#include <esp_camera.h>
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <freertos/task.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Camera
+
+// Header of the synthetic JPEG frames, followed by filler up to the frame length and FF D9
+#define FAKE_JPEG_HEADER_LEN 16
+
+// What a synthetic JPEG frame or re-encoded image describes
+typedef struct {
+    int encoded;            // written by fmt2jpg_cb, the RGB888 pixels follow the header
+    uint16_t width;
+    uint16_t height;
+    uint8_t quality;
+    uint8_t scene;          // scene the camera saw, decides the pixels
+    framesize_t framesize;
+    uint32_t frame;         // frames produced by the camera before this one
+} fake_jpeg_info_t;
+
+// Frames per second the camera produces, 25 by default
+void fake_camera_set_fps(int fps);
+
+// Scene of the following frames, every pixel changes with it
+void fake_camera_set_scene(uint8_t scene);
+
+// Length of the following frames, 0 to derive it from the frame size and quality like the sensor does
+void fake_camera_set_jpeg_len(size_t len);
+
+// Frames captured with the old settings after a switch, fb_count - 1 by default like the continuous mode
+void fake_camera_set_latency(int frames);
+
+// Makes esp_camera_init take this long, like probing a slow sensor
+void fake_camera_set_init_delay_ms(int ms);
+
+// Settings written to the sensor since boot, each set_framesize or set_quality call is one
+uint32_t fake_camera_sensor_writes(void);
+
+// Makes the next count calls of esp_camera_fb_get fail
+void fake_camera_fail_next(int count);
+
+// Frames handed out by esp_camera_fb_get and frame buffers currently taken
+uint32_t fake_camera_frames(void);
+int fake_camera_taken(void);
+
+// Reads the header of a synthetic frame or re-encoded image, returns 0 if it is one
+int fake_jpeg_parse(const uint8_t *buf, size_t len, fake_jpeg_info_t *info);
+
+// Luma of a full resolution pixel of a scene, the decoder outputs it as grey
+uint8_t fake_jpeg_pixel(uint8_t scene, int x, int y);
+
+// HTTP
+
+#define FAKE_HTTP_MAX_HEADERS 16
+
+// A request as it arrives on a connection
+typedef struct {
+    httpd_method_t method;
+    const char *uri;        // path and query
+    const char *headers;    // "Name: value\r\n" lines, may be NULL
+    const void *body;
+    size_t body_len;
+    size_t recv_max;        // longest piece httpd_req_recv hands out, 0 for all at once
+    int recv_timeouts;      // httpd_req_recv times out this often before the first piece
+    size_t send_limit;      // sends fail like on a closed connection after this many bytes, 0 for no limit
+} fake_http_request_t;
+
+// Response header
+typedef struct {
+    const char *name;
+    const char *value;
+} fake_http_header_t;
+
+// Everything the handler sent
+typedef struct {
+    esp_err_t result;       // returned by the handler
+    char status[48];
+    char type[64];
+    fake_http_header_t headers[FAKE_HTTP_MAX_HEADERS];
+    int header_count;
+    uint8_t *body;          // malloc'd, chunks are joined, raw socket writes included as they are
+    size_t len;
+    int chunks;             // httpd_resp_send_chunk calls with data
+    int raw;                // the handler wrote to the socket itself
+    int64_t duration_us;    // handler run time
+} fake_http_response_t;
+
+// Opens a connection to the server on a port, returns its socket or -1
+int fake_httpd_connect(uint16_t port);
+
+// Closes a connection from the client side
+void fake_httpd_disconnect(int fd);
+
+// Returns whether the server still keeps a connection open
+int fake_httpd_is_open(int fd);
+
+// Runs a request on a connection, handler and queued work run on the calling thread
+esp_err_t fake_httpd_request_on(int fd, const fake_http_request_t *request, fake_http_response_t *response);
+
+// Runs a request on a connection of its own that stays open for the next request on the port
+esp_err_t fake_httpd_request(uint16_t port, const fake_http_request_t *request, fake_http_response_t *response);
+
+// Shorthand for a GET without body
+esp_err_t fake_httpd_get(uint16_t port, const char *uri, const char *headers, fake_http_response_t *response);
+
+// Runs the work queued with httpd_queue_work on the server of a port, like its task does between requests
+void fake_httpd_run_work(uint16_t port);
+
+// Bytes the handlers and the tasks writing to connections of the server on a port sent so far,
+// from_fb counts those that went out straight from camera frame buffers
+void fake_httpd_sent(uint16_t port, uint64_t *from_fb, uint64_t *other);
+
+// Returns a response header or NULL
+const char *fake_http_header(const fake_http_response_t *response, const char *name);
+
+// Returns the numeric status, 200 unless the handler set another one
+int fake_http_status(const fake_http_response_t *response);
+
+// Frees the body of a response
+void fake_http_response_free(fake_http_response_t *response);
+
+// RMT
+
+// Items of the last transmission on a channel, NULL before the first, count may be NULL
+const rmt_item32_t *fake_rmt_items(rmt_channel_t channel, int *count);
+
+// Transmissions started on a channel
+uint32_t fake_rmt_writes(rmt_channel_t channel);
+
+// Returns whether a channel is configured and installed
+int fake_rmt_installed(rmt_channel_t channel);
+
+// GPIO and memory blocks a channel was configured with, returns 0 if it was not
+int fake_rmt_config(rmt_channel_t channel, int *gpio, int *mem_blocks);
+
+// LEDs the strip on a channel has, longer transmissions are cut off
+#define FAKE_RMT_STRIP_LEDS 1024
+
+// Called for every transmission
+typedef void (*fake_rmt_observer_t)(rmt_channel_t channel, const rmt_item32_t *items, int count);
+
+// Transmissions whose items changed in their buffer before they were sent completely
+// Checked when the channel is waited for or written next, so a buffer changed between the end and that is counted too
+uint32_t fake_rmt_torn(rmt_channel_t channel);
+
+// Copies the 24 bit words the strip on a channel latched, in the order they were sent, returns how many it has
+int fake_rmt_strip(rmt_channel_t channel, uint32_t *words, int max);
+
+// Calls fn with the items of every transmission when it starts, on the task writing them, NULL to stop
+void fake_rmt_set_observer(fake_rmt_observer_t fn);
+
+// Scales the simulated wire time of every transmission, 1 by default, 0 sends instantly
+void fake_rmt_set_time_scale(float scale);
+
+// Network
+
+// Address the station gets when it connects, 10.0.0.2 by default
+void fake_wifi_set_ip(const char *ip);
+
+// Makes association take this long, like an access point that answers slowly
+void fake_wifi_set_associate_delay_ms(int ms);
+
+// Drops the connection to the access point, the station reconnects on its own
+void fake_wifi_disconnect(void);
+
+// Returns whether the station has an address
+int fake_wifi_connected(void);
+
+// Delivers a datagram from an address to the UDP socket bound to a port, waits up to timeout_ms for one
+int fake_net_inject(uint16_t port, const struct sockaddr_in *from, const void *data, size_t len, int timeout_ms);
+
+// Takes the next datagram the socket bound to a port sent, returns its length or -1 after timeout_ms
+int fake_net_receive(uint16_t port, struct sockaddr_in *to, void *data, size_t len, int timeout_ms);
+
+// Log
+
+// Receives a formatted log line
+typedef void (*fake_log_capture_t)(esp_log_level_t level, const char *tag, const char *line);
+
+// Hands every line written from now on to fn instead of stderr, NULL to write to stderr again
+// Only lines of enabled levels are written, see esp_log_level_set
+void fake_log_set_capture(fake_log_capture_t fn);
+
+// Heap
+
+// Free bytes heap_caps_get_free_size reports for one of MALLOC_CAP_INTERNAL or MALLOC_CAP_SPIRAM
+void fake_heap_set_free(uint32_t caps, size_t bytes);
+
+// Clock
+
+// Starts esp_timer time at 0 again, for a station in a process forked by a test, before the firmware runs
+void fake_clock_restart(void);
+
+// Tasks
+
+// Returns the handle of a task created by the firmware, NULL if there is none by that name
+TaskHandle_t fake_task_find(const char *name);
+
+#endif /* HOST_HOST_FAKE_H_ */
@@ -0,0 +1,23 @@
+/*
+ * img_converters.h
+ *
+ *  Host stand-in for the esp32-camera image converters. The encoder
+ *  writes the pixels into the synthetic JPEG format of the fake camera,
+ *  which fake_jpeg_pixel reads back.
+ */
+
+#ifndef HOST_IMG_CONVERTERS_H_
+#define HOST_IMG_CONVERTERS_H_
+
+#include "esp_camera.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef size_t (*jpg_out_cb)(void *arg, size_t index, const void *data, size_t len);
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                uint8_t quality, jpg_out_cb cb, void *arg);
+bool frame2jpg_cb(camera_fb_t *fb, uint8_t quality, jpg_out_cb cb, void *arg);
+
+#endif /* HOST_IMG_CONVERTERS_H_ */
@@ -0,0 +1,22 @@
+/*
+ * lwip/ip4_addr.h
+ *
+ *  Host stand-in for the lwIP IPv4 address type, in network byte order.
+ */
+
+#ifndef HOST_LWIP_IP4_ADDR_H_
+#define HOST_LWIP_IP4_ADDR_H_
+
+#include <stdint.h>
+
+typedef struct ip4_addr {
+    uint32_t addr;
+} ip4_addr_t;
+
+// Formats an address into a static buffer
+char *ip4addr_ntoa(const ip4_addr_t *addr);
+
+// Formats an address into buf, NULL if it does not fit
+char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen);
+
+#endif /* HOST_LWIP_IP4_ADDR_H_ */
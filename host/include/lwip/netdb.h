@@ -0,0 +1,12 @@
+/*
+ * lwip/netdb.h
+ *
+ *  Host stand-in for the lwIP resolver.
+ */
+
+#ifndef HOST_LWIP_NETDB_H_
+#define HOST_LWIP_NETDB_H_
+
+#include <netdb.h>
+
+#endif /* HOST_LWIP_NETDB_H_ */
@@ -0,0 +1,57 @@
+/*
+ * lwip/sockets.h
+ *
+ *  Host stand-in for the lwIP socket API.
+ *
+ *  TCP sockets are the host's own. UDP sockets are routed through the
+ *  fake network of fake/net.c, so tests exchange datagrams with the
+ *  station without multicast routes, see fake_net_* in host_fake.h.
+ *  Connections of the fake HTTP servers write into their response. The
+ *  lwIP only address helpers taking the address by value are mapped to
+ *  ip4addr_ntoa like lwIP does.
+ */
+
+#ifndef HOST_LWIP_SOCKETS_H_
+#define HOST_LWIP_SOCKETS_H_
+
+#include "ip4_addr.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+int lwip_socket(int domain, int type, int protocol);
+int lwip_bind(int s, const struct sockaddr *name, socklen_t namelen);
+int lwip_connect(int s, const struct sockaddr *name, socklen_t namelen);
+int lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen);
+ssize_t lwip_send(int s, const void *data, size_t size, int flags);
+ssize_t lwip_sendto(int s, const void *data, size_t size, int flags, const struct sockaddr *to, socklen_t tolen);
+ssize_t lwip_recvfrom(int s, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen);
+ssize_t lwip_writev(int s, const struct iovec *iov, int iovcnt);
+int lwip_shutdown(int s, int how);
+int lwip_close(int s);
+int lwip_inet_aton(const char *cp, void *addr);
+
+#define socket(domain, type, protocol) lwip_socket(domain, type, protocol)
+#define bind(s, name, namelen) lwip_bind(s, name, namelen)
+#define connect(s, name, namelen) lwip_connect(s, name, namelen)
+#define setsockopt(s, level, optname, optval, optlen) lwip_setsockopt(s, level, optname, optval, optlen)
+#define send(s, data, size, flags) lwip_send(s, data, size, flags)
+#define sendto(s, data, size, flags, to, tolen) lwip_sendto(s, data, size, flags, to, tolen)
+#define recvfrom(s, mem, len, flags, from, fromlen) lwip_recvfrom(s, mem, len, flags, from, fromlen)
+#define shutdown(s, how) lwip_shutdown(s, how)
+#define close(s) lwip_close(s)
+
+// lwIP takes a pointer to any 32 bit address and the address itself by value
+#define inet_aton(cp, addr) lwip_inet_aton(cp, addr)
+#define inet_ntoa(addr) ip4addr_ntoa((const ip4_addr_t *) &(addr))
+#define inet_ntoa_r(addr, buf, buflen) ip4addr_ntoa_r((const ip4_addr_t *) &(addr), buf, buflen)
+
+#define IP_MULTICAST(a) IN_MULTICAST(a)
+
+#endif /* HOST_LWIP_SOCKETS_H_ */
@@ -0,0 +1,15 @@
+/*
+ * nvs_flash.h
+ *
+ *  Host stand-in for the NVS flash partition, always ready.
+ */
+
+#ifndef HOST_NVS_FLASH_H_
+#define HOST_NVS_FLASH_H_
+
+#include "esp_err.h"
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif /* HOST_NVS_FLASH_H_ */
@@ -0,0 +1,65 @@
+/*
+ * sensor.h
+ *
+ *  Host stand-in for the esp32-camera sensor interface, frame sizes in
+ *  the order of the driver the firmware was written against.
+ */
+
+#ifndef HOST_SENSOR_H_
+#define HOST_SENSOR_H_
+
+#include <stdint.h>
+
+typedef enum {
+    PIXFORMAT_RGB565,
+    PIXFORMAT_YUV422,
+    PIXFORMAT_GRAYSCALE,
+    PIXFORMAT_JPEG,
+    PIXFORMAT_RGB888,
+    PIXFORMAT_RAW,
+    PIXFORMAT_RGB444,
+    PIXFORMAT_RGB555,
+} pixformat_t;
+
+typedef enum {
+    FRAMESIZE_QQVGA,    // 160x120
+    FRAMESIZE_QQVGA2,   // 128x160
+    FRAMESIZE_QCIF,     // 176x144
+    FRAMESIZE_HQVGA,    // 240x176
+    FRAMESIZE_QVGA,     // 320x240
+    FRAMESIZE_CIF,      // 400x296
+    FRAMESIZE_VGA,      // 640x480
+    FRAMESIZE_SVGA,     // 800x600
+    FRAMESIZE_XGA,      // 1024x768
+    FRAMESIZE_SXGA,     // 1280x1024
+    FRAMESIZE_UXGA,     // 1600x1200
+    FRAMESIZE_QXGA,     // 2048x1536
+    FRAMESIZE_INVALID
+} framesize_t;
+
+typedef struct {
+    const uint16_t width;
+    const uint16_t height;
+} resolution_info_t;
+
+// Sizes of the frame sizes above
+extern const resolution_info_t resolution[];
+
+typedef struct {
+    framesize_t framesize;
+    uint8_t quality;
+    int8_t brightness;
+    int8_t contrast;
+    int8_t saturation;
+} camera_status_t;
+
+typedef struct _sensor sensor_t;
+
+struct _sensor {
+    pixformat_t pixformat;
+    camera_status_t status;
+    int (*set_framesize)(sensor_t *sensor, framesize_t framesize);
+    int (*set_quality)(sensor_t *sensor, int quality);
+};
+
+#endif /* HOST_SENSOR_H_ */
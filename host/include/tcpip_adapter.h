@@ -0,0 +1,29 @@
+/*
+ * tcpip_adapter.h
+ *
+ *  Host stand-in for the TCP/IP adapter of ESP-IDF 3.3.
+ */
+
+#ifndef HOST_TCPIP_ADAPTER_H_
+#define HOST_TCPIP_ADAPTER_H_
+
+#include "esp_err.h"
+#include <lwip/ip4_addr.h>
+
+typedef enum {
+    TCPIP_ADAPTER_IF_STA,
+    TCPIP_ADAPTER_IF_AP,
+    TCPIP_ADAPTER_IF_ETH,
+    TCPIP_ADAPTER_IF_MAX,
+} tcpip_adapter_if_t;
+
+typedef struct {
+    ip4_addr_t ip;
+    ip4_addr_t netmask;
+    ip4_addr_t gw;
+} tcpip_adapter_ip_info_t;
+
+void tcpip_adapter_init(void);
+esp_err_t tcpip_adapter_get_ip_info(tcpip_adapter_if_t tcpip_if, tcpip_adapter_ip_info_t *ip_info);
+
+#endif /* HOST_TCPIP_ADAPTER_H_ */
@@ -0,0 +1,68 @@
+/*
+ * test.h
+ *
+ *  Checks and boot helpers of the host tests. A test is a program that
+ *  boots the firmware against the fakes, drives it through host_fake.h
+ *  and exits with the number of failed checks.
+ */
+
+#ifndef HOST_TEST_TEST_H_
+#define HOST_TEST_TEST_H_
+
+#include "host_fake.h"
+#include "boot.h"
+#include "settings.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Checks that failed so far
+static int test_failures = 0;
+
+#define CHECK(cond) do {                                                                            \
+        if (!(cond)) {                                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                \
+            test_failures++;                                                                        \
+        }                                                                                           \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) do {                                                             \
+        long long _a = (long long) (actual);                                                        \
+        long long _e = (long long) (expected);                                                      \
+        if (_a != _e) {                                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__,   \
+                    #actual, #expected, _a, _e);                                                    \
+            test_failures++;                                                                        \
+        }                                                                                           \
+    } while (0)
+
+// Defined by main.c
+void app_main(void);
+
+// Boots the firmware like the device does and waits until it serves requests with the camera up
+static inline void test_boot(void) {
+    app_main();
+    boot_wait(BOOT_CAMERA);
+    boot_wait(BOOT_NETWORK);
+}
+
+// Sleeps for ms milliseconds
+static inline void test_sleep_ms(int ms) {
+    usleep(ms * 1000);
+}
+
+// Prints the result and returns the exit code of the test
+static inline int test_done(const char *name) {
+    if (test_failures == 0) {
+        printf("%s: passed\n", name);
+        return 0;
+    }
+
+    printf("%s: %d checks failed\n", name, test_failures);
+    return 1;
+}
+
+#endif /* HOST_TEST_TEST_H_ */
@@ -0,0 +1,264 @@
+/*
+ * test_anim.c
+ *
+ *  Renders blink, pulse and chase effects frame by frame and checks
+ *  every frame against one painted from scratch, with frames skipped
+ *  and effects next to each other, checks that malformed uploads are
+ *  refused, and prints the render time per frame and effect for ranges
+ *  of 50 to 4000 LEDs. Then uploads a chase through /led_effects and
+ *  prints the interval between the transmissions the LED task started
+ *  against CONFIG_ANIM_FPS. The effects are made up by the test and the
+ *  intervals are those of esp_timer and threads on the host.
+ */
+
+#include "test.h"
+#include "LED.h"
+#include "anim.h"
+
+#define MAX_LEDS 4000
+#define COST_FRAMES 200000
+#define TICKS 60
+
+static uint32_t base[MAX_LEDS];
+static uint32_t out[MAX_LEDS];
+static uint32_t expected[MAX_LEDS];
+
+// Paints a frame of the effects from scratch
+static void paint(const anim_t *anim, uint32_t frame, int leds) {
+    memcpy(expected, base, leds * sizeof(uint32_t));
+
+    for (int i = 0; i < anim->count; i++) {
+        const anim_track_t *track = &anim->tracks[i];
+        const anim_effect_t *effect = &track->effect;
+        uint32_t phase = frame % track->frames;
+        int step = phase * (2 * ANIM_PULSE_STEPS) / track->frames;
+        int position = phase * effect->count / track->frames;
+
+        for (int led = 0; led < effect->count; led++) {
+            uint32_t *color = &expected[effect->start + led];
+
+            if (effect->type == ANIM_BLINK && phase < track->frames / 2) {
+                *color = effect->color;
+            } else if (effect->type == ANIM_PULSE) {
+                *color = track->levels[step < ANIM_PULSE_STEPS ? step : 2 * ANIM_PULSE_STEPS - 1 - step];
+            } else if (effect->type == ANIM_CHASE && (led - position + effect->count) % effect->count < effect->width) {
+                *color = effect->color;
+            }
+        }
+    }
+}
+
+// Renders frames one after the other, every step-th, returns the frames that differ from the painted ones
+static int check_frames(anim_t *anim, int leds, uint32_t frames, uint32_t step) {
+    int wrong = 0;
+
+    memcpy(out, base, leds * sizeof(uint32_t));
+    anim_reset(anim);
+
+    for (uint32_t frame = 0; frame < frames; frame += step) {
+        anim_render(anim, base, out, frame);
+        paint(anim, frame, leds);
+        wrong += memcmp(out, expected, leds * sizeof(uint32_t)) != 0;
+    }
+
+    return wrong;
+}
+
+// Render time of a frame in ns and LEDs changed per frame, of one effect over a range of LEDs
+static double render_cost(uint8_t type, int leds, double *changed) {
+    anim_effect_t effect = { .type = type, .start = 0, .count = leds, .color = 0x00FF40, .period_ms = 1000,
+                             .width = 5 };
+    static anim_t anim;
+    int64_t changes = 0;
+
+    anim_load(&anim, &effect, 1, CONFIG_ANIM_FPS);
+    memcpy(out, base, leds * sizeof(uint32_t));
+
+    for (uint32_t frame = 0; frame < anim.tracks[0].frames; frame++) {
+        memcpy(expected, out, leds * sizeof(uint32_t));
+        anim_render(&anim, base, out, frame);
+
+        for (int led = 0; led < leds; led++) {
+            changes += out[led] != expected[led];
+        }
+    }
+
+    *changed = (double) changes / anim.tracks[0].frames;
+
+    int64_t start = esp_timer_get_time();
+
+    for (uint32_t frame = 0; frame < COST_FRAMES; frame++) {
+        anim_render(&anim, base, out, frame);
+    }
+
+    return (esp_timer_get_time() - start) * 1e3 / COST_FRAMES;
+}
+
+// Start times of the transmissions on the first channel
+static volatile int64_t ticks[TICKS];
+static volatile int tick_count;
+
+static void observe(rmt_channel_t channel, const rmt_item32_t *items, int count) {
+    if (channel == RMT_CHANNEL_0 && tick_count < TICKS) {
+        ticks[tick_count++] = esp_timer_get_time();
+    }
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Posts effect records, returns the status
+static int post_effects(const uint8_t *records, size_t len) {
+    fake_http_response_t response;
+    fake_http_request_t request = { .method = HTTP_POST, .uri = "/led_effects", .body = records, .body_len = len };
+
+    fake_httpd_request(80, &request, &response);
+
+    int status = fake_http_status(&response);
+
+    fake_http_response_free(&response);
+    return status;
+}
+
+int main(void) {
+    static anim_t anim;
+    uint8_t lut[256];
+
+    for (int i = 0; i < MAX_LEDS; i++) {
+        base[i] = (i * 0x030507) & 0xFFFFFF;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        lut[i] = i;
+    }
+
+    // Next to each other with periods that do not divide the frame rate
+    anim_effect_t effects[] = {
+            { .type = ANIM_BLINK, .start = 0, .count = 7, .color = 0xFF0000, .period_ms = 250 },
+            { .type = ANIM_PULSE, .start = 7, .count = 13, .color = 0x80C0FF, .period_ms = 1700 },
+            { .type = ANIM_CHASE, .start = 20, .count = 29, .color = 0x00FF00, .period_ms = 900, .width = 3 },
+            { .type = ANIM_CHASE, .start = 49, .count = 4, .color = 0x0000FF, .period_ms = 20, .width = 4 },
+    };
+
+    anim_load(&anim, effects, 4, CONFIG_ANIM_FPS);
+    CHECK_EQ(check_frames(&anim, 60, 600, 1), 0);
+    CHECK_EQ(check_frames(&anim, 60, 600, 7), 0);
+    CHECK_EQ(check_frames(&anim, 60, 600, 61), 0);
+
+    // Pulse levels rise from off to the colour
+    CHECK_EQ(anim.tracks[1].levels[0], 0);
+    CHECK_EQ(anim.tracks[1].levels[ANIM_PULSE_STEPS - 1], 0x80C0FF);
+
+    // Records as uploaded, then malformed ones
+    uint8_t records[2 * ANIM_RECORD_LEN] = {
+            ANIM_BLINK, 0, 0, 10, 0, 255, 0, 0, 200, 0, 0,
+            ANIM_CHASE, 10, 0, 30, 0, 0, 0, 255, 232, 3, 2,
+    };
+    anim_effect_t parsed[ANIM_MAX_EFFECTS];
+
+    CHECK_EQ(anim_parse(records, sizeof(records), lut, 50, parsed), 2);
+    CHECK_EQ(parsed[0].color, 0xFF0000);
+    CHECK_EQ(parsed[0].period_ms, 200);
+    CHECK_EQ(parsed[1].start, 10);
+    CHECK_EQ(parsed[1].count, 30);
+    CHECK_EQ(parsed[1].width, 2);
+    CHECK_EQ(anim_parse(records, sizeof(records) - 1, lut, 50, parsed), -1);
+    CHECK_EQ(anim_parse(records, sizeof(records), lut, 39, parsed), -1);
+
+    static const struct {
+        int offset;
+        uint8_t value;
+    } broken[] = {
+            { 0, 0 },                                   // no such type
+            { 0, ANIM_CHASE + 1 },
+            { 3, 0 },                                   // no LEDs
+            { 8, 0 },                                   // no period
+            { ANIM_RECORD_LEN + 1, 9 },                 // overlaps the blink
+            { ANIM_RECORD_LEN + 10, 0 },                // chase without lit LEDs
+            { ANIM_RECORD_LEN + 10, 31 },               // more lit LEDs than the range has
+    };
+
+    for (int i = 0; i < sizeof(broken) / sizeof(broken[0]); i++) {
+        uint8_t copy[sizeof(records)];
+
+        memcpy(copy, records, sizeof(records));
+        copy[broken[i].offset] = broken[i].value;
+        CHECK_EQ(anim_parse(copy, sizeof(copy), lut, 50, parsed), -1);
+    }
+
+    // Cost per frame, a chase touches its lit LEDs only whatever the range, blink and pulse the changed ones
+    static const char *names[] = { [ANIM_BLINK] = "blink", [ANIM_PULSE] = "pulse", [ANIM_CHASE] = "chase" };
+    static const int lengths[] = { 50, 500, MAX_LEDS };
+    double chase_short = 0;
+    double chase_long = 0;
+
+    for (uint8_t type = ANIM_BLINK; type <= ANIM_CHASE; type++) {
+        for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+            double changed;
+            double ns = render_cost(type, lengths[i], &changed);
+
+            printf("%s over %4d LEDs: %8.1fns per frame, %7.1f LEDs changed per frame\n", names[type], lengths[i],
+                   ns, changed);
+
+            if (type == ANIM_CHASE) {
+                chase_short = i == 0 ? ns : chase_short;
+                chase_long = ns;
+            }
+        }
+    }
+
+    CHECK(chase_long < chase_short * 4 + 50);
+
+    // Played by the LED task, a chase moving every frame is sent every frame
+    uint8_t chase[ANIM_RECORD_LEN] = { ANIM_CHASE, 0, 0, 30, 0, 255, 0, 0, 232, 3, 1 };
+    uint32_t words[NUM_LEDS];
+
+    test_boot();
+    fake_rmt_set_time_scale(0);
+    fake_rmt_set_observer(observe);
+    CHECK_EQ(post_effects(chase, sizeof(chase)), 200);
+    test_sleep_ms(TICKS * 1000 / CONFIG_ANIM_FPS + 500);
+    fake_rmt_set_observer(NULL);
+    CHECK_EQ(tick_count, TICKS);
+
+    int64_t intervals[TICKS - 1];
+    int64_t period = 1000000 / CONFIG_ANIM_FPS;
+
+    for (int i = 1; i < TICKS; i++) {
+        intervals[i - 1] = ticks[i] - ticks[i - 1];
+    }
+
+    qsort(intervals, TICKS - 1, sizeof(int64_t), compare_i64);
+    printf("%d frames at %d fps: intervals p1 %.2fms, p50 %.2fms, p99 %.2fms for %.2fms\n", TICKS, CONFIG_ANIM_FPS,
+           intervals[0] / 1e3, intervals[(TICKS - 1) / 2] / 1e3, intervals[TICKS - 2] / 1e3, period / 1e3);
+    CHECK(llabs(intervals[(TICKS - 1) / 2] - period) < period / 10);
+    CHECK((ticks[TICKS - 1] - ticks[0]) / (TICKS - 1) > period * 9 / 10);
+    CHECK((ticks[TICKS - 1] - ticks[0]) / (TICKS - 1) < period * 11 / 10);
+
+    // One LED of the range is lit in strip order, the rest of the strip stays dark
+    int lit = 0;
+
+    CHECK(fake_rmt_strip(RMT_CHANNEL_0, words, NUM_LEDS) >= NUM_LEDS);
+
+    for (int i = 0; i < NUM_LEDS; i++) {
+        lit += words[i] != 0;
+        CHECK(words[i] == 0 || (i < 30 && words[i] == 0x00FF00));
+    }
+
+    CHECK_EQ(lit, 1);
+
+    // No effects, nothing is sent any more
+    CHECK_EQ(post_effects(NULL, 0), 200);
+    test_sleep_ms(100);
+
+    uint32_t writes = fake_rmt_writes(RMT_CHANNEL_0);
+
+    test_sleep_ms(300);
+    CHECK_EQ(fake_rmt_writes(RMT_CHANNEL_0), writes);
+
+    return test_done("anim");
+}
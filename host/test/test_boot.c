@@ -0,0 +1,119 @@
+/*
+ * test_boot.c
+ *
+ *  Boots with a camera that takes 1.5s to probe and an access point
+ *  that takes 2s to associate, checks that the HTTP servers answer
+ *  right away, with 503 and Retry-After for the camera until it is up,
+ *  and that every stage logs its timing. Prints the timeline of the
+ *  stages and the critical path against the stages run one after the
+ *  other, the way app_main ran them before: camera, WiFi, association,
+ *  then the servers. The delays are stubs chosen by the test, not
+ *  measured on a device.
+ */
+
+#include "test.h"
+
+#define CAMERA_MS 1500
+#define ASSOCIATE_MS 2000
+
+static volatile int timing_lines;
+
+static void capture(esp_log_level_t level, const char *tag, const char *line) {
+    if (strcmp(tag, "BOOT") == 0 && strstr(line, " ready at ") != NULL && strstr(line, "ms, took ") != NULL) {
+        timing_lines++;
+    }
+}
+
+// Value of a line of the /metrics output starting with prefix, -1 if there is none
+static double metric(const char *text, const char *prefix) {
+    const char *line = strstr(text, prefix);
+
+    return line != NULL ? atof(line + strlen(prefix)) : -1;
+}
+
+int main(void) {
+    static const char *names[BOOT_STAGE_COUNT] = { "flash", "wifi", "network", "camera", "leds", "http" };
+    fake_http_response_t response;
+
+    fake_camera_set_init_delay_ms(CAMERA_MS);
+    fake_wifi_set_associate_delay_ms(ASSOCIATE_MS);
+    fake_log_set_capture(capture);
+    esp_log_level_set("BOOT", ESP_LOG_INFO);
+
+    int64_t start = esp_timer_get_time();
+
+    app_main();
+
+    int64_t returned = esp_timer_get_time() - start;
+
+    // Serving before the camera and the network are up
+    CHECK(boot_is_done(BOOT_HTTP));
+    CHECK(!boot_is_done(BOOT_CAMERA));
+    CHECK(!boot_is_done(BOOT_NETWORK));
+    CHECK_EQ(fake_httpd_get(80, "/jpg", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 503);
+
+    const char *retry = fake_http_header(&response, "Retry-After");
+
+    CHECK(retry != NULL && strcmp(retry, "1") == 0);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(fake_httpd_get(80, "/frame.bin", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 503);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    fake_http_response_free(&response);
+
+    boot_wait(BOOT_CAMERA);
+    boot_wait(BOOT_NETWORK);
+
+    int64_t ready = esp_timer_get_time() - start;
+
+    CHECK_EQ(fake_httpd_get(80, "/jpg", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    fake_http_response_free(&response);
+    fake_log_set_capture(NULL);
+    CHECK_EQ(timing_lines, BOOT_STAGE_COUNT);
+
+    // The timeline as /metrics reports it
+    double begin[BOOT_STAGE_COUNT];
+    double end[BOOT_STAGE_COUNT];
+    char prefix[96];
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+
+    char *text = calloc(1, response.len + 1);
+
+    memcpy(text, response.body, response.len);
+    fake_http_response_free(&response);
+
+    for (int stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+        snprintf(prefix, sizeof(prefix), "esp32cam_boot_stage_start_seconds{stage=\"%s\"} ", names[stage]);
+        begin[stage] = metric(text, prefix) * 1000;
+        snprintf(prefix, sizeof(prefix), "esp32cam_boot_stage_end_seconds{stage=\"%s\"} ", names[stage]);
+        end[stage] = metric(text, prefix) * 1000;
+        CHECK(begin[stage] >= 0 && end[stage] >= begin[stage]);
+        printf("%-8s %7.1fms - %7.1fms\n", names[stage], begin[stage], end[stage]);
+    }
+
+    free(text);
+
+    // One after the other the association only starts after the camera, and the servers wait for the address
+    double sequential = 0;
+
+    for (int stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+        sequential += end[stage] - begin[stage];
+    }
+
+    printf("app_main returned after %.1fms, serving after %.1fms, camera and network up after %.1fms, "
+           "%.1fms one after the other\n", returned / 1e3, end[BOOT_HTTP], ready / 1e3, sequential);
+    CHECK(end[BOOT_HTTP] < 200);
+    CHECK(end[BOOT_CAMERA] >= CAMERA_MS);
+    CHECK(end[BOOT_NETWORK] >= ASSOCIATE_MS);
+    CHECK(ready / 1e3 < ASSOCIATE_MS + 300);
+    CHECK(sequential >= CAMERA_MS + ASSOCIATE_MS);
+
+    return test_done("boot");
+}
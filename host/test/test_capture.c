@@ -0,0 +1,172 @@
+/*
+ * test_capture.c
+ *
+ *  Built once with the capture pipeline and once capturing on demand.
+ *  Checks how long /jpg waits for its frame in either mode, that fresh
+ *  frames are shared and that every frame buffer goes back to the
+ *  driver, also with concurrent requests and failed captures. The
+ *  camera is the synthetic one at 25 fps, so the times are those of its
+ *  frame grid, not of a sensor.
+ */
+
+#include "test.h"
+#include "capture.h"
+#include <pthread.h>
+
+#define FRAME_PERIOD_US 40000
+// The connection fake_httpd_get keeps open takes the last socket
+#define CLIENTS (CONFIG_HTTP_MAX_SOCKETS - 1)
+#define CLIENT_REQUESTS 25
+
+// Requests of a client thread that did not get a JPEG
+static int client_errors[CLIENTS];
+
+static int compare_us(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Median /jpg handler time of count requests spaced gap_ms apart
+static int64_t median_jpg_us(int count, int gap_ms) {
+    int64_t durations[16];
+    fake_http_response_t response;
+
+    for (int i = 0; i < count; i++) {
+        test_sleep_ms(gap_ms);
+        CHECK_EQ(fake_httpd_get(80, "/jpg", NULL, &response), ESP_OK);
+        CHECK_EQ(fake_http_status(&response), 200);
+        durations[i] = response.duration_us;
+        fake_http_response_free(&response);
+    }
+
+    qsort(durations, count, sizeof(durations[0]), compare_us);
+    return durations[count / 2];
+}
+
+// Client on a connection of its own, sometimes asking for the next frame
+static void *client(void *arg) {
+    int index = (int) (intptr_t) arg;
+    int fd = fake_httpd_connect(80);
+    fake_http_response_t response;
+
+    for (int i = 0; i < CLIENT_REQUESTS; i++) {
+        fake_http_request_t request = {
+                .method = HTTP_GET,
+                .uri = "/jpg",
+                .headers = i % 3 == 0 ? "Cache-Control: no-cache\r\n" : NULL,
+        };
+
+        if (fake_httpd_request_on(fd, &request, &response) != ESP_OK || fake_http_status(&response) != 200) {
+            client_errors[index]++;
+        }
+
+        // A failed request closes the connection, like a browser the client opens another one
+        if (!fake_httpd_is_open(fd)) {
+            fd = fake_httpd_connect(80);
+        }
+
+        fake_http_response_free(&response);
+    }
+
+    fake_httpd_disconnect(fd);
+    return NULL;
+}
+
+int main(void) {
+    capture_stats_t before;
+    capture_stats_t after;
+    fake_http_response_t response;
+
+    test_boot();
+    test_sleep_ms(200);
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    // The newest frame is always ready, requests do not wait for the sensor
+    int64_t median = median_jpg_us(9, 60);
+
+    printf("pipeline: median /jpg %lldus\n", (long long) median);
+    CHECK(median < FRAME_PERIOD_US / 2);
+#else
+    // Past the freshness window every request waits for a whole frame after the next VSYNC
+    int64_t median = median_jpg_us(5, CONFIG_CAPTURE_MAX_AGE_MS + 50);
+
+    printf("on demand: median /jpg %lldus\n", (long long) median);
+    CHECK(median >= FRAME_PERIOD_US);
+#endif
+
+    // Requests within the freshness window share the frame
+    capture_get_stats(&before);
+    capture_frame_t *first = capture_acquire(CONFIG_CAPTURE_MAX_AGE_MS * 1000LL);
+    capture_frame_t *second = capture_acquire(CONFIG_CAPTURE_MAX_AGE_MS * 1000LL);
+    capture_get_stats(&after);
+
+    CHECK(first != NULL && second != NULL);
+    CHECK(first == second);
+    CHECK(after.shares > before.shares);
+    capture_release(first);
+    capture_release(second);
+
+    // The next frame is a new one
+    first = capture_acquire(CONFIG_CAPTURE_MAX_AGE_MS * 1000LL);
+    uint32_t seq = first != NULL ? first->seq : 0;
+#ifndef CONFIG_CAPTURE_PIPELINE
+    // The driver has a single buffer, the frame has to go back before the next one is captured
+    capture_release(first);
+#endif
+    second = capture_acquire_after(capture_last_seq());
+
+    CHECK(first != NULL && second != NULL);
+    CHECK(second != NULL && second->seq > seq);
+#ifdef CONFIG_CAPTURE_PIPELINE
+    // Holding two frames still leaves the producer a buffer
+    capture_release(first);
+#endif
+    capture_release(second);
+
+    // Concurrent clients and failing captures
+    pthread_t threads[CLIENTS];
+
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_create(&threads[i], NULL, client, (void *) (intptr_t) i);
+    }
+
+    test_sleep_ms(100);
+    fake_camera_fail_next(2);
+
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int errors = 0;
+
+    for (int i = 0; i < CLIENTS; i++) {
+        errors += client_errors[i];
+    }
+
+    // Only requests that ran into one of the failed captures may have missed their frame
+    CHECK(errors <= 2);
+
+    // All frames were returned: the driver still has a buffer to fill and serves the next request
+    test_sleep_ms(200);
+    printf("buffers taken %d of %d\n", fake_camera_taken(), CAPTURE_FB_COUNT);
+#ifdef CONFIG_CAPTURE_PIPELINE
+    // The newest frame and the one the producer is waiting for
+    CHECK(fake_camera_taken() <= 2);
+#else
+    // The last frame is kept for sharing
+    CHECK(fake_camera_taken() <= 1);
+#endif
+
+    CHECK_EQ(fake_httpd_get(80, "/jpg", "Cache-Control: no-cache\r\n", &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    CHECK(response.duration_us < 1000000);
+    fake_http_response_free(&response);
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    return test_done("capture");
+#else
+    return test_done("capture_on_demand");
+#endif
+}
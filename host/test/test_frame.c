@@ -0,0 +1,202 @@
+/*
+ * test_frame.c
+ *
+ *  Fetches /frame.bin and /jpg with "Accept: application/x-frame",
+ *  decodes them with the Linux reference decoder of host/tools and
+ *  checks the header against the JPEG it carries, and that the decoder
+ *  reads back to back frames like those of push mode and refuses
+ *  truncated or foreign input. Then prints the bytes every frame costs
+ *  on top of the JPEG against the head of a /jpg response and the
+ *  handler times of both. The frames are the fake camera's synthetic
+ *  ones, the /jpg head is rebuilt from the headers the handler set the
+ *  way the ESP-IDF server writes them, and the times are those of the
+ *  fake server without a network.
+ */
+
+#include "test.h"
+#include "frame.h"
+#include "frame_decode.h"
+#include <stddef.h>
+
+#define RUNS 500
+#define SMALL_JPEG 2000
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Decodes a frame response, checks its head and header, returns the bytes in front of the JPEG or -1
+static long check_frame(const fake_http_response_t *response, frame_info_t *info) {
+    fake_jpeg_info_t jpeg;
+    long head = frame_skip_http(response->body, response->len);
+
+    if (head <= 0 || strncmp((const char *) response->body, "HTTP/1.1 200 OK\r\n", 17) != 0) {
+        return -1;
+    }
+
+    const char *length = strstr((const char *) response->body, "Content-Length: ");
+    long taken = frame_decode(response->body + head, response->len - head, info);
+
+    CHECK(length != NULL && (const uint8_t *) length < response->body + head);
+    CHECK(strstr((const char *) response->body, "Content-Type: " FRAME_CONTENT_TYPE "\r\n") != NULL);
+    CHECK_EQ(taken, response->len - head);
+    CHECK(length != NULL && strtol(length + 16, NULL, 10) == taken);
+
+    if (taken <= 0) {
+        return -1;
+    }
+
+    CHECK_EQ(info->version, FRAME_VERSION);
+    CHECK_EQ(info->header_len, sizeof(frame_header_t));
+    CHECK_EQ(info->device_id, CONFIG_DEVICE_ID);
+    CHECK(info->timestamp > 0 && info->timestamp <= esp_timer_get_time());
+    CHECK_EQ(fake_jpeg_parse(info->jpeg, info->len, &jpeg), 0);
+    CHECK_EQ(info->width, jpeg.width);
+    CHECK_EQ(info->height, jpeg.height);
+    CHECK_EQ(info->framesize, jpeg.framesize);
+    CHECK_EQ(info->quality, jpeg.quality);
+
+    return head + info->header_len;
+}
+
+// Bytes of the status line and headers the ESP-IDF server writes in front of a /jpg body
+static size_t jpg_head_len(const fake_http_response_t *response) {
+    char line[256];
+    size_t len = snprintf(line, sizeof(line), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n",
+                          response->status, response->type, response->len);
+
+    for (int i = 0; i < response->header_count; i++) {
+        len += snprintf(line, sizeof(line), "%s: %s\r\n", response->headers[i].name, response->headers[i].value);
+    }
+
+    return len + 2;
+}
+
+// Median handler time of a request in us, keeps the head length of the last response
+static double median_us(const char *uri, const char *headers, size_t *head) {
+    static int64_t durations[RUNS];
+    fake_http_response_t response;
+
+    for (int i = 0; i < RUNS; i++) {
+        CHECK_EQ(fake_httpd_get(80, uri, headers, &response), ESP_OK);
+        durations[i] = response.duration_us;
+
+        if (response.raw) {
+            frame_info_t info;
+            long before = check_frame(&response, &info);
+
+            *head = before < 0 ? 0 : before;
+        } else {
+            *head = jpg_head_len(&response);
+        }
+
+        fake_http_response_free(&response);
+    }
+
+    qsort(durations, RUNS, sizeof(int64_t), compare_i64);
+    return durations[RUNS / 2];
+}
+
+int main(void) {
+    fake_http_response_t response;
+    frame_info_t info;
+    frame_info_t second;
+
+    test_boot();
+
+    // The layout the decoder reads, whatever the host packs
+    CHECK_EQ(sizeof(frame_header_t), FRAME_DECODE_MIN_LEN);
+    CHECK_EQ(offsetof(frame_header_t, seq), 8);
+    CHECK_EQ(offsetof(frame_header_t, timestamp), 12);
+    CHECK_EQ(offsetof(frame_header_t, framesize), 24);
+    CHECK_EQ(offsetof(frame_header_t, device_id), 30);
+    CHECK_EQ(offsetof(frame_header_t, len), 32);
+
+    // Both ways of asking for it, a new frame has a higher sequence number
+    CHECK_EQ(fake_httpd_get(80, "/frame.bin", NULL, &response), ESP_OK);
+    CHECK(response.raw);
+    CHECK(check_frame(&response, &info) > 0);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(fake_httpd_get(80, "/jpg", "Accept: " FRAME_CONTENT_TYPE "\r\nCache-Control: no-cache\r\n",
+                            &response), ESP_OK);
+    CHECK(response.raw);
+    CHECK(check_frame(&response, &second) > 0);
+    CHECK(second.seq > info.seq);
+
+    // Truncated anywhere the decoder asks for more, a foreign or broken header is refused
+    long head = frame_skip_http(response.body, response.len);
+    const uint8_t *frame = response.body + head;
+    size_t frame_len = response.len - head;
+    uint8_t *broken = malloc(frame_len);
+
+    CHECK_EQ(frame_skip_http(response.body, head - 1), -1);
+    CHECK_EQ(frame_skip_http(frame, frame_len), 0);
+
+    for (size_t len = 0; len < frame_len; len += len < 64 ? 1 : 997) {
+        CHECK_EQ(frame_decode(frame, len, &info), 0);
+    }
+
+    memcpy(broken, frame, frame_len);
+    broken[3] ^= 0x20;
+    CHECK_EQ(frame_decode(broken, frame_len, &info), -1);
+    memcpy(broken, frame, frame_len);
+    broken[6] = FRAME_DECODE_MIN_LEN - 1;
+    CHECK_EQ(frame_decode(broken, frame_len, &info), -1);
+    free(broken);
+    fake_http_response_free(&response);
+
+    // A push mode stream, frames back to back without HTTP framing
+    static uint8_t stream[1 << 20];
+    size_t stream_len = 0;
+    uint32_t seqs[5];
+
+    for (int i = 0; i < 5; i++) {
+        capture_frame_t *captured = capture_acquire_after(capture_last_seq());
+        frame_header_t header;
+
+        CHECK(captured != NULL);
+        frame_header_init(&header, captured);
+        seqs[i] = captured->seq;
+        CHECK(stream_len + sizeof(header) + header.len <= sizeof(stream));
+        memcpy(stream + stream_len, &header, sizeof(header));
+        memcpy(stream + stream_len + sizeof(header), captured->fb->buf, header.len);
+        stream_len += sizeof(header) + header.len;
+        capture_release(captured);
+    }
+
+    size_t pos = 0;
+    int decoded = 0;
+    long taken;
+
+    while ((taken = frame_decode(stream + pos, stream_len - pos, &info)) > 0) {
+        CHECK(decoded < 5 && info.seq == seqs[decoded]);
+        pos += taken;
+        decoded++;
+    }
+
+    CHECK_EQ(taken, 0);
+    CHECK_EQ(decoded, 5);
+    CHECK_EQ(pos, stream_len);
+
+    // Per frame overhead with small frames, where it weighs the most
+    size_t jpg_head;
+    size_t frame_head;
+
+    fake_camera_set_jpeg_len(SMALL_JPEG);
+
+    double jpg_us = median_us("/jpg", NULL, &jpg_head);
+    double frame_us = median_us("/frame.bin", NULL, &frame_head);
+
+    printf("/jpg: %zuB of headers, %.0fus per request\n", jpg_head, jpg_us);
+    printf("/frame.bin: %zuB of head and header, %.0fus per request\n", frame_head, frame_us);
+    printf("%.1f%% of a %dB frame against %.1f%%\n", 100.0 * frame_head / SMALL_JPEG, SMALL_JPEG,
+           100.0 * jpg_head / SMALL_JPEG);
+    CHECK(frame_head > 0);
+    CHECK(frame_head < jpg_head);
+
+    return test_done("frame");
+}
@@ -0,0 +1,258 @@
+/*
+ * test_handshake.c
+ *
+ *  Drives the handshake state machine on a simulated clock: the backoff
+ *  and its jitter while searching, keepalives and the link timeout,
+ *  restarts, socket failures and a clock wrapping around. A simulated
+ *  controller that loses answers gives the time to link over many
+ *  stations. Then checks on the running station that a new address
+ *  restarts the search at once and that /metrics reports the link. The
+ *  controller, its losses and round trips are made up by the test.
+ */
+
+#include "test.h"
+#include "handshake.h"
+#include "mulmsg.h"
+#include <arpa/inet.h>
+
+#define STATIONS 1000
+
+// Requests a station sends until now while nobody answers, with the gap before each
+static int search(handshake *hs, uint32_t start, uint32_t until, uint32_t *gaps, int max) {
+    uint32_t now = start;
+    uint32_t last = start;
+    int sent = 0;
+
+    while ((int32_t) (until - now) > 0) {
+        if (handshake_poll(hs, now)) {
+            if (sent < max) {
+                gaps[sent] = now - last;
+            }
+
+            last = now;
+            sent++;
+        }
+
+        // Never woken up early, never late
+        uint32_t timeout = handshake_timeout(hs, now);
+
+        CHECK(timeout > 0);
+        CHECK(timeout <= HANDSHAKE_BACKOFF_MAX_MS);
+        now += timeout;
+    }
+
+    return sent;
+}
+
+// Links a station to a controller answering after rtt ms and losing answers with the given percentage
+static uint32_t link_time(uint32_t seed, int loss, uint32_t rtt, int *requests) {
+    handshake hs;
+    uint32_t now = 1000;
+    uint32_t answer_at = 0;
+
+    handshake_init(&hs, seed);
+    handshake_start(&hs, now);
+    *requests = 0;
+
+    while (!handshake_isLinked(&hs)) {
+        if (handshake_poll(&hs, now)) {
+            (*requests)++;
+
+            if ((uint32_t) rand() % 100 >= (uint32_t) loss) {
+                answer_at = now + rtt;
+            }
+        }
+
+        uint32_t next = now + handshake_timeout(&hs, now);
+
+        if (answer_at != 0 && (int32_t) (next - answer_at) >= 0) {
+            now = answer_at;
+            answer_at = 0;
+            handshake_received(&hs, now, 1);
+        } else {
+            now = next;
+        }
+    }
+
+    CHECK_EQ(hs.rtt, rtt);
+    return hs.timeToLink;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Waits for the next "Are You There?" of the station to the group, returns when it came or -1
+static int64_t next_group_request(int timeout_ms) {
+    char data[64];
+    struct sockaddr_in to;
+    int64_t deadline = esp_timer_get_time() + timeout_ms * 1000LL;
+
+    while (esp_timer_get_time() < deadline) {
+        int len = fake_net_receive(CONFIG_MULTICAST_PORT, &to, data, sizeof(data), 50);
+
+        if (len == MULMSG_LEN && to.sin_addr.s_addr == inet_addr(CONFIG_MULTICAST_ADDR)
+                && mulmsg_getAlive(mulmsg_wrap(data, len)) == 0) {
+            return esp_timer_get_time();
+        }
+    }
+
+    return -1;
+}
+
+int main(void) {
+    handshake hs;
+    uint32_t gaps[64];
+
+    // Idle until started
+    handshake_init(&hs, 1);
+    CHECK(!handshake_poll(&hs, 0));
+    CHECK_EQ(handshake_timeout(&hs, 0), UINT32_MAX);
+    CHECK(!handshake_received(&hs, 0, 1));
+
+    // Searching: the first request at once, then every [b / 2, b] with b doubling up to the maximum
+    handshake_start(&hs, 5000);
+    int sent = search(&hs, 5000, 5000 + 120000, gaps, 64);
+    uint32_t backoff = HANDSHAKE_BACKOFF_MIN_MS;
+
+    CHECK_EQ(gaps[0], 0);
+
+    for (int i = 1; i < sent && i < 64; i++) {
+        CHECK(gaps[i] >= backoff / 2);
+        CHECK(gaps[i] <= backoff);
+        backoff = backoff * 2 > HANDSHAKE_BACKOFF_MAX_MS ? HANDSHAKE_BACKOFF_MAX_MS : backoff * 2;
+    }
+
+    // About two minutes at up to 8s apart, not the busy loop of a failing socket
+    CHECK(sent >= 120000 / HANDSHAKE_BACKOFF_MAX_MS);
+    CHECK(sent <= 6 + 2 * 120000 / HANDSHAKE_BACKOFF_MAX_MS);
+
+    // Stations booted together spread out
+    handshake other;
+    uint32_t other_gaps[64];
+
+    handshake_init(&other, 2);
+    handshake_start(&other, 5000);
+    search(&other, 5000, 5000 + 120000, other_gaps, 64);
+    CHECK(memcmp(gaps + 1, other_gaps + 1, 8 * sizeof(uint32_t)) != 0);
+
+    // A new address restarts at the shortest interval with a request right away
+    handshake_start(&hs, 200000);
+    CHECK(handshake_poll(&hs, 200000));
+    CHECK(handshake_timeout(&hs, 200000) <= HANDSHAKE_BACKOFF_MIN_MS);
+
+    // Linked by an answer: round trip, time to link, keepalive
+    CHECK(!handshake_received(&hs, 200020, 0));
+    CHECK(!handshake_isLinked(&hs));
+    CHECK(handshake_received(&hs, 200030, 1));
+    CHECK(handshake_isLinked(&hs));
+    CHECK_EQ(hs.rtt, 30);
+    CHECK_EQ(hs.timeToLink, 30);
+    CHECK_EQ(hs.links, 1);
+    CHECK(!handshake_received(&hs, 200040, 1));
+    CHECK_EQ(handshake_timeout(&hs, 200030), HANDSHAKE_KEEPALIVE_MS);
+    CHECK(!handshake_poll(&hs, 200030 + HANDSHAKE_KEEPALIVE_MS - 1));
+    CHECK(handshake_poll(&hs, 200030 + HANDSHAKE_KEEPALIVE_MS));
+
+    // Silence for the link timeout drops the link and searches again at once
+    uint32_t silent = 200040 + HANDSHAKE_LINK_TIMEOUT_MS;
+
+    CHECK(handshake_timeout(&hs, silent - 1000) <= 1000);
+    CHECK(handshake_poll(&hs, silent));
+    CHECK(!handshake_isLinked(&hs));
+    CHECK_EQ(hs.losses, 1);
+
+    // Socket failures back off up to the maximum, a link resets them
+    uint32_t retry = HANDSHAKE_RETRY_MIN_MS;
+
+    for (int i = 0; i < 12; i++) {
+        uint32_t delay = handshake_failed(&hs);
+
+        CHECK(delay >= retry / 2);
+        CHECK(delay <= retry);
+        CHECK(!handshake_poll(&hs, silent));
+        retry = retry * 2 > HANDSHAKE_RETRY_MAX_MS ? HANDSHAKE_RETRY_MAX_MS : retry * 2;
+    }
+
+    CHECK_EQ(hs.retry, HANDSHAKE_RETRY_MAX_MS);
+    handshake_start(&hs, silent);
+    handshake_received(&hs, silent + 5, 1);
+    CHECK_EQ(hs.retry, HANDSHAKE_RETRY_MIN_MS);
+
+    // The ms clock wraps after 49 days
+    handshake_init(&hs, 3);
+    handshake_start(&hs, UINT32_MAX - 5000);
+    sent = search(&hs, UINT32_MAX - 5000, 20000, gaps, 64);
+    CHECK(sent >= 4);
+
+    for (int i = 1; i < sent && i < 64; i++) {
+        CHECK(gaps[i] <= HANDSHAKE_BACKOFF_MAX_MS);
+    }
+
+    handshake_received(&hs, 20000, 1);
+    CHECK(handshake_isLinked(&hs));
+    CHECK_EQ(hs.timeToLink, 20000 + 5001);
+
+    // Time to link over many stations with a controller losing 30% of the answers
+    static uint32_t times[STATIONS];
+    int requests;
+    int most_requests = 0;
+
+    srand(10);
+
+    for (int i = 0; i < STATIONS; i++) {
+        times[i] = link_time(i + 1, 30, 15, &requests);
+        most_requests = requests > most_requests ? requests : most_requests;
+    }
+
+    qsort(times, STATIONS, sizeof(times[0]), compare_u32);
+    printf("time to link with 30%% loss: p50 %ums, p99 %ums, max %ums, at most %d requests\n",
+           times[STATIONS / 2], times[STATIONS * 99 / 100], times[STATIONS - 1], most_requests);
+    CHECK(times[STATIONS / 2] < 1000);
+    CHECK(times[STATIONS - 1] < 60000);
+
+    // The running station: linked by the controller's answer
+    char answer[MULMSG_LEN] = {0};
+    mulmsg *msg = mulmsg_wrap(answer, MULMSG_LEN);
+    struct sockaddr_in controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = inet_addr("10.0.0.1"),
+    };
+    fake_http_response_t response;
+
+    test_boot();
+    CHECK(next_group_request(2000) >= 0);
+
+    mulmsg_setSource(msg, 1);
+    mulmsg_setAlive(msg, 1);
+    mulmsg_setDeviceId(msg, 1);
+    fake_net_inject(CONFIG_MULTICAST_PORT, &controller, answer, sizeof(answer), 1000);
+    test_sleep_ms(200);
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+    response.body[response.len - 1] = 0;
+    CHECK(strstr((char *) response.body, "esp32cam_mcast_linked 1") != NULL);
+    CHECK(strstr((char *) response.body, "esp32cam_mcast_links_total 1") != NULL);
+    CHECK(strstr((char *) response.body, "esp32cam_mcast_time_to_link_seconds") != NULL);
+    fake_http_response_free(&response);
+
+    // Linked, the next request is the keepalive in 10s, a new address asks at once
+    while (fake_net_receive(CONFIG_MULTICAST_PORT, NULL, answer, sizeof(answer), 100) >= 0) {
+    }
+
+    int64_t reconnect = esp_timer_get_time();
+
+    fake_wifi_disconnect();
+
+    int64_t request = next_group_request(3000);
+
+    CHECK(request >= 0);
+    printf("request %lldms after the new address\n", (long long) (request - reconnect) / 1000);
+    CHECK(request - reconnect < 1000000);
+
+    return test_done("handshake");
+}
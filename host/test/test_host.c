@@ -0,0 +1,82 @@
+/*
+ * test_host.c
+ *
+ *  Boots the firmware against the fakes and checks the basic paths work:
+ *  a JPEG from /jpg, the metrics, the LED strip on its RMT channel and
+ *  the multicast discovery.
+ */
+
+#include "test.h"
+#include "LED.h"
+#include "mulmsg.h"
+#include <arpa/inet.h>
+
+int main(void) {
+    fake_http_response_t response;
+    fake_jpeg_info_t info;
+
+    test_boot();
+
+    CHECK_EQ(fake_httpd_get(80, "/jpg", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    CHECK(strcmp(response.type, "image/jpeg") == 0);
+    CHECK_EQ(fake_jpeg_parse(response.body, response.len, &info), 0);
+    CHECK_EQ(info.width, 1600);
+    CHECK_EQ(info.height, 1200);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    CHECK(response.len > 0);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(fake_httpd_get(80, "/missing", NULL, &response), ESP_ERR_NOT_FOUND);
+    CHECK_EQ(fake_http_status(&response), 404);
+    fake_http_response_free(&response);
+
+    // A written frame goes out as 24 bits per LED and a reset
+    struct led_state state = {0};
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int count = 0;
+
+    state.leds[0] = 0xFF0000;
+    write_leds_notify(&state, self);
+    CHECK(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000)) > 0);
+    CHECK(fake_rmt_installed(RMT_CHANNEL_0));
+    CHECK(fake_rmt_items(RMT_CHANNEL_0, &count) != NULL);
+    CHECK_EQ(count, NUM_LEDS * 24 + 1);
+
+    // Discovery: "Are You There?" from the controller is answered with "Here I Am!"
+    char request[MULMSG_LEN] = {0};
+    char reply[64];
+    struct sockaddr_in controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = inet_addr("10.0.0.1"),
+    };
+    struct sockaddr_in to;
+    mulmsg *msg = mulmsg_wrap(request, MULMSG_LEN);
+
+    mulmsg_setSource(msg, 1);
+    mulmsg_setAlive(msg, 0);
+    mulmsg_setDeviceId(msg, 1);
+    CHECK_EQ(fake_net_inject(CONFIG_MULTICAST_PORT, &controller, request, sizeof(request), 2000), 0);
+
+    int found = 0;
+
+    for (int i = 0; i < 10 && !found; i++) {
+        int len = fake_net_receive(CONFIG_MULTICAST_PORT, &to, reply, sizeof(reply), 2000);
+
+        if (len < 0) {
+            break;
+        }
+
+        mulmsg *answer = mulmsg_wrap(reply, len);
+        found = len >= MULMSG_LEN && to.sin_addr.s_addr == controller.sin_addr.s_addr
+                && mulmsg_getSource(answer) == 0 && mulmsg_getAlive(answer) != 0
+                && mulmsg_getDeviceId(answer) == CONFIG_DEVICE_ID;
+    }
+
+    CHECK(found);
+    return test_done("host");
+}
@@ -0,0 +1,185 @@
+/*
+ * test_keepalive.c
+ *
+ *  Built with a one second idle limit. Replays a poll pattern like the
+ *  controller's: /jpg and /start_led on one connection every 50ms, a
+ *  dashboard scraping /metrics, a client that connects and goes silent
+ *  and a WiFi drop in the middle. Prints connection setups per 1000
+ *  requests and the request latency, then checks the idle sweep and the
+ *  LRU purge. The pattern is generated, not recorded from a controller,
+ *  and the latency is that of the fake server without a network.
+ */
+
+#include "test.h"
+#include "ledmsg.h"
+
+#define REPLAY_MS 4000
+#define POLL_MS 50
+#define SCRAPE_MS 300
+#define MAX_REQUESTS 1000
+
+// A client keeping one connection, reconnecting when the server closed it
+typedef struct {
+    const char *name;
+    int fd;
+    int setups;
+    int requests;
+    int failures;
+    int64_t latencies[MAX_REQUESTS];
+} client_t;
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int send_request(client_t *client, const fake_http_request_t *request) {
+    fake_http_response_t response;
+
+    if (client->fd < 0 || !fake_httpd_is_open(client->fd)) {
+        if (client->fd >= 0) {
+            fake_httpd_disconnect(client->fd);
+        }
+
+        client->fd = fake_httpd_connect(80);
+        client->setups++;
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t res = fake_httpd_request_on(client->fd, request, &response);
+    int status = fake_http_status(&response);
+
+    fake_http_response_free(&response);
+
+    if (client->requests < MAX_REQUESTS) {
+        client->latencies[client->requests] = esp_timer_get_time() - start;
+    }
+
+    client->requests++;
+
+    if (res != ESP_OK || status != 200) {
+        client->failures++;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void report(client_t *client) {
+    int count = client->requests < MAX_REQUESTS ? client->requests : MAX_REQUESTS;
+
+    qsort(client->latencies, count, sizeof(int64_t), compare_i64);
+    printf("%s: %d requests, %.1f connection setups per 1000, p50 %.2fms, p99 %.2fms, %d failed\n", client->name,
+           client->requests, client->setups * 1000.0 / client->requests, client->latencies[count / 2] / 1e3,
+           client->latencies[count * 99 / 100] / 1e3, client->failures);
+}
+
+// Value of a counter in the /metrics output
+static double metric(const char *name) {
+    fake_http_response_t response;
+    char *text;
+    double value = -1;
+
+    fake_httpd_get(80, "/metrics", NULL, &response);
+    text = calloc(1, response.len + 1);
+    memcpy(text, response.body, response.len);
+    fake_http_response_free(&response);
+
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        if (strncmp(line, name, strlen(name)) == 0 && line[strlen(name)] == ' ') {
+            value = atof(line + strlen(name) + 1);
+        }
+    }
+
+    free(text);
+    return value;
+}
+
+int main(void) {
+    static client_t controller = { .name = "controller", .fd = -1 };
+    static client_t dashboard = { .name = "dashboard", .fd = -1 };
+    uint8_t led_body[1 + 7] = { LEDMSG_RANGES, 0, 0, 10, 0, 20, 40, 60 };
+    fake_http_request_t jpg = { .method = HTTP_GET, .uri = "/jpg" };
+    fake_http_request_t led = { .method = HTTP_POST, .uri = "/start_led", .body = led_body,
+                                .body_len = sizeof(led_body) };
+    fake_http_request_t scrape = { .method = HTTP_GET, .uri = "/metrics" };
+
+    test_boot();
+    fake_rmt_set_time_scale(0);
+
+    double sessions_before = metric("esp32cam_http_sessions_total");
+
+    // Connects and never sends a request, like a peer gone with its WiFi
+    int silent = fake_httpd_connect(80);
+
+    int64_t start = esp_timer_get_time();
+    int64_t next_scrape = start;
+    int dropped = 0;
+
+    while (esp_timer_get_time() - start < REPLAY_MS * 1000LL) {
+        int64_t poll = esp_timer_get_time();
+
+        send_request(&controller, &jpg);
+        send_request(&controller, &led);
+
+        if (poll >= next_scrape) {
+            send_request(&dashboard, &scrape);
+            next_scrape += SCRAPE_MS * 1000;
+        }
+
+        // A short WiFi drop half way, the servers keep running
+        if (!dropped && poll - start > REPLAY_MS * 500LL) {
+            fake_wifi_disconnect();
+            dropped = 1;
+        }
+
+        int64_t wait = POLL_MS * 1000LL - (esp_timer_get_time() - poll);
+
+        if (wait > 0) {
+            usleep(wait);
+        }
+    }
+
+    report(&controller);
+    report(&dashboard);
+
+    // Connections polled within the idle limit live through the replay and the WiFi drop
+    CHECK_EQ(controller.setups, 1);
+    CHECK_EQ(controller.failures, 0);
+    CHECK_EQ(dashboard.failures, 0);
+    CHECK(dashboard.setups <= 2);
+    CHECK(fake_wifi_connected());
+
+    // The silent one was closed by the sweep
+    CHECK(!fake_httpd_is_open(silent));
+    CHECK(metric("esp32cam_http_idle_closes_total") >= 1);
+    fake_httpd_disconnect(silent);
+
+    // A new client beyond the socket limit replaces the least recently used connection
+    int fds[CONFIG_HTTP_MAX_SOCKETS + 1];
+
+    send_request(&controller, &jpg);
+
+    for (int i = 0; i < CONFIG_HTTP_MAX_SOCKETS + 1; i++) {
+        fake_http_response_t response;
+        fake_http_request_t request = { .method = HTTP_GET, .uri = "/metrics" };
+
+        fds[i] = fake_httpd_connect(80);
+        CHECK(fds[i] >= 0);
+        CHECK_EQ(fake_httpd_request_on(fds[i], &request, &response), ESP_OK);
+        fake_http_response_free(&response);
+    }
+
+    CHECK(!fake_httpd_is_open(controller.fd));
+    CHECK(fake_httpd_is_open(fds[CONFIG_HTTP_MAX_SOCKETS]));
+
+    for (int i = 0; i < CONFIG_HTTP_MAX_SOCKETS + 1; i++) {
+        fake_httpd_disconnect(fds[i]);
+    }
+
+    printf("%.0f connections accepted\n", metric("esp32cam_http_sessions_total") - sessions_before);
+
+    return test_done("keepalive");
+}
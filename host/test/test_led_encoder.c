@@ -0,0 +1,164 @@
+/*
+ * test_led_encoder.c
+ *
+ *  Built for the 50 LEDs of settings.h and for a strip of 1000. Sends
+ *  random frames and partial updates through the LED task and checks
+ *  that the items are bit-identical to those of the per-bit encoder the
+ *  lookup table replaced, that a transmission ends right after the last
+ *  changed LED, that unchanged frames are not sent at all and that the
+ *  strip ends up showing every frame. The updates are generated from a
+ *  fixed seed, not recorded from the controller.
+ */
+
+#include "test.h"
+#include "LED.h"
+
+#define T0H 8
+#define T1H 17
+#define T1L 8
+#define T0L 17
+#define TRST 3000
+
+#define UPDATES 400
+
+// Items of the last transmission, copied by the observer
+static rmt_item32_t sent[NUM_LEDS * 24 + 1];
+static volatile int sent_count;
+
+static void observe(rmt_channel_t channel, const rmt_item32_t *items, int count) {
+    if (count <= sizeof(sent) / sizeof(sent[0])) {
+        memcpy(sent, items, count * sizeof(rmt_item32_t));
+    }
+
+    sent_count = count;
+}
+
+// The encoder before the lookup table, for one LED whose colour is already in strip order
+static void reference_encode(rmt_item32_t *items, uint32_t bits_to_send) {
+    uint32_t mask = 1 << (24 - 1);
+
+    for (uint32_t bit = 0; bit < 24; bit++) {
+        uint32_t bit_is_set = bits_to_send & mask;
+        items[bit] = bit_is_set ? (rmt_item32_t) {{{T1H, 1, T1L, 0}}}
+                                : (rmt_item32_t) {{{T0H, 1, T0L, 0}}};
+        mask >>= 1;
+    }
+}
+
+// Strip order of the registries this test is built with
+static uint32_t grb(uint32_t rgb) {
+    return ((rgb & 0x00FF00) << 8) | ((rgb & 0xFF0000) >> 8) | (rgb & 0xFF);
+}
+
+static uint32_t random_color(void) {
+    return ((uint32_t) rand() << 8 ^ (uint32_t) rand()) & 0xFFFFFF;
+}
+
+// Changes the frame like the controller would: all of it, one LED, a range or nothing
+static void mutate(struct led_state *state, int kind) {
+    int start = rand() % NUM_LEDS;
+    int count = 1 + rand() % (NUM_LEDS - start);
+
+    switch (kind) {
+        case 0:
+            for (int i = 0; i < NUM_LEDS; i++) {
+                state->leds[i] = random_color();
+            }
+            break;
+        case 1:
+            state->leds[start] = random_color();
+            break;
+        case 2: {
+            uint32_t color = random_color();
+
+            for (int i = start; i < start + count; i++) {
+                state->leds[i] = color;
+            }
+            break;
+        }
+        case 3:
+            // Bits above the colour are ignored
+            state->leds[start] |= 0xFF000000;
+            break;
+        default:
+            break;
+    }
+}
+
+int main(void) {
+    static struct led_state state;
+    static struct led_state shown;
+    static rmt_item32_t expected[NUM_LEDS * 24];
+    static uint32_t strip[NUM_LEDS];
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int partial = 0;
+    int skipped = 0;
+
+    test_boot();
+    fake_rmt_set_time_scale(0);
+    fake_rmt_set_observer(observe);
+    srand(6);
+
+    // The strip starts dark, the first frame is sent completely
+    for (int update = 0; update < UPDATES; update++) {
+        if (update > 0) {
+            mutate(&state, rand() % 5);
+        }
+
+        uint32_t writes = fake_rmt_writes(RMT_CHANNEL_0);
+
+        write_leds_notify(&state, self);
+        CHECK(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2000)) > 0);
+
+        int last = -1;
+
+        for (int i = 0; i < NUM_LEDS; i++) {
+            if ((state.leds[i] & 0xFFFFFF) != shown.leds[i] || update == 0) {
+                last = i;
+            }
+
+            shown.leds[i] = state.leds[i] & 0xFFFFFF;
+            reference_encode(&expected[i * 24], grb(shown.leds[i]));
+        }
+
+        if (last < 0) {
+            // Nothing changed, nothing is sent
+            CHECK_EQ(fake_rmt_writes(RMT_CHANNEL_0), writes);
+            skipped++;
+            continue;
+        }
+
+        CHECK_EQ(fake_rmt_writes(RMT_CHANNEL_0), writes + 1);
+
+        // Everything up to the last changed LED, then the reset that latches it
+        int send = last + 1;
+
+        CHECK_EQ(sent_count, send * 24 + 1);
+
+        if (sent_count == send * 24 + 1) {
+            CHECK(memcmp(sent, expected, send * 24 * sizeof(rmt_item32_t)) == 0);
+            CHECK_EQ(sent[send * 24].duration0, TRST);
+            CHECK_EQ(sent[send * 24].level0, 0);
+        }
+
+        partial += send < NUM_LEDS;
+
+        // The LEDs behind the last changed one keep the colour they had
+        CHECK_EQ(fake_rmt_strip(RMT_CHANNEL_0, strip, NUM_LEDS), NUM_LEDS);
+
+        for (int i = 0; i < NUM_LEDS; i++) {
+            if (strip[i] != grb(shown.leds[i])) {
+                fprintf(stderr, "update %d: LED %d shows %06x instead of %06x\n", update, i, strip[i],
+                        grb(shown.leds[i]));
+                test_failures++;
+                break;
+            }
+        }
+    }
+
+    printf("%d LEDs: %d updates, %d shortened, %d not sent\n", NUM_LEDS, UPDATES, partial, skipped);
+    CHECK(partial > 0);
+    CHECK(skipped > 0);
+
+    return test_done("led_encoder");
+}
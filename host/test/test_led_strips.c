@@ -0,0 +1,186 @@
+/*
+ * test_led_strips.c
+ *
+ *  Built for the single strip of settings.h and for three strips of
+ *  different length and colour order. Checks the GPIO and RMT memory
+ *  of every channel, that each strip shows its part of the frame in its
+ *  colour order, that only strips with changes are sent, and that all
+ *  strips start together so a frame takes as long as the longest one.
+ *  Prints the frame time against the wire time of each strip and their
+ *  sum. The frames are generated from a fixed seed and the wire time is
+ *  the fake RMT's, derived from the items sent.
+ */
+
+#include "test.h"
+#include "LED.h"
+
+#define FRAMES 30
+// Wire time of an LED and of the reset that latches the strip at the RMT clock of LED.c
+#define LED_US 30
+#define RESET_US 300
+
+// The registry this test is built with
+typedef struct {
+    rmt_channel_t channel;
+    int gpio;
+    int leds;
+    led_order_t order;
+} strip_t;
+
+#define STRIP_ENTRY(channel, gpio, leds, order) { channel, gpio, leds, order },
+
+static const strip_t strips[] = { CONFIG_LED_STRIPS(STRIP_ENTRY) };
+
+#define STRIPS ((int) (sizeof(strips) / sizeof(strips[0])))
+
+// Start time of the last transmission per channel
+static volatile int64_t started[RMT_CHANNEL_MAX];
+
+static void observe(rmt_channel_t channel, const rmt_item32_t *items, int count) {
+    started[channel] = esp_timer_get_time();
+}
+
+static uint32_t reorder(uint32_t rgb, led_order_t order) {
+    uint32_t r = (rgb >> 16) & 0xFF;
+    uint32_t g = (rgb >> 8) & 0xFF;
+    uint32_t b = rgb & 0xFF;
+    uint32_t bytes[] = {
+            [LED_ORDER_RGB] = r << 16 | g << 8 | b,
+            [LED_ORDER_RBG] = r << 16 | b << 8 | g,
+            [LED_ORDER_GRB] = g << 16 | r << 8 | b,
+            [LED_ORDER_GBR] = g << 16 | b << 8 | r,
+            [LED_ORDER_BRG] = b << 16 | r << 8 | g,
+            [LED_ORDER_BGR] = b << 16 | g << 8 | r,
+    };
+
+    return bytes[order];
+}
+
+// Mismatches between the strips and a frame
+static int check_strips(const struct led_state *state) {
+    static uint32_t words[FAKE_RMT_STRIP_LEDS];
+    int first = 0;
+    int mismatches = 0;
+
+    for (int i = 0; i < STRIPS; i++) {
+        int len = fake_rmt_strip(strips[i].channel, words, FAKE_RMT_STRIP_LEDS);
+
+        mismatches += len != strips[i].leds;
+
+        for (int led = 0; led < strips[i].leds && led < len; led++) {
+            mismatches += words[led] != reorder(state->leds[first + led], strips[i].order);
+        }
+
+        first += strips[i].leds;
+    }
+
+    return mismatches;
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(void) {
+    static struct led_state state;
+    static int64_t latencies[FRAMES];
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int total = 0;
+    int longest = 0;
+
+    test_boot();
+    srand(19);
+
+    // Every strip on its GPIO, with RMT memory up to the next registered channel
+    for (int i = 0; i < STRIPS; i++) {
+        int gpio;
+        int blocks;
+        int next = RMT_CHANNEL_MAX;
+
+        for (int j = 0; j < STRIPS; j++) {
+            if (strips[j].channel > strips[i].channel && strips[j].channel < next) {
+                next = strips[j].channel;
+            }
+        }
+
+        CHECK(fake_rmt_installed(strips[i].channel));
+        CHECK(fake_rmt_config(strips[i].channel, &gpio, &blocks));
+        CHECK_EQ(gpio, strips[i].gpio);
+        CHECK_EQ(blocks, next - strips[i].channel < 2 ? next - strips[i].channel : 2);
+        total += strips[i].leds;
+        longest = strips[i].leds > longest ? strips[i].leds : longest;
+    }
+
+    CHECK_EQ(total, NUM_LEDS);
+
+    // Each strip shows its part of the frame in its colour order
+    fake_rmt_set_observer(observe);
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+        for (int i = 0; i < NUM_LEDS; i++) {
+            state.leds[i] = ((uint32_t) rand() << 8 ^ (uint32_t) rand()) & 0xFFFFFF;
+        }
+
+        int64_t start = esp_timer_get_time();
+
+        write_leds_notify(&state, self);
+        CHECK(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2000)) > 0);
+        latencies[frame] = esp_timer_get_time() - start;
+        CHECK_EQ(check_strips(&state), 0);
+
+        // Started together, not one after the other
+        int64_t first_start = INT64_MAX;
+        int64_t last_start = 0;
+
+        for (int i = 0; i < STRIPS; i++) {
+            first_start = started[strips[i].channel] < first_start ? started[strips[i].channel] : first_start;
+            last_start = started[strips[i].channel] > last_start ? started[strips[i].channel] : last_start;
+        }
+
+        CHECK(last_start - first_start < 1000);
+    }
+
+    qsort(latencies, FRAMES, sizeof(int64_t), compare_i64);
+
+    int64_t wire_longest = longest * LED_US + RESET_US;
+    int64_t wire_sum = total * LED_US + STRIPS * RESET_US;
+
+    printf("%d strips, %d LEDs: frame %.2fms, longest strip %.2fms, all strips in a row %.2fms\n", STRIPS,
+           NUM_LEDS, latencies[FRAMES / 2] / 1e3, wire_longest / 1e3, wire_sum / 1e3);
+    CHECK(latencies[FRAMES / 2] >= wire_longest);
+
+    if (STRIPS > 1) {
+        CHECK(latencies[FRAMES / 2] < (wire_longest + wire_sum) / 2);
+    }
+
+    // A change on one strip is sent on its channel only
+    fake_rmt_set_time_scale(0);
+
+    int first = 0;
+
+    for (int i = 0; i < STRIPS; i++) {
+        uint32_t writes[RMT_CHANNEL_MAX];
+
+        for (int j = 0; j < STRIPS; j++) {
+            writes[j] = fake_rmt_writes(strips[j].channel);
+        }
+
+        state.leds[first + strips[i].leds / 2] ^= 0x123456;
+        write_leds_notify(&state, self);
+        CHECK(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2000)) > 0);
+        CHECK_EQ(check_strips(&state), 0);
+
+        for (int j = 0; j < STRIPS; j++) {
+            CHECK_EQ(fake_rmt_writes(strips[j].channel), writes[j] + (i == j));
+        }
+
+        first += strips[i].leds;
+    }
+
+    fake_rmt_set_observer(NULL);
+
+    return test_done("led_strips");
+}
@@ -0,0 +1,161 @@
+/*
+ * test_led_task.c
+ *
+ *  Checks the LED task: write_leds returns without waiting for the RMT,
+ *  every transmission carries one whole frame that was written, frames
+ *  go out in the order they were written, a buffer is never changed
+ *  while it is sent and write_leds_notify reports once its frame is on
+ *  the strip. The frames are synthetic, each paints the whole strip in
+ *  a colour derived from its number.
+ */
+
+#include "test.h"
+#include "LED.h"
+#include <pthread.h>
+
+#define WRITER_FRAMES 2000
+// 24 bits of 1.25us per LED and the reset of 2 x 3000 ticks at 20MHz
+#define FRAME_WIRE_US (NUM_LEDS * 30 + 300)
+#define TIME_SCALE 10
+
+// Frames seen by the observer, whole means all LEDs had the colour of one frame
+static volatile int transmissions;
+static volatile int mixed;
+static volatile int out_of_order;
+static volatile int last_frame = -1;
+
+// Colour of frame n, a different one for every frame of a run
+static uint32_t frame_color(int n) {
+    return (uint32_t) (n + 1) * 0x010203 & 0xFFFFFF;
+}
+
+// Strip order of the default registry
+static uint32_t grb(uint32_t rgb) {
+    return ((rgb & 0x00FF00) << 8) | ((rgb & 0xFF0000) >> 8) | (rgb & 0xFF);
+}
+
+// Decodes a transmission, all its LEDs must show the same frame and frames must come in order
+static void observe(rmt_channel_t channel, const rmt_item32_t *items, int count) {
+    int leds = count / 24;
+    uint32_t first = 0;
+
+    for (int led = 0; led < leds; led++) {
+        uint32_t bits = 0;
+
+        for (int bit = 0; bit < 24; bit++) {
+            const rmt_item32_t *item = &items[led * 24 + bit];
+            bits = (bits << 1) | (item->duration0 > item->duration1);
+        }
+
+        if (led == 0) {
+            first = bits;
+        } else if (bits != first) {
+            mixed++;
+            return;
+        }
+    }
+
+    for (int n = 0; n < WRITER_FRAMES; n++) {
+        if (grb(frame_color(n)) == first) {
+            if (n < last_frame) {
+                out_of_order++;
+            }
+
+            last_frame = n;
+            break;
+        }
+    }
+
+    transmissions++;
+}
+
+// Writes frames as fast as it can, like the HTTP task under a burst of updates
+static void *writer(void *arg) {
+    static struct led_state state;
+    int64_t *longest = arg;
+
+    for (int n = 0; n < WRITER_FRAMES; n++) {
+        for (int i = 0; i < NUM_LEDS; i++) {
+            state.leds[i] = frame_color(n);
+        }
+
+        int64_t start = esp_timer_get_time();
+        write_leds(&state);
+        int64_t duration = esp_timer_get_time() - start;
+
+        if (duration > *longest) {
+            *longest = duration;
+        }
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    static struct led_state state;
+    uint32_t strip[NUM_LEDS];
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+    test_boot();
+    fake_rmt_set_observer(observe);
+
+    // Slower transmissions make the writer outrun them by far
+    fake_rmt_set_time_scale(TIME_SCALE);
+
+    int64_t longest = 0;
+    int64_t start = esp_timer_get_time();
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, writer, &longest);
+    pthread_join(thread, NULL);
+
+    int64_t writing = esp_timer_get_time() - start;
+    int64_t frame_us = FRAME_WIRE_US * TIME_SCALE;
+
+    printf("%d frames written in %lldus, longest write_leds %lldus, a frame takes %lldus on the wire\n",
+           WRITER_FRAMES, (long long) writing, (long long) longest, (long long) frame_us);
+
+    // Writing does not wait for transmissions, most frames are superseded before the task takes them
+    CHECK(writing < WRITER_FRAMES * frame_us / 4);
+
+    // The last frame written is latched once its notification arrives
+    for (int i = 0; i < NUM_LEDS; i++) {
+        state.leds[i] = frame_color(WRITER_FRAMES - 1);
+    }
+
+    write_leds_notify(&state, self);
+    CHECK(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2000)) > 0);
+    CHECK_EQ(fake_rmt_strip(RMT_CHANNEL_0, strip, NUM_LEDS), NUM_LEDS);
+
+    for (int i = 0; i < NUM_LEDS; i++) {
+        CHECK_EQ(strip[i], grb(frame_color(WRITER_FRAMES - 1)));
+    }
+
+    printf("%d transmissions\n", transmissions);
+    CHECK(transmissions > 0);
+    CHECK(transmissions < WRITER_FRAMES);
+    CHECK_EQ(mixed, 0);
+    CHECK_EQ(out_of_order, 0);
+    CHECK_EQ(last_frame, WRITER_FRAMES - 1);
+    CHECK_EQ(fake_rmt_torn(RMT_CHANNEL_0), 0);
+
+    // A notification for a superseded frame still arrives, each one exactly once
+    int notified = 0;
+
+    for (int n = 0; n < 10; n++) {
+        for (int i = 0; i < NUM_LEDS; i++) {
+            state.leds[i] = frame_color(n);
+        }
+
+        write_leds_notify(&state, self);
+    }
+
+    while (ulTaskNotifyTake(pdFALSE, pdMS_TO_TICKS(500)) > 0) {
+        notified++;
+    }
+
+    CHECK_EQ(notified, 10);
+    CHECK_EQ(fake_rmt_torn(RMT_CHANNEL_0), 0);
+
+    return test_done("led_task");
+}
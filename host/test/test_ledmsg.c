@@ -0,0 +1,326 @@
+/*
+ * test_ledmsg.c
+ *
+ *  Fuzzes the binary /start_led parser against a whole-body reference
+ *  with valid, corrupted and random bodies fed in random chunks, checks
+ *  the gamma table and sends updates through POST /start_led, where a
+ *  brightness query that does not fit is refused. Prints the parse
+ *  throughput of full frames. The bodies come from a fixed
+ *  seed, not from a controller.
+ */
+
+#include "test.h"
+#include "LED.h"
+#include "ledmsg.h"
+
+#define BODIES 20000
+#define BODY_MAX (1 + NUM_LEDS * 3 + 16)
+#define GUARD 0x5A5A5A5A
+
+// State between guard words, the parser must never write outside
+static struct {
+    uint32_t before[4];
+    struct led_state state;
+    uint32_t after[4];
+} guarded;
+
+// Applies a whole body, returns 0 if it is valid, like the parser promises
+static int reference_apply(const uint8_t *body, int len, struct led_state *state, const uint8_t *lut) {
+    static const int record_len[] = { 0, 3, 5, 7 };
+
+    if (len < 1 || body[0] < LEDMSG_FRAME || body[0] > LEDMSG_RANGES) {
+        return -1;
+    }
+
+    int size = record_len[body[0]];
+
+    if ((len - 1) % size != 0) {
+        return -1;
+    }
+
+    for (int pos = 1, led = 0; pos < len; pos += size, led++) {
+        const uint8_t *r = body + pos;
+        uint32_t start = r[0] | (r[1] << 8);
+        uint32_t count = r[2] | (r[3] << 8);
+
+        switch (body[0]) {
+            case LEDMSG_FRAME:
+                if (led >= NUM_LEDS) {
+                    return -1;
+                }
+                state->leds[led] = lut[r[0]] << 16 | lut[r[1]] << 8 | lut[r[2]];
+                break;
+            case LEDMSG_PIXELS:
+                if (start >= NUM_LEDS) {
+                    return -1;
+                }
+                state->leds[start] = lut[r[2]] << 16 | lut[r[3]] << 8 | lut[r[4]];
+                break;
+            default:
+                if (start + count > NUM_LEDS) {
+                    return -1;
+                }
+                for (uint32_t i = start; i < start + count; i++) {
+                    state->leds[i] = lut[r[4]] << 16 | lut[r[5]] << 8 | lut[r[6]];
+                }
+                break;
+        }
+    }
+
+    return 0;
+}
+
+// Index near the ends of the strip, sometimes past them
+static uint16_t random_index(void) {
+    switch (rand() % 4) {
+        case 0: return rand() % NUM_LEDS;
+        case 1: return NUM_LEDS - 1 - rand() % 3;
+        case 2: return NUM_LEDS + rand() % 3;
+        default: return rand();
+    }
+}
+
+// A body that is mostly valid, then maybe truncated, extended or overwritten at one byte
+static int random_body(uint8_t *body) {
+    int command = 1 + rand() % 3;
+    int len = 1;
+
+    body[0] = command;
+
+    if (command == LEDMSG_FRAME) {
+        int leds = rand() % 4 == 0 ? NUM_LEDS : rand() % (NUM_LEDS + 2);
+
+        for (int i = 0; i < leds * 3; i++) {
+            body[len++] = rand();
+        }
+    } else {
+        int records = rand() % 8;
+
+        for (int i = 0; i < records; i++) {
+            uint16_t start = random_index();
+            uint16_t count = command == LEDMSG_RANGES && rand() % 2 ? NUM_LEDS - start % NUM_LEDS : random_index();
+
+            body[len++] = start;
+            body[len++] = start >> 8;
+
+            if (command == LEDMSG_RANGES) {
+                body[len++] = count;
+                body[len++] = count >> 8;
+            }
+
+            for (int c = 0; c < 3; c++) {
+                body[len++] = rand();
+            }
+        }
+    }
+
+    switch (rand() % 8) {
+        case 0: len -= rand() % len; break;
+        case 1: body[len++] = rand(); break;
+        case 2: body[rand() % len] = rand(); break;
+        case 3:
+            len = rand() % 64;
+            for (int i = 0; i < len; i++) {
+                body[i] = rand();
+            }
+            break;
+        default: break;
+    }
+
+    return len;
+}
+
+// Feeds a body to the parser in random pieces, returns 0 if it accepted it
+static int parse_chunked(const uint8_t *body, int len, struct led_state *state, const uint8_t *lut) {
+    ledmsg_parser parser;
+    int pos = 0;
+    int res = 0;
+
+    ledmsg_init(&parser, state, lut);
+
+    while (pos < len && res == 0) {
+        int piece = 1 + rand() % (rand() % 2 ? 8 : len);
+
+        if (piece > len - pos) {
+            piece = len - pos;
+        }
+
+        res = ledmsg_feed(&parser, body + pos, piece);
+        pos += piece;
+    }
+
+    return res == 0 ? ledmsg_finish(&parser) : -1;
+}
+
+// Waits until the strip shows a colour in the byte order of the default registry, returns 0 then
+static int wait_strip(uint32_t rgb) {
+    uint32_t grb = ((rgb & 0x00FF00) << 8) | ((rgb & 0xFF0000) >> 8) | (rgb & 0xFF);
+    uint32_t strip[NUM_LEDS];
+
+    for (int wait = 0; wait < 200; wait++) {
+        int count = fake_rmt_strip(RMT_CHANNEL_0, strip, NUM_LEDS);
+        int same = count == NUM_LEDS;
+
+        for (int i = 0; i < count && same; i++) {
+            same = strip[i] == grb;
+        }
+
+        if (same) {
+            return 0;
+        }
+
+        test_sleep_ms(5);
+    }
+
+    return -1;
+}
+
+int main(void) {
+    static uint8_t body[BODY_MAX];
+    static struct led_state expected;
+    uint8_t lut[256];
+    int accepted = 0;
+
+    srand(7);
+    ledmsg_buildLut(lut, 255);
+
+    // Gamma: black and white stay, the curve rises and passes below linear
+    CHECK_EQ(lut[0], 0);
+    CHECK_EQ(lut[255], 255);
+    CHECK(lut[128] < 128);
+
+    for (int i = 1; i < 256; i++) {
+        CHECK(lut[i] >= lut[i - 1]);
+    }
+
+    uint8_t dimmed[256];
+
+    ledmsg_buildLut(dimmed, 0);
+    CHECK_EQ(dimmed[255], 0);
+    ledmsg_buildLut(dimmed, 128);
+    CHECK_EQ(dimmed[255], 128);
+
+    for (int n = 0; n < BODIES; n++) {
+        int len = random_body(body);
+
+        for (int i = 0; i < 4; i++) {
+            guarded.before[i] = guarded.after[i] = GUARD;
+        }
+
+        for (int i = 0; i < NUM_LEDS; i++) {
+            guarded.state.leds[i] = expected.leds[i] = i;
+        }
+
+        int valid = reference_apply(body, len, &expected, lut);
+        int res = parse_chunked(body, len, &guarded.state, lut);
+
+        for (int i = 0; i < 4; i++) {
+            CHECK_EQ(guarded.before[i], GUARD);
+            CHECK_EQ(guarded.after[i], GUARD);
+        }
+
+        if ((res == 0) != (valid == 0)) {
+            fprintf(stderr, "body %d of %dB starting with %02x: parser %d, reference %d\n", n, len, body[0], res,
+                    valid);
+            test_failures++;
+        } else if (valid == 0) {
+            CHECK(memcmp(&guarded.state, &expected, sizeof(expected)) == 0);
+            accepted++;
+        }
+    }
+
+    printf("%d bodies, %d valid\n", BODIES, accepted);
+    CHECK(accepted > BODIES / 4);
+    CHECK(accepted < BODIES * 3 / 4);
+
+    // Full frames straight from the buffer
+    body[0] = LEDMSG_FRAME;
+
+    for (int i = 1; i < 1 + NUM_LEDS * 3; i++) {
+        body[i] = i;
+    }
+
+    int frames = 20000;
+    int64_t start = esp_timer_get_time();
+    ledmsg_parser parser;
+
+    for (int n = 0; n < frames; n++) {
+        ledmsg_init(&parser, &expected, lut);
+        ledmsg_feed(&parser, body, 1 + NUM_LEDS * 3);
+        CHECK_EQ(ledmsg_finish(&parser), 0);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    printf("full frame of %d LEDs parsed in %.2fus, %.1fMB/s\n", NUM_LEDS, (double) elapsed / frames,
+           (double) frames * (1 + NUM_LEDS * 3) / elapsed);
+
+    // Through the handler, received in small pieces
+    fake_http_response_t response;
+    fake_http_request_t request = {
+            .method = HTTP_POST,
+            .uri = "/start_led?brightness=255",
+            .body = body,
+            .recv_max = 7,
+    };
+
+    test_boot();
+    fake_rmt_set_time_scale(0);
+
+    body[0] = LEDMSG_RANGES;
+    memcpy(body + 1, (uint8_t[]) { 0, 0, NUM_LEDS, 0, 255, 0, 0 }, 7);
+    request.body_len = 8;
+    CHECK_EQ(fake_httpd_request(80, &request, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    fake_http_response_free(&response);
+    CHECK_EQ(wait_strip(0xFF0000), 0);
+
+    // Brightness after a long parameter is still applied, a query cut short is refused instead of ignored
+    char uri[256];
+    char padding[160];
+
+    memset(padding, 'x', sizeof(padding) - 1);
+    padding[sizeof(padding) - 1] = '\0';
+    ledmsg_buildLut(lut, 64);
+    snprintf(uri, sizeof(uri), "/start_led?note=%.90s&brightness=64", padding);
+    request.uri = uri;
+    CHECK_EQ(fake_httpd_request(80, &request, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    fake_http_response_free(&response);
+    CHECK(lut[255] < 255);
+    CHECK_EQ(wait_strip(lut[255] << 16), 0);
+
+    const char *refused[] = { "/start_led?note=%.150s&brightness=255", "/start_led?brightness=0000000255" };
+
+    for (int i = 0; i < 2; i++) {
+        snprintf(uri, sizeof(uri), refused[i], padding);
+        fake_httpd_request(80, &request, &response);
+        CHECK_EQ(fake_http_status(&response), 400);
+        fake_http_response_free(&response);
+    }
+
+    test_sleep_ms(50);
+    CHECK_EQ(wait_strip(lut[255] << 16), 0);
+
+    // A broken update is refused and leaves the LEDs as they are
+    request.uri = "/start_led?brightness=64";
+    body[0] = LEDMSG_PIXELS;
+    memcpy(body + 1, (uint8_t[]) { 0, 0, 0, 255, 0, NUM_LEDS, 0, 0, 0, 255 }, 10);
+    request.body_len = 11;
+    fake_httpd_request(80, &request, &response);
+    CHECK_EQ(fake_http_status(&response), 400);
+    fake_http_response_free(&response);
+    test_sleep_ms(50);
+    CHECK_EQ(wait_strip(lut[255] << 16), 0);
+
+    // The legacy hex digits are 00GGRRBB
+    request.body = "00FF0000";
+    request.body_len = 8;
+    request.uri = "/start_led";
+    CHECK_EQ(fake_httpd_request(80, &request, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    fake_http_response_free(&response);
+    CHECK_EQ(wait_strip(0x00FF00), 0);
+
+    return test_done("ledmsg");
+}
@@ -0,0 +1,141 @@
+/*
+ * test_mcast_sender.c
+ *
+ *  Checks the multicast sender: requests go to the group resolved once
+ *  at start, answers to the address that asked, the resolver is never
+ *  called and the send log, the debug line of the bytes sent included,
+ *  is limited to a line per second however many datagrams go out. Prints the answers per second of a burst of
+ *  discovery requests from a controller made up by the test, sent over
+ *  the fake's local sockets rather than WiFi.
+ */
+
+#include "test.h"
+#include "mulmsg.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define REQUESTS 500
+
+static volatile int lookups;
+static volatile int send_lines;
+static volatile int unlogged_reported;
+static volatile int debug_lines;
+
+// Replaces the resolver, the station has no business looking up addresses while it runs
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+    __atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+    return EAI_FAIL;
+}
+
+// Counts the send log lines, the datagrams they say were left out and the debug lines of the sends
+static void capture(esp_log_level_t level, const char *tag, const char *line) {
+    const char *sending = strstr(line, "Sending to IPV4 address");
+    unsigned int unlogged;
+
+    if (strstr(line, "SND ") != NULL) {
+        debug_lines++;
+    }
+
+    if (sending != NULL) {
+        send_lines++;
+
+        if (sscanf(strchr(sending, '('), "(%u unlogged)", &unlogged) == 1) {
+            unlogged_reported += unlogged;
+        }
+    }
+}
+
+// Receives the answers still due to the controller, counts datagrams to any other address than it or the group
+static int receive_answers(const struct sockaddr_in *controller, int due, int *misdirected) {
+    char reply[64];
+    struct sockaddr_in to;
+    int answers = 0;
+
+    while (fake_net_receive(CONFIG_MULTICAST_PORT, &to, reply, sizeof(reply), answers < due ? 500 : 0) >= 0) {
+        if (to.sin_addr.s_addr == controller->sin_addr.s_addr) {
+            answers++;
+        } else if (to.sin_addr.s_addr != inet_addr(CONFIG_MULTICAST_ADDR)) {
+            (*misdirected)++;
+        }
+    }
+
+    return answers;
+}
+
+int main(void) {
+    char request[MULMSG_LEN] = {0};
+    char reply[64];
+    struct sockaddr_in controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = inet_addr("10.0.0.1"),
+    };
+    struct sockaddr_in to;
+    mulmsg *msg = mulmsg_wrap(request, MULMSG_LEN);
+
+    fake_log_set_capture(capture);
+    esp_log_level_set("LMS", ESP_LOG_INFO);
+    test_boot();
+
+    // The first request of the handshake goes to the group
+    int len = fake_net_receive(CONFIG_MULTICAST_PORT, &to, reply, sizeof(reply), 2000);
+
+    CHECK_EQ(len, MULMSG_LEN);
+    CHECK_EQ(to.sin_addr.s_addr, inet_addr(CONFIG_MULTICAST_ADDR));
+    CHECK_EQ(ntohs(to.sin_port), CONFIG_MULTICAST_PORT);
+
+    // A burst of "Are You There?", each answered to the controller
+    mulmsg_setSource(msg, 1);
+    mulmsg_setAlive(msg, 0);
+    mulmsg_setDeviceId(msg, 1);
+
+    // As fast as the station answers
+    int answers = 0;
+    int misdirected = 0;
+    int64_t start = esp_timer_get_time();
+
+    for (int i = 0; i < REQUESTS; i++) {
+        fake_net_inject(CONFIG_MULTICAST_PORT, &controller, request, sizeof(request), 1000);
+        answers += receive_answers(&controller, 2 * (i + 1) - answers, &misdirected);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    printf("%d datagrams answered in %lldms, %.0f/s\n", answers, (long long) elapsed / 1000, answers * 1e6 / elapsed);
+
+    // "Here I Am!" and the announcement for every request
+    CHECK_EQ(answers, 2 * REQUESTS);
+    CHECK_EQ(misdirected, 0);
+    CHECK_EQ(lookups, 0);
+
+    // Spread over 2.5s, at most one send log line per second is written, the others are counted as unlogged
+    int lines_before = send_lines;
+    int unlogged_before = unlogged_reported;
+    int debug_before = debug_lines;
+
+    start = esp_timer_get_time();
+    answers = 0;
+
+    for (int i = 0; i < 250; i++) {
+        fake_net_inject(CONFIG_MULTICAST_PORT, &controller, request, sizeof(request), 1000);
+        answers += receive_answers(&controller, 2 * (i + 1) - answers, &misdirected);
+        test_sleep_ms(10);
+    }
+
+    elapsed = esp_timer_get_time() - start;
+
+    int lines = send_lines - lines_before;
+
+    printf("%d datagrams in %lldms, %d send log lines\n", answers, (long long) elapsed / 1000, lines);
+    CHECK(lines >= 2);
+    CHECK(lines <= elapsed / 1000000 + 1);
+    CHECK(unlogged_reported - unlogged_before > answers / 2);
+#ifdef CONFIG_MULTICAST_DEBUG
+    // The bytes of a datagram are only logged along with the send line
+    CHECK_EQ(debug_lines - debug_before, lines);
+#endif
+    CHECK_EQ(lookups, 0);
+
+    fake_log_set_capture(NULL);
+    return test_done("mcast_sender");
+}
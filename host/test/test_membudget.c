@@ -0,0 +1,191 @@
+/*
+ * test_membudget.c
+ *
+ *  Checks that a budget that does not fit its heap fails at boot, then
+ *  has threads allocate frame sized blocks of random length from the
+ *  snapshot arena, fill them and free them in random order. Checks that
+ *  no block overlaps another, that the usage the arena reports matches
+ *  the blocks held, that it never goes over its budget and that the free
+ *  space merges back into one block, and prints the high-water mark,
+ *  the failed allocations and the fragmentation seen. The sizes are
+ *  drawn from a fixed seed, not taken from recorded frames.
+ */
+
+#include "test.h"
+#include "membudget.h"
+#include <esp_heap_caps.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define ROUNDS 20000
+#define HELD 4
+#define MIN_BLOCK 2000
+#define MAX_BLOCK 120000
+// Room a block takes from an arena, as in membudget.c
+#define BLOCK_ROOM(bytes) ((((bytes) + 7) & ~7) + 8)
+
+static volatile uint32_t held_bytes;
+static volatile uint32_t failures;
+static volatile uint32_t fragmented;
+static volatile uint32_t samples;
+
+// Allocates, fills and frees blocks, keeping up to HELD of them
+static void *stress(void *arg) {
+    unsigned int seed = (uintptr_t) arg;
+    uint8_t *blocks[HELD] = { NULL };
+    size_t lens[HELD];
+    uint8_t fill = (uintptr_t) arg * 16;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int slot = rand_r(&seed) % HELD;
+
+        if (blocks[slot] != NULL) {
+            // Nobody else wrote into the block while it was held
+            for (size_t i = 0; i < lens[slot]; i += 61) {
+                if (blocks[slot][i] != (uint8_t) (fill + slot)) {
+                    __atomic_add_fetch(&test_failures, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+
+            __atomic_sub_fetch(&held_bytes, BLOCK_ROOM(lens[slot]), __ATOMIC_RELAXED);
+            membudget_free(MEM_SNAPSHOT, blocks[slot]);
+            blocks[slot] = NULL;
+            continue;
+        }
+
+        lens[slot] = MIN_BLOCK + rand_r(&seed) % (MAX_BLOCK - MIN_BLOCK);
+        blocks[slot] = membudget_alloc(MEM_SNAPSHOT, lens[slot]);
+
+        if (blocks[slot] == NULL) {
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        __atomic_add_fetch(&held_bytes, BLOCK_ROOM(lens[slot]), __ATOMIC_RELAXED);
+        memset(blocks[slot], fill + slot, lens[slot]);
+
+        // Now and then, whether the free space would hold the largest block but only in pieces
+        if (round % 100 == 0) {
+            membudget_stats_t stats;
+
+            membudget_get_stats(MEM_SNAPSHOT, &stats);
+            __atomic_add_fetch(&samples, 1, __ATOMIC_RELAXED);
+
+            if (stats.largest_free < MAX_BLOCK && stats.size - stats.used > BLOCK_ROOM(MAX_BLOCK)) {
+                __atomic_add_fetch(&fragmented, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    for (int slot = 0; slot < HELD; slot++) {
+        if (blocks[slot] != NULL) {
+            __atomic_sub_fetch(&held_bytes, BLOCK_ROOM(lens[slot]), __ATOMIC_RELAXED);
+            membudget_free(MEM_SNAPSHOT, blocks[slot]);
+        }
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[THREADS];
+    membudget_stats_t stats;
+
+    // The ROI scratch fits, the latched frames do not
+    fake_heap_set_free(MALLOC_CAP_SPIRAM, CONFIG_ROI_MAX_PIXELS * 3 + 64 * 1024);
+    CHECK_EQ(membudget_init(), ESP_ERR_NO_MEM);
+    fake_heap_set_free(MALLOC_CAP_SPIRAM, 4 * 1024 * 1024);
+
+    test_boot();
+    membudget_get_stats(MEM_SNAPSHOT, &stats);
+    CHECK_EQ(stats.size, CONFIG_MEM_SNAPSHOT_KB * 1024);
+    CHECK_EQ(stats.used, 0);
+    CHECK_EQ(stats.largest_free, stats.size - 8);
+
+    // Arenas of disabled features reserve nothing and hand out nothing
+    membudget_get_stats(MEM_PUSH, &stats);
+    CHECK_EQ(stats.size, 0);
+    CHECK(membudget_alloc(MEM_PUSH, 16) == NULL);
+
+    for (intptr_t i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress, (void *) (i + 1));
+    }
+
+    // The usage reported never goes over the budget
+    int over = 0;
+    void *done = NULL;
+
+    for (int i = 0; i < 200; i++) {
+        membudget_get_stats(MEM_SNAPSHOT, &stats);
+        over += stats.used > stats.size || stats.high_water > stats.size;
+        usleep(1000);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], &done);
+    }
+
+    CHECK_EQ(over, 0);
+    membudget_get_stats(MEM_SNAPSHOT, &stats);
+    printf("%d threads, %d rounds: high water %uKB of %uKB, %u allocations failed, "
+           "the largest block fitted only in pieces in %u of %u samples\n", THREADS, ROUNDS,
+           stats.high_water / 1024, stats.size / 1024, failures, fragmented, samples);
+
+    // Held blocks were accounted exactly, everything is back in one free block
+    CHECK_EQ(held_bytes, 0);
+    CHECK_EQ(stats.used, 0);
+    CHECK_EQ(stats.blocks, 0);
+    CHECK_EQ(stats.failures, failures);
+    CHECK_EQ(stats.largest_free, stats.size - 8);
+    CHECK(stats.high_water <= stats.size);
+    CHECK(stats.high_water > stats.size / 2);
+
+    // With one thread the usage matches the blocks held at every step
+    void *blocks[8];
+    uint32_t room = 0;
+
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = membudget_alloc(MEM_SNAPSHOT, 1000 * (i + 1) + i);
+        room += BLOCK_ROOM(1000 * (i + 1) + i);
+        membudget_get_stats(MEM_SNAPSHOT, &stats);
+        CHECK(blocks[i] != NULL);
+        CHECK_EQ(stats.used, room);
+    }
+
+    // Freeing every other block leaves holes that cannot merge, the space behind the last one is the largest
+    for (int i = 0; i < 8; i += 2) {
+        membudget_free(MEM_SNAPSHOT, blocks[i]);
+    }
+
+    membudget_get_stats(MEM_SNAPSHOT, &stats);
+    CHECK_EQ(stats.blocks, 4);
+    CHECK_EQ(stats.largest_free, stats.size - room - 8);
+
+    for (int i = 1; i < 8; i += 2) {
+        membudget_free(MEM_SNAPSHOT, blocks[i]);
+    }
+
+    membudget_get_stats(MEM_SNAPSHOT, &stats);
+    CHECK_EQ(stats.largest_free, stats.size - 8);
+
+    // Too large for the whole budget
+    CHECK(membudget_alloc(MEM_SNAPSHOT, stats.size) == NULL);
+    membudget_get_stats(MEM_SNAPSHOT, &stats);
+    CHECK_EQ(stats.failures, failures + 1);
+
+    // Exposed at runtime
+    fake_http_response_t response;
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+
+    char *text = calloc(1, response.len + 1);
+
+    memcpy(text, response.body, response.len);
+    CHECK(strstr(text, "esp32cam_mem_high_water_bytes{arena=\"snapshot\"}") != NULL);
+    CHECK(strstr(text, "esp32cam_mem_fragmentation_ratio{arena=\"snapshot\"} 0.000") != NULL);
+    free(text);
+    fake_http_response_free(&response);
+
+    return test_done("membudget");
+}
@@ -0,0 +1,172 @@
+/*
+ * test_metrics.c
+ *
+ *  Checks the bucket bounds and sums of the stage histograms, counters
+ *  recorded from several threads at once, the chunked writer with a
+ *  failing sink and the /metrics output after a few images were sent.
+ *  Prints what a recording costs on the host, which is no measure of
+ *  the ESP32 but catches a lock or an allocation sneaking in. The
+ *  requests are made up by the test.
+ */
+
+#include "test.h"
+#include "metrics.h"
+#include <pthread.h>
+
+#define THREADS 4
+#define RECORDS 100000
+#define IMAGES 5
+
+// Text handed to the sink, the sink fails after fail_after calls if that is set
+static char sink_text[65536];
+static size_t sink_len;
+static int sink_calls;
+static int sink_fail_after;
+
+static int sink(void *ctx, const char *data, size_t len) {
+    sink_calls++;
+
+    if (sink_fail_after > 0 && sink_calls > sink_fail_after) {
+        return -1;
+    }
+
+    CHECK(len <= METRICS_WRITER_BUF);
+    CHECK(sink_len + len < sizeof(sink_text));
+
+    if (sink_len + len < sizeof(sink_text)) {
+        memcpy(sink_text + sink_len, data, len);
+        sink_len += len;
+        sink_text[sink_len] = 0;
+    }
+
+    return 0;
+}
+
+// Writes all metrics into sink_text, returns the result of the writer
+static int write_all(int fail_after) {
+    metrics_writer_t writer;
+
+    sink_len = 0;
+    sink_calls = 0;
+    sink_fail_after = fail_after;
+    sink_text[0] = 0;
+    metrics_writer_init(&writer, sink, NULL);
+    metrics_write_all(&writer);
+    return metrics_writer_finish(&writer);
+}
+
+// Value of the sample with this name and labels in a text, -1 if it is missing
+static double sample(const char *text, const char *name) {
+    size_t name_len = strlen(name);
+
+    for (const char *line = text; line != NULL && *line != 0; line = strchr(line, '\n')) {
+        line += *line == '\n';
+
+        if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ') {
+            return atof(line + name_len + 1);
+        }
+    }
+
+    return -1;
+}
+
+static void *record_thread(void *arg) {
+    for (int i = 0; i < RECORDS; i++) {
+        metrics_record(METRIC_MOTION, 3);
+        metrics_count(METRIC_MCAST_BYTES, 2);
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    // Bucket i holds durations below 2^i us, its bound reads 2^i - 1 us
+    metrics_record(METRIC_PUSH, 0);
+    metrics_record(METRIC_PUSH, 1);
+    metrics_record(METRIC_PUSH, 2);
+    metrics_record(METRIC_PUSH, 3);
+    metrics_record(METRIC_PUSH, 1000);
+    metrics_record(METRIC_PUSH, UINT32_MAX);
+
+    CHECK_EQ(write_all(0), 0);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_bucket{stage=\"push\",le=\"0.000000\"}"), 1);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_bucket{stage=\"push\",le=\"0.000001\"}"), 2);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_bucket{stage=\"push\",le=\"0.000003\"}"), 4);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_bucket{stage=\"push\",le=\"0.000511\"}"), 4);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_bucket{stage=\"push\",le=\"0.001023\"}"), 5);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_bucket{stage=\"push\",le=\"+Inf\"}"), 6);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_count{stage=\"push\"}"), 6);
+    CHECK(sample(sink_text, "esp32cam_stage_seconds_sum{stage=\"push\"}") > 4294.9);
+
+    // Every stage and counter is in the output, in pieces no longer than the buffer
+    CHECK(sink_calls > 1);
+    CHECK(sample(sink_text, "esp32cam_stage_seconds_count{stage=\"mcast_rtt\"}") == 0);
+    CHECK(sample(sink_text, "esp32cam_snapshot_failures_total") == 0);
+
+    // A failing sink is not called again and fails the writer
+    CHECK(write_all(1) != 0);
+    CHECK_EQ(sink_calls, 2);
+
+    // Threads recording at once lose nothing, the sum belongs to the count
+    pthread_t threads[THREADS];
+    int64_t start = esp_timer_get_time();
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, record_thread, NULL);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    printf("%d recordings and counts from %d threads, %.1fns each\n", THREADS * RECORDS, THREADS,
+           elapsed * 1000.0 / (THREADS * RECORDS));
+    CHECK_EQ(write_all(0), 0);
+    CHECK_EQ(sample(sink_text, "esp32cam_stage_seconds_count{stage=\"motion\"}"), THREADS * RECORDS);
+    CHECK(sample(sink_text, "esp32cam_stage_seconds_sum{stage=\"motion\"}") > THREADS * RECORDS * 3e-6 - 1e-6);
+    CHECK_EQ(sample(sink_text, "esp32cam_mcast_bytes_total"), THREADS * RECORDS * 2);
+
+    // Through the server: images sent are counted with their bytes
+    fake_http_response_t response;
+    size_t bytes = 0;
+
+    test_boot();
+
+    for (int i = 0; i < IMAGES; i++) {
+        CHECK_EQ(fake_httpd_get(80, "/jpg", NULL, &response), ESP_OK);
+        bytes += response.len;
+        fake_http_response_free(&response);
+    }
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    CHECK(strncmp(response.type, "text/plain", 10) == 0);
+    CHECK(response.chunks > 1);
+
+    char *text = calloc(1, response.len + 1);
+
+    memcpy(text, response.body, response.len);
+    printf("/metrics: %zuB in %d chunks, %.1fms\n", response.len, response.chunks, response.duration_us / 1e3);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(sample(text, "esp32cam_stage_seconds_count{stage=\"capture\"}"), IMAGES);
+    CHECK_EQ(sample(text, "esp32cam_stage_seconds_count{stage=\"send\"}"), IMAGES);
+    CHECK_EQ(sample(text, "esp32cam_send_bytes_total"), bytes);
+    CHECK_EQ(sample(text, "esp32cam_send_failures_total"), 0);
+    CHECK(sample(text, "esp32cam_mcast_linked") >= 0);
+
+    // Every line is a comment or a sample with a value
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char *value = strrchr(line, ' ');
+
+        if (line[0] != '#' && (value == NULL || value[1] == 0 || strchr("0123456789+-", value[1]) == NULL)) {
+            fprintf(stderr, "not a sample: %s\n", line);
+            test_failures++;
+        }
+    }
+
+    free(text);
+    return test_done("metrics");
+}
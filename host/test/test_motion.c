@@ -0,0 +1,273 @@
+/*
+ * test_motion.c
+ *
+ *  Built without the capture pipeline, so no task analyzes frames
+ *  behind the test's back. Checks /jpg?since= against scene changes of
+ *  the fake camera, then runs the change detection over a generated
+ *  shelf sequence with sensor noise, flicker, single-frame glints and
+ *  objects placed and taken away, and prints the false positive and
+ *  false negative rates and the analysis time per frame. The rates are
+ *  checked for a steady light and only reported under flicker, where
+ *  uniform brightness changes count against the threshold. No recorded
+ *  frames are involved: the sequence is synthetic, and the fake decoder
+ *  samples a pixel per block at 1/8 scale where the real one averages
+ *  the block, so noise weighs more here than on the device.
+ */
+
+#include "test.h"
+#include "motion.h"
+#include <img_converters.h>
+
+#define WIDTH 640
+#define HEIGHT 480
+#define FRAMES 1500
+// Changed pixels of an object that has to be detected, an 80x80 box
+#define VISIBLE_PIXELS 6400
+
+static uint8_t base[WIDTH * HEIGHT];
+// Frame without noise, flicker and glint, and the one before it
+static uint8_t clean[WIDTH * HEIGHT];
+static uint8_t previous[WIDTH * HEIGHT];
+static uint8_t pixels[WIDTH * HEIGHT * 3];
+static uint8_t jpeg[FAKE_JPEG_HEADER_LEN + 2 + sizeof(pixels)];
+static size_t jpeg_len;
+
+// Objects on the shelf, in the order they were placed
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    uint8_t luma;
+} box_t;
+
+static box_t boxes[16];
+static int box_count;
+static uint32_t rng = 16;
+
+static uint32_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static int random_range(int lo, int hi) {
+    return lo + next_random() % (hi - lo + 1);
+}
+
+static size_t collect(void *arg, size_t index, const void *data, size_t len) {
+    memcpy(jpeg + index, data, len);
+    jpeg_len = index + len;
+    return len;
+}
+
+// Shelves with products of different brightness
+static void make_shelf(void) {
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            int shelf = y % 120 < 8;
+            int product = (x / 53 * 7 + y / 120 * 3) % 5;
+
+            base[y * WIDTH + x] = shelf ? 40 : 90 + product * 25;
+        }
+    }
+}
+
+static void draw(uint8_t *luma, const box_t *box) {
+    for (int y = box->y; y < box->y + box->h && y < HEIGHT; y++) {
+        for (int x = box->x; x < box->x + box->w && x < WIDTH; x++) {
+            luma[y * WIDTH + x] = box->luma;
+        }
+    }
+}
+
+// Outcome of a generated sequence
+typedef struct {
+    int noise;              // pixel noise amplitude
+    int flicker;            // uniform brightness change amplitude of a frame
+    int events;             // objects placed or taken away
+    int missed;
+    int hidden;             // objects mostly hidden behind another one
+    int glints;
+    int quiet;              // frames without a change
+    int false_alarms;
+} sequence_t;
+
+// Renders the shelf with its objects and a glint, adds flicker and noise, encodes it
+static void render(const sequence_t *sequence, const box_t *glint) {
+    static uint8_t luma[WIDTH * HEIGHT];
+    int flicker = random_range(-sequence->flicker, sequence->flicker);
+
+    memcpy(previous, clean, sizeof(clean));
+    memcpy(clean, base, sizeof(clean));
+
+    for (int i = 0; i < box_count; i++) {
+        draw(clean, &boxes[i]);
+    }
+
+    memcpy(luma, clean, sizeof(luma));
+
+    if (glint != NULL) {
+        draw(luma, glint);
+    }
+
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        int noise = (int) (next_random() % (sequence->noise + 1)) - (int) (next_random() % (sequence->noise + 1));
+        int value = luma[i] + flicker + noise;
+        uint8_t clamped = value < 0 ? 0 : value > 255 ? 255 : value;
+
+        pixels[i * 3] = pixels[i * 3 + 1] = pixels[i * 3 + 2] = clamped;
+    }
+
+    fmt2jpg_cb(pixels, sizeof(pixels), WIDTH, HEIGHT, PIXFORMAT_RGB888, 80, collect, NULL);
+}
+
+// Pixels an object placed or taken away changed, an object may hide behind one of the same colour
+static int changed_pixels(void) {
+    int changed = 0;
+
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        changed += clean[i] != previous[i];
+    }
+
+    return changed;
+}
+
+// Analyzes the rendered frame, returns whether the scene version went up
+static int analyze(uint32_t seq, int64_t *elapsed) {
+    camera_fb_t fb = {
+            .buf = jpeg,
+            .len = jpeg_len,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .format = PIXFORMAT_JPEG,
+    };
+    capture_frame_t frame = { .fb = &fb, .seq = seq };
+    uint32_t before = motion_get_version();
+    int64_t start = esp_timer_get_time();
+    uint32_t after = motion_analyze(&frame);
+
+    *elapsed += esp_timer_get_time() - start;
+    return after != before;
+}
+
+// Runs the change detection over a generated shelf sequence, the first frame becomes the reference
+static void run_sequence(sequence_t *sequence, uint32_t seq) {
+    int64_t elapsed = 0;
+
+    box_count = 0;
+    render(sequence, NULL);
+    analyze(seq++, &elapsed);
+
+    for (int n = 0; n < FRAMES; n++) {
+        int event = 0;
+        box_t glint;
+        int kind = next_random() % 25;
+
+        if (kind == 0 && box_count < 16) {
+            // An object is placed
+            boxes[box_count++] = (box_t) {
+                    .x = random_range(0, WIDTH - 80), .y = random_range(0, HEIGHT - 80),
+                    .w = random_range(80, 200), .h = random_range(80, 160),
+                    .luma = next_random() % 2 ? 10 : 250,
+            };
+            event = 1;
+        } else if (kind == 1 && box_count > 0) {
+            // The newest one is taken away
+            box_count--;
+            event = 1;
+        } else if (kind == 2) {
+            // A reflection smaller than a cell for one frame
+            glint = (box_t) {
+                    .x = random_range(0, WIDTH - 16), .y = random_range(0, HEIGHT - 16),
+                    .w = random_range(4, 16), .h = random_range(4, 16), .luma = 255,
+            };
+            sequence->glints++;
+        }
+
+        render(sequence, kind == 2 ? &glint : NULL);
+
+        int changed = analyze(seq++, &elapsed);
+        int visible = event ? changed_pixels() : 0;
+
+        if (visible >= VISIBLE_PIXELS) {
+            sequence->events++;
+            sequence->missed += !changed;
+        } else if (visible > 0) {
+            // Mostly hidden, detecting it or not is both fine
+            sequence->hidden++;
+        } else {
+            sequence->quiet++;
+            sequence->false_alarms += changed;
+        }
+    }
+
+    printf("noise %d, flicker %d: %d frames, %d changes, %d hidden, %d glints: %d missed (%.1f%%), "
+           "%d false alarms (%.2f%%), %.2fms per frame\n", sequence->noise, sequence->flicker, FRAMES,
+           sequence->events, sequence->hidden, sequence->glints, sequence->missed,
+           100.0 * sequence->missed / sequence->events, sequence->false_alarms,
+           100.0 * sequence->false_alarms / sequence->quiet, elapsed / 1e3 / (FRAMES + 1));
+}
+
+int main(void) {
+    fake_http_response_t response;
+    char uri[48];
+
+    // Through the server, each request with "since" captures and analyzes its own frame
+    test_boot();
+    fake_camera_set_scene(1);
+    CHECK_EQ(fake_httpd_get(80, "/jpg?since=0", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+
+    const char *header = fake_http_header(&response, "X-Scene-Version");
+    uint32_t version = header != NULL ? strtoul(header, NULL, 10) : 0;
+
+    CHECK(header != NULL);
+    fake_http_response_free(&response);
+
+    snprintf(uri, sizeof(uri), "/jpg?since=%u", version);
+    CHECK_EQ(fake_httpd_get(80, uri, NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 204);
+    CHECK_EQ(response.len, 0);
+    fake_http_response_free(&response);
+
+    // A frame captured after the scene changed
+    fake_camera_set_scene(2);
+    CHECK_EQ(fake_httpd_get(80, uri, "Cache-Control: no-cache\r\n", &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    header = fake_http_header(&response, "X-Scene-Version");
+    CHECK(header != NULL && strtoul(header, NULL, 10) == version + 1);
+    CHECK(response.len > 0);
+    fake_http_response_free(&response);
+
+    make_shelf();
+
+    // Sensor noise and flicker of a steady light
+    sequence_t calm = { .noise = 4, .flicker = 3 };
+
+    run_sequence(&calm, 1000);
+    CHECK(calm.events > 50);
+    CHECK(calm.glints > 20);
+    CHECK_EQ(calm.missed, 0);
+    CHECK(calm.false_alarms <= calm.quiet / 100);
+
+    // Under flickering light uniform brightness changes add to the noise, only reported
+    sequence_t flickering = { .noise = 8, .flicker = 6 };
+
+    run_sequence(&flickering, 10000);
+
+    // A frame analyzed twice counts once
+    motion_stats_t stats;
+    int64_t elapsed = 0;
+
+    motion_get_stats(&stats);
+
+    uint32_t frames_before = stats.frames;
+
+    analyze(10000 + FRAMES, &elapsed);
+    motion_get_stats(&stats);
+    CHECK_EQ(stats.frames, frames_before);
+
+    return test_done("motion");
+}
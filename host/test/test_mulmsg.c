@@ -0,0 +1,223 @@
+/*
+ * test_mulmsg.c
+ *
+ *  Round trips of the v2 multicast records, the legacy view of a v2
+ *  datagram, full buffers and truncated or random datagrams. Counts the
+ *  heap allocations of the whole process while messages are built and
+ *  read and while the station answers a burst of discovery requests,
+ *  none may happen. The datagrams are made up by the test, not captured
+ *  from a controller.
+ */
+
+#include "test.h"
+#include "mulmsg.h"
+#include "mulmsg2.h"
+#include <arpa/inet.h>
+
+#define ROUNDS 10000
+#define REQUESTS 200
+
+// glibc's allocator, the test replaces the public entry points to count calls
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile int allocations;
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+// Builds an announcement with every record type and reads it back
+static void round_trip(unsigned int id, unsigned long long clock) {
+    char buffer[MULMSG2_MAX_LEN];
+    mulmsg2 message;
+    mulmsg2 parsed;
+    unsigned char ip[4] = { 10, 0, 0, id & 0xff };
+    unsigned char profile[2] = { id % 11, 4 + id % 60 };
+    uint32_t seq = 0xFFFFFF00U + id;
+    unsigned char type;
+    unsigned char len;
+    const unsigned char *value;
+
+    CHECK_EQ(mulmsg2_init(&message, buffer, sizeof(buffer)), 0);
+    mulmsg_setSource(mulmsg2_header(&message), 0);
+    mulmsg_setAlive(mulmsg2_header(&message), 1);
+    mulmsg_setDeviceId(mulmsg2_header(&message), id);
+
+    CHECK_EQ(mulmsg2_put(&message, MULMSG2_IPV4, ip, 4), 0);
+    CHECK_EQ(mulmsg2_putU16(&message, MULMSG2_HTTP_PORT, 80 + id), 0);
+    CHECK_EQ(mulmsg2_put(&message, MULMSG2_PROFILE, profile, 2), 0);
+    CHECK_EQ(mulmsg2_putU32(&message, MULMSG2_FRAME_SEQ, seq), 0);
+    CHECK_EQ(mulmsg2_putU64(&message, MULMSG2_CLOCK, clock), 0);
+
+    int length = mulmsg2_length(&message);
+
+    // Legacy receivers read the first two bytes only
+    CHECK(mulmsg2_isV2(buffer, length));
+    CHECK(!mulmsg2_isV2(buffer, MULMSG_LEN));
+    mulmsg *legacy = mulmsg_wrap(buffer, MULMSG_LEN);
+    CHECK_EQ(mulmsg_getSource(legacy), 0);
+    CHECK(mulmsg_getAlive(legacy) != 0);
+    CHECK_EQ(mulmsg_getDeviceId(legacy), id);
+
+    CHECK_EQ(mulmsg2_parse(&parsed, buffer, length), 0);
+    int records = 0;
+
+    while (mulmsg2_next(&parsed, &type, &value, &len)) {
+        records++;
+
+        switch (type) {
+            case MULMSG2_IPV4:
+                CHECK_EQ(len, 4);
+                CHECK(memcmp(value, ip, 4) == 0);
+                break;
+            case MULMSG2_HTTP_PORT:
+                CHECK_EQ(len, 2);
+                CHECK_EQ(mulmsg2_getU16(value), 80 + id);
+                break;
+            case MULMSG2_PROFILE:
+                CHECK_EQ(len, 2);
+                CHECK(memcmp(value, profile, 2) == 0);
+                break;
+            case MULMSG2_FRAME_SEQ:
+                CHECK_EQ(len, 4);
+                CHECK_EQ(mulmsg2_getU32(value), seq);
+                break;
+            case MULMSG2_CLOCK:
+                CHECK_EQ(len, 8);
+                CHECK(mulmsg2_getU64(value) == clock);
+                break;
+            default:
+                CHECK(0);
+                break;
+        }
+    }
+
+    CHECK_EQ(records, 5);
+
+    // Read again from the start
+    mulmsg2_rewind(&parsed);
+    CHECK(mulmsg2_next(&parsed, &type, &value, &len));
+    CHECK_EQ(type, MULMSG2_IPV4);
+}
+
+// Answers to "Are You There?" from the controller, returns the datagrams received
+static int discovery_burst(int requests) {
+    char request[MULMSG_LEN] = {0};
+    char reply[MULMSG2_MAX_LEN];
+    struct sockaddr_in controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = htonl(0x0a000001),
+    };
+    struct sockaddr_in to;
+    mulmsg *msg = mulmsg_wrap(request, MULMSG_LEN);
+    int received = 0;
+
+    mulmsg_setSource(msg, 1);
+    mulmsg_setAlive(msg, 0);
+    mulmsg_setDeviceId(msg, 1);
+
+    for (int i = 0; i < requests; i++) {
+        fake_net_inject(CONFIG_MULTICAST_PORT, &controller, request, sizeof(request), 1000);
+
+        // "Here I Am!" and the announcement
+        while (fake_net_receive(CONFIG_MULTICAST_PORT, &to, reply, sizeof(reply), 20) >= 0) {
+            received++;
+        }
+    }
+
+    return received;
+}
+
+int main(void) {
+    char buffer[MULMSG2_MAX_LEN];
+    char small[17];
+    mulmsg2 message;
+    unsigned char type;
+    unsigned char len;
+    const unsigned char *value;
+
+    round_trip(DEVICEID_MAX, 0x0123456789ABCDEFULL);
+
+    // A full buffer refuses records and stays intact
+    CHECK_EQ(mulmsg2_init(&message, small, sizeof(small)), 0);
+    CHECK_EQ(mulmsg2_putU64(&message, MULMSG2_CLOCK, 1), 0);
+    CHECK_EQ(mulmsg2_putU32(&message, MULMSG2_FRAME_SEQ, 2), -1);
+    CHECK_EQ(mulmsg2_length(&message), MULMSG2_HEADER_LEN + 10);
+    CHECK_EQ(mulmsg2_putU16(&message, MULMSG2_HTTP_PORT, 3), 0);
+    CHECK_EQ(mulmsg2_length(&message), 17);
+    CHECK_EQ(mulmsg2_init(&message, small, 2), -1);
+
+    // Legacy messages are no v2 messages
+    CHECK(!mulmsg2_isV2("\x40\x02", 2));
+    CHECK(mulmsg2_parse(&message, "\x40\x02\x02", 3) != 0);
+
+    // A truncated record ends the message
+    CHECK_EQ(mulmsg2_init(&message, buffer, sizeof(buffer)), 0);
+    mulmsg2_putU32(&message, MULMSG2_FRAME_SEQ, 7);
+    mulmsg2_putU64(&message, MULMSG2_CLOCK, 8);
+    CHECK_EQ(mulmsg2_parse(&message, buffer, MULMSG2_HEADER_LEN + 6 + 9), 0);
+    CHECK(mulmsg2_next(&message, &type, &value, &len));
+    CHECK_EQ(type, MULMSG2_FRAME_SEQ);
+    CHECK(!mulmsg2_next(&message, &type, &value, &len));
+
+    // Random datagrams: records never reach past the datagram
+    srand(8);
+
+    for (int n = 0; n < ROUNDS; n++) {
+        int length = rand() % (int) sizeof(buffer);
+
+        for (int i = 0; i < length; i++) {
+            buffer[i] = rand() % 4 == 0 ? 2 : rand();
+        }
+
+        if (length >= MULMSG2_HEADER_LEN && rand() % 2) {
+            buffer[0] |= MULMSG2_MARKER;
+            buffer[2] = MULMSG2_VERSION;
+        }
+
+        if (mulmsg2_parse(&message, buffer, length) == 0) {
+            while (mulmsg2_next(&message, &type, &value, &len)) {
+                CHECK(value >= (unsigned char *) buffer + MULMSG2_HEADER_LEN + 2);
+                CHECK(value + len <= (unsigned char *) buffer + length);
+            }
+        }
+    }
+
+    // No allocation while building and reading messages
+    int before = allocations;
+
+    for (int n = 0; n < ROUNDS; n++) {
+        round_trip(n & DEVICEID_MAX, (unsigned long long) n << 20);
+    }
+
+    CHECK_EQ(allocations - before, 0);
+
+    // Nor while the station answers discovery, once it runs
+    test_boot();
+    discovery_burst(5);
+    test_sleep_ms(100);
+
+    before = allocations;
+    int received = discovery_burst(REQUESTS);
+    int during = allocations - before;
+
+    printf("%d requests answered with %d datagrams, %d allocations\n", REQUESTS, received, during);
+    CHECK(received >= REQUESTS * 2);
+    CHECK_EQ(during, 0);
+
+    return test_done("mulmsg");
+}
@@ -0,0 +1,114 @@
+/*
+ * test_profile.c
+ *
+ *  Checks that /jpg?size=&q= gets frames of the requested profile by
+ *  writing the sensor settings without restarting the driver, that
+ *  repeating a profile writes nothing and that clients alternating
+ *  profiles each get theirs. Prints the time of a switch and of a
+ *  request with the active profile. The switch latency is that of the
+ *  fake camera, whose settings reach the frames after those queued.
+ */
+
+#include "test.h"
+#include <esp_camera.h>
+
+// Fetches /jpg with a query and reads the frame, returns the handler time in us or -1
+static int64_t get_jpg(const char *uri, fake_jpeg_info_t *info) {
+    fake_http_response_t response;
+    int64_t duration = -1;
+
+    if (fake_httpd_get(80, uri, NULL, &response) == ESP_OK && fake_http_status(&response) == 200
+            && fake_jpeg_parse(response.body, response.len, info) == 0) {
+        duration = response.duration_us;
+    }
+
+    fake_http_response_free(&response);
+    return duration;
+}
+
+int main(void) {
+    fake_jpeg_info_t info;
+    fake_http_response_t response;
+
+    test_boot();
+    test_sleep_ms(200);
+
+    // A switch writes the sensor and waits for the first frame captured with the new settings
+    uint32_t frames = fake_camera_frames();
+    int64_t switch_us = get_jpg("/jpg?size=vga&q=20", &info);
+
+    CHECK(switch_us >= 0);
+    CHECK_EQ(info.width, 640);
+    CHECK_EQ(info.height, 480);
+    CHECK_EQ(info.quality, 20);
+    CHECK_EQ(info.framesize, FRAMESIZE_VGA);
+    CHECK(fake_camera_frames() > frames);
+
+    // The same profile again is cached, the sensor is not touched
+    uint32_t writes = fake_camera_sensor_writes();
+    int64_t cached_us = 0;
+
+    for (int i = 0; i < 5; i++) {
+        int64_t duration = get_jpg("/jpg?size=vga&q=20", &info);
+
+        CHECK(duration >= 0);
+        CHECK_EQ(info.width, 640);
+        CHECK_EQ(info.quality, 20);
+        cached_us += duration;
+        test_sleep_ms(50);
+    }
+
+    cached_us /= 5;
+    CHECK_EQ(fake_camera_sensor_writes(), writes);
+    printf("profile switch %lldus, cached profile %lldus\n", (long long) switch_us, (long long) cached_us);
+#ifdef CONFIG_CAPTURE_PIPELINE
+    CHECK(cached_us < switch_us);
+#endif
+
+    // Only the quality differs, only the quality is written
+    CHECK(get_jpg("/jpg?size=vga&q=30", &info) >= 0);
+    CHECK_EQ(info.width, 640);
+    CHECK_EQ(info.quality, 30);
+    CHECK_EQ(fake_camera_sensor_writes(), writes + 1);
+
+    // Clients alternating profiles each get their own
+    static const struct {
+        const char *uri;
+        uint16_t width;
+        uint8_t quality;
+    } profiles[] = {
+            { "/jpg?size=qvga&q=10", 320, 10 },
+            { "/jpg", 1600, 12 },
+            { "/jpg?q=40", 1600, 40 },
+            { "/jpg?size=svga", 800, 12 },
+    };
+
+    for (int i = 0; i < 8; i++) {
+        int p = i % 4;
+        int64_t duration = get_jpg(profiles[p].uri, &info);
+
+        CHECK(duration >= 0);
+        CHECK_EQ(info.width, profiles[p].width);
+        CHECK_EQ(info.quality, profiles[p].quality);
+        printf("%-22s %lldus\n", profiles[p].uri, (long long) duration);
+    }
+
+    // Sizes above the boot frame size do not fit into the frame buffers, q is limited to 4..63
+    static const char *const invalid[] = { "/jpg?size=qxga", "/jpg?q=64", "/jpg?q=2", "/jpg?size=huge" };
+
+    writes = fake_camera_sensor_writes();
+
+    for (int i = 0; i < 4; i++) {
+        fake_httpd_get(80, invalid[i], NULL, &response);
+        CHECK_EQ(fake_http_status(&response), 400);
+        fake_http_response_free(&response);
+    }
+
+    CHECK_EQ(fake_camera_sensor_writes(), writes);
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    return test_done("profile");
+#else
+    return test_done("profile_on_demand");
+#endif
+}
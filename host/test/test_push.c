@@ -0,0 +1,242 @@
+/*
+ * test_push.c
+ *
+ *  Plays the collector of push mode on a loopback TCP socket and
+ *  decodes what the station sends with the Linux reference decoder of
+ *  host/tools. Every frame has to carry CONFIG_DEVICE_ID, a JPEG of
+ *  the camera and a sequence number above the one before. A collector
+ *  that reads everything gets CONFIG_PUSH_FPS without drops, one that
+ *  reads slower than the frames come makes the queue fill up and drop
+ *  its oldest frames, and the counters have to account for every
+ *  frame queued. After the collector closed the connection the
+ *  station reconnects and starts with a frame captured after that,
+ *  nothing queued for the lost connection goes out. Prints frames per
+ *  second, throughput and queue depth of each collector. Frames are
+ *  synthetic and timed by the fake camera, the link is the host's
+ *  loopback, so throughput only shows the station side is no limit.
+ */
+
+#include "test.h"
+#include "frame.h"
+#include "frame_decode.h"
+#include "push.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#define JPEG_LEN 100000
+#define RUN_MS 3000
+#define BUF_LEN (4 * JPEG_LEN)
+// A slow collector takes SLOW_READ bytes every SLOW_PAUSE_MS, fewer than the frames bring
+#define SLOW_READ 16384
+#define SLOW_PAUSE_MS 100
+
+// Frames received by the collector
+typedef struct {
+    int fd;
+    uint8_t buf[BUF_LEN];
+    size_t len;
+    int frames;
+    uint32_t last_seq;
+    int64_t first_timestamp;    // capture time of the first frame of the connection
+    int64_t first_us;
+    int64_t last_us;
+    uint64_t bytes;
+    int closed;
+} collector_t;
+
+// Listens on the collector port of the push variant
+static int collector_listen(void) {
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_PUSH_COLLECTOR_PORT),
+            .sin_addr.s_addr = inet_addr(CONFIG_PUSH_COLLECTOR_ADDR),
+    };
+    int on = 1;
+    int rcvbuf = 32768;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    // A small receive window, a collector reading slowly holds the station up soon instead of after megabytes
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Waits up to timeout_ms for the station to connect, returns the connection or -1
+static int collector_accept(int listen_fd, int timeout_ms) {
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+
+    return accept(listen_fd, NULL, NULL);
+}
+
+// Decodes the complete frames at the front of the buffer and checks each
+static void collector_decode(collector_t *c) {
+    frame_info_t info;
+    fake_jpeg_info_t jpeg;
+    long taken;
+
+    while ((taken = frame_decode(c->buf, c->len, &info)) != 0) {
+        if (taken < 0) {
+            fprintf(stderr, "no frame at offset %llu\n", (unsigned long long) c->bytes);
+            test_failures++;
+            c->len = 0;
+            return;
+        }
+
+        CHECK_EQ(info.version, FRAME_VERSION);
+        CHECK_EQ(info.device_id, CONFIG_DEVICE_ID);
+        CHECK_EQ(info.len, JPEG_LEN);
+        CHECK(info.seq > c->last_seq);
+        CHECK_EQ(fake_jpeg_parse(info.jpeg, info.len, &jpeg), 0);
+
+        c->last_seq = info.seq;
+        c->last_us = esp_timer_get_time();
+
+        if (c->frames++ == 0) {
+            c->first_us = c->last_us;
+            c->first_timestamp = info.timestamp;
+        }
+
+        c->bytes += taken;
+        memmove(c->buf, c->buf + taken, c->len - taken);
+        c->len -= taken;
+    }
+}
+
+// Reads for ms, at most chunk bytes every pause_ms or everything if chunk is 0
+static void collector_read(collector_t *c, int ms, size_t chunk, int pause_ms) {
+    int64_t end = esp_timer_get_time() + ms * 1000LL;
+
+    while (!c->closed && esp_timer_get_time() < end) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 50) <= 0) {
+            continue;
+        }
+
+        ssize_t got = read(c->fd, c->buf + c->len, chunk > 0 ? MIN(chunk, BUF_LEN - c->len) : BUF_LEN - c->len);
+
+        if (got <= 0) {
+            c->closed = 1;
+            break;
+        }
+
+        c->len += got;
+        collector_decode(c);
+
+        if (pause_ms > 0) {
+            test_sleep_ms(pause_ms);
+        }
+    }
+}
+
+// Starts counting a new collector on a connection, the sequence numbers carry on from the previous one
+static void collector_start(collector_t *c, int fd) {
+    uint32_t last_seq = c->last_seq;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->last_seq = last_seq;
+}
+
+static double collector_fps(const collector_t *c) {
+    return c->frames < 2 ? 0 : (c->frames - 1) * 1e6 / (c->last_us - c->first_us);
+}
+
+static void print_collector(const char *name, const collector_t *c, const push_stats_t *before,
+                            const push_stats_t *after) {
+    printf("%-16s %3d frames %4.1f fps, %6.0f KB/s, %2u dropped, queue depth %u of %d at most\n", name, c->frames,
+           collector_fps(c), c->bytes / 1024.0 / MAX(1, c->last_us - c->first_us) * 1e6,
+           after->dropped - before->dropped, after->max_depth, CONFIG_PUSH_QUEUE_FRAMES);
+}
+
+// Every frame queued was sent, dropped, is waiting or is the one being sent
+static void check_accounting(const push_stats_t *stats) {
+    uint32_t accounted = stats->sent + stats->dropped + stats->depth;
+
+    CHECK(stats->queued >= accounted && stats->queued <= accounted + 1);
+    CHECK(stats->depth <= CONFIG_PUSH_QUEUE_FRAMES);
+}
+
+int main(void) {
+    static collector_t c;
+    push_stats_t before;
+    push_stats_t after;
+    int listen_fd = collector_listen();
+
+    CHECK(listen_fd >= 0);
+    fake_camera_set_jpeg_len(JPEG_LEN);
+    test_boot();
+
+    // The station connects on its own once it is up
+    collector_start(&c, collector_accept(listen_fd, 5000));
+    CHECK(c.fd >= 0);
+
+    // A collector reading everything gets every frame pushed, none is dropped
+    test_sleep_ms(200);
+    push_get_stats(&before);
+    collector_read(&c, RUN_MS, 0, 0);
+    push_get_stats(&after);
+    print_collector("fast collector", &c, &before, &after);
+    CHECK(after.connected);
+    CHECK_EQ(after.connects, 1);
+    CHECK(collector_fps(&c) > CONFIG_PUSH_FPS * 0.9 && collector_fps(&c) < CONFIG_PUSH_FPS * 1.1);
+    CHECK_EQ(after.dropped - before.dropped, 0);
+    CHECK(after.max_depth <= 2);
+    check_accounting(&after);
+
+    // A slow collector fills the queue, the oldest frames give way and the sequence numbers still only grow
+    int frames = c.frames;
+
+    collector_start(&c, c.fd);
+    push_get_stats(&before);
+    collector_read(&c, 2 * RUN_MS, SLOW_READ, SLOW_PAUSE_MS);
+    push_get_stats(&after);
+    print_collector("slow collector", &c, &before, &after);
+    CHECK(frames > 0 && c.frames > 0);
+    CHECK(!c.closed);
+    CHECK(collector_fps(&c) < SLOW_READ * 1e3 / SLOW_PAUSE_MS / JPEG_LEN + 0.5);
+    CHECK(after.dropped - before.dropped > 0);
+    CHECK_EQ(after.max_depth, CONFIG_PUSH_QUEUE_FRAMES);
+    // Pushed at CONFIG_PUSH_FPS meanwhile, sent or dropped
+    CHECK(after.queued - before.queued >= (2 * RUN_MS / 1000) * CONFIG_PUSH_FPS * 8 / 10);
+    check_accounting(&after);
+
+    // The collector goes away with frames queued, the station reconnects with none of them
+    close(c.fd);
+    int64_t closed_us = esp_timer_get_time();
+    collector_start(&c, collector_accept(listen_fd, CONFIG_PUSH_RETRY_MS + 5000));
+    int64_t accepted_us = esp_timer_get_time();
+
+    CHECK(c.fd >= 0);
+    push_get_stats(&before);
+    collector_read(&c, RUN_MS, 0, 0);
+    push_get_stats(&after);
+    print_collector("reconnected", &c, &before, &after);
+    printf("%-16s after %lld ms, first frame captured %+lld ms from the connection\n", "",
+           (long long) (accepted_us - closed_us) / 1000, (long long) (c.first_timestamp - accepted_us) / 1000);
+    CHECK(accepted_us - closed_us >= CONFIG_PUSH_RETRY_MS * 1000LL * 9 / 10);
+    CHECK(c.frames > 0);
+    // Frames queued for the lost connection were captured before it went away, the retry pause ago
+    CHECK(c.first_timestamp > closed_us);
+    CHECK(c.first_timestamp > accepted_us - 200000);
+    CHECK_EQ(after.connects, 2);
+    CHECK(collector_fps(&c) > CONFIG_PUSH_FPS * 0.9);
+    CHECK_EQ(after.dropped - before.dropped, 0);
+    check_accounting(&after);
+
+    close(c.fd);
+    close(listen_fd);
+    return test_done("push");
+}
@@ -0,0 +1,261 @@
+/*
+ * test_ratectl.c
+ *
+ *  Built with rate control and frame size steps. Feeds the controller
+ *  frame size traces of a steady scene, a scene that gets busy and calm
+ *  again, two with frame to frame noise of 10% and 25% and one drifting
+ *  with the daylight, with each frame captured two frames after its
+ *  profile was chosen like from the driver's buffers. Prints how many
+ *  frames it takes to get within the budget and stay there, the profile
+ *  changes per 100 frames after that and how often and how far frames
+ *  go over the budget. Swings of 25% and the drift are only reported,
+ *  they keep moving the averages past the hysteresis. Then polls /jpg
+ *  until the frames fit. No recorded traces are involved: the traces
+ *  are generated, and frame sizes follow the fake camera's model of
+ *  pixels over quality, scaled by the scene.
+ */
+
+#include "test.h"
+#include "ratectl.h"
+#include <math.h>
+
+#define FRAMES 1200
+#define INTERVAL_US 50000
+#define LAG 2
+#define BUDGET (CONFIG_RATE_TARGET_KB * 1024.0)
+
+// Generated scene complexity, scales the frame size
+typedef struct {
+    const char *name;
+    double (*complexity)(int frame);
+    int window;             // frames averaged to decide whether the budget is met
+    int segments[2];        // frames where the scene changes, 0 if it does not
+} trace_t;
+
+// Outcome of a trace
+typedef struct {
+    int settle[3];          // frames until the average stayed within the budget, per segment, -1 if never
+    int changes;            // profile changes after the first segment settled
+    int late_changes;       // profile changes in the second half
+    int checked;            // frames after the first segment settled
+    int over;               // of those, frames over the budget
+    double worst;           // largest frame over the budget, relative to it
+    double mean;            // mean frame size after the first segment settled, relative to the budget
+} outcome_t;
+
+static uint32_t rng = 24;
+
+static double uniform(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return (rng & 0xFFFFFF) / (double) 0xFFFFFF;
+}
+
+static double steady(int frame) {
+    return 1.0;
+}
+
+// A quiet aisle, people walking through, quiet again
+static double busy(int frame) {
+    return frame >= 400 && frame < 800 ? 1.5 : 0.7;
+}
+
+// Frame sizes of a still scene vary with sensor noise
+static double noisy(int frame) {
+    return 1.0 + 0.1 * (2 * uniform() - 1);
+}
+
+// Flickering light or moving leaves
+static double restless(int frame) {
+    return 1.0 + 0.25 * (2 * uniform() - 1);
+}
+
+static double daylight(int frame) {
+    return 1.0 + 0.5 * sin(2 * M_PI * frame / 600);
+}
+
+// Bytes of a frame like the fake camera derives them, scaled by the scene
+static double frame_bytes(const capture_profile_t *profile, double complexity) {
+    static const struct {
+        framesize_t framesize;
+        int pixels;
+    } sizes[] = {
+            { FRAMESIZE_QVGA, 320 * 240 }, { FRAMESIZE_CIF, 400 * 296 }, { FRAMESIZE_VGA, 640 * 480 },
+            { FRAMESIZE_SVGA, 800 * 600 }, { FRAMESIZE_XGA, 1024 * 768 }, { FRAMESIZE_SXGA, 1280 * 1024 },
+            { FRAMESIZE_UXGA, 1600 * 1200 },
+    };
+    int pixels = 0;
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        pixels = sizes[i].framesize == profile->framesize ? sizes[i].pixels : pixels;
+    }
+
+    return pixels * 2.0 / (profile->quality + 12) * complexity;
+}
+
+// Runs a trace from UXGA at quality 12
+static void run_trace(const trace_t *trace, outcome_t *outcome) {
+    static double lens[FRAMES];
+    static int changed[FRAMES];
+    capture_profile_t start = { .framesize = FRAMESIZE_UXGA, .quality = 12 };
+    capture_profile_t chosen[LAG + 1];
+    ratectl_t rate;
+    int64_t now = 0;
+
+    ratectl_init(&rate, &start);
+
+    for (int i = 0; i <= LAG; i++) {
+        chosen[i] = rate.profile;
+    }
+
+    // The frame was captured with the profile chosen LAG frames earlier
+    for (int frame = 0; frame < FRAMES; frame++) {
+        capture_profile_t *profile = &chosen[frame % (LAG + 1)];
+
+        now += INTERVAL_US;
+        lens[frame] = frame_bytes(profile, trace->complexity(frame));
+        changed[frame] = ratectl_observe(&rate, profile, (size_t) lens[frame], 20000, now);
+        chosen[frame % (LAG + 1)] = rate.profile;
+    }
+
+    // Settled from the first frame whose window average stays within the budget to the end of the segment
+    memset(outcome, 0, sizeof(outcome_t));
+
+    for (int segment = 0; segment < 3; segment++) {
+        int begin = segment == 0 ? 0 : trace->segments[segment - 1];
+        int end = segment < 2 && trace->segments[segment] != 0 ? trace->segments[segment] : FRAMES;
+
+        outcome->settle[segment] = -1;
+
+        if (segment > 0 && begin == 0) {
+            break;
+        }
+
+        for (int frame = end - trace->window; frame >= begin; frame--) {
+            double sum = 0;
+
+            for (int i = frame; i < frame + trace->window; i++) {
+                sum += lens[i];
+            }
+
+            if (sum / trace->window > BUDGET) {
+                break;
+            }
+
+            outcome->settle[segment] = frame - begin;
+        }
+    }
+
+    int settled = outcome->settle[0] < 0 ? 0 : outcome->settle[0];
+    double sum = 0;
+
+    for (int frame = settled; frame < FRAMES; frame++) {
+        outcome->changes += changed[frame];
+        outcome->late_changes += frame >= FRAMES / 2 && changed[frame];
+        outcome->over += lens[frame] > BUDGET;
+        outcome->worst = fmax(outcome->worst, lens[frame] / BUDGET);
+        sum += lens[frame];
+        outcome->checked++;
+    }
+
+    outcome->mean = outcome->checked > 0 ? sum / outcome->checked / BUDGET : 0;
+    if (outcome->settle[0] >= 0) {
+        printf("%-8s settled after %4d frames", trace->name, outcome->settle[0]);
+    } else {
+        printf("%-8s never settled", trace->name);
+    }
+
+    for (int segment = 1; segment < 3 && trace->segments[segment - 1] != 0; segment++) {
+        printf(", %4d after the change at %d", outcome->settle[segment], trace->segments[segment - 1]);
+    }
+
+    printf(": %.1f changes per 100 frames, %.1f%% over the budget, worst %.0f%%, mean %.0f%% of it\n",
+           100.0 * outcome->changes / outcome->checked, 100.0 * outcome->over / outcome->checked,
+           100 * outcome->worst, 100 * outcome->mean);
+}
+
+int main(void) {
+    outcome_t outcome;
+
+    // Steady scene: within the budget once there, raises the quality up to the hysteresis and stops moving
+    trace_t steady_trace = { "steady", steady, 1 };
+
+    run_trace(&steady_trace, &outcome);
+    CHECK(outcome.settle[0] >= 0 && outcome.settle[0] < 80);
+    CHECK_EQ(outcome.late_changes, 0);
+    CHECK_EQ(outcome.over, 0);
+    CHECK(outcome.mean > 1.0 - CONFIG_RATE_HYSTERESIS_PCT / 100.0 - 0.05);
+
+    // Busy and calm again: back within the budget soon after each change
+    trace_t busy_trace = { "busy", busy, 1, { 400, 800 } };
+
+    run_trace(&busy_trace, &outcome);
+
+    for (int segment = 0; segment < 3; segment++) {
+        CHECK(outcome.settle[segment] >= 0 && outcome.settle[segment] < 80);
+    }
+
+    CHECK(outcome.mean <= 1.0);
+
+    // Noise: the hysteresis keeps the profile from following every frame
+    trace_t noisy_trace = { "noisy", noisy, 20 };
+
+    run_trace(&noisy_trace, &outcome);
+    CHECK(outcome.settle[0] >= 0 && outcome.settle[0] < 80);
+    CHECK(outcome.changes * 100 < outcome.checked * 2);
+    CHECK(outcome.mean <= 1.0);
+
+    // Larger swings and a slow drift, only reported: they move the averages past the hysteresis now and then
+    trace_t restless_trace = { "restless", restless, 20 };
+    trace_t daylight_trace = { "daylight", daylight, 20 };
+
+    run_trace(&restless_trace, &outcome);
+    run_trace(&daylight_trace, &outcome);
+
+    // Through the server, UXGA at the lowest quality does not fit, a smaller frame size does
+    fake_http_response_t response;
+    fake_jpeg_info_t info;
+    size_t largest = 0;
+
+    test_boot();
+
+    for (int i = 0; i < 60; i++) {
+        CHECK_EQ(fake_httpd_get(80, "/jpg", NULL, &response), ESP_OK);
+        CHECK_EQ(fake_http_status(&response), 200);
+
+        if (i >= 50) {
+            largest = response.len > largest ? response.len : largest;
+        }
+
+        if (i == 59) {
+            CHECK_EQ(fake_jpeg_parse(response.body, response.len, &info), 0);
+            printf("/jpg: %s q%d, largest of the last 10 frames %zuKB\n", capture_framesize_name(info.framesize),
+                   info.quality, largest / 1024);
+            CHECK(info.framesize < FRAMESIZE_UXGA);
+        }
+
+        fake_http_response_free(&response);
+    }
+
+    CHECK(largest <= BUDGET);
+
+    // Explicit profiles are served as asked
+    CHECK_EQ(fake_httpd_get(80, "/jpg?size=uxga&q=12", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_jpeg_parse(response.body, response.len, &info), 0);
+    CHECK_EQ(info.framesize, FRAMESIZE_UXGA);
+    CHECK_EQ(info.quality, 12);
+    fake_http_response_free(&response);
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+
+    char *text = calloc(1, response.len + 1);
+
+    memcpy(text, response.body, response.len);
+    CHECK(strstr(text, "esp32cam_rate_budget_bytes 65536") != NULL);
+    CHECK(strstr(text, "esp32cam_rate_changes_total") != NULL);
+    free(text);
+    fake_http_response_free(&response);
+
+    return test_done("ratectl");
+}
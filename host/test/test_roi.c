@@ -0,0 +1,187 @@
+/*
+ * test_roi.c
+ *
+ *  Crops and downscales regions of a synthetic UXGA frame, checks every
+ *  output pixel against the scene, that the decoder stops after the
+ *  region and that bad regions are refused, then fetches regions
+ *  through /jpg?roi=. Prints the time per region size and scale and the
+ *  peak scratch memory. The frames are the fake camera's synthetic
+ *  ones and its encoder stores raw pixels, so the times show the
+ *  decode and copy work only and the output sizes are not JPEG sizes.
+ */
+
+#include "test.h"
+#include "capture.h"
+#include "membudget.h"
+#include "roi.h"
+
+#define RUNS 20
+
+// Encoded output of the last region
+static uint8_t out[FAKE_JPEG_HEADER_LEN + 2 + CONFIG_ROI_MAX_PIXELS * 3];
+static size_t out_len;
+
+static size_t collect(void *arg, size_t index, const void *data, size_t len) {
+    if (index + len > sizeof(out)) {
+        return 0;
+    }
+
+    memcpy(out + index, data, len);
+    out_len = index + len;
+    return len;
+}
+
+// Checks the pixels of an encoded region against the scene, returns the mismatches
+static int check_region(const roi_t *roi, uint8_t scene) {
+    fake_jpeg_info_t info;
+    int x0 = roi->x >> roi->scale;
+    int y0 = roi->y >> roi->scale;
+    int mismatches = 0;
+
+    if (fake_jpeg_parse(out, out_len, &info) != 0 || !info.encoded || info.width != roi->w >> roi->scale
+            || info.height != roi->h >> roi->scale) {
+        return -1;
+    }
+
+    for (int y = 0; y < info.height; y++) {
+        for (int x = 0; x < info.width; x++) {
+            const uint8_t *px = out + FAKE_JPEG_HEADER_LEN + (y * info.width + x) * 3;
+            uint8_t luma = fake_jpeg_pixel(scene, (x0 + x) << roi->scale, (y0 + y) << roi->scale);
+
+            mismatches += px[0] != luma || px[1] != luma || px[2] != luma;
+        }
+    }
+
+    return mismatches;
+}
+
+// Average time of a region in us, checks its pixels once
+static double time_region(const camera_fb_t *fb, uint8_t scene, int x, int y, int w, int h, jpg_scale_t scale) {
+    roi_t roi = { .x = x, .y = y, .w = w, .h = h, .scale = scale };
+    int64_t start = esp_timer_get_time();
+
+    for (int i = 0; i < RUNS; i++) {
+        CHECK_EQ(roi_encode(fb, &roi, CONFIG_ROI_QUALITY, collect, NULL), ESP_OK);
+    }
+
+    double us = (double) (esp_timer_get_time() - start) / RUNS;
+    int mismatches = check_region(&roi, scene);
+
+    if (mismatches != 0) {
+        fprintf(stderr, "region %d,%d %dx%d /%d: %d wrong pixels\n", x, y, w, h, 1 << scale, mismatches);
+        test_failures++;
+    }
+
+    return us;
+}
+
+int main(void) {
+    capture_profile_t uxga = { .framesize = FRAMESIZE_UXGA, .quality = 12 };
+    fake_jpeg_info_t info;
+
+    test_boot();
+    fake_camera_set_scene(5);
+    CHECK_EQ(capture_set_profile(&uxga), ESP_OK);
+
+    capture_frame_t *frame = NULL;
+
+    // Frames still in the driver may have the old size
+    for (int i = 0; i < 5 && (frame == NULL || frame->profile.framesize != FRAMESIZE_UXGA); i++) {
+        capture_release(frame);
+        frame = capture_acquire_after(capture_last_seq());
+    }
+
+    CHECK(frame != NULL);
+    CHECK_EQ(frame->fb->width, 1600);
+    CHECK_EQ(fake_jpeg_parse(frame->fb->buf, frame->fb->len, &info), 0);
+
+    const camera_fb_t *fb = frame->fb;
+    static const struct {
+        int w;
+        int h;
+        jpg_scale_t scale;
+    } sizes[] = {
+            { 64, 64, JPG_SCALE_NONE },
+            { 320, 240, JPG_SCALE_NONE },
+            { 640, 480, JPG_SCALE_NONE },
+            { 640, 480, JPG_SCALE_2X },
+            { 1600, 1200, JPG_SCALE_4X },
+            { 1600, 1200, JPG_SCALE_8X },
+    };
+
+    // Regions at the bottom of the frame decode every row above them, those at the top stop early
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int w = sizes[i].w;
+        int h = sizes[i].h;
+        double top = time_region(fb, info.scene, 0, 0, w, h, sizes[i].scale);
+        double bottom = time_region(fb, info.scene, 1600 - w, 1200 - h, w, h, sizes[i].scale);
+
+        printf("%4dx%-4d /%d: %7.2fms at the top, %7.2fms at the bottom, %7zuB of raw pixels\n", w, h,
+               1 << sizes[i].scale, top / 1e3, bottom / 1e3, out_len);
+
+        if (h <= 240) {
+            CHECK(top < bottom);
+        }
+    }
+
+    // Odd positions that do not fall on a block
+    time_region(fb, info.scene, 333, 777, 101, 57, JPG_SCALE_NONE);
+    time_region(fb, info.scene, 1598, 1198, 2, 2, JPG_SCALE_NONE);
+    time_region(fb, info.scene, 17, 9, 150, 90, JPG_SCALE_2X);
+
+    // Outside the frame, wrapping around or too large
+    roi_t bad[] = {
+            { 1600, 0, 1, 1, JPG_SCALE_NONE },
+            { 0, 1200, 1, 1, JPG_SCALE_NONE },
+            { 1, 0, 1600, 1, JPG_SCALE_NONE },
+            { 0x7FFFFFFF, 0, 2, 2, JPG_SCALE_NONE },
+            { 8, 8, 0x7FFFFFF8, 2, JPG_SCALE_NONE },
+            { 0, 0, 4, 4, JPG_SCALE_8X },
+    };
+
+    for (int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CHECK_EQ(roi_encode(fb, &bad[i], CONFIG_ROI_QUALITY, collect, NULL), ESP_ERR_INVALID_ARG);
+    }
+
+    roi_t large = { 0, 0, 1600, 1200, JPG_SCALE_NONE };
+
+    CHECK_EQ(roi_encode(fb, &large, CONFIG_ROI_QUALITY, collect, NULL), ESP_ERR_INVALID_SIZE);
+
+    // One scratch buffer of the configured size, allocated once
+    membudget_stats_t stats;
+
+    membudget_get_stats(MEM_ROI, &stats);
+    printf("scratch: %uB peak, %u blocks\n", stats.high_water, stats.blocks);
+    CHECK_EQ(stats.blocks, 1);
+    CHECK(stats.high_water >= CONFIG_ROI_MAX_PIXELS * 3);
+    CHECK(stats.high_water < CONFIG_ROI_MAX_PIXELS * 3 + 64);
+    capture_release(frame);
+
+    // Through the server
+    fake_http_response_t response;
+    fake_jpeg_info_t region;
+
+    CHECK_EQ(fake_httpd_get(80, "/jpg?size=uxga&roi=800,600,320,240&scale=2", NULL, &response), ESP_OK);
+    CHECK_EQ(fake_http_status(&response), 200);
+    CHECK(response.chunks > 1);
+    CHECK_EQ(fake_jpeg_parse(response.body, response.len, &region), 0);
+    CHECK_EQ(region.width, 160);
+    CHECK_EQ(region.height, 120);
+    fake_http_response_free(&response);
+
+    const char *refused[] = {
+            "/jpg?size=uxga&roi=1500,0,200,10",
+            "/jpg?size=uxga&roi=0,0,1600,1200",
+            "/jpg?size=uxga&roi=0,0,10,10&scale=3",
+            "/jpg?size=uxga&roi=0,0,-1,10",
+            "/jpg?size=uxga&roi=0,0,10",
+    };
+
+    for (int i = 0; i < sizeof(refused) / sizeof(refused[0]); i++) {
+        fake_httpd_get(80, refused[i], NULL, &response);
+        CHECK_EQ(fake_http_status(&response), 400);
+        fake_http_response_free(&response);
+    }
+
+    return test_done("roi");
+}
@@ -0,0 +1,172 @@
+/*
+ * test_sharing.c
+ *
+ *  Built with and without the capture pipeline. Threads acquire and
+ *  hold frames at once and check that a held frame keeps its buffer and
+ *  content, that the driver never has more buffers out than it owns and
+ *  that the shares counter matches the requests handed a frame another
+ *  one got. Then as many clients as the server has sockets pull /jpg at
+ *  once and the aggregate throughput is printed against the captures it
+ *  took. The hold times and client counts are made up by the test.
+ */
+
+#include "test.h"
+#include "capture.h"
+#include <pthread.h>
+#include <sys/param.h>
+
+#define THREADS 8
+#define ACQUISITIONS 300
+#define MAX_AGE_US 50000
+#define PULL_MS 1000
+
+// Sequence numbers of every frame handed out
+static uint32_t seqs[THREADS * ACQUISITIONS];
+static volatile int seq_count;
+static volatile int overtaken;
+
+static void *hold_frames(void *arg) {
+    unsigned int seed = (uintptr_t) arg;
+    uint8_t head[64];
+
+    for (int i = 0; i < ACQUISITIONS; i++) {
+        capture_frame_t *frame = capture_acquire(MAX_AGE_US);
+
+        if (frame == NULL) {
+            __atomic_add_fetch(&test_failures, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        camera_fb_t *fb = frame->fb;
+        size_t len = fb->len;
+        uint32_t seq = frame->seq;
+
+        memcpy(head, fb->buf, MIN(len, sizeof(head)));
+        seqs[__atomic_fetch_add(&seq_count, 1, __ATOMIC_RELAXED)] = seq;
+
+        if (fake_camera_taken() > CAPTURE_FB_COUNT) {
+            __atomic_add_fetch(&overtaken, 1, __ATOMIC_RELAXED);
+        }
+
+        usleep(rand_r(&seed) % 3000);
+
+        // Nobody returned the buffer or reused the slot while it was held
+        if (frame->fb != fb || frame->seq != seq || fb->len != len
+                || memcmp(head, fb->buf, MIN(len, sizeof(head))) != 0) {
+            fprintf(stderr, "frame %u changed while held\n", seq);
+            __atomic_add_fetch(&test_failures, 1, __ATOMIC_RELAXED);
+        }
+
+        capture_release(frame);
+    }
+
+    return NULL;
+}
+
+// Pulls /jpg on a connection of its own until the time is up, returns the images it got
+static volatile int pulling;
+
+static void *pull_images(void *arg) {
+    int fd = fake_httpd_connect(80);
+    intptr_t count = 0;
+
+    while (pulling) {
+        fake_http_response_t response;
+        fake_http_request_t request = { .method = HTTP_GET, .uri = "/jpg" };
+
+        if (fake_httpd_request_on(fd, &request, &response) == ESP_OK && fake_http_status(&response) == 200) {
+            count++;
+        }
+
+        fake_http_response_free(&response);
+    }
+
+    fake_httpd_disconnect(fd);
+    return (void *) count;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(void) {
+    pthread_t threads[THREADS];
+    capture_stats_t before;
+    capture_stats_t after;
+
+    test_boot();
+    capture_get_stats(&before);
+
+    for (intptr_t i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, hold_frames, (void *) (i + 1));
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    capture_get_stats(&after);
+    CHECK_EQ(seq_count, THREADS * ACQUISITIONS);
+    CHECK_EQ(overtaken, 0);
+
+    // Every request handed a frame some earlier request got counts as a share, the motion task of the pipeline
+    // takes a few frames of its own
+    int frames = 0;
+
+    qsort(seqs, seq_count, sizeof(seqs[0]), compare_u32);
+
+    for (int i = 0; i < seq_count; i++) {
+        frames += i == 0 || seqs[i] != seqs[i - 1];
+    }
+
+    printf("%d acquisitions by %d threads served by %d frames, %u shares\n", seq_count, THREADS, frames,
+           after.shares - before.shares);
+    int background = (after.hits - before.hits) + (after.misses - before.misses) - seq_count;
+
+    CHECK(background >= 0);
+    CHECK(background <= 20);
+    CHECK(after.shares - before.shares >= seq_count - frames);
+    CHECK(after.shares - before.shares <= seq_count - frames + background);
+    CHECK(frames < seq_count / 2);
+
+    // Every held reference is back, only the newest frame keeps one of its own
+    CHECK(fake_camera_taken() <= CAPTURE_FB_COUNT);
+
+    // As many clients as the server has sockets
+    pthread_t clients[CONFIG_HTTP_MAX_SOCKETS];
+    uint32_t frames_before = fake_camera_frames();
+    int images = 0;
+
+    pulling = 1;
+
+    for (int i = 0; i < CONFIG_HTTP_MAX_SOCKETS; i++) {
+        pthread_create(&clients[i], NULL, pull_images, NULL);
+    }
+
+    test_sleep_ms(PULL_MS);
+    pulling = 0;
+
+    for (int i = 0; i < CONFIG_HTTP_MAX_SOCKETS; i++) {
+        void *count;
+
+        pthread_join(clients[i], &count);
+        CHECK((intptr_t) count > 0);
+        images += (intptr_t) count;
+    }
+
+    uint32_t captured = fake_camera_frames() - frames_before;
+
+    printf("%d clients: %.0f images/s from %.0f captures/s\n", CONFIG_HTTP_MAX_SOCKETS, images * 1000.0 / PULL_MS,
+           captured * 1000.0 / PULL_MS);
+    CHECK(captured < images);
+    CHECK(fake_camera_taken() <= CAPTURE_FB_COUNT);
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    return test_done("sharing");
+#else
+    return test_done("sharing_on_demand");
+#endif
+}
@@ -0,0 +1,218 @@
+/*
+ * test_snapshot_cache.c
+ *
+ *  Built with and without the capture pipeline. As many pollers as the
+ *  server has sockets pull /jpg on connections of their own, and the
+ *  captures the camera made are compared with the requests served,
+ *  every response has to carry an ETag. The hit and miss counters have
+ *  to add up to the requests. Then one client revalidates a frame with
+ *  If-None-Match in its strong, weak, list and * forms and gets 304
+ *  without a body, a tag of another frame gets the image. Cache-Control
+ *  no-cache and max-age=0 get a frame captured after the request and
+ *  count as misses, max-age=N and the default window reuse the cached
+ *  one and count as hits. The frames are synthetic and the request
+ *  rate is that of the fake httpd, so the captures saved only show the
+ *  order of magnitude.
+ */
+
+#include "test.h"
+#include "capture.h"
+#include <pthread.h>
+#include <sys/param.h>
+
+#define POLLERS CONFIG_HTTP_MAX_SOCKETS
+#define POLL_MS 2000
+// Acquisitions of the motion task of the pipeline while the pollers run, one every CONFIG_MOTION_INTERVAL_MS
+#define BACKGROUND (POLL_MS / CONFIG_MOTION_INTERVAL_MS + 2)
+
+static volatile int polling;
+static volatile int missing_etags;
+
+// Pulls /jpg on a connection of its own until the time is up, returns the images it got
+static void *poll_images(void *arg) {
+    int fd = fake_httpd_connect(80);
+    intptr_t count = 0;
+
+    while (polling) {
+        fake_http_response_t response;
+        fake_http_request_t request = { .method = HTTP_GET, .uri = "/jpg" };
+
+        if (fake_httpd_request_on(fd, &request, &response) == ESP_OK && fake_http_status(&response) == 200) {
+            count++;
+
+            if (fake_http_header(&response, "ETag") == NULL) {
+                __atomic_add_fetch(&missing_etags, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        fake_http_response_free(&response);
+    }
+
+    fake_httpd_disconnect(fd);
+    return (void *) count;
+}
+
+// GET /jpg with extra header lines, returns the status and copies the ETag into etag
+static int get_jpg(const char *headers, char *etag, size_t *len) {
+    fake_http_response_t response;
+    int status = -1;
+
+    if (fake_httpd_get(80, "/jpg", headers, &response) == ESP_OK) {
+        const char *value = fake_http_header(&response, "ETag");
+
+        status = fake_http_status(&response);
+        snprintf(etag, 16, "%s", value != NULL ? value : "");
+        *len = response.len;
+    }
+
+    fake_http_response_free(&response);
+    return status;
+}
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+// Waits until the pipeline captured another frame
+static void wait_next_frame(void) {
+    for (uint32_t seq = capture_last_seq(); capture_last_seq() == seq;) {
+        test_sleep_ms(1);
+    }
+}
+#endif
+
+// Sequence number of a frame from its ETag
+static uint32_t etag_seq(const char *etag) {
+    return strtoul(etag + 1, NULL, 10);
+}
+
+int main(void) {
+    capture_stats_t before;
+    capture_stats_t after;
+    pthread_t pollers[POLLERS];
+    int requests = 0;
+
+    test_boot();
+
+    // N pollers at once, most requests get the frame another one triggered or the pipeline had ready
+    uint32_t frames_before = fake_camera_frames();
+
+    capture_get_stats(&before);
+    polling = 1;
+
+    for (int i = 0; i < POLLERS; i++) {
+        pthread_create(&pollers[i], NULL, poll_images, NULL);
+    }
+
+    test_sleep_ms(POLL_MS);
+    polling = 0;
+
+    for (int i = 0; i < POLLERS; i++) {
+        void *count;
+
+        pthread_join(pollers[i], &count);
+        CHECK((intptr_t) count > 0);
+        requests += (intptr_t) count;
+    }
+
+    capture_get_stats(&after);
+    uint32_t captures = fake_camera_frames() - frames_before;
+    uint32_t hits = after.hits - before.hits;
+    uint32_t misses = after.misses - before.misses;
+
+    printf("%d pollers: %d requests in %d ms from %u captures, %d captures saved (%.1f%%)\n", POLLERS, requests,
+           POLL_MS, captures, requests - (int) captures, 100.0 * (requests - (int) captures) / MAX(1, requests));
+    printf("cache: %u hits, %u misses, %u shares\n", hits, misses, after.shares - before.shares);
+    CHECK_EQ(missing_etags, 0);
+    CHECK(captures * 10 < (uint32_t) requests);
+#ifdef CONFIG_CAPTURE_PIPELINE
+    CHECK(hits + misses >= (uint32_t) requests);
+    CHECK(hits + misses <= (uint32_t) requests + BACKGROUND);
+#else
+    // Without the pipeline every miss is one capture and nothing else acquires frames
+    CHECK_EQ(hits + misses, requests);
+    CHECK(misses <= captures);
+#endif
+
+    // Revalidation with a frame that stays the newest for a second
+    char etag[16];
+    char other[16];
+    char headers[256];
+    size_t len;
+
+    fake_camera_set_fps(1);
+#ifdef CONFIG_CAPTURE_PIPELINE
+    test_sleep_ms(1100);
+    wait_next_frame();
+#endif
+
+    CHECK_EQ(get_jpg("Cache-Control: max-age=10\r\n", etag, &len), 200);
+    CHECK(etag[0] == '"' && etag_seq(etag) > 0);
+    CHECK(len > 0);
+
+    const char *matching[] = { "%s", "W/%s", "\"0\", W/\"1\",%s", "\"1\" ,  W/%s , \"2\"", "*" };
+
+    for (size_t i = 0; i < sizeof(matching) / sizeof(matching[0]); i++) {
+        char tag[64];
+
+        snprintf(tag, sizeof(tag), matching[i], etag);
+        snprintf(headers, sizeof(headers), "Cache-Control: max-age=10\r\nIf-None-Match: %s\r\n", tag);
+        CHECK_EQ(get_jpg(headers, other, &len), 304);
+        CHECK_EQ(len, 0);
+        CHECK(strcmp(other, etag) == 0);
+    }
+
+    // Another frame's tag, and a tag the list pushes past what is read of the header
+    CHECK_EQ(get_jpg("Cache-Control: max-age=10\r\nIf-None-Match: \"0\", W/\"1\"\r\n", other, &len), 200);
+    CHECK(len > 0);
+    snprintf(headers, sizeof(headers), "Cache-Control: max-age=10\r\nIf-None-Match: "
+             "\"1000001\", \"1000002\", \"1000003\", \"1000004\", \"1000005\", \"1000006\", \"1000007\", "
+             "\"1000008\", \"1000009\", \"1000010\", %s\r\n", etag);
+    CHECK_EQ(get_jpg(headers, other, &len), 200);
+    CHECK(strcmp(other, etag) == 0);
+
+    // no-cache and max-age=0 wait for a frame captured after the request, the others reuse the cached one
+    // The frame due at 1 fps comes first, the motion task would wait for it as well and count a miss
+    fake_camera_set_fps(25);
+#ifdef CONFIG_CAPTURE_PIPELINE
+    wait_next_frame();
+    test_sleep_ms(100);
+#endif
+
+    struct {
+        const char *headers;
+        int fresh;              // a frame after the previous response is required
+    } ages[] = {
+            { "Cache-Control: no-cache\r\n", 1 },
+            { "Cache-Control: max-age=10\r\n", 0 },
+            { "Cache-Control: max-age=0\r\n", 1 },
+            { NULL, 0 },
+            { "Cache-Control: public, no-cache\r\n", 1 },
+    };
+    uint32_t last = etag_seq(etag);
+
+    for (size_t i = 0; i < sizeof(ages) / sizeof(ages[0]); i++) {
+        uint32_t seq_before = capture_last_seq();
+
+        capture_get_stats(&before);
+        CHECK_EQ(get_jpg(ages[i].headers, etag, &len), 200);
+        capture_get_stats(&after);
+
+        uint32_t seq = etag_seq(etag);
+
+        CHECK(seq >= last);
+        last = seq;
+
+        if (ages[i].fresh) {
+            CHECK(seq > seq_before);
+            CHECK_EQ(after.misses - before.misses, 1);
+        } else {
+            CHECK(seq <= capture_last_seq());
+            CHECK_EQ(after.misses - before.misses, 0);
+            CHECK(after.hits - before.hits >= 1);
+        }
+    }
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    return test_done("snapshot_cache");
+#else
+    return test_done("snapshot_cache_on_demand");
+#endif
+}
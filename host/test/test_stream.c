@@ -0,0 +1,309 @@
+/*
+ * test_stream.c
+ *
+ *  Drives /stream on the stream server through the fake httpd and reads
+ *  the multipart response from the client end of the connection. A
+ *  single client checks the response head, the frame rate cap and that
+ *  every JPEG byte went out straight from a camera frame buffer, only
+ *  the part headers are formatted. Two clients with different caps
+ *  are then served at the same time, and a reader that takes a part
+ *  only every SLOW_READ_MS skips frames while the other client keeps
+ *  its rate and the camera its pace. A client beyond
+ *  CONFIG_STREAM_MAX_CLIENTS gets a 503, and a reader that stops
+ *  reading is disconnected after CONFIG_STREAM_SEND_TIMEOUT_S. Frames
+ *  per second, skipped frames and bytes copied per frame are printed.
+ *  Frames are synthetic and timed by the fake camera at 25 fps, the
+ *  socket buffers are those of the host.
+ */
+
+#define _GNU_SOURCE
+#include "test.h"
+#include "capture.h"
+#include "stream.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#define JPEG_LEN 100000
+#define RUN_MS 3000
+#define SLOW_READ_MS 400
+#define BUF_LEN (4 * JPEG_LEN)
+
+// Client reading a stream on a thread of its own
+typedef struct {
+    int fd;
+    int delay_ms;           // pause after every part
+    volatile int stop;      // stop reading, the connection stays open
+    int head_ok;
+    int parts;
+    uint64_t jpeg_bytes;
+    uint32_t skipped;       // camera frames between the parts received
+    uint32_t last_frame;
+    int64_t first_us;
+    int64_t last_us;
+    int closed;             // the station closed the connection
+    pthread_t thread;
+} client_t;
+
+// Takes one complete part or the head from the front of buf, returns its length or 0 if more is needed
+static size_t take_part(client_t *client, const uint8_t *buf, size_t len) {
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+
+    if (end == NULL) {
+        return 0;
+    }
+
+    size_t head_len = (const uint8_t *) end + 4 - buf;
+    char head[512];
+
+    memcpy(head, buf, MIN(head_len, sizeof(head) - 1));
+    head[MIN(head_len, sizeof(head) - 1)] = '\0';
+
+    if (!client->head_ok) {
+        client->head_ok = strncmp(head, "HTTP/1.1 200 OK\r\n", 17) == 0
+                && strstr(head, "Content-Type: " STREAM_CONTENT_TYPE "\r\n") != NULL;
+        return head_len;
+    }
+
+    const char *length = strstr(head, "Content-Length: ");
+
+    if (strncmp(head, "\r\n--" STREAM_BOUNDARY "\r\n", 4 + strlen(STREAM_BOUNDARY) + 2) != 0 || length == NULL) {
+        fprintf(stderr, "bad part header\n");
+        __atomic_add_fetch(&test_failures, 1, __ATOMIC_RELAXED);
+        return len;
+    }
+
+    size_t jpeg_len = strtoul(length + 16, NULL, 10);
+    fake_jpeg_info_t info;
+
+    if (len < head_len + jpeg_len) {
+        return 0;
+    }
+
+    if (fake_jpeg_parse(buf + head_len, jpeg_len, &info) != 0) {
+        fprintf(stderr, "part is no frame\n");
+        __atomic_add_fetch(&test_failures, 1, __ATOMIC_RELAXED);
+    } else if (client->parts > 0) {
+        client->skipped += info.frame - client->last_frame - 1;
+    }
+
+    client->last_frame = info.frame;
+    client->last_us = esp_timer_get_time();
+
+    if (client->parts++ == 0) {
+        client->first_us = client->last_us;
+    }
+
+    client->jpeg_bytes += jpeg_len;
+
+    if (client->delay_ms > 0) {
+        test_sleep_ms(client->delay_ms);
+    }
+
+    return head_len + jpeg_len;
+}
+
+// Reads and parses the stream until told to stop or the station closes it
+static void *read_stream(void *arg) {
+    client_t *client = (client_t *) arg;
+    uint8_t *buf = malloc(BUF_LEN);
+    size_t len = 0;
+
+    while (!client->stop) {
+        struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 50) <= 0) {
+            continue;
+        }
+
+        ssize_t got = read(client->fd, buf + len, BUF_LEN - len);
+
+        if (got <= 0) {
+            client->closed = 1;
+            break;
+        }
+
+        len += got;
+
+        for (size_t taken; (taken = take_part(client, buf, len)) > 0;) {
+            memmove(buf, buf + taken, len - taken);
+            len -= taken;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Opens /stream on a connection of its own, returns the status of the request
+static int stream_open(client_t *client, const char *uri, int delay_ms) {
+    fake_http_response_t response;
+    fake_http_request_t request = { .method = HTTP_GET, .uri = uri };
+
+    *client = (client_t) { .fd = fake_httpd_connect(CONFIG_STREAM_PORT), .delay_ms = delay_ms };
+    CHECK(client->fd >= 0);
+    fake_httpd_request_on(client->fd, &request, &response);
+
+    int status = fake_http_status(&response);
+
+    // The stream task writes the response, the handler returned without sending anything
+    if (status == 200) {
+        CHECK_EQ(response.len, 0);
+        pthread_create(&client->thread, NULL, read_stream, client);
+    }
+
+    fake_http_response_free(&response);
+    return status;
+}
+
+// Stops reading and closes the connection
+static void stream_close(client_t *client) {
+    client->stop = 1;
+    pthread_join(client->thread, NULL);
+    fake_httpd_disconnect(client->fd);
+}
+
+// Frames per second between the first and the last part
+static double client_fps(const client_t *client) {
+    if (client->parts < 2) {
+        return 0;
+    }
+
+    return (client->parts - 1) * 1e6 / (client->last_us - client->first_us);
+}
+
+// Reads a counter from /metrics
+static long metric(const char *name) {
+    fake_http_response_t response;
+    long value = -1;
+
+    if (fake_httpd_get(80, "/metrics", NULL, &response) == ESP_OK) {
+        char *text = calloc(1, response.len + 2);
+        char sample[96];
+        char *line;
+
+        // The sample, not the HELP and TYPE lines naming it
+        memcpy(text + 1, response.body, response.len);
+        text[0] = '\n';
+        snprintf(sample, sizeof(sample), "\n%s ", name);
+        line = strstr(text, sample);
+
+        if (line != NULL) {
+            value = atol(line + strlen(sample));
+        }
+
+        free(text);
+    }
+
+    fake_http_response_free(&response);
+    return value;
+}
+
+static void print_client(const char *name, const client_t *client) {
+    printf("%-22s %4d parts %5.1f fps, %3u frames skipped, %.0f KB/s\n", name, client->parts, client_fps(client),
+           client->skipped,
+           client->jpeg_bytes / 1024.0 / MAX(1, client->last_us - client->first_us) * 1e6);
+}
+
+int main(void) {
+    static client_t a;
+    static client_t b;
+    static client_t c;
+    uint64_t fb_before;
+    uint64_t other_before;
+    uint64_t fb_after;
+    uint64_t other_after;
+
+    fake_camera_set_jpeg_len(JPEG_LEN);
+    test_boot();
+
+    // One client capped at 5 fps, nothing but the part headers is formatted or copied
+    fake_httpd_sent(CONFIG_STREAM_PORT, &fb_before, &other_before);
+    CHECK_EQ(stream_open(&a, "/stream?fps=5", 0), 200);
+    test_sleep_ms(RUN_MS);
+    stream_close(&a);
+    test_sleep_ms(200);
+    fake_httpd_sent(CONFIG_STREAM_PORT, &fb_after, &other_after);
+
+    CHECK(a.head_ok);
+    CHECK(a.parts >= RUN_MS / 1000 * 5 - 2);
+    CHECK(client_fps(&a) > 4.5 && client_fps(&a) < 5.5);
+    // Parts sent after the last one read went out from the frame buffers as well
+    CHECK(fb_after - fb_before >= a.jpeg_bytes);
+    CHECK((fb_after - fb_before) % JPEG_LEN == 0);
+    uint64_t sent_parts = (fb_after - fb_before) / JPEG_LEN;
+    CHECK(sent_parts > 0);
+    CHECK(other_after - other_before < 256 + sent_parts * 128);
+    print_client("fps=5", &a);
+    printf("%-22s %.1f B formatted per frame, %llu of %llu B straight from fb->buf\n", "",
+           (double) (other_after - other_before) / MAX(1, sent_parts), (unsigned long long) (fb_after - fb_before),
+           (unsigned long long) (fb_after - fb_before + other_after - other_before));
+
+    // Two clients with their own caps at the same time
+    CHECK_EQ(stream_open(&a, "/stream?fps=10", 0), 200);
+    CHECK_EQ(stream_open(&b, "/stream?fps=2", 0), 200);
+    test_sleep_ms(RUN_MS);
+    stream_close(&a);
+    stream_close(&b);
+    print_client("fps=10 next to fps=2", &a);
+    print_client("fps=2 next to fps=10", &b);
+    CHECK(client_fps(&a) > 8.5 && client_fps(&a) < 10.5);
+    CHECK(client_fps(&b) > 1.5 && client_fps(&b) < 2.5);
+    test_sleep_ms(200);
+
+    // A slow reader skips frames, the fast client and the camera keep their pace
+    long drops_before = metric("esp32cam_stream_drops_total");
+    uint32_t frames_before = fake_camera_frames();
+    int64_t start = esp_timer_get_time();
+
+    CHECK_EQ(stream_open(&a, "/stream?fps=10", 0), 200);
+    CHECK_EQ(stream_open(&b, "/stream?fps=10", SLOW_READ_MS), 200);
+    test_sleep_ms(RUN_MS);
+
+    // Beyond the stream tasks a client is refused instead of waiting or taking over a stream
+    CHECK_EQ(stream_open(&c, "/stream", 0), 503);
+    CHECK(!fake_httpd_is_open(c.fd));
+    fake_httpd_disconnect(c.fd);
+
+    stream_close(&a);
+    stream_close(&b);
+    double camera_fps = (fake_camera_frames() - frames_before) * 1e6 / (esp_timer_get_time() - start);
+    print_client("fps=10 fast reader", &a);
+    print_client("fps=10 slow reader", &b);
+    printf("%-22s camera at %.1f fps\n", "", camera_fps);
+    CHECK(client_fps(&a) > 8.5);
+    CHECK(client_fps(&b) < 1e3 / SLOW_READ_MS + 0.5);
+    // Parts the socket buffer held from before the reader fell behind skip fewer frames, later ones about 9
+    CHECK(b.parts >= 2 && b.skipped / (b.parts - 1.0) > 2 * a.skipped / (a.parts - 1.0));
+    CHECK(camera_fps > 22);
+    test_sleep_ms(200);
+    CHECK(metric("esp32cam_stream_drops_total") - drops_before >= (long) (a.skipped + b.skipped));
+
+    // The slots are free again
+    CHECK_EQ(stream_open(&c, "/stream?fps=10", 0), 200);
+
+    // A reader that stops taking anything is disconnected, the other stream keeps going
+    CHECK_EQ(stream_open(&b, "/stream?fps=10", 0), 200);
+    test_sleep_ms(500);
+    b.stop = 1;
+    pthread_join(b.thread, NULL);
+    int parts_before = c.parts;
+    int waited_ms = 0;
+
+    while (fake_httpd_is_open(b.fd) && waited_ms < (2 * CONFIG_STREAM_SEND_TIMEOUT_S + 4) * 1000) {
+        test_sleep_ms(100);
+        waited_ms += 100;
+    }
+
+    printf("stalled reader disconnected after %d ms\n", waited_ms);
+    CHECK(!fake_httpd_is_open(b.fd));
+    // The write that filled the socket buffer returns short after one timeout, the next one fails after another
+    CHECK(waited_ms >= (CONFIG_STREAM_SEND_TIMEOUT_S - 1) * 1000);
+    CHECK(c.parts - parts_before >= waited_ms / 100 * 8 / 10 - 2);
+    fake_httpd_disconnect(b.fd);
+    stream_close(&c);
+
+    CHECK(fake_camera_taken() <= CAPTURE_FB_COUNT);
+    return test_done("stream");
+}
@@ -0,0 +1,587 @@
+/*
+ * test_sync_capture.c
+ *
+ *  Forks STATIONS station processes, each booting the firmware on a
+ *  clock of its own, and bridges their fake multicast sockets to the
+ *  loopback multicast group, so the test plays the controller on real
+ *  datagrams. The controller answers the handshake requests with its
+ *  clock, then sends one capture-at-T command to the group. Every
+ *  station has to report the frame it latched, and /jpg?seq= on the
+ *  station has to serve that frame with the skew it reported. The
+ *  station's clock offset estimated from the handshake is read from
+ *  its log and compared with the true one only the test knows, which
+ *  gives the capture time of every latched frame on the controller's
+ *  clock. Prints the spread of the reported skews and of the true
+ *  capture times and the largest clock error. A command for other
+ *  device IDs latches nothing. The frames are synthetic, the cameras
+ *  run at 25 fps from their own boot, and all stations share the host's
+ *  CPUs and loopback, so the spread shows the frame phase, not the
+ *  latency of a WiFi network.
+ */
+
+#include "test.h"
+#include "capture.h"
+#include "mulmsg.h"
+#include "mulmsg2.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define STATIONS 20
+// The controller's clock, unrelated to the stations' clocks that start at their boot
+#define CONTROLLER_EPOCH_US 1700000000000000LL
+#define CAPTURE_AHEAD_MS 1000
+#define CAPTURE_ID 42
+#define FRAME_US (1000000 / 25)
+
+// Messages between the controller and a station process
+typedef enum {
+    STATION_HELLO,          // station: its datagrams come from port
+    STATION_READY,          // station: booted
+    STATION_FETCH,          // controller: get seq with /jpg?seq=
+    STATION_FETCHED,        // station: what /jpg?seq= answered
+    STATION_EXIT,           // controller: stop the station
+} station_kind_t;
+
+typedef struct {
+    station_kind_t kind;
+    uint16_t port;
+    uint32_t seq;
+    int status;
+    int32_t skew;           // X-Capture-Skew-Us
+    int etag_ok;
+    int jpeg_ok;
+    int64_t true_offset;    // controller time minus station time, known to the test only
+    int64_t est_offset;     // the same as the station estimated it from the handshake
+    uint32_t rtt;           // round trip of the handshake sample it used
+} station_msg_t;
+
+// A station as the controller sees it
+typedef struct {
+    pid_t pid;
+    int ctrl;               // the controller's end of the message socket
+    uint16_t port;
+    int ready;
+    int captured;           // reports of the capture
+    uint32_t seq;
+    int32_t skew;
+    station_msg_t hello;
+    station_msg_t fetched;
+} station_t;
+
+static int64_t controller_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return CONTROLLER_EPOCH_US + now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Loopback address of the group the fake station addresses
+static struct sockaddr_in group_addr(void) {
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = inet_addr(CONFIG_MULTICAST_ADDR),
+    };
+
+    return addr;
+}
+
+// Opens a socket receiving the group's datagrams on loopback, shared by all processes
+static int group_socket(void) {
+    struct sockaddr_in addr = group_addr();
+    struct ip_mreq mreq = {
+            .imr_multiaddr.s_addr = inet_addr(CONFIG_MULTICAST_ADDR),
+            .imr_interface.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int on = 1;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Opens a socket on a loopback port of its own that sends to the group on loopback, returns the port in port
+static int unicast_socket(uint16_t *port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    struct in_addr loopback = { .s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    unsigned char loop = 1;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) != 0
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Station process
+
+// Bridge between the fake multicast socket of the station and loopback
+static struct {
+    int group;              // receives the group
+    int unicast;            // sends everything and receives the controller's answers
+    uint16_t controller;    // port the controller sends from
+    volatile int stop;
+} bridge;
+
+// Clock offset and round trip the station logs when it schedules a capture
+static volatile int64_t logged_offset;
+static volatile uint32_t logged_rtt;
+
+static void capture_log(esp_log_level_t level, const char *tag, const char *line) {
+    const char *offset = strstr(line, "clock offset ");
+    long long us;
+    unsigned int rtt;
+
+    if (offset != NULL && sscanf(offset, "clock offset %lldus, rtt %uus", &us, &rtt) == 2) {
+        logged_offset = us;
+        logged_rtt = rtt;
+    }
+}
+
+// Hands what the station sends to the group or the controller on loopback
+static void *bridge_out(void *arg) {
+    struct sockaddr_in group = group_addr();
+    struct sockaddr_in controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(bridge.controller),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    char data[MULMSG2_MAX_LEN];
+    struct sockaddr_in to;
+
+    while (!bridge.stop) {
+        int len = fake_net_receive(CONFIG_MULTICAST_PORT, &to, data, sizeof(data), 100);
+
+        if (len >= 0) {
+            int to_group = to.sin_addr.s_addr == group.sin_addr.s_addr;
+
+            sendto(bridge.unicast, data, len, 0, (struct sockaddr *) (to_group ? &group : &controller),
+                   sizeof(struct sockaddr_in));
+        }
+    }
+
+    return NULL;
+}
+
+// Hands the controller's datagrams to the station, those of the other stations are not for it
+static void *bridge_in(void *arg) {
+    struct pollfd pfd[] = { { .fd = bridge.group, .events = POLLIN }, { .fd = bridge.unicast, .events = POLLIN } };
+    // Address the controller has on the fake network, the station answers to it
+    struct sockaddr_in fake_controller = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_MULTICAST_PORT),
+            .sin_addr.s_addr = inet_addr("10.0.0.1"),
+    };
+    char data[MULMSG2_MAX_LEN];
+
+    while (!bridge.stop) {
+        if (poll(pfd, 2, 100) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+
+            if (!(pfd[i].revents & POLLIN)) {
+                continue;
+            }
+
+            ssize_t len = recvfrom(pfd[i].fd, data, sizeof(data), 0, (struct sockaddr *) &from, &from_len);
+
+            if (len >= 0 && ntohs(from.sin_port) == bridge.controller) {
+                fake_net_inject(CONFIG_MULTICAST_PORT, &fake_controller, data, len, 1000);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Boots a station on a clock started index * 37 ms after the controller's and serves the controller's requests
+static int station_main(int index, int ctrl, uint16_t controller_port) {
+    station_msg_t msg = { .kind = STATION_HELLO };
+    pthread_t threads[2];
+
+    // Stations boot at different times, so their clocks and frame phases differ
+    test_sleep_ms(index * 37 % 500);
+    fake_clock_restart();
+    esp_log_level_set("LMS", ESP_LOG_INFO);
+    fake_log_set_capture(capture_log);
+
+    // The bridge first, the station's first handshake request is a clock sample
+    bridge.controller = controller_port;
+    bridge.group = group_socket();
+    bridge.unicast = unicast_socket(&msg.port);
+
+    if (bridge.group < 0 || bridge.unicast < 0) {
+        return 1;
+    }
+
+    pthread_create(&threads[0], NULL, bridge_out, NULL);
+    pthread_create(&threads[1], NULL, bridge_in, NULL);
+    msg.true_offset = controller_us() - esp_timer_get_time();
+    send(ctrl, &msg, sizeof(msg), 0);
+
+    test_boot();
+    msg.kind = STATION_READY;
+    send(ctrl, &msg, sizeof(msg), 0);
+
+    while (recv(ctrl, &msg, sizeof(msg), 0) == sizeof(msg) && msg.kind == STATION_FETCH) {
+        fake_http_response_t response;
+        fake_jpeg_info_t info;
+        char uri[32];
+        char etag[16];
+
+        snprintf(uri, sizeof(uri), "/jpg?seq=%u", msg.seq);
+        snprintf(etag, sizeof(etag), "\"%u\"", msg.seq);
+        fake_httpd_get(80, uri, NULL, &response);
+
+        const char *skew = fake_http_header(&response, "X-Capture-Skew-Us");
+        const char *tag = fake_http_header(&response, "ETag");
+
+        msg.kind = STATION_FETCHED;
+        msg.status = fake_http_status(&response);
+        msg.skew = skew != NULL ? atoi(skew) : INT32_MIN;
+        msg.etag_ok = tag != NULL && strcmp(tag, etag) == 0;
+        msg.jpeg_ok = fake_jpeg_parse(response.body, response.len, &info) == 0;
+        msg.est_offset = logged_offset;
+        msg.rtt = logged_rtt;
+        fake_http_response_free(&response);
+        send(ctrl, &msg, sizeof(msg), 0);
+    }
+
+    bridge.stop = 1;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    return test_failures;
+}
+
+// Controller
+
+static station_t stations[STATIONS];
+// Ports of the handshake requests answered, a request may come before the hello naming its port
+static uint16_t answered_ports[64 * STATIONS];
+static int answered_count;
+static int controller_fd;
+static int controller_group_fd;
+
+static station_t *station_by_port(uint16_t port) {
+    for (int i = 0; i < STATIONS; i++) {
+        if (stations[i].port == port) {
+            return &stations[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Answers an "Are You There?" with "Here I Am!" stamped with the controller's clock
+static void answer_request(const struct sockaddr_in *to) {
+    char buffer[MULMSG2_MAX_LEN];
+    mulmsg2 message;
+
+    mulmsg2_init(&message, buffer, sizeof(buffer));
+    mulmsg_setSource(mulmsg2_header(&message), 1);
+    mulmsg_setAlive(mulmsg2_header(&message), 1);
+    mulmsg_setDeviceId(mulmsg2_header(&message), 0);
+    mulmsg2_putU64(&message, MULMSG2_CLOCK, controller_us());
+    sendto(controller_fd, buffer, mulmsg2_length(&message), 0, (const struct sockaddr *) to, sizeof(*to));
+}
+
+// Handles a datagram of a station: answers requests, notes capture reports
+static void controller_receive(int fd) {
+    char buffer[MULMSG2_MAX_LEN];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &from_len);
+    mulmsg *msg = len >= MULMSG_LEN ? mulmsg_wrap(buffer, len) : NULL;
+    station_t *station = station_by_port(ntohs(from.sin_port));
+    mulmsg2 msg2;
+    unsigned char type;
+    unsigned char record_len;
+    const unsigned char *value;
+
+    if (msg == NULL || mulmsg_getSource(msg) != 0) {
+        return;
+    }
+
+    if (mulmsg_getAlive(msg) == 0) {
+        answer_request(&from);
+
+        if (answered_count < (int) (sizeof(answered_ports) / sizeof(answered_ports[0]))) {
+            answered_ports[answered_count++] = ntohs(from.sin_port);
+        }
+
+        return;
+    }
+
+    if (mulmsg2_parse(&msg2, buffer, len) != 0) {
+        return;
+    }
+
+    while (mulmsg2_next(&msg2, &type, &value, &record_len)) {
+        if (type == MULMSG2_CAPTURED && record_len == 12) {
+            CHECK(station != NULL);
+
+            if (station != NULL) {
+                CHECK_EQ(mulmsg2_getU32(value), CAPTURE_ID);
+                station->captured++;
+                station->seq = mulmsg2_getU32(value + 4);
+                station->skew = (int32_t) mulmsg2_getU32(value + 8);
+            }
+        }
+    }
+}
+
+// Receives from the stations for ms, hellos included
+static void controller_run(int ms) {
+    int64_t end = esp_timer_get_time() + ms * 1000LL;
+    struct pollfd pfd[2 + STATIONS];
+
+    pfd[0] = (struct pollfd) { .fd = controller_fd, .events = POLLIN };
+    pfd[1] = (struct pollfd) { .fd = controller_group_fd, .events = POLLIN };
+
+    for (int i = 0; i < STATIONS; i++) {
+        pfd[2 + i] = (struct pollfd) { .fd = stations[i].ctrl, .events = POLLIN };
+    }
+
+    while (esp_timer_get_time() < end) {
+        if (poll(pfd, 2 + STATIONS, 20) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (pfd[i].revents & POLLIN) {
+                controller_receive(pfd[i].fd);
+            }
+        }
+
+        for (int i = 0; i < STATIONS; i++) {
+            if (pfd[2 + i].revents & POLLIN) {
+                station_msg_t msg;
+
+                if (recv(stations[i].ctrl, &msg, sizeof(msg), 0) != sizeof(msg)) {
+                    pfd[2 + i].fd = -1;
+                } else if (msg.kind == STATION_HELLO) {
+                    stations[i].hello = msg;
+                    stations[i].port = msg.port;
+                } else if (msg.kind == STATION_READY) {
+                    stations[i].ready = 1;
+                } else {
+                    stations[i].fetched = msg;
+                }
+            }
+        }
+    }
+}
+
+// Returns whether a handshake request from port was answered
+static int answered(uint16_t port) {
+    for (int i = 0; i < answered_count; i++) {
+        if (answered_ports[i] == port) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Counts the stations booted whose handshake request was answered
+static int stations_linked(void) {
+    int linked = 0;
+
+    for (int i = 0; i < STATIONS; i++) {
+        linked += stations[i].ready && stations[i].port != 0 && answered(stations[i].port);
+    }
+
+    return linked;
+}
+
+// Sends "capture at" to the group, for the listed device IDs or all stations if count is 0
+static void send_capture(uint32_t id, int64_t at, const unsigned int *device_ids, int count) {
+    char buffer[MULMSG2_MAX_LEN];
+    unsigned char capture[12];
+    unsigned char ids[16];
+    mulmsg2 message;
+    struct sockaddr_in group = group_addr();
+
+    for (int i = 0; i < 4; i++) {
+        capture[i] = (id >> (8 * i)) & 0xff;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        capture[4 + i] = ((uint64_t) at >> (8 * i)) & 0xff;
+    }
+
+    for (int i = 0; i < count; i++) {
+        ids[2 * i] = device_ids[i] & 0xff;
+        ids[2 * i + 1] = device_ids[i] >> 8;
+    }
+
+    mulmsg2_init(&message, buffer, sizeof(buffer));
+    mulmsg_setSource(mulmsg2_header(&message), 1);
+    mulmsg_setAlive(mulmsg2_header(&message), 1);
+    mulmsg_setDeviceId(mulmsg2_header(&message), 0);
+    mulmsg2_put(&message, MULMSG2_CAPTURE_AT, capture, sizeof(capture));
+
+    if (count > 0) {
+        mulmsg2_put(&message, MULMSG2_DEVICE_IDS, ids, 2 * count);
+    }
+
+    mulmsg2_putU64(&message, MULMSG2_CLOCK, controller_us());
+    sendto(controller_fd, buffer, mulmsg2_length(&message), 0, (struct sockaddr *) &group, sizeof(group));
+}
+
+int main(void) {
+    uint16_t controller_port;
+
+    controller_fd = unicast_socket(&controller_port);
+    controller_group_fd = group_socket();
+    CHECK(controller_fd >= 0 && controller_group_fd >= 0);
+
+    if (controller_fd < 0 || controller_group_fd < 0) {
+        printf("no loopback multicast\n");
+        return test_done("sync_capture");
+    }
+
+    // One process per station, the fakes keep their state in statics
+    for (int i = 0; i < STATIONS; i++) {
+        int pair[2];
+
+        socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair);
+        fflush(stdout);
+        stations[i].pid = fork();
+
+        if (stations[i].pid == 0) {
+            close(pair[0]);
+            close(controller_fd);
+            close(controller_group_fd);
+            _exit(station_main(i, pair[1], controller_port));
+        }
+
+        close(pair[1]);
+        stations[i].ctrl = pair[0];
+    }
+
+    // Every station boots and takes a clock sample from the answer to its handshake request
+    int64_t start = esp_timer_get_time();
+
+    while (stations_linked() < STATIONS && esp_timer_get_time() - start < 20000000) {
+        controller_run(100);
+    }
+
+    printf("%d of %d stations linked after %lld ms\n", stations_linked(), STATIONS,
+           (long long) (esp_timer_get_time() - start) / 1000);
+    CHECK_EQ(stations_linked(), STATIONS);
+    controller_run(300);
+
+    // Capture at T, addressed to a list containing the stations' device ID
+    unsigned int addressed[] = { 1, CONFIG_DEVICE_ID, 7 };
+    int64_t at = controller_us() + CAPTURE_AHEAD_MS * 1000LL;
+
+    send_capture(CAPTURE_ID, at, addressed, 3);
+    controller_run(CAPTURE_AHEAD_MS + 1000);
+
+    // Each station fetches its latched frame by the sequence number it reported
+    for (int i = 0; i < STATIONS; i++) {
+        station_msg_t fetch = { .kind = STATION_FETCH, .seq = stations[i].seq };
+
+        CHECK_EQ(stations[i].captured, 1);
+        send(stations[i].ctrl, &fetch, sizeof(fetch), 0);
+    }
+
+    controller_run(500);
+
+    int32_t skew_min = INT32_MAX;
+    int32_t skew_max = INT32_MIN;
+    int64_t true_min = INT64_MAX;
+    int64_t true_max = INT64_MIN;
+    int64_t error_max = 0;
+    uint32_t rtt_max = 0;
+
+    for (int i = 0; i < STATIONS; i++) {
+        station_t *s = &stations[i];
+        // The estimated offset put the latch at T - est on the station clock, the true offset maps it back
+        int64_t clock_error = s->fetched.est_offset - s->hello.true_offset;
+        int64_t true_skew = s->skew - clock_error;
+
+        CHECK_EQ(s->fetched.kind, STATION_FETCHED);
+        CHECK_EQ(s->fetched.status, 200);
+        CHECK_EQ(s->fetched.skew, s->skew);
+        CHECK(s->fetched.etag_ok);
+        CHECK(s->fetched.jpeg_ok);
+        // The controller's stamp lies between request and answer, so the error is at most half the round trip
+        CHECK(s->fetched.rtt > 0);
+        CHECK(llabs(clock_error) <= s->fetched.rtt / 2 + 100);
+        // The first frame completed after T
+        CHECK(s->skew >= 0 && s->skew < 2 * FRAME_US + 50000);
+
+        skew_min = MIN(skew_min, s->skew);
+        skew_max = MAX(skew_max, s->skew);
+        true_min = MIN(true_min, true_skew);
+        true_max = MAX(true_max, true_skew);
+        error_max = MAX(error_max, llabs(clock_error));
+        rtt_max = MAX(rtt_max, s->fetched.rtt);
+    }
+
+    printf("%d stations latched capture %d: reported skew %.1f..%.1f ms (spread %.1f ms)\n", STATIONS, CAPTURE_ID,
+           skew_min / 1e3, skew_max / 1e3, (skew_max - skew_min) / 1e3);
+    printf("true capture times %.1f..%.1f ms after T (spread %.1f ms), clock error up to %lld us, rtt up to %u us\n",
+           true_min / 1e3, true_max / 1e3, (true_max - true_min) / 1e3, (long long) error_max, rtt_max);
+    // Within a frame period of each other, as the cameras are not synchronized, plus the clock errors
+    CHECK(true_max - true_min <= FRAME_US + 2 * error_max + 15000);
+
+    // A frame nobody latched
+    station_msg_t fetch = { .kind = STATION_FETCH, .seq = stations[0].seq + 100000 };
+
+    send(stations[0].ctrl, &fetch, sizeof(fetch), 0);
+    controller_run(300);
+    CHECK_EQ(stations[0].fetched.status, 404);
+
+    // A command for other device IDs latches nothing
+    unsigned int others[] = { CONFIG_DEVICE_ID + 1 };
+
+    send_capture(CAPTURE_ID + 1, controller_us() + 200000, others, 1);
+    controller_run(1200);
+
+    for (int i = 0; i < STATIONS; i++) {
+        CHECK_EQ(stations[i].captured, 1);
+    }
+
+    for (int i = 0; i < STATIONS; i++) {
+        station_msg_t stop = { .kind = STATION_EXIT };
+        int status;
+
+        send(stations[i].ctrl, &stop, sizeof(stop), 0);
+
+        if (waitpid(stations[i].pid, &status, 0) != stations[i].pid || !WIFEXITED(status)
+                || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "station %d failed\n", i);
+            test_failures++;
+        }
+    }
+
+    return test_done("sync_capture");
+}
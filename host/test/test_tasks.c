@@ -0,0 +1,317 @@
+/*
+ * test_tasks.c
+ *
+ *  Checks that the application tasks run on the cores, priorities and
+ *  stacks of the task configuration and that /metrics lists them. A
+ *  simulated two-core fixed priority scheduler then runs the configured
+ *  topology and the old one, where LED frames were written on the HTTP
+ *  task, while a large JPEG is sent, and compares the LED latency. The
+ *  CPU costs and periods of the simulation are estimates, not measured
+ *  on the ESP32. Last, the firmware's LED task is timed while another
+ *  thread pulls large images, which only shows that nothing on the LED
+ *  path waits for the HTTP server.
+ */
+
+#include "test.h"
+#include "LED.h"
+#include <pthread.h>
+
+// Simulated time step and length in us
+#define SIM_STEP 10
+#define SIM_LENGTH 20000000
+#define SIM_FLOATING -1
+#define SIM_MAX_JOBS 64
+
+// Estimated CPU costs in us
+#define COST_JPEG 60000         // sending a 400KB JPEG, between waits for the TCP window
+#define COST_LED_REQUEST 100    // receiving and parsing /start_led
+#define COST_LED_FRAME 400      // encoding a frame and handing it to the RMT
+#define LED_PERIOD 20000
+
+#define LED_FRAMES 500
+#define IMAGE_LEN 400000
+
+typedef struct {
+    int64_t release;
+    int64_t remaining;
+    int led;                // a LED frame, latency is measured from the release to its end
+    int64_t led_release;
+    int next;               // task the job moves on to, -1 for none
+    int64_t next_cost;
+} sim_job_t;
+
+typedef struct {
+    const char *name;
+    int core;
+    int prio;
+    sim_job_t jobs[SIM_MAX_JOBS];
+    int head;
+    int count;
+} sim_task_t;
+
+// Periodic work handed to a task
+typedef struct {
+    int task;
+    int64_t period;         // 0 to release the next job when the last one ended
+    int64_t cost;
+    int led;
+    int next;
+    int64_t next_cost;
+    int64_t due;
+} sim_source_t;
+
+typedef struct {
+    sim_task_t tasks[12];
+    int task_count;
+    sim_source_t sources[12];
+    int source_count;
+    int64_t latencies[SIM_LENGTH / LED_PERIOD + 1];
+    int latency_count;
+} sim_t;
+
+static int sim_task(sim_t *sim, const char *name, int core, int prio) {
+    sim->tasks[sim->task_count] = (sim_task_t) { .name = name, .core = core, .prio = prio };
+    return sim->task_count++;
+}
+
+static void sim_source(sim_t *sim, int task, int64_t period, int64_t cost, int led, int next, int64_t next_cost) {
+    sim->sources[sim->source_count++] = (sim_source_t) {
+            .task = task, .period = period, .cost = cost, .led = led, .next = next, .next_cost = next_cost,
+    };
+}
+
+static void sim_push(sim_task_t *task, sim_job_t job) {
+    if (task->count < SIM_MAX_JOBS) {
+        task->jobs[(task->head + task->count++) % SIM_MAX_JOBS] = job;
+    }
+}
+
+// Runs the highest priority ready task of each core, floating tasks take any core left, one step at a time
+static void sim_run(sim_t *sim) {
+    for (int64_t now = 0; now < SIM_LENGTH; now += SIM_STEP) {
+        for (int i = 0; i < sim->source_count; i++) {
+            sim_source_t *source = &sim->sources[i];
+            sim_task_t *task = &sim->tasks[source->task];
+            int due = source->period > 0 ? now >= source->due : task->count == 0;
+
+            if (due) {
+                sim_push(task, (sim_job_t) {
+                        .release = now, .remaining = source->cost, .led = source->led, .led_release = now,
+                        .next = source->next, .next_cost = source->next_cost,
+                });
+                source->due = now + source->period;
+            }
+        }
+
+        int running[2] = { -1, -1 };
+
+        for (int core = 0; core < 2; core++) {
+            for (int i = 0; i < sim->task_count; i++) {
+                sim_task_t *task = &sim->tasks[i];
+                int taken = running[0] == i || running[1] == i;
+
+                if (task->count > 0 && !taken && (task->core == core || task->core == SIM_FLOATING)
+                        && (running[core] < 0 || task->prio > sim->tasks[running[core]].prio)) {
+                    running[core] = i;
+                }
+            }
+        }
+
+        for (int core = 0; core < 2; core++) {
+            if (running[core] < 0) {
+                continue;
+            }
+
+            sim_task_t *task = &sim->tasks[running[core]];
+            sim_job_t *job = &task->jobs[task->head];
+
+            job->remaining -= SIM_STEP;
+
+            if (job->remaining <= 0) {
+                sim_job_t done = *job;
+
+                task->head = (task->head + 1) % SIM_MAX_JOBS;
+                task->count--;
+
+                if (done.next >= 0) {
+                    sim_push(&sim->tasks[done.next], (sim_job_t) {
+                            .release = now, .remaining = done.next_cost, .led = done.led,
+                            .led_release = done.led_release, .next = -1,
+                    });
+                } else if (done.led) {
+                    sim->latencies[sim->latency_count++] = now + SIM_STEP - done.led_release;
+                }
+            }
+        }
+    }
+}
+
+// Load both topologies share: WiFi and lwIP while the image goes out, the other application tasks
+static void sim_background(sim_t *sim, int wifi, int tcpip) {
+    sim_source(sim, wifi, 1000, 150, 0, -1, 0);
+    sim_source(sim, tcpip, 1000, 200, 0, -1, 0);
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Median and maximum LED latency in us
+static void sim_latency(sim_t *sim, const char *topology, int64_t *median, int64_t *max) {
+    qsort(sim->latencies, sim->latency_count, sizeof(int64_t), compare_i64);
+    *median = sim->latencies[sim->latency_count / 2];
+    *max = sim->latencies[sim->latency_count - 1];
+    printf("%s: %d LED frames, latency median %.2fms, max %.2fms\n", topology, sim->latency_count, *median / 1e3,
+           *max / 1e3);
+}
+
+// Pulls large images until stopped
+static volatile int pulling = 1;
+static volatile int images;
+
+static void *pull_images(void *arg) {
+    int fd = fake_httpd_connect(80);
+
+    while (pulling) {
+        fake_http_response_t response;
+        fake_http_request_t request = { .method = HTTP_GET, .uri = "/jpg" };
+
+        if (fake_httpd_request_on(fd, &request, &response) == ESP_OK && response.len >= IMAGE_LEN) {
+            images++;
+        }
+
+        fake_http_response_free(&response);
+    }
+
+    fake_httpd_disconnect(fd);
+    return NULL;
+}
+
+// Checks the core, priority and stack of a task
+static void check_task(const TaskStatus_t *status, int count, const char *name, int core, int prio, int stack) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(status[i].pcTaskName, name) == 0) {
+            CHECK_EQ(status[i].xCoreID, core);
+            CHECK_EQ(status[i].uxCurrentPriority, prio);
+            CHECK_EQ(status[i].usStackHighWaterMark, stack);
+            return;
+        }
+    }
+
+    fprintf(stderr, "task %s not found\n", name);
+    test_failures++;
+}
+
+int main(void) {
+    static sim_t configured;
+    static sim_t old;
+    int64_t median;
+    int64_t max;
+    int64_t old_median;
+    int64_t old_max;
+
+    // Configured: pinned LED, capture, motion, snapshot and stream tasks, two floating HTTP servers
+    sim_t *sim = &configured;
+    int wifi = sim_task(sim, "wifi", 0, 23);
+    int tcpip = sim_task(sim, "tcpip", SIM_FLOATING, 18);
+    int httpd = sim_task(sim, "httpd", SIM_FLOATING, CONFIG_HTTP_TASK_PRIORITY);
+    int stream = sim_task(sim, "stream_task_0", CONFIG_STREAM_TASK_CORE, CONFIG_STREAM_TASK_PRIORITY);
+    int led = sim_task(sim, "led_task", CONFIG_LED_TASK_CORE, CONFIG_LED_TASK_PRIORITY);
+    int capture = sim_task(sim, "capture_task", CONFIG_CAPTURE_TASK_CORE, CONFIG_CAPTURE_TASK_PRIORITY);
+    int motion = sim_task(sim, "motion_task", CONFIG_MOTION_TASK_CORE, CONFIG_MOTION_TASK_PRIORITY);
+    int snapshot = sim_task(sim, "snapshot_task", CONFIG_SNAPSHOT_TASK_CORE, CONFIG_SNAPSHOT_TASK_PRIORITY);
+    int mcast = sim_task(sim, "mcast_task", CONFIG_MCAST_TASK_CORE, CONFIG_MCAST_TASK_PRIORITY);
+
+    sim_background(sim, wifi, tcpip);
+    sim_source(sim, stream, 0, COST_JPEG, 0, -1, 0);
+    sim_source(sim, httpd, LED_PERIOD, COST_LED_REQUEST, 1, led, COST_LED_FRAME);
+    sim_source(sim, capture, 40000, 1000, 0, -1, 0);
+    sim_source(sim, motion, 40000, 10000, 0, -1, 0);
+    sim_source(sim, snapshot, 1000000, 300, 0, -1, 0);
+    sim_source(sim, mcast, 500000, 200, 0, -1, 0);
+    sim_run(sim);
+    sim_latency(sim, "configured", &median, &max);
+
+    // Old: one server for images and LEDs, frames encoded and sent on the HTTP task, nothing pinned
+    sim = &old;
+    wifi = sim_task(sim, "wifi", 0, 23);
+    tcpip = sim_task(sim, "tcpip", SIM_FLOATING, 18);
+    httpd = sim_task(sim, "httpd", SIM_FLOATING, 5);
+    mcast = sim_task(sim, "mcast_task", SIM_FLOATING, 5);
+
+    sim_background(sim, wifi, tcpip);
+    sim_source(sim, httpd, 0, COST_JPEG, 0, -1, 0);
+    sim_source(sim, httpd, LED_PERIOD, COST_LED_REQUEST + COST_LED_FRAME, 1, -1, 0);
+    sim_source(sim, mcast, 500000, 200, 0, -1, 0);
+    sim_run(sim);
+    sim_latency(sim, "old", &old_median, &old_max);
+
+    // Only the tasks of higher priority on the LED core come before a frame, never the image
+    CHECK(configured.latency_count >= SIM_LENGTH / LED_PERIOD - 1);
+    CHECK(max < 2000);
+    CHECK(old_max > COST_JPEG / 2);
+
+    // The firmware's tasks where the configuration puts them
+    static TaskStatus_t status[32];
+
+    test_boot();
+
+    int count = uxTaskGetSystemState(status, 32, NULL);
+
+    check_task(status, count, "led_task", CONFIG_LED_TASK_CORE, CONFIG_LED_TASK_PRIORITY, CONFIG_LED_TASK_STACK);
+    check_task(status, count, "capture_task", CONFIG_CAPTURE_TASK_CORE, CONFIG_CAPTURE_TASK_PRIORITY,
+               CONFIG_CAPTURE_TASK_STACK);
+    check_task(status, count, "mcast_task", CONFIG_MCAST_TASK_CORE, CONFIG_MCAST_TASK_PRIORITY,
+               CONFIG_MCAST_TASK_STACK);
+    check_task(status, count, "stream_task_0", CONFIG_STREAM_TASK_CORE, CONFIG_STREAM_TASK_PRIORITY,
+               CONFIG_STREAM_TASK_STACK);
+
+    // Listed with their headroom and run time
+    fake_http_response_t response;
+
+    CHECK_EQ(fake_httpd_get(80, "/metrics", NULL, &response), ESP_OK);
+
+    char *text = calloc(1, response.len + 1);
+    char led_line[96];
+
+    memcpy(text, response.body, response.len);
+    fake_http_response_free(&response);
+    snprintf(led_line, sizeof(led_line), "esp32cam_task_stack_free_bytes{task=\"led_task\",priority=\"%d\"} %d",
+             CONFIG_LED_TASK_PRIORITY, CONFIG_LED_TASK_STACK);
+    CHECK(strstr(text, led_line) != NULL);
+    CHECK(strstr(text, "esp32cam_task_cpu_seconds_total{task=\"led_task\"}") != NULL);
+    free(text);
+
+    // LED frames while another thread pulls large images
+    static struct led_state state;
+    static int64_t latencies[LED_FRAMES];
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    pthread_t puller;
+
+    fake_camera_set_jpeg_len(IMAGE_LEN);
+    pthread_create(&puller, NULL, pull_images, NULL);
+    test_sleep_ms(100);
+
+    for (int i = 0; i < LED_FRAMES; i++) {
+        int64_t start = esp_timer_get_time();
+
+        state.leds[0] = i;
+        write_leds_notify(&state, self);
+        CHECK(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(2000)) > 0);
+        latencies[i] = esp_timer_get_time() - start;
+    }
+
+    pulling = 0;
+    pthread_join(puller, NULL);
+
+    qsort(latencies, LED_FRAMES, sizeof(int64_t), compare_i64);
+    printf("firmware: %d LED frames during %d images of %dKB, latency median %.2fms, max %.2fms\n", LED_FRAMES,
+           images, IMAGE_LEN / 1024, latencies[LED_FRAMES / 2] / 1e3, latencies[LED_FRAMES - 1] / 1e3);
+    CHECK(images > 0);
+    CHECK(latencies[LED_FRAMES / 2] < 20000);
+
+    return test_done("tasks");
+}
@@ -0,0 +1,99 @@
+/*
+ * frame_decode.h
+ *
+ *  Reference decoder of the binary capture + metadata format of
+ *  /frame.bin and push mode for Linux clients. Fields are read byte by
+ *  byte as little-endian, so it works on any host and does not depend
+ *  on the packing of the firmware's frame_header_t. Headers longer than
+ *  the fields known here are skipped, later versions may append fields.
+ */
+
+#ifndef HOST_TOOLS_FRAME_DECODE_H_
+#define HOST_TOOLS_FRAME_DECODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_DECODE_MAGIC   0x4d414346
+#define FRAME_DECODE_MIN_LEN 36
+
+// A decoded frame, jpeg points into the buffer that was decoded
+typedef struct {
+    uint16_t version;
+    uint16_t header_len;
+    uint32_t seq;
+    int64_t timestamp;      // us since the station booted
+    uint32_t capture_us;
+    uint8_t framesize;
+    uint8_t quality;
+    uint16_t width;
+    uint16_t height;
+    uint16_t device_id;
+    uint32_t len;
+    const uint8_t *jpeg;
+} frame_info_t;
+
+static inline uint16_t frame_u16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t frame_u32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t frame_u64(const uint8_t *p) {
+    return frame_u32(p) | (uint64_t) frame_u32(p + 4) << 32;
+}
+
+// Decodes the frame at the start of buf, returns the bytes it takes, 0 if more are needed, -1 if it is none
+static inline long frame_decode(const uint8_t *buf, size_t len, frame_info_t *info) {
+    if (len < 8) {
+        return 0;
+    }
+
+    if (frame_u32(buf) != FRAME_DECODE_MAGIC || frame_u16(buf + 6) < FRAME_DECODE_MIN_LEN) {
+        return -1;
+    }
+
+    info->version = frame_u16(buf + 4);
+    info->header_len = frame_u16(buf + 6);
+
+    if (len < info->header_len) {
+        return 0;
+    }
+
+    info->seq = frame_u32(buf + 8);
+    info->timestamp = (int64_t) frame_u64(buf + 12);
+    info->capture_us = frame_u32(buf + 20);
+    info->framesize = buf[24];
+    info->quality = buf[25];
+    info->width = frame_u16(buf + 26);
+    info->height = frame_u16(buf + 28);
+    info->device_id = frame_u16(buf + 30);
+    info->len = frame_u32(buf + 32);
+    info->jpeg = buf + info->header_len;
+
+    if (len - info->header_len < info->len) {
+        return 0;
+    }
+
+    return (long) info->header_len + info->len;
+}
+
+// Skips the head of an HTTP response, returns where the body starts, 0 without a head, -1 if it is incomplete
+static inline long frame_skip_http(const uint8_t *buf, size_t len) {
+    if (len < 5 || memcmp(buf, "HTTP/", 5) != 0) {
+        return len < 5 && memcmp(buf, "HTTP/", len) == 0 ? -1 : 0;
+    }
+
+    for (size_t i = 3; i < len; i++) {
+        if (memcmp(buf + i - 3, "\r\n\r\n", 4) == 0) {
+            return (long) i + 1;
+        }
+    }
+
+    return -1;
+}
+
+#endif /* HOST_TOOLS_FRAME_DECODE_H_ */
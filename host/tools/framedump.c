@@ -0,0 +1,110 @@
+/*
+ * framedump.c
+ *
+ *  Reads frames in the binary capture + metadata format from a file or
+ *  stdin and prints their metadata, optionally writing the JPEGs to a
+ *  directory. Takes a push mode stream as written by e.g.
+ *  "nc -l 5005 > frames.bin" as well as saved /frame.bin responses:
+ *
+ *    curl -s http://station/frame.bin | framedump -o frames
+ */
+
+#include "frame_decode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Writes the JPEG of a frame to dir, returns 0 on success
+static int write_jpeg(const char *dir, const frame_info_t *info) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/frame_%u_%u.jpg", dir, info->device_id, info->seq);
+
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    size_t written = fwrite(info->jpeg, 1, info->len, file);
+
+    fclose(file);
+    return written == info->len ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    FILE *in = stdin;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt != 'o') {
+            fprintf(stderr, "usage: %s [-o dir] [file]\n", argv[0]);
+            return 2;
+        }
+
+        dir = optarg;
+    }
+
+    if (optind < argc && (in = fopen(argv[optind], "rb")) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    size_t size = 1 << 20;
+    size_t len = 0;
+    uint8_t *buf = malloc(size);
+    int frames = 0;
+    int eof = 0;
+
+    while (buf != NULL && (!eof || len > 0)) {
+        if (!eof) {
+            if (len == size && (buf = realloc(buf, size *= 2)) == NULL) {
+                break;
+            }
+
+            size_t n = fread(buf + len, 1, size - len, in);
+
+            eof = n == 0;
+            len += n;
+        }
+
+        size_t pos = 0;
+        frame_info_t info;
+
+        for (;;) {
+            long head = frame_skip_http(buf + pos, len - pos);
+            long taken = head < 0 ? 0 : frame_decode(buf + pos + head, len - pos - head, &info);
+
+            if (taken < 0) {
+                fprintf(stderr, "no frame at byte %zu\n", pos);
+                return 1;
+            } else if (taken == 0) {
+                break;
+            }
+
+            printf("device %u frame %u: %ux%u q%u, %uB, completed at %.6fs after %uus\n", info.device_id,
+                   info.seq, info.width, info.height, info.quality, info.len, info.timestamp / 1e6,
+                   info.capture_us);
+            frames++;
+
+            if (dir != NULL && write_jpeg(dir, &info) != 0) {
+                return 1;
+            }
+
+            pos += head + taken;
+        }
+
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+
+        if (eof && len > 0) {
+            fprintf(stderr, "%zu bytes of an incomplete frame at the end\n", len);
+            return 1;
+        }
+    }
+
+    free(buf);
+    return frames > 0 ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+/*
+ * long_strip.h
+ *
+ *  Settings of the host build driving a single strip of 1000 LEDs, the
+ *  longest the LED encoder is tested with.
+ */
+
+#ifndef HOST_VARIANTS_LONG_STRIP_H_
+#define HOST_VARIANTS_LONG_STRIP_H_
+
+#include <settings.h>
+
+#undef CONFIG_LED_STRIPS
+#define CONFIG_LED_STRIPS(X) \
+        X(RMT_CHANNEL_0, 14, 1000, LED_ORDER_GRB)
+
+#undef CONFIG_LED_BUFFER_KB
+#define CONFIG_LED_BUFFER_KB 200
+
+#endif /* HOST_VARIANTS_LONG_STRIP_H_ */
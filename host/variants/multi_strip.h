@@ -0,0 +1,23 @@
+/*
+ * multi_strip.h
+ *
+ *  Settings of the host build driving three strips of different length
+ *  and colour order on channels that are not next to each other, so
+ *  they get different RMT memory.
+ */
+
+#ifndef HOST_VARIANTS_MULTI_STRIP_H_
+#define HOST_VARIANTS_MULTI_STRIP_H_
+
+#include <settings.h>
+
+#undef CONFIG_LED_STRIPS
+#define CONFIG_LED_STRIPS(X) \
+        X(RMT_CHANNEL_0, 14, 300, LED_ORDER_GRB) \
+        X(RMT_CHANNEL_2, 15, 120, LED_ORDER_RGB) \
+        X(RMT_CHANNEL_3, 13, 60, LED_ORDER_BGR)
+
+#undef CONFIG_LED_BUFFER_KB
+#define CONFIG_LED_BUFFER_KB 100
+
+#endif /* HOST_VARIANTS_MULTI_STRIP_H_ */
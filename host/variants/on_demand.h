@@ -0,0 +1,15 @@
+/*
+ * on_demand.h
+ *
+ *  Settings of the host build capturing frames on demand, without the
+ *  producer task.
+ */
+
+#ifndef HOST_VARIANTS_ON_DEMAND_H_
+#define HOST_VARIANTS_ON_DEMAND_H_
+
+#include <settings.h>
+
+#undef CONFIG_CAPTURE_PIPELINE
+
+#endif /* HOST_VARIANTS_ON_DEMAND_H_ */
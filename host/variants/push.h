@@ -0,0 +1,19 @@
+/*
+ * push.h
+ *
+ *  Settings of the host build with the options settings.h ships without:
+ *  push mode towards a collector on the local host and rate control.
+ */
+
+#ifndef HOST_VARIANTS_PUSH_H_
+#define HOST_VARIANTS_PUSH_H_
+
+#include <settings.h>
+
+#define CONFIG_PUSH_MODE
+#define CONFIG_RATE_CONTROL
+
+#undef CONFIG_PUSH_COLLECTOR_ADDR
+#define CONFIG_PUSH_COLLECTOR_ADDR "127.0.0.1"
+
+#endif /* HOST_VARIANTS_PUSH_H_ */
@@ -0,0 +1,16 @@
+/*
+ * rate_control.h
+ *
+ *  Settings of the host build adapting the quality and frame size of
+ *  /jpg to the frame size budget of settings.h.
+ */
+
+#ifndef HOST_VARIANTS_RATE_CONTROL_H_
+#define HOST_VARIANTS_RATE_CONTROL_H_
+
+#include <settings.h>
+
+#define CONFIG_RATE_CONTROL
+#define CONFIG_RATE_FRAMESIZE
+
+#endif /* HOST_VARIANTS_RATE_CONTROL_H_ */
@@ -0,0 +1,16 @@
+/*
+ * short_idle.h
+ *
+ *  Settings of the host build closing idle keep-alive connections after
+ *  a second, so tests see the sweep without waiting half a minute.
+ */
+
+#ifndef HOST_VARIANTS_SHORT_IDLE_H_
+#define HOST_VARIANTS_SHORT_IDLE_H_
+
+#include <settings.h>
+
+#undef CONFIG_HTTP_IDLE_TIMEOUT_S
+#define CONFIG_HTTP_IDLE_TIMEOUT_S 1
+
+#endif /* HOST_VARIANTS_SHORT_IDLE_H_ */
@@ -1,67 +1,449 @@
 #include "LED.h"
+#include "metrics.h"
 #include "driver/rmt.h"
-
-#define LED_RMT_TX_CHANNEL RMT_CHANNEL_0
-#define LED_RMT_TX_GPIO 14
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <string.h>
+#include <sys/param.h>
 
 #define BITS_PER_LED_CMD 24
-#define LED_BUFFER_ITEMS ((NUM_LEDS * BITS_PER_LED_CMD))
+#define LED_COLOR_MASK 0xFFFFFF
 
 #define T0H 8
 #define T1H 17
 #define T1L 8
 #define T0L 17
+// Low period after a frame that makes the strip latch it
+#define TRST 3000
+
+#define LED_RESET_ITEMS 1
 
-#define GREEN 0xFF0000
-#define RED   0x00FF00
+// Task notification bits of the LED task
+#define LED_EVENT_FRAME   0x01     // a frame was queued
+#define LED_EVENT_EFFECTS 0x02     // new effects were staged
+#define LED_EVENT_TICK    0x04     // the next effect frame is due
+// RMT memory blocks a channel uses at most, the following channels lend theirs
+#define LED_MEM_BLOCKS 2
+
+#define RED   0xFF0000
+#define GREEN 0x00FF00
 #define BLUE  0x0000FF
 #define WHITE 0xFFFFFF
 #define BLACK 0x000000
-#define NUM_LEDS 50
 
-rmt_item32_t led_data_buffer[LED_BUFFER_ITEMS];
+// Strip of the registry and where its LEDs live
+struct led_strip {
+    rmt_channel_t channel;
+    int gpio;
+    uint32_t length;
+    led_order_t order;
+    uint32_t first;             // index of its first LED in struct led_state
+    rmt_item32_t *items[2];     // its part of both buffers
+    uint32_t latch[2];          // LED whose first item is overwritten by an early reset item, length if none
+    uint32_t send;              // LEDs to send of the frame just encoded
+};
+
+#define LED_STRIP_INIT(c, g, n, o) { .channel = (c), .gpio = (g), .length = (n), .order = (o) },
+
+static struct led_strip strips[] = {
+        CONFIG_LED_STRIPS(LED_STRIP_INIT)
+};
+
+#define LED_STRIP_COUNT (sizeof(strips) / sizeof(strips[0]))
+#define LED_BUFFER_ITEMS (NUM_LEDS * BITS_PER_LED_CMD + LED_STRIP_COUNT * LED_RESET_ITEMS)
+
+static const char *TAG = "LED";
+// One buffer is transmitted by the RMT driver while the other one is encoded, every strip has its part of both
+static rmt_item32_t led_data_buffer[2][LED_BUFFER_ITEMS];
+
+_Static_assert(sizeof(led_data_buffer) <= CONFIG_LED_BUFFER_KB * 1024,
+               "The RMT items of CONFIG_LED_STRIPS do not fit into CONFIG_LED_BUFFER_KB");
+
+// Colours each buffer holds, only LEDs differing from them are encoded again
+static struct led_state buffer_state[2];
+static int buffer_valid[2];
+// Colours the strips are showing, unchanged LEDs at their end are not sent again
+static struct led_state shown_state;
+static int shown_valid;
+// RMT items of every 4 bit pattern, most significant bit first
+static rmt_item32_t nibble_items[16][4];
+static TaskHandle_t led_task_handle;
+// Frames handed to the LED task, writers fill the one it does not read, a frame not taken yet is overwritten
+static SemaphoreHandle_t frame_lock;
+static struct led_state frames[2];
+static int frame_read = 0;
+static int frame_pending = 0;
+static TaskHandle_t pending_notify = NULL;
+// Waiter of the frame currently transmitted and the buffer encoded next, only touched by the LED task
+static TaskHandle_t on_wire = NULL;
+static int back = 0;
+
+// Effects handed over to the LED task by led_set_effects
+static portMUX_TYPE staged_mux = portMUX_INITIALIZER_UNLOCKED;
+static anim_effect_t staged_effects[ANIM_MAX_EFFECTS];
+static int staged_count;
+// Effects being played and the frame they are played on top of, only touched by the LED task
+static anim_t anim;
+static const struct led_state *base_state = &frames[0];
+static struct led_state anim_state;
+static int64_t anim_start;
+static esp_timer_handle_t anim_timer;
+
+static uint32_t setup_rmt_data_buffer(int buffer, const struct led_state *new_state);
+
+static void led_task(void *pvParameters);
+
+// Wakes the LED task for the next effect frame, runs on the esp_timer task
+static void anim_timer_tick(void *arg) {
+    xTaskNotify(led_task_handle, LED_EVENT_TICK, eSetBits);
+}
+
+// Returns the RMT memory blocks a strip may use without overlapping the next registered channel
+static int strip_mem_blocks(const struct led_strip *strip) {
+    int next = RMT_CHANNEL_MAX;
+
+    for (int i = 0; i < LED_STRIP_COUNT; i++) {
+        if (strips[i].channel > strip->channel && strips[i].channel < next) {
+            next = strips[i].channel;
+        } else if (&strips[i] != strip && strips[i].channel == strip->channel) {
+            return 0;
+        }
+    }
 
-void setup_rmt_data_buffer(struct led_state new_state);
+    return MIN(LED_MEM_BLOCKS, next - strip->channel);
+}
 
 void init_leds(void) {
-    rmt_config_t config;
-    config.rmt_mode = RMT_MODE_TX;
-    config.channel = LED_RMT_TX_CHANNEL;
-    config.gpio_num = LED_RMT_TX_GPIO;
-    config.mem_block_num = 2;
-    config.tx_config.loop_en = false;
-    config.tx_config.carrier_freq_hz = 100;
-    config.tx_config.carrier_duty_percent = 50;
-    config.tx_config.carrier_en = false;
-    config.tx_config.idle_output_en = true;
-    config.tx_config.idle_level = 0;
-    config.clk_div = 4;
-
-    ESP_ERROR_CHECK(rmt_config(&config));
-    ESP_ERROR_CHECK(rmt_driver_install(config.channel, 0, 0));
-
-}
-
-void write_leds(struct led_state new_state) {
-    setup_rmt_data_buffer(new_state);
-    ESP_ERROR_CHECK(rmt_write_items(LED_RMT_TX_CHANNEL, led_data_buffer, LED_BUFFER_ITEMS, false));
-    ESP_ERROR_CHECK(rmt_wait_tx_done(LED_RMT_TX_CHANNEL, portMAX_DELAY));
-}
-
-
-void setup_rmt_data_buffer(struct led_state new_state) {
-    for (uint32_t led = 0; led < NUM_LEDS; led++) {
-        uint32_t bits_to_send = new_state.leds[led];
-        uint32_t mask = 1 << (BITS_PER_LED_CMD - 1);
-        for (uint32_t bit = 0; bit < BITS_PER_LED_CMD; bit++) {
-            uint32_t bit_is_set = bits_to_send & mask;
-            led_data_buffer[led * BITS_PER_LED_CMD + bit] = bit_is_set ? (rmt_item32_t) {{{T1H, 1, T1L, 0}}}
-                                                                       : (rmt_item32_t) {{{T0H, 1, T0L, 0}}};
-            mask >>= 1;
+    uint32_t first = 0;
+    uint32_t offset = 0;
+
+    for (int i = 0; i < LED_STRIP_COUNT; i++) {
+        struct led_strip *strip = &strips[i];
+        rmt_config_t config;
+        config.rmt_mode = RMT_MODE_TX;
+        config.channel = strip->channel;
+        config.gpio_num = strip->gpio;
+        config.mem_block_num = strip_mem_blocks(strip);
+        config.tx_config.loop_en = false;
+        config.tx_config.carrier_freq_hz = 100;
+        config.tx_config.carrier_duty_percent = 50;
+        config.tx_config.carrier_en = false;
+        config.tx_config.idle_output_en = true;
+        config.tx_config.idle_level = 0;
+        config.clk_div = 4;
+
+        if (config.mem_block_num == 0) {
+            ESP_LOGE(TAG, "RMT channel %d is used by more than one strip", strip->channel);
+            ESP_ERROR_CHECK(ESP_ERR_INVALID_ARG);
+        }
+
+        ESP_ERROR_CHECK(rmt_config(&config));
+        ESP_ERROR_CHECK(rmt_driver_install(config.channel, 0, 0));
+
+        strip->first = first;
+        strip->items[0] = &led_data_buffer[0][offset];
+        strip->items[1] = &led_data_buffer[1][offset];
+        strip->latch[0] = strip->length;
+        strip->latch[1] = strip->length;
+
+        for (int b = 0; b < 2; b++) {
+            strip->items[b][strip->length * BITS_PER_LED_CMD] = (rmt_item32_t) {{{TRST, 0, TRST, 0}}};
+        }
+
+        first += strip->length;
+        offset += strip->length * BITS_PER_LED_CMD + LED_RESET_ITEMS;
+        ESP_LOGI(TAG, "Strip %d: LEDs %u-%u on GPIO %d, RMT channel %d", i, strip->first,
+                 first - 1, strip->gpio, strip->channel);
+    }
+
+    for (int nibble = 0; nibble < 16; nibble++) {
+        for (int bit = 0; bit < 4; bit++) {
+            nibble_items[nibble][bit] = nibble & (8 >> bit) ? (rmt_item32_t) {{{T1H, 1, T1L, 0}}}
+                                                            : (rmt_item32_t) {{{T0H, 1, T0L, 0}}};
+        }
+    }
+
+    esp_timer_create_args_t timer_args = {
+            .callback = anim_timer_tick,
+            .name = "anim_tick",
+    };
+
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &anim_timer));
+    frame_lock = xSemaphoreCreateMutex();
+    ESP_LOGI(TAG, "%d LEDs, %uB of RMT items out of %dKB", NUM_LEDS, (uint32_t) sizeof(led_data_buffer),
+             CONFIG_LED_BUFFER_KB);
+    xTaskCreatePinnedToCore(&led_task, "led_task", CONFIG_LED_TASK_STACK, NULL, CONFIG_LED_TASK_PRIORITY,
+                            &led_task_handle, CONFIG_LED_TASK_CORE);
+}
+
+void write_leds(const struct led_state *new_state) {
+    write_leds_notify(new_state, NULL);
+}
+
+void write_leds_notify(const struct led_state *new_state, TaskHandle_t notify) {
+    TaskHandle_t superseded = NULL;
+
+    xSemaphoreTake(frame_lock, portMAX_DELAY);
+
+    // If the LED task is behind, the frame it has not taken yet is superseded by this one
+    if (frame_pending) {
+        metrics_count(METRIC_LED_DROPS, 1);
+        superseded = pending_notify;
+    }
+
+    memcpy(&frames[frame_read ^ 1], new_state, sizeof(struct led_state));
+    pending_notify = notify;
+    __atomic_store_n(&frame_pending, 1, __ATOMIC_RELAXED);
+    xSemaphoreGive(frame_lock);
+
+    if (superseded != NULL) {
+        xTaskNotifyGive(superseded);
+    }
+
+    xTaskNotify(led_task_handle, LED_EVENT_FRAME, eSetBits);
+}
+
+// Switches to the frame written last, returns 0 if there is none, only called by the LED task
+static int take_frame(TaskHandle_t *notify) {
+    int taken;
+
+    xSemaphoreTake(frame_lock, portMAX_DELAY);
+    taken = frame_pending;
+
+    if (taken) {
+        frame_read ^= 1;
+        base_state = &frames[frame_read];
+        *notify = pending_notify;
+        __atomic_store_n(&frame_pending, 0, __ATOMIC_RELAXED);
+    }
+
+    xSemaphoreGive(frame_lock);
+    return taken;
+}
+
+void led_set_effects(const anim_effect_t *effects, int count) {
+    portENTER_CRITICAL(&staged_mux);
+
+    // No effects may come as NULL, which memcpy must not be given even for 0 bytes
+    if (count > 0) {
+        memcpy(staged_effects, effects, count * sizeof(anim_effect_t));
+    }
+
+    staged_count = count;
+    portEXIT_CRITICAL(&staged_mux);
+
+    xTaskNotify(led_task_handle, LED_EVENT_EFFECTS, eSetBits);
+}
+
+// Waits until every strip has sent its last frame
+static void wait_strips_done(void) {
+    for (int i = 0; i < LED_STRIP_COUNT; i++) {
+        ESP_ERROR_CHECK(rmt_wait_tx_done(strips[i].channel, portMAX_DELAY));
+    }
+}
+
+// Encodes and sends a frame, the previous one may still be on the wire from the other buffer
+static void show_frame(const struct led_state *state, TaskHandle_t notify) {
+    int64_t encode_start = esp_timer_get_time();
+    uint32_t send_leds = setup_rmt_data_buffer(back, state);
+    int64_t wait_start = esp_timer_get_time();
+    metrics_record(METRIC_LED_ENCODE, wait_start - encode_start);
+
+    if (send_leds == 0) {
+        // The strips already show this frame, the one still on the wire is its predecessor and latched once done
+        if (on_wire != NULL) {
+            wait_strips_done();
+            xTaskNotifyGive(on_wire);
+            on_wire = NULL;
+        }
+
+        if (notify != NULL) {
+            xTaskNotifyGive(notify);
+        }
+
+        return;
+    }
+
+    wait_strips_done();
+    metrics_record(METRIC_RMT_WAIT, esp_timer_get_time() - wait_start);
+
+    if (on_wire != NULL) {
+        xTaskNotifyGive(on_wire);
+    }
+
+    // All strips are started before any is waited for, so a frame takes as long as its longest strip
+    for (int i = 0; i < LED_STRIP_COUNT; i++) {
+        struct led_strip *strip = &strips[i];
+
+        if (strip->send > 0) {
+            ESP_ERROR_CHECK(rmt_write_items(strip->channel, strip->items[back],
+                                            strip->send * BITS_PER_LED_CMD + LED_RESET_ITEMS, false));
         }
     }
+
+    on_wire = notify;
+    back ^= 1;
+
+    // Nothing to overlap with, so report completion right away
+    if (on_wire != NULL && !__atomic_load_n(&frame_pending, __ATOMIC_RELAXED)) {
+        wait_strips_done();
+        xTaskNotifyGive(on_wire);
+        on_wire = NULL;
+    }
+}
+
+// Takes over staged effects and starts or stops the frame timer
+static void load_effects(void) {
+    anim_effect_t effects[ANIM_MAX_EFFECTS];
+    int count;
+
+    portENTER_CRITICAL(&staged_mux);
+    count = staged_count;
+    memcpy(effects, staged_effects, count * sizeof(anim_effect_t));
+    portEXIT_CRITICAL(&staged_mux);
+
+    esp_timer_stop(anim_timer);
+    anim_load(&anim, effects, count, CONFIG_ANIM_FPS);
+    anim_start = esp_timer_get_time();
+
+    if (count > 0) {
+        esp_timer_start_periodic(anim_timer, 1000000 / CONFIG_ANIM_FPS);
+    }
+}
+
+// Renders the effects due now on top of the base frame, repaints them completely if the base changed
+static void render_effects(int repaint) {
+    int64_t start = esp_timer_get_time();
+    uint32_t frame = (start - anim_start) * CONFIG_ANIM_FPS / 1000000;
+
+    if (repaint) {
+        anim_state = *base_state;
+        anim_reset(&anim);
+    }
+
+    anim_render(&anim, base_state->leds, anim_state.leds, frame);
+    metrics_record(METRIC_ANIM_RENDER, esp_timer_get_time() - start);
 }
 
+static void led_task(void *pvParameters) {
+    TaskHandle_t notify;
+    uint32_t events;
+
+    while (1) {
+        xTaskNotifyWait(0, UINT32_MAX, &events, portMAX_DELAY);
 
+        if (events & LED_EVENT_EFFECTS) {
+            load_effects();
+        }
+
+        int shown = 0;
+
+        // Written frames replace the base, the effects are played on top of each of them
+        while (take_frame(&notify)) {
+            if (anim.count > 0) {
+                render_effects(1);
+                show_frame(&anim_state, notify);
+            } else {
+                show_frame(base_state, notify);
+            }
+
+            shown = 1;
+        }
 
+        if (shown) {
+            continue;
+        }
 
+        if (events & LED_EVENT_EFFECTS) {
+            // Stopped effects leave the base frame behind
+            render_effects(1);
+            show_frame(&anim_state, NULL);
+        } else if ((events & LED_EVENT_TICK) && anim.count > 0) {
+            render_effects(0);
+            show_frame(&anim_state, NULL);
+        }
+    }
+}
+
+
+static inline void encode_led(rmt_item32_t *items, uint32_t bits) {
+    for (int shift = BITS_PER_LED_CMD - 4; shift >= 0; shift -= 4) {
+        const rmt_item32_t *nibble = nibble_items[(bits >> shift) & 0xF];
+        items[0] = nibble[0];
+        items[1] = nibble[1];
+        items[2] = nibble[2];
+        items[3] = nibble[3];
+        items += 4;
+    }
+}
+
+// Reorders a 0xRRGGBB colour into the byte order of a strip
+static inline uint32_t strip_bits(uint32_t rgb, led_order_t order) {
+    uint32_t r = (rgb >> 16) & 0xFF;
+    uint32_t g = (rgb >> 8) & 0xFF;
+    uint32_t b = rgb & 0xFF;
+
+    switch (order) {
+        case LED_ORDER_RBG: return (r << 16) | (b << 8) | g;
+        case LED_ORDER_GRB: return (g << 16) | (r << 8) | b;
+        case LED_ORDER_GBR: return (g << 16) | (b << 8) | r;
+        case LED_ORDER_BRG: return (b << 16) | (r << 8) | g;
+        case LED_ORDER_BGR: return (b << 16) | (g << 8) | r;
+        default: return rgb;
+    }
+}
+
+// Encodes the LEDs of a strip that changed since the buffer was last used, returns how many LEDs need to be sent
+static uint32_t setup_strip(struct led_strip *strip, int buffer, const struct led_state *new_state) {
+    rmt_item32_t *items = strip->items[buffer];
+    const uint32_t *colors = &new_state->leds[strip->first];
+    uint32_t *held = &buffer_state[buffer].leds[strip->first];
+    const uint32_t *shown = &shown_state.leds[strip->first];
+    uint32_t send_leds = 0;
+
+    for (uint32_t led = 0; led < strip->length; led++) {
+        uint32_t color = colors[led] & LED_COLOR_MASK;
+
+        if (!buffer_valid[buffer] || color != held[led] || led == strip->latch[buffer]) {
+            encode_led(&items[led * BITS_PER_LED_CMD], strip_bits(color, strip->order));
+            held[led] = color;
+        }
+
+        if (!shown_valid || color != shown[led]) {
+            send_leds = led + 1;
+        }
+    }
+
+    if (send_leds == 0) {
+        return 0;
+    }
+
+    // Latch right after the last changed LED, the ones behind keep their colour
+    strip->latch[buffer] = send_leds;
+
+    if (send_leds < strip->length) {
+        items[send_leds * BITS_PER_LED_CMD] = items[strip->length * BITS_PER_LED_CMD];
+    }
+
+    return send_leds;
+}
+
+// Encodes the LEDs that changed since the buffer was last used, returns how many LEDs of all strips need to be sent
+static uint32_t setup_rmt_data_buffer(int buffer, const struct led_state *new_state) {
+    uint32_t send_leds = 0;
+
+    for (int i = 0; i < LED_STRIP_COUNT; i++) {
+        strips[i].send = setup_strip(&strips[i], buffer, new_state);
+        send_leds += strips[i].send;
+    }
+
+    buffer_valid[buffer] = 1;
+
+    if (send_leds > 0) {
+        shown_state = buffer_state[buffer];
+        shown_valid = 1;
+    }
+
+    return send_leds;
+}
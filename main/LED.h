@@ -1,20 +1,41 @@
 #ifndef ESP32_CAM_HTTP_JPG_LED_H
 #define ESP32_CAM_HTTP_JPG_LED_H
 
+#include "settings.h"
+#include "anim.h"
 #include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
+// Order a strip expects the colour bytes in, the strips differ by vendor
+typedef enum {
+    LED_ORDER_RGB,
+    LED_ORDER_RBG,
+    LED_ORDER_GRB,
+    LED_ORDER_GBR,
+    LED_ORDER_BRG,
+    LED_ORDER_BGR,
+} led_order_t;
 
-#ifndef NUM_LEDS
-#define NUM_LEDS 50
-#endif
+// Total LEDs of all strips in CONFIG_LED_STRIPS
+#define LED_STRIP_LEDS(channel, gpio, leds, order) + (leds)
+#define NUM_LEDS (0 CONFIG_LED_STRIPS(LED_STRIP_LEDS))
 
 
+// Colours as 0xRRGGBB, reordered for each strip when sent
 struct led_state {
     uint32_t leds[NUM_LEDS];
 };
 
 void init_leds(void);
 
-void write_leds(struct led_state new_state);
+// Copies a frame for the LED task and returns immediately, a frame the task has not taken yet is replaced
+void write_leds(const struct led_state *new_state);
+
+// Like write_leds, notifies the task (xTaskNotifyGive) once the frame is latched or superseded
+void write_leds_notify(const struct led_state *new_state, TaskHandle_t notify);
+
+// Plays effects on top of the frames written, rendered at CONFIG_ANIM_FPS by the LED task, (NULL, 0) stops them
+void led_set_effects(const anim_effect_t *effects, int count);
 
 #endif //ESP32_CAM_HTTP_JPG_LED_H
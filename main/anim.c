@@ -0,0 +1,161 @@
+/*
+ * anim.c
+ *
+ *  LED effects rendered on the device.
+ */
+
+#include "anim.h"
+#include <math.h>
+#include <string.h>
+
+#define ANIM_GAMMA 2.2f
+
+// Reads effect records for num_leds LEDs, colours go through lut, returns the number of effects or -1 if malformed
+int anim_parse(const uint8_t *body, int len, const uint8_t *lut, int num_leds, anim_effect_t *effects) {
+    int count = len / ANIM_RECORD_LEN;
+
+    if (len % ANIM_RECORD_LEN != 0 || count > ANIM_MAX_EFFECTS) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++, body += ANIM_RECORD_LEN) {
+        anim_effect_t *effect = &effects[i];
+
+        effect->type = body[0];
+        effect->start = body[1] | (body[2] << 8);
+        effect->count = body[3] | (body[4] << 8);
+        effect->color = (lut[body[5]] << 16) | (lut[body[6]] << 8) | lut[body[7]];
+        effect->period_ms = body[8] | (body[9] << 8);
+        effect->width = body[10];
+
+        if (effect->type < ANIM_BLINK || effect->type > ANIM_CHASE || effect->count == 0
+                || effect->start >= num_leds || effect->count > num_leds - effect->start
+                || effect->period_ms == 0) {
+            return -1;
+        }
+
+        if (effect->type == ANIM_CHASE && (effect->width == 0 || effect->width > effect->count)) {
+            return -1;
+        }
+
+        // Overlapping effects would undo each other's changes
+        for (int j = 0; j < i; j++) {
+            if (effect->start < effects[j].start + effects[j].count
+                    && effects[j].start < effect->start + effect->count) {
+                return -1;
+            }
+        }
+    }
+
+    return count;
+}
+
+// Scales each channel of a colour
+static uint32_t anim_scale(uint32_t color, float factor) {
+    uint32_t r = (uint32_t) (((color >> 16) & 0xFF) * factor + 0.5f);
+    uint32_t g = (uint32_t) (((color >> 8) & 0xFF) * factor + 0.5f);
+    uint32_t b = (uint32_t) ((color & 0xFF) * factor + 0.5f);
+
+    return (r << 16) | (g << 8) | b;
+}
+
+// Prepares effects for playing at fps frames per second
+void anim_load(anim_t *anim, const anim_effect_t *effects, int count, int fps) {
+    memset(anim, 0, sizeof(anim_t));
+    anim->count = count;
+
+    for (int i = 0; i < count; i++) {
+        anim_track_t *track = &anim->tracks[i];
+
+        track->effect = effects[i];
+        track->frames = effects[i].period_ms * fps / 1000;
+        track->state = -1;
+
+        if (track->frames < 2) {
+            track->frames = 2;
+        }
+
+        if (effects[i].type == ANIM_PULSE) {
+            for (int step = 0; step < ANIM_PULSE_STEPS; step++) {
+                float level = (float) step / (ANIM_PULSE_STEPS - 1);
+                track->levels[step] = anim_scale(effects[i].color, powf(level, ANIM_GAMMA));
+            }
+        }
+    }
+}
+
+// Makes the next anim_render paint every effect completely, out has to hold the base colours
+void anim_reset(anim_t *anim) {
+    for (int i = 0; i < anim->count; i++) {
+        anim->tracks[i].state = -1;
+    }
+}
+
+// Paints a range of LEDs with one colour
+static void anim_fill(uint32_t *out, int start, int count, uint32_t color) {
+    for (int led = start; led < start + count; led++) {
+        out[led] = color;
+    }
+}
+
+// Paints the lit LEDs of a chase at position with either its colour or the base colours
+static void anim_chase(const anim_effect_t *effect, const uint32_t *base, uint32_t *out, int position, int lit) {
+    for (int i = 0; i < effect->width; i++) {
+        int led = effect->start + (position + i) % effect->count;
+        out[led] = lit ? effect->color : base[led];
+    }
+}
+
+// Renders a frame into out, only LEDs of effects that changed since the last frame are written
+void anim_render(anim_t *anim, const uint32_t *base, uint32_t *out, uint32_t frame) {
+    for (int i = 0; i < anim->count; i++) {
+        anim_track_t *track = &anim->tracks[i];
+        const anim_effect_t *effect = &track->effect;
+        uint32_t phase = frame % track->frames;
+        int32_t state;
+
+        switch (effect->type) {
+            case ANIM_BLINK:
+                state = phase < track->frames / 2;
+
+                if (state != track->state) {
+                    if (state) {
+                        anim_fill(out, effect->start, effect->count, effect->color);
+                    } else {
+                        memcpy(&out[effect->start], &base[effect->start], effect->count * sizeof(uint32_t));
+                    }
+                }
+                break;
+
+            case ANIM_PULSE:
+                // Triangle over the period, up the steps and down again
+                state = phase * (2 * ANIM_PULSE_STEPS) / track->frames;
+
+                if (state >= ANIM_PULSE_STEPS) {
+                    state = 2 * ANIM_PULSE_STEPS - 1 - state;
+                }
+
+                if (state != track->state) {
+                    anim_fill(out, effect->start, effect->count, track->levels[state]);
+                }
+                break;
+
+            case ANIM_CHASE:
+                state = phase * effect->count / track->frames;
+
+                if (state != track->state) {
+                    if (track->state >= 0) {
+                        anim_chase(effect, base, out, track->state, 0);
+                    }
+
+                    anim_chase(effect, base, out, state, 1);
+                }
+                break;
+
+            default:
+                continue;
+        }
+
+        track->state = state;
+    }
+}
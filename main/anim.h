@@ -0,0 +1,67 @@
+/*
+ * anim.h
+ *
+ *  LED effects rendered on the device.
+ *
+ *  Effects are uploaded once as records of ANIM_RECORD_LEN bytes,
+ *  little endian:
+ *    type start_lo start_hi n_lo n_hi r g b period_lo period_hi width
+ *  with type ANIM_BLINK, ANIM_PULSE or ANIM_CHASE, the LED range
+ *  start..start+n-1 and the period in ms. width is the number of LEDs
+ *  lit by a chase. Everything that changes from frame to frame is
+ *  precomputed when the effects are loaded, and a frame only touches
+ *  the LEDs whose effect moved on since the last one.
+ */
+
+#ifndef MAIN_ANIM_H_
+#define MAIN_ANIM_H_
+
+#include <stdint.h>
+
+#define ANIM_MAX_EFFECTS 16
+#define ANIM_RECORD_LEN  11
+#define ANIM_PULSE_STEPS 32
+
+typedef enum {
+    ANIM_BLINK = 1,     // colour for the first half of the period, base colours for the second
+    ANIM_PULSE,         // fades from off to the colour and back
+    ANIM_CHASE,         // width lit LEDs running through the range once per period
+} anim_type_t;
+
+// Effect on a range of LEDs as uploaded
+typedef struct {
+    uint8_t type;
+    uint16_t start;
+    uint16_t count;
+    uint32_t color;         // 0xRRGGBB
+    uint16_t period_ms;
+    uint8_t width;
+} anim_effect_t;
+
+// Effect being played and what it rendered last
+typedef struct {
+    anim_effect_t effect;
+    uint32_t frames;        // frames per period
+    int32_t state;          // blink phase, pulse step or chase position, -1 if not rendered yet
+    uint32_t levels[ANIM_PULSE_STEPS]; // pulse colours
+} anim_track_t;
+
+// Set of effects played together
+typedef struct {
+    anim_track_t tracks[ANIM_MAX_EFFECTS];
+    int count;
+} anim_t;
+
+// Reads effect records for num_leds LEDs, colours go through lut, returns the number of effects or -1 if malformed
+int anim_parse(const uint8_t *body, int len, const uint8_t *lut, int num_leds, anim_effect_t *effects);
+
+// Prepares effects for playing at fps frames per second
+void anim_load(anim_t *anim, const anim_effect_t *effects, int count, int fps);
+
+// Makes the next anim_render paint every effect completely, out has to hold the base colours
+void anim_reset(anim_t *anim);
+
+// Renders a frame into out, only LEDs of effects that changed since the last frame are written
+void anim_render(anim_t *anim, const uint32_t *base, uint32_t *out, uint32_t frame);
+
+#endif /* MAIN_ANIM_H_ */
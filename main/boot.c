@@ -0,0 +1,81 @@
+/*
+ * boot.c
+ *
+ *  Boot stages and their timing.
+ */
+
+#include "boot.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+// Logger tag name
+static const char *TAG = "BOOT";
+// One bit per finished stage
+static EventGroupHandle_t boot_events;
+// esp_timer times in us, the timer starts with the application
+static int64_t started[BOOT_STAGE_COUNT];
+static int64_t finished[BOOT_STAGE_COUNT];
+
+static const char *stage_names[BOOT_STAGE_COUNT] = {
+        "flash",
+        "wifi",
+        "network",
+        "camera",
+        "leds",
+        "http",
+};
+
+// Prepares the stage tracking, called first thing in app_main
+void boot_init(void) {
+    boot_events = xEventGroupCreate();
+}
+
+// Marks a stage as started
+void boot_begin(boot_stage_t stage) {
+    started[stage] = esp_timer_get_time();
+}
+
+// Marks a stage as finished and logs its timing, later calls are ignored
+void boot_done(boot_stage_t stage) {
+    if (boot_is_done(stage)) {
+        return;
+    }
+
+    finished[stage] = esp_timer_get_time();
+    ESP_LOGI(TAG, "%s ready at %ums, took %ums", stage_names[stage], (uint32_t) (finished[stage] / 1000),
+             (uint32_t) ((finished[stage] - started[stage]) / 1000));
+    xEventGroupSetBits(boot_events, 1 << stage);
+}
+
+// Returns whether a stage has finished
+int boot_is_done(boot_stage_t stage) {
+    return (xEventGroupGetBits(boot_events) & (1 << stage)) != 0;
+}
+
+// Blocks until a stage has finished
+void boot_wait(boot_stage_t stage) {
+    xEventGroupWaitBits(boot_events, 1 << stage, false, true, portMAX_DELAY);
+}
+
+// Appends the start and end of every finished stage in Prometheus text format
+void boot_write_metrics(metrics_writer_t *writer) {
+    metrics_printf(writer, "# TYPE esp32cam_boot_stage_start_seconds gauge\n");
+
+    for (int stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+        if (boot_is_done(stage)) {
+            metrics_printf(writer, "esp32cam_boot_stage_start_seconds{stage=\"%s\"} %.3f\n", stage_names[stage],
+                           started[stage] / 1e6);
+        }
+    }
+
+    metrics_printf(writer, "# TYPE esp32cam_boot_stage_end_seconds gauge\n");
+
+    for (int stage = 0; stage < BOOT_STAGE_COUNT; stage++) {
+        if (boot_is_done(stage)) {
+            metrics_printf(writer, "esp32cam_boot_stage_end_seconds{stage=\"%s\"} %.3f\n", stage_names[stage],
+                           finished[stage] / 1e6);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * boot.h
+ *
+ *  Boot stages and their timing.
+ *
+ *  app_main starts the stages that do not depend on each other at the
+ *  same time: WiFi association runs in the background while the camera
+ *  is probed on a task of its own and the LEDs and HTTP servers are set
+ *  up. Every stage logs when it began and finished, and other tasks can
+ *  check or wait for a stage they depend on.
+ */
+
+#ifndef MAIN_BOOT_H_
+#define MAIN_BOOT_H_
+
+#include "metrics.h"
+
+typedef enum {
+    BOOT_FLASH,
+    BOOT_WIFI,              // driver started, association goes on in the background
+    BOOT_NETWORK,           // first IP address
+    BOOT_CAMERA,            // driver probed and frames captured
+    BOOT_LEDS,
+    BOOT_HTTP,              // servers accepting requests
+    BOOT_STAGE_COUNT
+} boot_stage_t;
+
+// Prepares the stage tracking, called first thing in app_main
+void boot_init(void);
+
+// Marks a stage as started
+void boot_begin(boot_stage_t stage);
+
+// Marks a stage as finished and logs its timing, later calls are ignored
+void boot_done(boot_stage_t stage);
+
+// Returns whether a stage has finished
+int boot_is_done(boot_stage_t stage);
+
+// Blocks until a stage has finished
+void boot_wait(boot_stage_t stage);
+
+// Appends the start and end of every finished stage in Prometheus text format
+void boot_write_metrics(metrics_writer_t *writer);
+
+#endif /* MAIN_BOOT_H_ */
@@ -0,0 +1,457 @@
+/*
+ * capture.c
+ *
+ *  Frame acquisition shared by all image handlers.
+ */
+
+#include "capture.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+#include <sys/param.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+// Maximum time a consumer waits for a frame
+#define CAPTURE_WAIT_MS 2000
+#define FRAME_READY_BIT BIT0
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+// In continuous mode the driver may have filled all its buffers with the old settings
+#define CAPTURE_STALE_FRAMES CAPTURE_FB_COUNT
+#else
+// A single buffer is only filled on request, the next frame already has the new settings
+#define CAPTURE_STALE_FRAMES 0
+#endif
+
+// Frame size names accepted by capture_framesize_from_name
+static const struct {
+    const char *name;
+    framesize_t framesize;
+} framesize_names[] = {
+        { "qqvga", FRAMESIZE_QQVGA },
+        { "qcif",  FRAMESIZE_QCIF },
+        { "hqvga", FRAMESIZE_HQVGA },
+        { "qvga",  FRAMESIZE_QVGA },
+        { "cif",   FRAMESIZE_CIF },
+        { "vga",   FRAMESIZE_VGA },
+        { "svga",  FRAMESIZE_SVGA },
+        { "xga",   FRAMESIZE_XGA },
+        { "sxga",  FRAMESIZE_SXGA },
+        { "uxga",  FRAMESIZE_UXGA },
+};
+
+// Logger tag name
+static const char *TAG = "CAP";
+// Guards the frame slots, their reference counts and the active profile
+static SemaphoreHandle_t capture_lock;
+// One slot per driver frame buffer, a slot is free while fb is NULL
+static capture_frame_t slots[CAPTURE_FB_COUNT];
+static uint32_t next_seq = 1;
+// Sensor settings new frames are captured with
+static capture_profile_t active_profile;
+// Frames still in the driver after a profile switch, captured with the old settings
+static int skip_frames = 0;
+
+// Serializes esp_jpg_decode, which keeps its work area in a static buffer
+static SemaphoreHandle_t decode_lock;
+// Logger tag of esp_jpg_decode
+static const char *DECODE_TAG = "esp_jpg_decode";
+
+// Newest completed frame, holds one reference of its own
+static capture_frame_t *latest = NULL;
+// Cache hit and miss counters
+static capture_stats_t stats;
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+// Pulsed by the producer whenever a new frame is published
+static EventGroupHandle_t frame_events;
+
+// Producer task keeping the newest frame ready
+static void capture_task(void *pvParameters);
+#else
+// Serializes on-demand captures so concurrent requests share one frame
+static SemaphoreHandle_t capture_busy;
+#endif
+
+// Wraps a driver frame buffer requested at start into a free slot, caller holds the lock
+static capture_frame_t *slot_alloc(camera_fb_t *fb, int64_t start) {
+    for (int i = 0; i < CAPTURE_FB_COUNT; i++) {
+        if (slots[i].fb == NULL) {
+            slots[i].fb = fb;
+            slots[i].timestamp = esp_timer_get_time();
+            slots[i].capture_us = slots[i].timestamp - start;
+            slots[i].seq = next_seq++;
+            slots[i].profile = active_profile;
+            slots[i].refs = 1;
+            slots[i].served = 0;
+            return &slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Drops one reference and returns the buffer to the driver on the last one, caller holds the lock
+static void slot_unref(capture_frame_t *frame) {
+    if (--frame->refs == 0) {
+        esp_camera_fb_return(frame->fb);
+        frame->fb = NULL;
+    }
+}
+
+// Hands a frame to one more request, caller holds the lock
+static capture_frame_t *frame_serve(capture_frame_t *frame) {
+    frame->refs++;
+
+    if (frame->served++ > 0) {
+        stats.shares++;
+    }
+
+    return frame;
+}
+
+// Takes a reference on the newest frame if it follows after_seq and is recent enough, caller holds the lock
+static capture_frame_t *latest_ref(int64_t max_age_us, uint32_t after_seq) {
+    if (latest != NULL && latest->seq > after_seq && esp_timer_get_time() - latest->timestamp <= max_age_us) {
+        return frame_serve(latest);
+    }
+
+    return NULL;
+}
+
+// Publishes a new frame as the newest one, caller holds the lock
+static void latest_set(capture_frame_t *frame) {
+    if (latest != NULL) {
+        slot_unref(latest);
+    }
+
+    latest = frame;
+}
+
+// Decides whether a fresh driver buffer predates the last profile switch, caller holds the lock
+static int skip_stale(void) {
+    if (skip_frames > 0) {
+        skip_frames--;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Initializes the capture module, requires a running camera driver set up with the given profile
+esp_err_t capture_init(const capture_profile_t *profile) {
+    active_profile = *profile;
+    capture_lock = xSemaphoreCreateMutex();
+    decode_lock = xSemaphoreCreateMutex();
+
+    if (capture_lock == NULL || decode_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    frame_events = xEventGroupCreate();
+
+    if (frame_events == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreatePinnedToCore(&capture_task, "capture_task", CONFIG_CAPTURE_TASK_STACK, NULL,
+                                CONFIG_CAPTURE_TASK_PRIORITY, NULL, CONFIG_CAPTURE_TASK_CORE) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Capture pipeline running with %d frame buffers", CAPTURE_FB_COUNT);
+#else
+    capture_busy = xSemaphoreCreateMutex();
+
+    if (capture_busy == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
+    return ESP_OK;
+}
+
+// Switches the sensor to the given profile, a no-op if it is already active, the last switch wins
+esp_err_t capture_set_profile(const capture_profile_t *profile) {
+    xSemaphoreTake(capture_lock, portMAX_DELAY);
+
+    if (profile->framesize == active_profile.framesize && profile->quality == active_profile.quality) {
+        xSemaphoreGive(capture_lock);
+        return ESP_OK;
+    }
+
+    int64_t sw_start = esp_timer_get_time();
+    sensor_t *s = esp_camera_sensor_get();
+    esp_err_t res = ESP_OK;
+
+    // The driver buffers are sized for the boot frame size, so only switch within it
+    if (s == NULL) {
+        res = ESP_ERR_INVALID_STATE;
+    } else if (profile->framesize != active_profile.framesize && s->set_framesize(s, profile->framesize) != 0) {
+        res = ESP_FAIL;
+    } else if (profile->quality != active_profile.quality && s->set_quality(s, profile->quality) != 0) {
+        res = ESP_FAIL;
+    }
+
+    if (res == ESP_OK) {
+        active_profile = *profile;
+        skip_frames = CAPTURE_STALE_FRAMES;
+        latest_set(NULL);
+    }
+
+    xSemaphoreGive(capture_lock);
+
+    int64_t sw_end = esp_timer_get_time();
+
+    if (res == ESP_OK) {
+        ESP_LOGI(TAG, "Profile %s q%d: %uus", capture_framesize_name(profile->framesize), profile->quality,
+                 (uint32_t) (sw_end - sw_start));
+    } else {
+        ESP_LOGE(TAG, "Failed to switch profile to %s q%d", capture_framesize_name(profile->framesize),
+                 profile->quality);
+    }
+
+    return res;
+}
+
+// Copies the currently active profile
+void capture_get_profile(capture_profile_t *profile) {
+    xSemaphoreTake(capture_lock, portMAX_DELAY);
+    *profile = active_profile;
+    xSemaphoreGive(capture_lock);
+}
+
+// Returns the sequence number of the newest frame, capture_acquire_after waits for the one following it
+uint32_t capture_last_seq(void) {
+    xSemaphoreTake(capture_lock, portMAX_DELAY);
+    uint32_t seq = next_seq - 1;
+    xSemaphoreGive(capture_lock);
+    return seq;
+}
+
+// Copies the cache hit and miss counters
+void capture_get_stats(capture_stats_t *out) {
+    xSemaphoreTake(capture_lock, portMAX_DELAY);
+    *out = stats;
+    out->last_seq = next_seq - 1;
+    xSemaphoreGive(capture_lock);
+}
+
+// Looks up a frame size by its lower case name, e.g. "vga"
+framesize_t capture_framesize_from_name(const char *name) {
+    for (int i = 0; i < sizeof(framesize_names) / sizeof(framesize_names[0]); i++) {
+        if (strcmp(framesize_names[i].name, name) == 0) {
+            return framesize_names[i].framesize;
+        }
+    }
+
+    return FRAMESIZE_INVALID;
+}
+
+// Returns the lower case name of a frame size
+const char *capture_framesize_name(framesize_t framesize) {
+    for (int i = 0; i < sizeof(framesize_names) / sizeof(framesize_names[0]); i++) {
+        if (framesize_names[i].framesize == framesize) {
+            return framesize_names[i].name;
+        }
+    }
+
+    return "?";
+}
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+// Producer task keeping the newest frame ready
+static void capture_task(void *pvParameters) {
+    while (1) {
+        int64_t start = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+
+        if (!fb) {
+            ESP_LOGE(TAG, "Camera capture failed");
+            vTaskDelay(100 / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        xSemaphoreTake(capture_lock, portMAX_DELAY);
+        capture_frame_t *frame = skip_stale() ? NULL : slot_alloc(fb, start);
+
+        if (frame == NULL) {
+            esp_camera_fb_return(fb);
+        } else {
+            latest_set(frame);
+        }
+
+        xSemaphoreGive(capture_lock);
+
+        // Wake up everyone waiting right now, a waiter that misses the pulse finds the frame on its next check
+        if (frame != NULL) {
+            xEventGroupSetBits(frame_events, FRAME_READY_BIT);
+            xEventGroupClearBits(frame_events, FRAME_READY_BIT);
+        }
+    }
+}
+
+// Returns the newest frame if it follows after_seq and is not older than max_age_us, waits for the next one otherwise
+static capture_frame_t *acquire(int64_t max_age_us, uint32_t after_seq) {
+    int64_t deadline = esp_timer_get_time() + CAPTURE_WAIT_MS * 1000LL;
+    int64_t now;
+    int waited = 0;
+
+    while ((now = esp_timer_get_time()) < deadline) {
+        xSemaphoreTake(capture_lock, portMAX_DELAY);
+        capture_frame_t *frame = latest_ref(max_age_us, after_seq);
+
+        if (frame != NULL) {
+            if (waited) {
+                stats.misses++;
+            } else {
+                stats.hits++;
+            }
+
+            xSemaphoreGive(capture_lock);
+            return frame;
+        }
+
+        xSemaphoreGive(capture_lock);
+
+        TickType_t ticks = (deadline - now) / 1000 / portTICK_PERIOD_MS;
+        xEventGroupWaitBits(frame_events, FRAME_READY_BIT, pdFALSE, pdTRUE, ticks > 0 ? ticks : 1);
+        waited = 1;
+    }
+
+    ESP_LOGE(TAG, "No frame within %dms", CAPTURE_WAIT_MS);
+    return NULL;
+}
+#else
+// Returns the last frame if it follows after_seq and is not older than max_age_us, captures a new one otherwise
+static capture_frame_t *acquire(int64_t max_age_us, uint32_t after_seq) {
+    capture_frame_t *frame = NULL;
+
+    // Whoever held capture_busy before us may just have captured a frame we can share
+    xSemaphoreTake(capture_busy, portMAX_DELAY);
+    xSemaphoreTake(capture_lock, portMAX_DELAY);
+    frame = latest_ref(max_age_us, after_seq);
+
+    if (frame != NULL) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        // Hand the stale buffer back, the driver has only one
+        latest_set(NULL);
+    }
+
+    xSemaphoreGive(capture_lock);
+
+    while (frame == NULL) {
+        int64_t start = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+
+        if (!fb) {
+            ESP_LOGE(TAG, "Camera capture failed");
+            break;
+        }
+
+        xSemaphoreTake(capture_lock, portMAX_DELAY);
+        frame = skip_stale() ? NULL : slot_alloc(fb, start);
+
+        if (frame == NULL) {
+            esp_camera_fb_return(fb);
+        } else {
+            latest_set(frame);
+            frame_serve(frame);
+        }
+
+        xSemaphoreGive(capture_lock);
+    }
+
+    xSemaphoreGive(capture_busy);
+    return frame;
+}
+#endif
+
+// Returns a frame not older than max_age_us or NULL on failure, frames are shared while fresh
+capture_frame_t *capture_acquire(int64_t max_age_us) {
+    return acquire(max_age_us, 0);
+}
+
+// Returns the first frame with a sequence number above seq or NULL on failure, waits for one if needed
+capture_frame_t *capture_acquire_after(uint32_t seq) {
+    // Sequence numbers only grow, so any frame after seq is younger than the caller's last one
+    return acquire(INT64_MAX, seq);
+}
+
+// Hands a frame obtained by capture_acquire back to the capture module
+void capture_release(capture_frame_t *frame) {
+    if (frame == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(capture_lock, portMAX_DELAY);
+    slot_unref(frame);
+    xSemaphoreGive(capture_lock);
+}
+
+// Frame being decoded and the caller's writer
+typedef struct {
+    const camera_fb_t *fb;
+    jpg_writer_cb writer;
+    void *arg;
+    int stopped;        // the writer ended the decoding early
+} decode_job_t;
+
+// Feeds the decoder straight from the frame buffer
+static size_t decode_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+    const camera_fb_t *fb = ((decode_job_t *) arg)->fb;
+
+    if (index >= fb->len) {
+        return 0;
+    }
+
+    len = MIN(len, fb->len - index);
+
+    if (buf != NULL) {
+        memcpy(buf, fb->buf + index, len);
+    }
+
+    return len;
+}
+
+// Passes decoded pixels on to the caller's writer
+static bool decode_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    decode_job_t *job = (decode_job_t *) arg;
+
+    if (!job->writer(job->arg, x, y, w, h, data)) {
+        job->stopped = 1;
+        return false;
+    }
+
+    return true;
+}
+
+// Decodes a JPEG frame buffer at the given scale, passing the pixels to writer
+esp_err_t capture_decode(const camera_fb_t *fb, jpg_scale_t scale, jpg_writer_cb writer, void *arg) {
+    decode_job_t job = {
+            .fb = fb,
+            .writer = writer,
+            .arg = arg,
+            .stopped = 0,
+    };
+
+    // The decoder logs an error when a writer stops it, so it is silenced for as long as the lock is held
+    // and real failures are logged here instead
+    xSemaphoreTake(decode_lock, portMAX_DELAY);
+    esp_log_level_set(DECODE_TAG, ESP_LOG_NONE);
+    esp_err_t res = esp_jpg_decode(fb->len, scale, decode_read, decode_write, &job);
+    esp_log_level_set(DECODE_TAG, CONFIG_LOG_DEFAULT_LEVEL);
+    xSemaphoreGive(decode_lock);
+
+    if (res != ESP_OK && !job.stopped) {
+        ESP_LOGE(TAG, "Failed to decode a %uB frame", (uint32_t) fb->len);
+    }
+
+    return res;
+}
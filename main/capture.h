@@ -0,0 +1,83 @@
+/*
+ * capture.h
+ *
+ *  Frame acquisition shared by all image handlers.
+ */
+
+#ifndef MAIN_CAPTURE_H_
+#define MAIN_CAPTURE_H_
+
+#include "settings.h"
+#include <esp_camera.h>
+#include <esp_err.h>
+#include <esp_jpg_decode.h>
+#include <stdint.h>
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+#define CAPTURE_FB_COUNT CONFIG_CAPTURE_FB_COUNT
+#else
+#define CAPTURE_FB_COUNT 1
+#endif
+
+// Sensor settings applied to a capture
+typedef struct {
+    framesize_t framesize;
+    int quality;        // 0-63 lower number means higher quality
+} capture_profile_t;
+
+// Captured frame, owned by the capture module and reference counted
+typedef struct {
+    camera_fb_t *fb;
+    int64_t timestamp;  // esp_timer time of completion in us
+    uint32_t capture_us; // time the driver took to hand out the frame
+    uint32_t seq;       // monotonically increasing frame sequence number
+    capture_profile_t profile;
+    int refs;
+    uint32_t served;    // requests handed this frame so far
+} capture_frame_t;
+
+// Snapshot cache counters
+typedef struct {
+    uint32_t hits;      // requests served with an already captured frame
+    uint32_t misses;    // requests that had to wait for a new capture
+    uint32_t shares;    // requests handed a frame another request got as well
+    uint32_t last_seq;  // sequence number of the newest frame
+} capture_stats_t;
+
+// Initializes the capture module, requires a running camera driver set up with the given profile
+esp_err_t capture_init(const capture_profile_t *profile);
+
+// Switches the sensor to the given profile, a no-op if it is already active, the last switch wins
+// The profile is shared by all tasks, callers compare the profile of the frames they get with theirs
+esp_err_t capture_set_profile(const capture_profile_t *profile);
+
+// Copies the currently active profile
+void capture_get_profile(capture_profile_t *profile);
+
+// Copies the cache hit and miss counters
+void capture_get_stats(capture_stats_t *stats);
+
+// Looks up a frame size by its lower case name, e.g. "vga"
+framesize_t capture_framesize_from_name(const char *name);
+
+// Returns the lower case name of a frame size
+const char *capture_framesize_name(framesize_t framesize);
+
+// Returns a frame not older than max_age_us or NULL on failure, frames are shared while fresh
+capture_frame_t *capture_acquire(int64_t max_age_us);
+
+// Returns the first frame with a sequence number above seq or NULL on failure, waits for one if needed
+capture_frame_t *capture_acquire_after(uint32_t seq);
+
+// Returns the sequence number of the newest frame, capture_acquire_after waits for the one following it
+uint32_t capture_last_seq(void);
+
+// Hands a frame obtained by capture_acquire back to the capture module
+void capture_release(capture_frame_t *frame);
+
+// Decodes a JPEG frame buffer at the given scale, passing the pixels to writer
+// The decoder works in a static buffer, so calls from different tasks are serialized
+// A writer returning false stops the decoding, which fails without logging an error
+esp_err_t capture_decode(const camera_fb_t *fb, jpg_scale_t scale, jpg_writer_cb writer, void *arg);
+
+#endif /* MAIN_CAPTURE_H_ */
@@ -0,0 +1,55 @@
+/*
+ * clocksync.c
+ *
+ *  Offset between the local clock and the clock of the multicast
+ *  controller.
+ */
+
+#include "clocksync.h"
+#include <string.h>
+
+void clocksync_init(clocksync* sync) {
+	memset(sync, 0, sizeof(*sync));
+}
+
+// Adds the answer to a request sent and received at local times, stamped with the controller's time remote
+void clocksync_sample(clocksync* sync, int64_t sent, int64_t received, int64_t remote) {
+	if (received < sent) {
+		return;
+	}
+
+	sync->offsets[sync->next] = remote - (sent + (received - sent) / 2);
+	sync->rtts[sync->next] = (uint32_t) (received - sent);
+	sync->next = (sync->next + 1) % CLOCKSYNC_WINDOW;
+	sync->samples++;
+
+	if (sync->count < CLOCKSYNC_WINDOW) {
+		sync->count++;
+	}
+
+	// Old samples leave the window, so a drifting clock is followed as well
+	int best = 0;
+
+	for (int i = 1; i < sync->count; i++) {
+		if (sync->rtts[i] < sync->rtts[best]) {
+			best = i;
+		}
+	}
+
+	sync->offset = sync->offsets[best];
+	sync->rtt = sync->rtts[best];
+}
+
+int clocksync_isValid(clocksync* sync) {
+	return sync->count > 0;
+}
+
+// Converts a controller time into local time
+int64_t clocksync_toLocal(clocksync* sync, int64_t remote) {
+	return remote - sync->offset;
+}
+
+// Converts a local time into controller time
+int64_t clocksync_toRemote(clocksync* sync, int64_t local) {
+	return local + sync->offset;
+}
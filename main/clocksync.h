@@ -0,0 +1,43 @@
+/*
+ * clocksync.h
+ *
+ *  Offset between the local clock and the clock of the multicast
+ *  controller.
+ *
+ *  Every answered handshake request is a sample: the controller stamps
+ *  its "Here I Am!" with its own time, which is assumed to lie halfway
+ *  between sending the request and receiving the answer. The error of
+ *  a sample is at most half its round trip, so the sample with the
+ *  shortest round trip of the last CLOCKSYNC_WINDOW is used.
+ *
+ *  Like the handshake, a pure state machine fed with the caller's
+ *  times in us.
+ */
+
+#ifndef MAIN_CLOCKSYNC_H_
+#define MAIN_CLOCKSYNC_H_
+
+#include <stdint.h>
+
+#define CLOCKSYNC_WINDOW 8
+
+typedef struct clocksync clocksync;
+
+struct clocksync {
+	int64_t offset;        // controller time minus local time of the best sample
+	uint32_t rtt;          // round trip of the best sample
+	int count;             // samples in the window
+	int next;              // slot the next sample goes to
+	int64_t offsets[CLOCKSYNC_WINDOW];
+	uint32_t rtts[CLOCKSYNC_WINDOW];
+	uint32_t samples;      // samples taken since init
+};
+
+void clocksync_init(clocksync* sync);
+void clocksync_sample(clocksync* sync, int64_t sent, int64_t received, int64_t remote);
+
+int clocksync_isValid(clocksync* sync);
+int64_t clocksync_toLocal(clocksync* sync, int64_t remote);
+int64_t clocksync_toRemote(clocksync* sync, int64_t local);
+
+#endif /* MAIN_CLOCKSYNC_H_ */
@@ -0,0 +1,105 @@
+/*
+ * frame.c
+ *
+ *  Binary capture + metadata format for machine clients.
+ */
+
+#include "frame.h"
+#include <errno.h>
+#include <string.h>
+#include <lwip/sockets.h>
+
+// HTTP head up to the length, the rest is appended by frame_send
+static const char FRAME_HEAD[] = "HTTP/1.1 200 OK\r\n"
+        "Content-Type: " FRAME_CONTENT_TYPE "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Content-Length: ";
+
+// Fills the header describing a captured frame
+void frame_header_init(frame_header_t *header, const capture_frame_t *frame) {
+    header->magic = FRAME_MAGIC;
+    header->version = FRAME_VERSION;
+    header->header_len = sizeof(frame_header_t);
+    header->seq = frame->seq;
+    header->timestamp = frame->timestamp;
+    header->capture_us = frame->capture_us;
+    header->framesize = frame->profile.framesize;
+    header->quality = frame->profile.quality;
+    header->width = frame->fb->width;
+    header->height = frame->fb->height;
+    header->device_id = CONFIG_DEVICE_ID;
+    header->len = frame->fb->len;
+}
+
+// Writes "<value>\r\n\r\n" into the end of buf, returns where it starts
+static char *frame_length_end(char *buf, size_t size, uint32_t value) {
+    char *p = buf + size;
+
+    *--p = '\n';
+    *--p = '\r';
+    *--p = '\n';
+    *--p = '\r';
+
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    return p;
+}
+
+// Writes all buffers to a connected socket, continuing where a send timeout cut a write short, iov is modified
+esp_err_t frame_writev(int sockfd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t sent = lwip_writev(sockfd, iov, count);
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return ESP_FAIL;
+        }
+
+        while (count > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Sends a complete HTTP response carrying the frame on a connected socket
+esp_err_t frame_send(int sockfd, const capture_frame_t *frame) {
+    frame_header_t header;
+    char length[16];
+
+    frame_header_init(&header, frame);
+
+    char *end = frame_length_end(length, sizeof(length), sizeof(header) + header.len);
+    struct iovec iov[] = {
+            { .iov_base = (void *) FRAME_HEAD, .iov_len = sizeof(FRAME_HEAD) - 1 },
+            { .iov_base = end, .iov_len = length + sizeof(length) - end },
+            { .iov_base = &header, .iov_len = sizeof(header) },
+            { .iov_base = frame->fb->buf, .iov_len = frame->fb->len },
+    };
+
+    return frame_writev(sockfd, iov, sizeof(iov) / sizeof(iov[0]));
+}
+
+// Sends a header and the JPEG it describes on a connected socket, without HTTP framing
+esp_err_t frame_write(int sockfd, const frame_header_t *header, const uint8_t *jpeg) {
+    struct iovec iov[] = {
+            { .iov_base = (void *) header, .iov_len = sizeof(frame_header_t) },
+            { .iov_base = (void *) jpeg, .iov_len = header->len },
+    };
+
+    return frame_writev(sockfd, iov, sizeof(iov) / sizeof(iov[0]));
+}
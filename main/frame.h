@@ -0,0 +1,55 @@
+/*
+ * frame.h
+ *
+ *  Binary capture + metadata format for machine clients.
+ *
+ *  A frame is a fixed little-endian frame_header_t followed by the
+ *  JPEG bytes. The header is filled from integers only and goes out
+ *  in the same writev as the HTTP head and the frame buffer, so no
+ *  string formatting or copying happens per frame. Push mode sends
+ *  the same header and JPEG back to back without HTTP framing.
+ */
+
+#ifndef MAIN_FRAME_H_
+#define MAIN_FRAME_H_
+
+#include "settings.h"
+#include "capture.h"
+#include <esp_err.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define FRAME_MAGIC   0x4d414346    // "FCAM" in memory
+#define FRAME_VERSION 1
+
+#define FRAME_CONTENT_TYPE "application/x-frame"
+
+// Header in front of every JPEG, the ESP32 is little-endian so it is sent as is
+typedef struct __attribute__((packed)) {
+    uint32_t magic;         // FRAME_MAGIC
+    uint16_t version;       // FRAME_VERSION
+    uint16_t header_len;    // sizeof(frame_header_t), the JPEG starts right after
+    uint32_t seq;           // frame sequence number
+    int64_t timestamp;      // esp_timer time of capture completion in us
+    uint32_t capture_us;    // time the driver took to hand out the frame
+    uint8_t framesize;      // framesize_t of the sensor
+    uint8_t quality;        // 0-63 lower number means higher quality
+    uint16_t width;
+    uint16_t height;
+    uint16_t device_id;     // CONFIG_DEVICE_ID
+    uint32_t len;           // JPEG bytes following the header
+} frame_header_t;
+
+// Fills the header describing a captured frame
+void frame_header_init(frame_header_t *header, const capture_frame_t *frame);
+
+// Sends a complete HTTP response carrying the frame on a connected socket
+esp_err_t frame_send(int sockfd, const capture_frame_t *frame);
+
+// Sends a header and the JPEG it describes on a connected socket, without HTTP framing
+esp_err_t frame_write(int sockfd, const frame_header_t *header, const uint8_t *jpeg);
+
+// Writes all buffers to a connected socket, continuing where a send timeout cut a write short, iov is modified
+esp_err_t frame_writev(int sockfd, struct iovec *iov, int count);
+
+#endif /* MAIN_FRAME_H_ */
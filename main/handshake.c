@@ -0,0 +1,130 @@
+/*
+ * handshake.c
+ *
+ *  Handshake and keepalive with the multicast controller.
+ */
+
+#include "handshake.h"
+#include <string.h>
+
+// Wrap-safe "a is not before b" for ms timestamps
+static int reached(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) >= 0;
+}
+
+// Picks a delay in [interval / 2, interval] so stations rebooted together spread out
+static uint32_t jitter(handshake* hs, uint32_t interval) {
+	uint32_t x = hs->random;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	hs->random = x;
+
+	return interval / 2 + x % (interval / 2 + 1);
+}
+
+void handshake_init(handshake* hs, uint32_t seed) {
+	memset(hs, 0, sizeof(*hs));
+	hs->phase = HANDSHAKE_IDLE;
+	hs->random = seed != 0 ? seed : 0x2545F491;
+	hs->retry = HANDSHAKE_RETRY_MIN_MS;
+}
+
+// (Re)starts searching, the first request is due immediately
+void handshake_start(handshake* hs, uint32_t now) {
+	hs->phase = HANDSHAKE_SEARCHING;
+	hs->backoff = HANDSHAKE_BACKOFF_MIN_MS;
+	hs->nextSend = now;
+	hs->started = now;
+	hs->requestPending = 0;
+}
+
+void handshake_stop(handshake* hs) {
+	hs->phase = HANDSHAKE_IDLE;
+	hs->requestPending = 0;
+}
+
+// Returns 1 if a request is to be sent now and schedules the next one
+int handshake_poll(handshake* hs, uint32_t now) {
+	if (hs->phase == HANDSHAKE_LINKED
+			&& reached(now, hs->lastSeen + HANDSHAKE_LINK_TIMEOUT_MS)) {
+		hs->losses++;
+		handshake_start(hs, now);
+	}
+
+	if (hs->phase == HANDSHAKE_IDLE || !reached(now, hs->nextSend)) {
+		return 0;
+	}
+
+	if (hs->phase == HANDSHAKE_SEARCHING) {
+		hs->nextSend = now + jitter(hs, hs->backoff);
+		hs->backoff = hs->backoff * 2 > HANDSHAKE_BACKOFF_MAX_MS ? HANDSHAKE_BACKOFF_MAX_MS : hs->backoff * 2;
+	} else {
+		hs->nextSend = now + HANDSHAKE_KEEPALIVE_MS;
+	}
+
+	hs->requestSent = now;
+	hs->requestPending = 1;
+
+	return 1;
+}
+
+// Returns the ms until handshake_poll has something to do
+uint32_t handshake_timeout(handshake* hs, uint32_t now) {
+	if (hs->phase == HANDSHAKE_IDLE) {
+		return UINT32_MAX;
+	}
+
+	uint32_t due = hs->nextSend;
+
+	if (hs->phase == HANDSHAKE_LINKED && reached(due, hs->lastSeen + HANDSHAKE_LINK_TIMEOUT_MS)) {
+		due = hs->lastSeen + HANDSHAKE_LINK_TIMEOUT_MS;
+	}
+
+	return reached(now, due) ? 0 : due - now;
+}
+
+// Feeds a server message, alive is set for "Here I Am!", returns 1 if this established the link
+int handshake_received(handshake* hs, uint32_t now, int alive) {
+	if (hs->phase == HANDSHAKE_IDLE) {
+		return 0;
+	}
+
+	hs->lastSeen = now;
+
+	if (!alive) {
+		return 0;
+	}
+
+	if (hs->requestPending) {
+		hs->rtt = now - hs->requestSent;
+		hs->requestPending = 0;
+	}
+
+	if (hs->phase == HANDSHAKE_LINKED) {
+		return 0;
+	}
+
+	hs->phase = HANDSHAKE_LINKED;
+	hs->timeToLink = now - hs->started;
+	hs->links++;
+	hs->retry = HANDSHAKE_RETRY_MIN_MS;
+	hs->nextSend = now + HANDSHAKE_KEEPALIVE_MS;
+
+	return 1;
+}
+
+// Drops the link after a socket failure, returns the ms to wait before retrying
+uint32_t handshake_failed(handshake* hs) {
+	uint32_t delay = jitter(hs, hs->retry);
+
+	hs->retry = hs->retry * 2 > HANDSHAKE_RETRY_MAX_MS ? HANDSHAKE_RETRY_MAX_MS : hs->retry * 2;
+	handshake_stop(hs);
+
+	return delay;
+}
+
+int handshake_isLinked(handshake* hs) {
+	return hs->phase == HANDSHAKE_LINKED;
+}
@@ -0,0 +1,65 @@
+/*
+ * handshake.h
+ *
+ *  Handshake and keepalive with the multicast controller.
+ *
+ *  A pure state machine driven by the caller's clock: it never sends,
+ *  sleeps or reads the time itself. The caller feeds it the current
+ *  time in ms and received server messages, sends "Are You There?"
+ *  whenever handshake_poll asks for it and sleeps at most
+ *  handshake_timeout ms in between.
+ *
+ *  While searching, requests are repeated with jittered exponential
+ *  backoff. Once linked, a keepalive request is sent periodically and
+ *  the link is dropped if the server stays silent for too long.
+ */
+
+#ifndef MAIN_HANDSHAKE_H_
+#define MAIN_HANDSHAKE_H_
+
+#include <stdint.h>
+
+#define HANDSHAKE_BACKOFF_MIN_MS  250
+#define HANDSHAKE_BACKOFF_MAX_MS  8000
+#define HANDSHAKE_KEEPALIVE_MS    10000
+#define HANDSHAKE_LINK_TIMEOUT_MS 30000
+#define HANDSHAKE_RETRY_MIN_MS    100    // socket failures
+#define HANDSHAKE_RETRY_MAX_MS    5000
+
+typedef enum {
+	HANDSHAKE_IDLE,        // no network, nothing to send
+	HANDSHAKE_SEARCHING,   // looking for the controller
+	HANDSHAKE_LINKED       // controller answered, keepalive running
+} handshake_phase;
+
+typedef struct handshake handshake;
+
+struct handshake {
+	handshake_phase phase;
+	uint32_t random;       // xorshift state for the jitter
+	uint32_t backoff;      // current request interval while searching
+	uint32_t retry;        // current delay after socket failures
+	uint32_t nextSend;     // time of the next request
+	uint32_t lastSeen;     // time of the last server message
+	uint32_t started;      // time the current search started
+	uint32_t requestSent;  // time of the last request
+	int requestPending;
+
+	uint32_t timeToLink;   // duration of the last search
+	uint32_t rtt;          // round trip of the last answered request
+	uint32_t links;        // searches that ended linked
+	uint32_t losses;       // links dropped by timeout
+};
+
+void handshake_init(handshake* hs, uint32_t seed);
+void handshake_start(handshake* hs, uint32_t now);
+void handshake_stop(handshake* hs);
+
+int handshake_poll(handshake* hs, uint32_t now);
+uint32_t handshake_timeout(handshake* hs, uint32_t now);
+int handshake_received(handshake* hs, uint32_t now, int alive);
+uint32_t handshake_failed(handshake* hs);
+
+int handshake_isLinked(handshake* hs);
+
+#endif /* MAIN_HANDSHAKE_H_ */
@@ -0,0 +1,142 @@
+/*
+ * ledmsg.c
+ *
+ *  Binary LED update bodies of POST /start_led.
+ */
+
+#include "ledmsg.h"
+#include <math.h>
+#include <string.h>
+
+#define LEDMSG_GAMMA 2.2f
+
+static const int record_len[] = {
+	[LEDMSG_FRAME]  = 3,
+	[LEDMSG_PIXELS] = 5,
+	[LEDMSG_RANGES] = 7,
+};
+
+// Colour word of struct led_state, each strip reorders it when sent
+static inline uint32_t ledmsg_color(const ledmsg_parser* parser, const uint8_t* rgb) {
+	return (parser->lut[rgb[0]] << 16) | (parser->lut[rgb[1]] << 8) | parser->lut[rgb[2]];
+}
+
+static void ledmsg_apply(ledmsg_parser* parser, const uint8_t* record) {
+	uint32_t start, count;
+
+	switch (parser->command) {
+		case LEDMSG_FRAME:
+			if (parser->led >= NUM_LEDS) {
+				parser->error = 1;
+				return;
+			}
+
+			parser->state->leds[parser->led++] = ledmsg_color(parser, record);
+			break;
+
+		case LEDMSG_PIXELS:
+			start = record[0] | (record[1] << 8);
+
+			if (start >= NUM_LEDS) {
+				parser->error = 1;
+				return;
+			}
+
+			parser->state->leds[start] = ledmsg_color(parser, record + 2);
+			break;
+
+		case LEDMSG_RANGES:
+			start = record[0] | (record[1] << 8);
+			count = record[2] | (record[3] << 8);
+
+			if (start >= NUM_LEDS || count > NUM_LEDS - start) {
+				parser->error = 1;
+				return;
+			}
+
+			uint32_t color = ledmsg_color(parser, record + 4);
+
+			for (uint32_t led = start; led < start + count; led++) {
+				parser->state->leds[led] = color;
+			}
+			break;
+	}
+}
+
+int ledmsg_isBinary(uint8_t first) {
+	return first == LEDMSG_FRAME || first == LEDMSG_PIXELS || first == LEDMSG_RANGES;
+}
+
+void ledmsg_buildLut(uint8_t* lut, uint8_t brightness) {
+	for (int i = 0; i < 256; i++) {
+		lut[i] = (uint8_t) (powf(i / 255.0f, LEDMSG_GAMMA) * brightness + 0.5f);
+	}
+}
+
+void ledmsg_init(ledmsg_parser* parser, struct led_state* state, const uint8_t* lut) {
+	memset(parser, 0, sizeof(ledmsg_parser));
+	parser->state = state;
+	parser->lut = lut;
+}
+
+int ledmsg_feed(ledmsg_parser* parser, const uint8_t* data, int len) {
+	if (parser->command == 0) {
+		if (len == 0) {
+			return 0;
+		}
+
+		if (!ledmsg_isBinary(data[0])) {
+			parser->error = 1;
+		}
+
+		parser->command = data[0];
+		data++;
+		len--;
+	}
+
+	if (parser->error) {
+		return -1;
+	}
+
+	int size = record_len[parser->command];
+
+	// Complete a record split across two chunks
+	if (parser->fill > 0) {
+		int take = size - parser->fill < len ? size - parser->fill : len;
+		memcpy(parser->record + parser->fill, data, take);
+		parser->fill += take;
+		data += take;
+		len -= take;
+
+		if (parser->fill < size) {
+			return 0;
+		}
+
+		ledmsg_apply(parser, parser->record);
+		parser->fill = 0;
+	}
+
+	// Whole records straight from the receive buffer
+	while (len >= size && !parser->error) {
+		ledmsg_apply(parser, data);
+		data += size;
+		len -= size;
+	}
+
+	if (parser->error) {
+		return -1;
+	}
+
+	memcpy(parser->record, data, len);
+	parser->fill = len;
+
+	return 0;
+}
+
+int ledmsg_finish(ledmsg_parser* parser) {
+	if (parser->error || parser->command == 0 || parser->fill != 0) {
+		return -1;
+	}
+
+	return 0;
+}
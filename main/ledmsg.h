@@ -0,0 +1,43 @@
+/*
+ * ledmsg.h
+ *
+ *  Binary LED update bodies of POST /start_led.
+ *
+ *  Every body starts with a command byte followed by its records:
+ *    LEDMSG_FRAME   r g b, ...                         one triple per LED from LED 0 on
+ *    LEDMSG_PIXELS  idx_lo idx_hi r g b, ...           single LEDs
+ *    LEDMSG_RANGES  start_lo start_hi n_lo n_hi r g b  runs of LEDs with one colour
+ *  LEDs not mentioned keep their current colour.
+ */
+
+#ifndef MAIN_LEDMSG_H_
+#define MAIN_LEDMSG_H_
+
+#include "LED.h"
+#include <stdint.h>
+
+#define LEDMSG_FRAME   0x01
+#define LEDMSG_PIXELS  0x02
+#define LEDMSG_RANGES  0x03
+#define LEDMSG_RECORD_MAX 7
+
+typedef struct ledmsg_parser ledmsg_parser;
+
+struct ledmsg_parser {
+	struct led_state* state;
+	const uint8_t* lut;
+	uint8_t command;
+	uint8_t record[LEDMSG_RECORD_MAX];
+	int fill;
+	uint32_t led;
+	int error;
+};
+
+int ledmsg_isBinary(uint8_t first);
+void ledmsg_buildLut(uint8_t* lut, uint8_t brightness);
+
+void ledmsg_init(ledmsg_parser* parser, struct led_state* state, const uint8_t* lut);
+int ledmsg_feed(ledmsg_parser* parser, const uint8_t* data, int len);
+int ledmsg_finish(ledmsg_parser* parser);
+
+#endif /* MAIN_LEDMSG_H_ */
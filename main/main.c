@@ -1,19 +1,34 @@
-#include <nvs_flash.h>
 #include "rest.h"
 #include "LED.h"
+#include "boot.h"
 
 #define RED   0xFFFFFF
 #define GREEN 0x00FF00
 #define BLUE  0x0000FF
-#define NUM_LEDS 3
 
 void app_main() {
     static httpd_handle_t server = NULL;
-    ESP_ERROR_CHECK(nvs_flash_init());
-    init_camera();
+    boot_init();
+
+    boot_begin(BOOT_FLASH);
+    init_flash();
+    boot_done(BOOT_FLASH);
+
+    // Association takes longest, it goes on in the background while the rest is set up
+    boot_begin(BOOT_WIFI);
     init_wifi(&server);
-    printf("init led");
+    boot_done(BOOT_WIFI);
+
+    // Probing the sensor and filling the first frames runs next to the LED and HTTP setup
+    start_camera();
+
+    boot_begin(BOOT_LEDS);
     init_leds();
+    boot_done(BOOT_LEDS);
+
+    boot_begin(BOOT_HTTP);
+    start_http(&server);
+    boot_done(BOOT_HTTP);
 //    printf("starting led");
 //    //reset_leds();
 //    struct led_state new_state;
@@ -23,4 +38,3 @@ void app_main() {
 //
 //    write_leds(new_state);
 }
-
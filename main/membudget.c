@@ -0,0 +1,272 @@
+/*
+ * membudget.c
+ *
+ *  Named memory budgets reserved at boot.
+ */
+
+#include "membudget.h"
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <sys/param.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#define MEMBUDGET_ALIGN 8
+// Room an allocation of bytes takes from an arena
+#define MEMBUDGET_BLOCK(bytes) ((((bytes) + MEMBUDGET_ALIGN - 1) & ~(MEMBUDGET_ALIGN - 1)) + sizeof(membudget_block_t))
+
+#define MEMBUDGET_PSRAM (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+
+// Budgets of the optional features, nothing is reserved for a disabled one
+#ifdef CONFIG_SYNC_CAPTURE
+#define MEM_SNAPSHOT_SIZE (CONFIG_MEM_SNAPSHOT_KB * 1024)
+#else
+#define MEM_SNAPSHOT_SIZE 0
+#endif
+
+#ifdef CONFIG_PUSH_MODE
+#define MEM_PUSH_SIZE (CONFIG_MEM_PUSH_KB * 1024)
+#else
+#define MEM_PUSH_SIZE 0
+#endif
+
+// Header in front of every block, blocks follow each other without gaps
+typedef struct {
+    uint32_t size;          // bytes including the header, a multiple of MEMBUDGET_ALIGN
+    uint32_t used;
+} membudget_block_t;
+
+// Memory reserved for a budget
+typedef struct {
+    uint32_t caps;          // heap the arena is reserved in
+    void *memory;           // as allocated from the heap
+    uint8_t *base;          // first block
+    membudget_stats_t stats;
+} membudget_arena_state_t;
+
+// Logger tag name
+static const char *TAG = "MEM";
+// Guards all arenas
+static SemaphoreHandle_t membudget_lock;
+static membudget_arena_state_t arenas[MEM_ARENA_COUNT] = {
+        [MEM_ROI] = {
+                .caps = MEMBUDGET_PSRAM,
+                .stats = { .name = "roi", .size = MEMBUDGET_BLOCK(CONFIG_ROI_MAX_PIXELS * 3) },
+        },
+        [MEM_SNAPSHOT] = {
+                .caps = MEMBUDGET_PSRAM,
+                .stats = { .name = "snapshot", .size = MEM_SNAPSHOT_SIZE },
+        },
+        [MEM_PUSH] = {
+                .caps = MEMBUDGET_PSRAM,
+                .stats = { .name = "push", .size = MEM_PUSH_SIZE },
+        },
+};
+
+// Returns the block following block
+static membudget_block_t *block_next(membudget_block_t *block) {
+    return (membudget_block_t *) ((uint8_t *) block + block->size);
+}
+
+// Merges neighbouring free blocks and finds the largest one, caller holds the lock
+static void arena_merge(membudget_arena_state_t *arena) {
+    membudget_block_t *end = (membudget_block_t *) (arena->base + arena->stats.size);
+    uint32_t largest = 0;
+
+    for (membudget_block_t *block = (membudget_block_t *) arena->base; block < end; block = block_next(block)) {
+        if (block->used) {
+            continue;
+        }
+
+        membudget_block_t *next = block_next(block);
+
+        while (next < end && !next->used) {
+            block->size += next->size;
+            next = block_next(block);
+        }
+
+        largest = MAX(largest, block->size - sizeof(membudget_block_t));
+    }
+
+    arena->stats.largest_free = largest;
+}
+
+// Reserves every arena, fails if one of the budgets does not fit into its heap
+esp_err_t membudget_init(void) {
+    membudget_lock = xSemaphoreCreateMutex();
+
+    if (membudget_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        membudget_arena_state_t *arena = &arenas[i];
+
+        if (arena->stats.size == 0) {
+            continue;
+        }
+
+        arena->stats.size &= ~(MEMBUDGET_ALIGN - 1);
+        arena->memory = heap_caps_malloc(arena->stats.size + MEMBUDGET_ALIGN, arena->caps);
+
+        if (arena->memory == NULL) {
+            ESP_LOGE(TAG, "No room for the %uKB %s budget, the largest free block is %uKB",
+                     arena->stats.size / 1024, arena->stats.name,
+                     (uint32_t) heap_caps_get_largest_free_block(arena->caps) / 1024);
+            return ESP_ERR_NO_MEM;
+        }
+
+        arena->base = (uint8_t *) (((uintptr_t) arena->memory + MEMBUDGET_ALIGN - 1) & ~(MEMBUDGET_ALIGN - 1));
+
+        membudget_block_t *first = (membudget_block_t *) arena->base;
+        first->size = arena->stats.size;
+        first->used = 0;
+        arena_merge(arena);
+
+        ESP_LOGI(TAG, "Reserved %uKB for %s", arena->stats.size / 1024, arena->stats.name);
+    }
+
+    ESP_LOGI(TAG, "Left free: %uKB internal, %uKB PSRAM",
+             (uint32_t) heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / 1024,
+             (uint32_t) heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024);
+    return ESP_OK;
+}
+
+// Allocates from an arena, returns NULL if the budget is exhausted
+void *membudget_alloc(membudget_arena_t id, size_t size) {
+    membudget_arena_state_t *arena = &arenas[id];
+    uint32_t need = MEMBUDGET_BLOCK(size);
+    void *ptr = NULL;
+
+    if (arena->base == NULL) {
+        return NULL;
+    }
+
+    xSemaphoreTake(membudget_lock, portMAX_DELAY);
+
+    membudget_block_t *end = (membudget_block_t *) (arena->base + arena->stats.size);
+
+    for (membudget_block_t *block = (membudget_block_t *) arena->base; block < end; block = block_next(block)) {
+        if (block->used || block->size < need) {
+            continue;
+        }
+
+        // The rest becomes a free block of its own unless it could not hold anything
+        if (block->size - need >= MEMBUDGET_BLOCK(1)) {
+            membudget_block_t *rest = (membudget_block_t *) ((uint8_t *) block + need);
+
+            rest->size = block->size - need;
+            rest->used = 0;
+            block->size = need;
+        }
+
+        block->used = 1;
+        arena->stats.used += block->size;
+        arena->stats.high_water = MAX(arena->stats.high_water, arena->stats.used);
+        arena->stats.blocks++;
+        ptr = block + 1;
+        break;
+    }
+
+    if (ptr != NULL) {
+        arena_merge(arena);
+    } else {
+        arena->stats.failures++;
+    }
+
+    xSemaphoreGive(membudget_lock);
+
+    if (ptr == NULL) {
+        ESP_LOGW(TAG, "%s budget exhausted, %u bytes requested, %u bytes free in the largest block",
+                 arena->stats.name, (uint32_t) size, arena->stats.largest_free);
+    }
+
+    return ptr;
+}
+
+// Returns a block to the arena it was allocated from, NULL is ignored
+void membudget_free(membudget_arena_t id, void *ptr) {
+    membudget_arena_state_t *arena = &arenas[id];
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    membudget_block_t *block = (membudget_block_t *) ptr - 1;
+
+    xSemaphoreTake(membudget_lock, portMAX_DELAY);
+    block->used = 0;
+    arena->stats.used -= block->size;
+    arena->stats.blocks--;
+    arena_merge(arena);
+    xSemaphoreGive(membudget_lock);
+}
+
+// Copies the usage of an arena
+void membudget_get_stats(membudget_arena_t id, membudget_stats_t *stats) {
+    xSemaphoreTake(membudget_lock, portMAX_DELAY);
+    *stats = arenas[id].stats;
+    xSemaphoreGive(membudget_lock);
+}
+
+// Appends the usage of all arenas and the free space of the heaps in Prometheus text format
+void membudget_write_metrics(metrics_writer_t *writer) {
+    membudget_stats_t stats[MEM_ARENA_COUNT];
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        membudget_get_stats(i, &stats[i]);
+    }
+
+    metrics_printf(writer, "# TYPE esp32cam_mem_budget_bytes gauge\n");
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        metrics_printf(writer, "esp32cam_mem_budget_bytes{arena=\"%s\"} %u\n", stats[i].name, stats[i].size);
+    }
+
+    metrics_printf(writer, "# TYPE esp32cam_mem_used_bytes gauge\n");
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        metrics_printf(writer, "esp32cam_mem_used_bytes{arena=\"%s\"} %u\n", stats[i].name, stats[i].used);
+    }
+
+    metrics_printf(writer, "# TYPE esp32cam_mem_high_water_bytes gauge\n");
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        metrics_printf(writer, "esp32cam_mem_high_water_bytes{arena=\"%s\"} %u\n", stats[i].name,
+                       stats[i].high_water);
+    }
+
+    // Share of the free space that is not in the largest free block
+    metrics_printf(writer, "# TYPE esp32cam_mem_fragmentation_ratio gauge\n");
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        uint32_t free = stats[i].size - stats[i].used;
+
+        metrics_printf(writer, "esp32cam_mem_fragmentation_ratio{arena=\"%s\"} %.3f\n", stats[i].name,
+                       free > sizeof(membudget_block_t) ? 1.0 - (double) stats[i].largest_free
+                               / (free - sizeof(membudget_block_t)) : 0.0);
+    }
+
+    metrics_printf(writer, "# TYPE esp32cam_mem_alloc_failures_total counter\n");
+
+    for (int i = 0; i < MEM_ARENA_COUNT; i++) {
+        metrics_printf(writer, "esp32cam_mem_alloc_failures_total{arena=\"%s\"} %u\n", stats[i].name,
+                       stats[i].failures);
+    }
+
+    metrics_printf(writer, "# TYPE esp32cam_heap_free_bytes gauge\n");
+    metrics_printf(writer, "esp32cam_heap_free_bytes{heap=\"internal\"} %u\n",
+                   (uint32_t) heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    metrics_printf(writer, "esp32cam_heap_free_bytes{heap=\"spiram\"} %u\n",
+                   (uint32_t) heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    metrics_printf(writer, "# TYPE esp32cam_heap_min_free_bytes gauge\n");
+    metrics_printf(writer, "esp32cam_heap_min_free_bytes{heap=\"internal\"} %u\n",
+                   (uint32_t) heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    metrics_printf(writer, "esp32cam_heap_min_free_bytes{heap=\"spiram\"} %u\n",
+                   (uint32_t) heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+    metrics_printf(writer, "# TYPE esp32cam_heap_largest_free_block_bytes gauge\n");
+    metrics_printf(writer, "esp32cam_heap_largest_free_block_bytes{heap=\"internal\"} %u\n",
+                   (uint32_t) heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    metrics_printf(writer, "esp32cam_heap_largest_free_block_bytes{heap=\"spiram\"} %u\n",
+                   (uint32_t) heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+}
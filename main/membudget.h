@@ -0,0 +1,58 @@
+/*
+ * membudget.h
+ *
+ *  Named memory budgets reserved at boot.
+ *
+ *  Every large buffer allocated after boot comes out of an arena of a
+ *  fixed size that is reserved in one piece when the station starts, so
+ *  a configuration that does not fit fails right away instead of running
+ *  out of memory at some point in the field. Arenas hand out blocks
+ *  first fit and merge neighbouring free blocks when they are freed,
+ *  and keep track of their high-water mark and of how fragmented the
+ *  free space is.
+ */
+
+#ifndef MAIN_MEMBUDGET_H_
+#define MAIN_MEMBUDGET_H_
+
+#include "settings.h"
+#include "metrics.h"
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Arenas, their sizes and heaps are listed in membudget.c
+typedef enum {
+    MEM_ROI,                // decoded region of interest pixels
+    MEM_SNAPSHOT,           // frames latched for synchronized captures
+    MEM_PUSH,               // frames queued for the collector
+    MEM_ARENA_COUNT
+} membudget_arena_t;
+
+// Arena usage
+typedef struct {
+    const char *name;
+    uint32_t size;          // bytes reserved at boot, 0 if the arena is not used
+    uint32_t used;          // bytes handed out including block headers
+    uint32_t high_water;    // most bytes used at once
+    uint32_t largest_free;  // largest block that can still be allocated
+    uint32_t blocks;        // allocations currently held
+    uint32_t failures;      // allocations the budget could not satisfy
+} membudget_stats_t;
+
+// Reserves every arena, fails if one of the budgets does not fit into its heap
+esp_err_t membudget_init(void);
+
+// Allocates from an arena, returns NULL if the budget is exhausted
+void *membudget_alloc(membudget_arena_t arena, size_t size);
+
+// Returns a block to the arena it was allocated from, NULL is ignored
+void membudget_free(membudget_arena_t arena, void *ptr);
+
+// Copies the usage of an arena
+void membudget_get_stats(membudget_arena_t arena, membudget_stats_t *stats);
+
+// Appends the usage of all arenas and the free space of the heaps in Prometheus text format
+void membudget_write_metrics(metrics_writer_t *writer);
+
+#endif /* MAIN_MEMBUDGET_H_ */
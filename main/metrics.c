@@ -0,0 +1,184 @@
+/*
+ * metrics.c
+ *
+ *  Latency histograms and counters of the hot paths.
+ */
+
+#include "metrics.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Tasks listed by metrics_write_tasks
+#define METRICS_MAX_TASKS 32
+
+// Power of two latency histogram
+typedef struct {
+    uint32_t buckets[METRICS_BUCKETS];
+    uint64_t sum_us;
+} metrics_histogram_t;
+
+// Prometheus names of the stages
+static const char *stage_names[METRIC_STAGE_COUNT] = {
+        "capture",
+        "send",
+        "roi",
+        "led_encode",
+        "rmt_wait",
+        "mcast_rtt",
+        "motion",
+        "anim_render",
+        "snapshot_skew",
+        "push",
+};
+
+// Prometheus names of the counters
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+        "esp32cam_capture_failures_total",
+        "esp32cam_send_failures_total",
+        "esp32cam_send_bytes_total",
+        "esp32cam_led_drops_total",
+        "esp32cam_mcast_failures_total",
+        "esp32cam_mcast_bytes_total",
+        "esp32cam_http_sessions_total",
+        "esp32cam_http_requests_total",
+        "esp32cam_http_idle_closes_total",
+        "esp32cam_snapshot_failures_total",
+        "esp32cam_stream_drops_total",
+};
+
+static metrics_histogram_t histograms[METRIC_STAGE_COUNT];
+static uint32_t counters[METRIC_COUNTER_COUNT];
+// Keeps the buckets and sum of a histogram consistent, the 64 bit sum has no atomic add on the ESP32
+static portMUX_TYPE histogram_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Adds one duration to a stage histogram
+void metrics_record(metrics_stage_t stage, uint32_t us) {
+    int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+
+    if (bucket >= METRICS_BUCKETS) {
+        bucket = METRICS_BUCKETS - 1;
+    }
+
+    portENTER_CRITICAL(&histogram_mux);
+    histograms[stage].buckets[bucket]++;
+    histograms[stage].sum_us += us;
+    portEXIT_CRITICAL(&histogram_mux);
+}
+
+// Adds n to a counter
+void metrics_count(metrics_counter_t counter, uint32_t n) {
+    __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+// Prepares a writer passing its output to flush
+void metrics_writer_init(metrics_writer_t *writer, metrics_flush_fn flush, void *ctx) {
+    writer->len = 0;
+    writer->flush = flush;
+    writer->ctx = ctx;
+    writer->err = 0;
+}
+
+// Hands the buffered text to the sink
+static void writer_flush(metrics_writer_t *writer) {
+    if (writer->len > 0 && writer->err == 0) {
+        writer->err = writer->flush(writer->ctx, writer->buf, writer->len);
+    }
+
+    writer->len = 0;
+}
+
+// Appends formatted text to the writer
+void metrics_printf(metrics_writer_t *writer, const char *format, ...) {
+    va_list args;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t space = sizeof(writer->buf) - writer->len;
+
+        va_start(args, format);
+        int n = vsnprintf(writer->buf + writer->len, space, format, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+
+        if (n < space) {
+            writer->len += n;
+            return;
+        }
+
+        // Did not fit, retry on an empty buffer, longer lines are truncated
+        writer_flush(writer);
+    }
+
+    writer->len = sizeof(writer->buf) - 1;
+}
+
+// Appends all histograms and counters in Prometheus text format
+void metrics_write_all(metrics_writer_t *writer) {
+    metrics_printf(writer, "# TYPE esp32cam_stage_seconds histogram\n");
+
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+        metrics_histogram_t h;
+        uint32_t cumulative = 0;
+
+        // Copied, printing under the lock would hold off every other task
+        portENTER_CRITICAL(&histogram_mux);
+        h = histograms[stage];
+        portEXIT_CRITICAL(&histogram_mux);
+
+        // Le bounds are inclusive while the buckets are exclusive, 2^i - 1 us is still exact
+        for (int bucket = 0; bucket < METRICS_BUCKETS - 1; bucket++) {
+            cumulative += h.buckets[bucket];
+            metrics_printf(writer, "esp32cam_stage_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %u\n",
+                           stage_names[stage], ((1u << bucket) - 1) / 1e6, cumulative);
+        }
+
+        cumulative += h.buckets[METRICS_BUCKETS - 1];
+        metrics_printf(writer, "esp32cam_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n",
+                       stage_names[stage], cumulative);
+        metrics_printf(writer, "esp32cam_stage_seconds_sum{stage=\"%s\"} %.6f\n",
+                       stage_names[stage], h.sum_us / 1e6);
+        metrics_printf(writer, "esp32cam_stage_seconds_count{stage=\"%s\"} %u\n",
+                       stage_names[stage], cumulative);
+    }
+
+    for (int counter = 0; counter < METRIC_COUNTER_COUNT; counter++) {
+        metrics_printf(writer, "# TYPE %s counter\n%s %u\n", counter_names[counter], counter_names[counter],
+                       __atomic_load_n(&counters[counter], __ATOMIC_RELAXED));
+    }
+}
+
+// Appends stack headroom and CPU time of every task, if FreeRTOS keeps track of them
+void metrics_write_tasks(metrics_writer_t *writer) {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    // Too large for the HTTP task stack, only ever used by the server task
+    static TaskStatus_t tasks[METRICS_MAX_TASKS];
+    uint32_t run_time;
+    UBaseType_t count = uxTaskGetSystemState(tasks, METRICS_MAX_TASKS, &run_time);
+
+    metrics_printf(writer, "# TYPE esp32cam_task_stack_free_bytes gauge\n");
+
+    for (int i = 0; i < count; i++) {
+        metrics_printf(writer, "esp32cam_task_stack_free_bytes{task=\"%s\",priority=\"%u\"} %u\n",
+                       tasks[i].pcTaskName, tasks[i].uxCurrentPriority, tasks[i].usStackHighWaterMark);
+    }
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    metrics_printf(writer, "# TYPE esp32cam_task_cpu_seconds_total counter\n");
+
+    for (int i = 0; i < count; i++) {
+        metrics_printf(writer, "esp32cam_task_cpu_seconds_total{task=\"%s\"} %.6f\n", tasks[i].pcTaskName,
+                       tasks[i].ulRunTimeCounter / 1e6);
+    }
+#endif
+#endif
+}
+
+// Flushes what is left, returns 0 if every flush succeeded
+int metrics_writer_finish(metrics_writer_t *writer) {
+    writer_flush(writer);
+    return writer->err;
+}
@@ -0,0 +1,88 @@
+/*
+ * metrics.h
+ *
+ *  Latency histograms and counters of the hot paths.
+ *
+ *  Recording works on static storage, so it may be called from any task
+ *  and never blocks or allocates. Counters are relaxed atomic adds. A
+ *  histogram bucket and its 64 bit sum are updated together in a short
+ *  critical section, so the output never shows a sum without its count.
+ *  Histograms use power of two buckets in microseconds.
+ */
+
+#ifndef MAIN_METRICS_H_
+#define MAIN_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bucket i counts durations below 2^i us, the last one everything above
+#define METRICS_BUCKETS 22
+// Output is flushed in pieces of this size
+#define METRICS_WRITER_BUF 512
+
+// Timed stages
+typedef enum {
+    METRIC_CAPTURE,         // waiting for a frame in the image handlers
+    METRIC_SEND,            // sending a JPEG to a client
+    METRIC_ROI,             // cropping, re-encoding and sending a region of interest
+    METRIC_LED_ENCODE,      // encoding a frame into RMT items
+    METRIC_RMT_WAIT,        // waiting for the previous LED frame to leave the wire
+    METRIC_MCAST_RTT,       // "Are You There?" to "Here I Am!"
+    METRIC_MOTION,          // reducing a frame to its change detection signature
+    METRIC_ANIM_RENDER,     // rendering a frame of LED effects
+    METRIC_SNAPSHOT_SKEW,   // latched frame completion from the time agreed on with the controller
+    METRIC_PUSH,            // sending a queued frame to the collector
+    METRIC_STAGE_COUNT
+} metrics_stage_t;
+
+// Event counters
+typedef enum {
+    METRIC_CAPTURE_FAILURES,
+    METRIC_SEND_FAILURES,
+    METRIC_SEND_BYTES,
+    METRIC_LED_DROPS,       // LED frames replaced in the queue before being shown
+    METRIC_MCAST_FAILURES,
+    METRIC_MCAST_BYTES,
+    METRIC_HTTP_SESSIONS,   // connections accepted by the HTTP servers
+    METRIC_HTTP_REQUESTS,
+    METRIC_HTTP_IDLE_CLOSES, // keep-alive connections closed for being idle
+    METRIC_SNAPSHOT_FAILURES, // synchronized captures that could not be latched
+    METRIC_STREAM_DROPS,    // frames a stream skipped while its client still received the previous one
+    METRIC_COUNTER_COUNT
+} metrics_counter_t;
+
+// Sink of the text output, returns 0 on success
+typedef int (*metrics_flush_fn)(void *ctx, const char *data, size_t len);
+
+// Buffers text output and hands it to a sink in pieces
+typedef struct {
+    char buf[METRICS_WRITER_BUF];
+    size_t len;
+    metrics_flush_fn flush;
+    void *ctx;
+    int err;
+} metrics_writer_t;
+
+// Adds one duration to a stage histogram
+void metrics_record(metrics_stage_t stage, uint32_t us);
+
+// Adds n to a counter
+void metrics_count(metrics_counter_t counter, uint32_t n);
+
+// Prepares a writer passing its output to flush
+void metrics_writer_init(metrics_writer_t *writer, metrics_flush_fn flush, void *ctx);
+
+// Appends formatted text to the writer
+void metrics_printf(metrics_writer_t *writer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Appends all histograms and counters in Prometheus text format
+void metrics_write_all(metrics_writer_t *writer);
+
+// Appends stack headroom and CPU time of every task, if FreeRTOS keeps track of them
+void metrics_write_tasks(metrics_writer_t *writer);
+
+// Flushes what is left, returns 0 if every flush succeeded
+int metrics_writer_finish(metrics_writer_t *writer);
+
+#endif /* MAIN_METRICS_H_ */
@@ -0,0 +1,189 @@
+/*
+ * motion.c
+ *
+ *  Change detection on captured frames.
+ */
+
+#include "motion.h"
+#include "capture.h"
+#include "metrics.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define MOTION_CELLS (MOTION_GRID_W * MOTION_GRID_H)
+
+// Luma sums of one frame being reduced to a signature
+typedef struct {
+    int width;              // decoded size
+    int height;
+    uint32_t sums[MOTION_CELLS];
+    uint16_t counts[MOTION_CELLS];
+} motion_job_t;
+
+// Logger tag name
+static const char *TAG = "MOT";
+// Guards the counters read by other tasks and the analysis state
+static SemaphoreHandle_t motion_lock;
+static motion_stats_t stats;
+// Signature of the scene at the last change
+static uint8_t reference[MOTION_CELLS];
+static int has_reference = 0;
+// Only used under motion_lock, too large for a stack
+static motion_job_t job;
+static uint8_t signature[MOTION_CELLS];
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+// Change detection task
+static void motion_task(void *pvParameters);
+#endif
+
+// Starts change detection, requires an initialized capture module
+esp_err_t motion_init(void) {
+    motion_lock = xSemaphoreCreateMutex();
+
+    if (motion_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+    if (xTaskCreatePinnedToCore(&motion_task, "motion_task", CONFIG_MOTION_TASK_STACK, NULL,
+                                CONFIG_MOTION_TASK_PRIORITY, NULL, CONFIG_MOTION_TASK_CORE) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
+    return ESP_OK;
+}
+
+// Returns the current scene version
+uint32_t motion_get_version(void) {
+    return __atomic_load_n(&stats.version, __ATOMIC_RELAXED);
+}
+
+// Copies the change detection counters
+void motion_get_stats(motion_stats_t *out) {
+    xSemaphoreTake(motion_lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(motion_lock);
+}
+
+// Adds the luma of a decoded block to the cells it covers
+static bool motion_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    motion_job_t *job = (motion_job_t *) arg;
+
+    if (data == NULL) {
+        // The first call announces the decoded size
+        if (x == 0 && y == 0) {
+            job->width = w;
+            job->height = h;
+        }
+
+        return true;
+    }
+
+    if (job->width == 0 || job->height == 0) {
+        return false;
+    }
+
+    for (int row = y; row < y + h; row++) {
+        int cell_row = row * MOTION_GRID_H / job->height * MOTION_GRID_W;
+
+        for (int col = x; col < x + w; col++, data += 3) {
+            int cell = cell_row + col * MOTION_GRID_W / job->width;
+
+            job->sums[cell] += (77 * data[0] + 150 * data[1] + 29 * data[2]) >> 8;
+            job->counts[cell]++;
+        }
+    }
+
+    return true;
+}
+
+// Counts cells whose mean luma moved by more than threshold
+static int motion_diff(const uint8_t *a, const uint8_t *b, int threshold) {
+    int changed = 0;
+
+    // Branch free so the compiler can vectorize it where the target allows
+    for (int i = 0; i < MOTION_CELLS; i++) {
+        int d = a[i] - b[i];
+        changed += (d > threshold) | (d < -threshold);
+    }
+
+    return changed;
+}
+
+// Reduces a frame to its signature, returns 0 on success
+static int motion_signature(const camera_fb_t *fb, uint8_t *signature) {
+    memset(&job, 0, sizeof(job));
+
+    if (capture_decode(fb, JPG_SCALE_8X, motion_write, &job) != ESP_OK) {
+        return -1;
+    }
+
+    for (int i = 0; i < MOTION_CELLS; i++) {
+        signature[i] = job.counts[i] ? job.sums[i] / job.counts[i] : 0;
+    }
+
+    return 0;
+}
+
+// Compares a frame against the last change unless it was analyzed before, returns the scene version
+uint32_t motion_analyze(const capture_frame_t *frame) {
+    xSemaphoreTake(motion_lock, portMAX_DELAY);
+
+    if (frame->seq == stats.seq) {
+        xSemaphoreGive(motion_lock);
+        return motion_get_version();
+    }
+
+    int64_t start = esp_timer_get_time();
+
+    if (motion_signature(frame->fb, signature) != 0) {
+        xSemaphoreGive(motion_lock);
+        ESP_LOGE(TAG, "Failed to decode frame #%u", frame->seq);
+        return motion_get_version();
+    }
+
+    int changed = has_reference ? motion_diff(signature, reference, CONFIG_MOTION_LUMA_THRESHOLD) : MOTION_CELLS;
+    metrics_record(METRIC_MOTION, esp_timer_get_time() - start);
+
+    stats.frames++;
+    stats.changed_cells = changed;
+    stats.seq = frame->seq;
+
+    // Compared against the last change, so slow drifts add up until they count
+    if (changed >= CONFIG_MOTION_MIN_CELLS) {
+        __atomic_fetch_add(&stats.version, 1, __ATOMIC_RELAXED);
+        memcpy(reference, signature, sizeof(reference));
+        has_reference = 1;
+    }
+
+    uint32_t version = motion_get_version();
+    xSemaphoreGive(motion_lock);
+
+    if (changed >= CONFIG_MOTION_MIN_CELLS) {
+        ESP_LOGI(TAG, "Scene %u: %d cells changed in #%u", version, changed, frame->seq);
+    }
+
+    return version;
+}
+
+#ifdef CONFIG_CAPTURE_PIPELINE
+// Change detection task
+static void motion_task(void *pvParameters) {
+    while (1) {
+        vTaskDelay(CONFIG_MOTION_INTERVAL_MS / portTICK_PERIOD_MS);
+
+        capture_frame_t *frame = capture_acquire(CONFIG_MOTION_INTERVAL_MS * 1000LL);
+
+        if (frame != NULL) {
+            motion_analyze(frame);
+            capture_release(frame);
+        }
+    }
+}
+#endif
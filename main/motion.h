@@ -0,0 +1,47 @@
+/*
+ * motion.h
+ *
+ *  Change detection on captured frames.
+ *
+ *  Frames are reduced to a small grid of mean luma values, decoded at
+ *  1/8 scale where the JPEG decoder only needs the DC coefficients.
+ *  Whenever enough cells differ from the grid of the last change, the
+ *  scene version is incremented. With CONFIG_CAPTURE_PIPELINE a
+ *  background task analyzes the newest frame periodically. Without it
+ *  every frame would have to be captured for the task, so there is none
+ *  and only the frames passed to motion_analyze are looked at.
+ */
+
+#ifndef MAIN_MOTION_H_
+#define MAIN_MOTION_H_
+
+#include "settings.h"
+#include "capture.h"
+#include <esp_err.h>
+#include <stdint.h>
+
+// Signature grid size in cells
+#define MOTION_GRID_W 32
+#define MOTION_GRID_H 24
+
+// Change detection counters
+typedef struct {
+    uint32_t version;       // incremented on every detected change
+    uint32_t frames;        // frames analyzed
+    uint32_t changed_cells; // cells that differed in the last analyzed frame
+    uint32_t seq;           // sequence number of the last analyzed frame
+} motion_stats_t;
+
+// Starts change detection, requires an initialized capture module
+esp_err_t motion_init(void);
+
+// Compares a frame against the last change unless it was analyzed before, returns the scene version
+uint32_t motion_analyze(const capture_frame_t *frame);
+
+// Returns the current scene version
+uint32_t motion_get_version(void);
+
+// Copies the change detection counters
+void motion_get_stats(motion_stats_t *stats);
+
+#endif /* MAIN_MOTION_H_ */
@@ -29,6 +29,13 @@ mulmsg* mulmsg_create(char* buffer, int len) {
 	return message;
 }
 
+mulmsg* mulmsg_wrap(char* buffer, int len) {
+	if (buffer != 0 && len >= MULMSG_LEN) {
+		return (mulmsg*) buffer;
+	}
+
+	return 0;
+}
 
 void mulmsg_destroy(mulmsg* message) {
 	if (message != 0) {
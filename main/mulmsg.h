@@ -18,6 +18,7 @@
 typedef struct mulmsg mulmsg;
 
 mulmsg* mulmsg_create(char* buffer, int len);
+mulmsg* mulmsg_wrap(char* buffer, int len);	// in place, must not be destroyed
 void mulmsg_destroy(mulmsg* message);
 const char* mulmsg_unwrap(mulmsg* message);
 
@@ -0,0 +1,141 @@
+/*
+ * mulmsg2.c
+ *
+ *  Versioned multicast messages carrying typed records.
+ */
+
+#include "mulmsg2.h"
+#include <string.h>
+
+int mulmsg2_isV2(const char* buffer, int len) {
+	return len >= MULMSG2_HEADER_LEN
+			&& (buffer[0] & MULMSG2_MARKER) == MULMSG2_MARKER
+			&& buffer[2] == MULMSG2_VERSION;
+}
+
+int mulmsg2_init(mulmsg2* message, char* buffer, int size) {
+	if (message == 0 || buffer == 0 || size < MULMSG2_HEADER_LEN) {
+		return -1;
+	}
+
+	message->buffer = (unsigned char*) buffer;
+	message->size = size;
+	message->len = MULMSG2_HEADER_LEN;
+	message->offset = MULMSG2_HEADER_LEN;
+
+	message->buffer[0] = MULMSG2_MARKER;
+	message->buffer[1] = 0;
+	message->buffer[2] = MULMSG2_VERSION;
+
+	return 0;
+}
+
+int mulmsg2_parse(mulmsg2* message, char* buffer, int len) {
+	if (message == 0 || buffer == 0 || !mulmsg2_isV2(buffer, len)) {
+		return -1;
+	}
+
+	message->buffer = (unsigned char*) buffer;
+	message->size = len;
+	message->len = len;
+	message->offset = MULMSG2_HEADER_LEN;
+
+	return 0;
+}
+
+mulmsg* mulmsg2_header(mulmsg2* message) {
+	if (message != 0) {
+		return mulmsg_wrap((char*) message->buffer, MULMSG_LEN);
+	}
+
+	return 0;
+}
+
+const char* mulmsg2_unwrap(mulmsg2* message) {
+	if (message != 0) {
+		return (const char*) message->buffer;
+	}
+
+	return 0;
+}
+
+int mulmsg2_length(mulmsg2* message) {
+	if (message != 0) {
+		return message->len;
+	}
+
+	return 0;
+}
+
+int mulmsg2_put(mulmsg2* message, unsigned char type, const void* value, unsigned char len) {
+	if (message == 0 || message->len + 2 + len > message->size) {
+		return -1;
+	}
+
+	message->buffer[message->len++] = type;
+	message->buffer[message->len++] = len;
+	memcpy(message->buffer + message->len, value, len);
+	message->len += len;
+
+	return 0;
+}
+
+int mulmsg2_putU16(mulmsg2* message, unsigned char type, unsigned int value) {
+	unsigned char le[2] = { value & 0xff, (value >> 8) & 0xff };
+	return mulmsg2_put(message, type, le, sizeof(le));
+}
+
+int mulmsg2_putU32(mulmsg2* message, unsigned char type, unsigned long value) {
+	unsigned char le[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff };
+	return mulmsg2_put(message, type, le, sizeof(le));
+}
+
+int mulmsg2_putU64(mulmsg2* message, unsigned char type, unsigned long long value) {
+	unsigned char le[8];
+
+	for (int i = 0; i < 8; i++) {
+		le[i] = (value >> (8 * i)) & 0xff;
+	}
+
+	return mulmsg2_put(message, type, le, sizeof(le));
+}
+
+// Starts reading the records from the first one again
+void mulmsg2_rewind(mulmsg2* message) {
+	if (message != 0) {
+		message->offset = MULMSG2_HEADER_LEN;
+	}
+}
+
+int mulmsg2_next(mulmsg2* message, unsigned char* type, const unsigned char** value, unsigned char* len) {
+	if (message == 0 || message->offset + 2 > message->len) {
+		return 0;
+	}
+
+	unsigned char recordLen = message->buffer[message->offset + 1];
+
+	if (message->offset + 2 + recordLen > message->len) {
+		// truncated record, stop reading
+		message->offset = message->len;
+		return 0;
+	}
+
+	*type = message->buffer[message->offset];
+	*len = recordLen;
+	*value = message->buffer + message->offset + 2;
+	message->offset += 2 + recordLen;
+
+	return 1;
+}
+
+unsigned int mulmsg2_getU16(const unsigned char* value) {
+	return value[0] | (value[1] << 8);
+}
+
+unsigned long mulmsg2_getU32(const unsigned char* value) {
+	return value[0] | (value[1] << 8) | ((unsigned long) value[2] << 16) | ((unsigned long) value[3] << 24);
+}
+
+unsigned long long mulmsg2_getU64(const unsigned char* value) {
+	return mulmsg2_getU32(value) | ((unsigned long long) mulmsg2_getU32(value + 4) << 32);
+}
@@ -0,0 +1,64 @@
+/*
+ * mulmsg2.h
+ *
+ *  Versioned multicast messages carrying typed records.
+ *
+ *  A v2 datagram starts with a legacy 2 byte message whose unused bits
+ *  MULMSG2_MARKER are set, followed by the version and any number of
+ *  records (type, length, value). Receivers only reading MULMSG_LEN
+ *  bytes therefore see the equivalent legacy message.
+ *
+ *  Messages are built and read in place on caller owned buffers.
+ */
+
+#ifndef MAIN_MULMSG2_H_
+#define MAIN_MULMSG2_H_
+
+#include "mulmsg.h"
+
+#define MULMSG2_MARKER     0x30
+#define MULMSG2_VERSION    2
+#define MULMSG2_HEADER_LEN 3
+#define MULMSG2_MAX_LEN    128
+
+#define MULMSG2_IPV4        0x01   // 4 bytes, network order
+#define MULMSG2_HTTP_PORT   0x02   // u16
+#define MULMSG2_STREAM_PORT 0x03   // u16
+#define MULMSG2_PROFILE     0x04   // framesize u8, jpeg quality u8
+#define MULMSG2_FRAME_SEQ   0x05   // u32, newest captured frame
+#define MULMSG2_LED_COUNT   0x06   // u16
+#define MULMSG2_SCENE_VERSION 0x07 // u32, incremented whenever the image changed
+#define MULMSG2_CLOCK       0x08   // u64, sender's time in us when sent
+#define MULMSG2_CAPTURE_AT  0x09   // u32 capture id, u64 controller time in us to capture at
+#define MULMSG2_DEVICE_IDS  0x0a   // u16 each, stations a command is meant for, all if absent
+#define MULMSG2_CAPTURED    0x0b   // u32 capture id, u32 frame seq, i32 us the frame completed after the agreed time
+
+typedef struct mulmsg2 mulmsg2;
+
+struct mulmsg2 {
+	unsigned char* buffer;
+	int size;
+	int len;
+	int offset;
+};
+
+int mulmsg2_isV2(const char* buffer, int len);
+
+int mulmsg2_init(mulmsg2* message, char* buffer, int size);
+int mulmsg2_parse(mulmsg2* message, char* buffer, int len);
+mulmsg* mulmsg2_header(mulmsg2* message);
+const char* mulmsg2_unwrap(mulmsg2* message);
+int mulmsg2_length(mulmsg2* message);
+
+int mulmsg2_put(mulmsg2* message, unsigned char type, const void* value, unsigned char len);
+int mulmsg2_putU16(mulmsg2* message, unsigned char type, unsigned int value);
+int mulmsg2_putU32(mulmsg2* message, unsigned char type, unsigned long value);
+int mulmsg2_putU64(mulmsg2* message, unsigned char type, unsigned long long value);
+
+void mulmsg2_rewind(mulmsg2* message);
+int mulmsg2_next(mulmsg2* message, unsigned char* type, const unsigned char** value, unsigned char* len);
+unsigned int mulmsg2_getU16(const unsigned char* value);
+unsigned long mulmsg2_getU32(const unsigned char* value);
+unsigned long long mulmsg2_getU64(const unsigned char* value);
+
+#endif /* MAIN_MULMSG2_H_ */
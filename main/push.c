@@ -0,0 +1,288 @@
+/*
+ * push.c
+ *
+ *  Frames streamed to a collector over a station-initiated connection.
+ */
+
+#include "push.h"
+#include "capture.h"
+#include "frame.h"
+#include "membudget.h"
+#include "metrics.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+#include <sys/param.h>
+#include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define PUSH_SEND_TIMEOUT_S 5
+#define PUSH_IDLE_TICKS     (1000 / portTICK_PERIOD_MS)
+
+// Frame waiting to be sent
+typedef struct {
+    frame_header_t header;
+    uint8_t *buf;           // JPEG in PSRAM
+    size_t size;            // allocated bytes
+} push_entry_t;
+
+// Logger tag name
+static const char *TAG = "PSH";
+// Guards the queue and the counters
+static SemaphoreHandle_t push_lock;
+// Ring of stats.depth frames starting with the oldest at head, buffers are swapped in and out, never copied
+static push_entry_t queue[CONFIG_PUSH_QUEUE_FRAMES];
+static int head = 0;
+static push_stats_t stats;
+static TaskHandle_t send_task_handle;
+
+// Copies frames into the queue at CONFIG_PUSH_FPS while connected
+static void push_capture_task(void *pvParameters);
+
+// Connects to the collector and sends the queued frames
+static void push_send_task(void *pvParameters);
+
+// Starts pushing frames, requires an initialized capture module
+esp_err_t push_init(void) {
+    push_lock = xSemaphoreCreateMutex();
+
+    if (push_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The sender first, the capture task notifies it
+    if (xTaskCreatePinnedToCore(&push_send_task, "push_send_task", CONFIG_PUSH_TASK_STACK, NULL,
+                                CONFIG_PUSH_TASK_PRIORITY, &send_task_handle, CONFIG_PUSH_TASK_CORE) != pdPASS
+            || xTaskCreatePinnedToCore(&push_capture_task, "push_capture_task", CONFIG_PUSH_TASK_STACK, NULL,
+                                       CONFIG_PUSH_TASK_PRIORITY, NULL, CONFIG_PUSH_TASK_CORE) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+// Copies the push mode counters
+void push_get_stats(push_stats_t *out) {
+    xSemaphoreTake(push_lock, portMAX_DELAY);
+    *out = stats;
+    xSemaphoreGive(push_lock);
+}
+
+// Exchanges the frames held by two entries
+static void entry_swap(push_entry_t *a, push_entry_t *b) {
+    push_entry_t tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+// Copies a frame into an entry, growing its buffer if needed
+static esp_err_t entry_fill(push_entry_t *entry, const capture_frame_t *frame) {
+    if (entry->size < frame->fb->len) {
+        membudget_free(MEM_PUSH, entry->buf);
+        entry->buf = membudget_alloc(MEM_PUSH, frame->fb->len);
+        entry->size = entry->buf != NULL ? frame->fb->len : 0;
+
+        if (entry->buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    frame_header_init(&entry->header, frame);
+    memcpy(entry->buf, frame->fb->buf, frame->fb->len);
+    return ESP_OK;
+}
+
+// Appends a filled entry, replacing the oldest frame if the queue is full, entry gets a free buffer back
+// A frame copied while the connection went down is dropped, it would go out stale on the next one
+static void queue_push(push_entry_t *entry) {
+    xSemaphoreTake(push_lock, portMAX_DELAY);
+
+    if (!stats.connected) {
+        stats.queued++;
+        stats.dropped++;
+        xSemaphoreGive(push_lock);
+        return;
+    }
+
+    int tail = (head + stats.depth) % CONFIG_PUSH_QUEUE_FRAMES;
+
+    if (stats.depth == CONFIG_PUSH_QUEUE_FRAMES) {
+        head = (head + 1) % CONFIG_PUSH_QUEUE_FRAMES;
+        stats.dropped++;
+    } else {
+        stats.depth++;
+    }
+
+    entry_swap(&queue[tail], entry);
+    stats.queued++;
+    stats.max_depth = MAX(stats.max_depth, stats.depth);
+    xSemaphoreGive(push_lock);
+
+    xTaskNotifyGive(send_task_handle);
+}
+
+// Takes the oldest frame into entry, returns 0 if the queue is empty
+static int queue_pop(push_entry_t *entry) {
+    int popped = 0;
+
+    xSemaphoreTake(push_lock, portMAX_DELAY);
+
+    if (stats.depth > 0) {
+        entry_swap(&queue[head], entry);
+        head = (head + 1) % CONFIG_PUSH_QUEUE_FRAMES;
+        stats.depth--;
+        popped = 1;
+    }
+
+    xSemaphoreGive(push_lock);
+    return popped;
+}
+
+// Returns whether a collector is connected
+static int push_connected(void) {
+    return __atomic_load_n(&stats.connected, __ATOMIC_RELAXED);
+}
+
+// Marks the connection up or down, frames queued for a lost connection are dropped
+// queue_push checks the state under the same lock, so nothing is queued between the connections
+static void push_set_connected(int connected) {
+    xSemaphoreTake(push_lock, portMAX_DELAY);
+
+    if (connected) {
+        stats.connects++;
+    } else {
+        stats.dropped += stats.depth;
+        stats.depth = 0;
+        head = 0;
+    }
+
+    __atomic_store_n(&stats.connected, connected, __ATOMIC_RELAXED);
+    xSemaphoreGive(push_lock);
+}
+
+// Opens a connection to the collector, returns the socket or -1
+static int push_connect(void) {
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_PUSH_COLLECTOR_PORT),
+            .sin_addr.s_addr = inet_addr(CONFIG_PUSH_COLLECTOR_ADDR),
+    };
+    struct timeval timeout = { .tv_sec = PUSH_SEND_TIMEOUT_S };
+    int on = 1;
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (sockfd < 0) {
+        return -1;
+    }
+
+    // A stalled collector fails the send, so the connection is rebuilt instead of hanging
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Copies frames into the queue at CONFIG_PUSH_FPS while connected
+static void push_capture_task(void *pvParameters) {
+    push_entry_t entry = { 0 };
+    uint32_t last_seq = 0;
+    int64_t interval = 1000000 / CONFIG_PUSH_FPS;
+    int64_t next_due = esp_timer_get_time();
+
+    while (1) {
+        int64_t now = esp_timer_get_time();
+
+        if (now < next_due) {
+            vTaskDelay(MAX(1, (next_due - now) / 1000 / portTICK_PERIOD_MS));
+        }
+
+        next_due = MAX(next_due + interval, esp_timer_get_time());
+
+        if (!push_connected()) {
+            continue;
+        }
+
+        // Shares the newest frame with the HTTP clients, a new one is only waited for if it was pushed already
+        capture_frame_t *frame = last_seq == 0 ? capture_acquire(interval) : capture_acquire_after(last_seq);
+
+        if (frame == NULL) {
+            metrics_count(METRIC_CAPTURE_FAILURES, 1);
+            continue;
+        }
+
+        esp_err_t res = entry_fill(&entry, frame);
+
+        last_seq = frame->seq;
+        capture_release(frame);
+
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "No memory for frame #%u", last_seq);
+            continue;
+        }
+
+        queue_push(&entry);
+    }
+}
+
+// Connects to the collector and sends the queued frames
+static void push_send_task(void *pvParameters) {
+    push_entry_t entry = { 0 };
+
+    while (1) {
+        int sockfd = push_connect();
+
+        if (sockfd < 0) {
+            vTaskDelay(CONFIG_PUSH_RETRY_MS / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "Pushing to %s:%d", CONFIG_PUSH_COLLECTOR_ADDR, CONFIG_PUSH_COLLECTOR_PORT);
+        push_set_connected(1);
+
+        int64_t start = esp_timer_get_time();
+        uint32_t frames = 0;
+        uint64_t bytes = 0;
+
+        while (1) {
+            if (!queue_pop(&entry)) {
+                ulTaskNotifyTake(pdTRUE, PUSH_IDLE_TICKS);
+                continue;
+            }
+
+            int64_t send_start = esp_timer_get_time();
+
+            if (frame_write(sockfd, &entry.header, entry.buf) != ESP_OK) {
+                metrics_count(METRIC_SEND_FAILURES, 1);
+                break;
+            }
+
+            uint32_t len = sizeof(frame_header_t) + entry.header.len;
+
+            metrics_record(METRIC_PUSH, esp_timer_get_time() - send_start);
+            metrics_count(METRIC_SEND_BYTES, len);
+            frames++;
+            bytes += len;
+
+            xSemaphoreTake(push_lock, portMAX_DELAY);
+            stats.sent++;
+            stats.bytes += len;
+            xSemaphoreGive(push_lock);
+        }
+
+        close(sockfd);
+        push_set_connected(0);
+
+        int64_t ms = MAX(1, (esp_timer_get_time() - start) / 1000);
+        ESP_LOGI(TAG, "Push ended: %u frames in %ums (%u.%01u fps, %uKB/s)", frames, (uint32_t) ms,
+                 (uint32_t) (frames * 1000 / ms), (uint32_t) (frames * 10000 / ms % 10), (uint32_t) (bytes / ms));
+        vTaskDelay(CONFIG_PUSH_RETRY_MS / portTICK_PERIOD_MS);
+    }
+}
@@ -0,0 +1,39 @@
+/*
+ * push.h
+ *
+ *  Frames streamed to a collector over a station-initiated connection.
+ *
+ *  The station connects to CONFIG_PUSH_COLLECTOR_ADDR and sends every
+ *  frame as a frame_header_t followed by the JPEG, back to back on one
+ *  TCP connection. Frames are copied into a queue of
+ *  CONFIG_PUSH_QUEUE_FRAMES PSRAM buffers so the capture pipeline never
+ *  waits for the network. When the queue is full the oldest frame is
+ *  dropped, so a slow link delivers fewer but recent frames.
+ */
+
+#ifndef MAIN_PUSH_H_
+#define MAIN_PUSH_H_
+
+#include "settings.h"
+#include <esp_err.h>
+#include <stdint.h>
+
+// Push mode counters
+typedef struct {
+    uint32_t queued;        // frames copied into the queue
+    uint32_t sent;
+    uint32_t dropped;       // frames replaced by newer ones before being sent
+    uint32_t connects;      // connections established to the collector
+    uint64_t bytes;         // headers and JPEGs sent
+    uint32_t depth;         // frames waiting to be sent
+    uint32_t max_depth;
+    int connected;
+} push_stats_t;
+
+// Starts pushing frames, requires an initialized capture module
+esp_err_t push_init(void);
+
+// Copies the push mode counters
+void push_get_stats(push_stats_t *stats);
+
+#endif /* MAIN_PUSH_H_ */
@@ -0,0 +1,153 @@
+/*
+ * ratectl.c
+ *
+ *  JPEG quality control towards a frame size and bandwidth budget.
+ */
+
+#include "ratectl.h"
+#include <esp_log.h>
+#include <math.h>
+#include <sys/param.h>
+
+// Weight of a new sample in the moving averages
+#define RATECTL_ALPHA 0.25f
+// Largest quality step taken at once
+#define RATECTL_MAX_STEP 8
+
+#ifdef CONFIG_RATE_FRAMESIZE
+// Frame sizes the controller switches between, smallest first
+static const framesize_t ladder[] = {
+        FRAMESIZE_QVGA,
+        FRAMESIZE_CIF,
+        FRAMESIZE_VGA,
+        FRAMESIZE_SVGA,
+        FRAMESIZE_XGA,
+        FRAMESIZE_SXGA,
+        FRAMESIZE_UXGA,
+};
+#endif
+
+// Logger tag name
+static const char *TAG = "RATE";
+
+// Starts at the given profile, its frame size is the largest one used
+void ratectl_init(ratectl_t *rate, const capture_profile_t *profile) {
+    rate->profile = *profile;
+    rate->profile.quality = MAX(CONFIG_RATE_MIN_Q, MIN(profile->quality, CONFIG_RATE_MAX_Q));
+    rate->max_framesize = profile->framesize;
+    rate->frame_bytes = 0;
+    rate->throughput = 0;
+    rate->interval_us = 0;
+    rate->last_time = 0;
+    rate->samples = 0;
+    rate->changes = 0;
+}
+
+// Bytes a frame may take according to the budgets and the averages
+float ratectl_budget(const ratectl_t *rate) {
+    float budget = CONFIG_RATE_TARGET_KB > 0 ? CONFIG_RATE_TARGET_KB * 1024.0f : INFINITY;
+
+    if (CONFIG_RATE_TARGET_KBPS > 0 && rate->interval_us > 0) {
+        budget = MIN(budget, CONFIG_RATE_TARGET_KBPS * 1024.0f * rate->interval_us / 1e6f);
+    }
+
+    // What the link carries within the allowed send time, at the throughput seen lately
+    if (CONFIG_RATE_MAX_SEND_MS > 0 && rate->throughput > 0) {
+        budget = MIN(budget, rate->throughput * CONFIG_RATE_MAX_SEND_MS * 1000.0f);
+    }
+
+    return budget;
+}
+
+#ifdef CONFIG_RATE_FRAMESIZE
+// Returns the position of a frame size in the ladder, -1 if it is not on it
+static int ladder_index(framesize_t framesize) {
+    for (int i = 0; i < sizeof(ladder) / sizeof(ladder[0]); i++) {
+        if (ladder[i] == framesize) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+#endif
+
+// Moves the profile by step quality numbers, positive steps lower the quality, returns 1 if it changed
+static int ratectl_step(ratectl_t *rate, int step, float ratio) {
+    capture_profile_t next = rate->profile;
+
+    next.quality = MAX(CONFIG_RATE_MIN_Q, MIN(rate->profile.quality + step, CONFIG_RATE_MAX_Q));
+
+#ifdef CONFIG_RATE_FRAMESIZE
+    int index = ladder_index(rate->profile.framesize);
+
+    // Out of quality steps, the frame size goes down, or up at the lowest quality if a larger frame still fits
+    if (index > 0 && step > 0 && rate->profile.quality == CONFIG_RATE_MAX_Q) {
+        next.framesize = ladder[index - 1];
+    } else if (index >= 0 && index + 1 < sizeof(ladder) / sizeof(ladder[0]) && step < 0 && ratio < 0.5f
+            && rate->profile.quality == CONFIG_RATE_MIN_Q && ladder[index + 1] <= rate->max_framesize) {
+        next.framesize = ladder[index + 1];
+        next.quality = CONFIG_RATE_MAX_Q;
+    }
+#endif
+
+    if (next.framesize == rate->profile.framesize && next.quality == rate->profile.quality) {
+        return 0;
+    }
+
+    ESP_LOGI(TAG, "%s q%d -> %s q%d, %u bytes per frame for a budget of %u",
+             capture_framesize_name(rate->profile.framesize), rate->profile.quality,
+             capture_framesize_name(next.framesize), next.quality, (uint32_t) rate->frame_bytes,
+             (uint32_t) MIN(ratectl_budget(rate), UINT32_MAX));
+
+    rate->profile = next;
+    rate->samples = 0;
+    rate->changes++;
+    return 1;
+}
+
+// Feeds a frame sent at now in us that httpd_resp_send took send_us for, returns 1 if the profile changed
+int ratectl_observe(ratectl_t *rate, const capture_profile_t *profile, size_t len, int64_t send_us, int64_t now) {
+    // The time between frames counts all of them, it is the rate the budget is shared by
+    if (rate->last_time != 0) {
+        float interval = now - rate->last_time;
+        rate->interval_us = rate->interval_us > 0 ? rate->interval_us + RATECTL_ALPHA * (interval - rate->interval_us)
+                                                  : interval;
+    }
+
+    rate->last_time = now;
+
+    // Only the bytes beyond the socket buffer had to wait for the link
+    if (len > RATECTL_SEND_BUF && send_us > 0) {
+        float throughput = (float) (len - RATECTL_SEND_BUF) / send_us;
+        rate->throughput = rate->throughput > 0 ? rate->throughput + RATECTL_ALPHA * (throughput - rate->throughput)
+                                                : throughput;
+    }
+
+    if (profile->framesize != rate->profile.framesize || profile->quality != rate->profile.quality) {
+        return 0;
+    }
+
+    if (rate->samples == 0) {
+        rate->frame_bytes = len;
+    } else {
+        rate->frame_bytes += RATECTL_ALPHA * (len - rate->frame_bytes);
+    }
+
+    if (++rate->samples < CONFIG_RATE_SETTLE_FRAMES) {
+        return 0;
+    }
+
+    float ratio = rate->frame_bytes / ratectl_budget(rate);
+
+    if (ratio > 1.0f) {
+        // JPEG size falls roughly exponentially with the quality number, far off takes larger steps
+        return ratectl_step(rate, MIN(RATECTL_MAX_STEP, 1 + (int) ((ratio - 1.0f) * 8)), ratio);
+    }
+
+    if (ratio < 1.0f - CONFIG_RATE_HYSTERESIS_PCT / 100.0f) {
+        return ratectl_step(rate, -1, ratio);
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * ratectl.h
+ *
+ *  JPEG quality control towards a frame size and bandwidth budget.
+ *
+ *  The controller keeps moving averages of the length of the frames it
+ *  asked for, of the time between frames and of the link throughput.
+ *  From those it derives the bytes a frame may take: CONFIG_RATE_TARGET_KB,
+ *  the share of CONFIG_RATE_TARGET_KBPS at the observed frame rate, and
+ *  what the link sends within CONFIG_RATE_MAX_SEND_MS, whichever is
+ *  smallest. httpd_resp_send returns as soon as the last RATECTL_SEND_BUF
+ *  bytes are in the socket buffer, so the send time only covers the part
+ *  of a frame beyond them and smaller frames tell nothing about the link.
+ *  Frames over the budget lower the quality at once, by more steps the
+ *  further they are off. Frames more than CONFIG_RATE_HYSTERESIS_PCT
+ *  below it raise the quality by one step, which changes the size by
+ *  less than that margin, so the two never chase each other. After a
+ *  change the averages start over and CONFIG_RATE_SETTLE_FRAMES frames
+ *  of the new profile are awaited before the next one.
+ */
+
+#ifndef MAIN_RATECTL_H_
+#define MAIN_RATECTL_H_
+
+#include "settings.h"
+#include "capture.h"
+#include <sdkconfig.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes a send hands to the TCP socket buffer without waiting for the link
+#define RATECTL_SEND_BUF CONFIG_TCP_SND_BUF_DEFAULT
+
+// Controller state
+typedef struct {
+    capture_profile_t profile;  // profile the frames should be captured with
+    framesize_t max_framesize;  // the driver buffers do not fit anything larger
+    float frame_bytes;      // moving average of the frame length
+    float throughput;       // moving average of the link throughput in bytes per us, 0 before it was measured
+    float interval_us;      // moving average of the time between frames
+    int64_t last_time;      // esp_timer time of the last frame, 0 before the first
+    uint32_t samples;       // frames observed since the last change
+    uint32_t changes;       // profile changes so far
+} ratectl_t;
+
+// Starts at the given profile, its frame size is the largest one used
+void ratectl_init(ratectl_t *rate, const capture_profile_t *profile);
+
+// Bytes a frame may take according to the budgets and the averages
+float ratectl_budget(const ratectl_t *rate);
+
+// Feeds a frame sent at now in us that httpd_resp_send took send_us for, returns 1 if the profile changed
+// Frames of other profiles only count towards the frame rate and the throughput
+int ratectl_observe(ratectl_t *rate, const capture_profile_t *profile, size_t len, int64_t send_us, int64_t now);
+
+#endif /* MAIN_RATECTL_H_ */
@@ -7,17 +7,35 @@
 #include "rest.h"
 #include "settings.h"
 #include "mulmsg.h"
+#include "mulmsg2.h"
+#include "capture.h"
+#include "handshake.h"
+#include "metrics.h"
+#include "roi.h"
+#include "motion.h"
+#include "session.h"
+#include "stream.h"
+#include "frame.h"
+#include "clocksync.h"
+#include "snapshot.h"
+#include "push.h"
+#include "membudget.h"
+#include "ratectl.h"
+#include "boot.h"
 #include <nvs_flash.h>
 #include <esp_camera.h>
 #include <esp_event_loop.h>
 #include <esp_wifi.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_system.h>
 #include <esp_now.h>
 #include <tcpip_adapter.h>
 #include <lwip/sockets.h>
 #include <lwip/netdb.h>
 #include <freertos/event_groups.h>
 #include "LED.h"
+#include "ledmsg.h"
 #include <sys/param.h>
 
 
@@ -27,12 +45,62 @@ static esp_err_t event_handler(void *ctx, system_event_t *event);
 // Starts the HTTP daemon server
 static httpd_handle_t start_webserver(void);
 
-// Stops the HTTP daemon server
-static void stop_webserver(httpd_handle_t server);
-
 // Handles HTTP GET: "Image" request
 static esp_err_t jpg_httpd_handler(httpd_req_t *req);
 
+// Handles HTTP GET: "Frame" request, the binary capture + metadata format
+static esp_err_t frame_httpd_handler(httpd_req_t *req);
+
+// Handles HTTP GET: "Stream" request, hands the connection to a stream task
+static esp_err_t stream_httpd_handler(httpd_req_t *req);
+
+// HTTP GET handler: returns the hot path metrics as Prometheus text
+static esp_err_t metrics_httpd_handler(httpd_req_t *req);
+
+// Reads the capture profile from the query string, defaults to the given profile or the boot profile if NULL
+static esp_err_t parse_capture_profile(httpd_req_t *req, const capture_profile_t *defaults,
+                                       capture_profile_t *profile);
+
+// Reads the optional region of interest from the query string
+static esp_err_t parse_roi(httpd_req_t *req, roi_t *roi);
+
+// Sends the region of interest of a frame as a chunked JPEG
+static esp_err_t send_roi(httpd_req_t *req, const capture_frame_t *frame, const roi_t *roi, size_t *sent);
+
+// Reads the acceptable frame age from "Cache-Control", defaults to CONFIG_CAPTURE_MAX_AGE_MS, 0 for a new frame
+static int64_t parse_max_age(httpd_req_t *req);
+
+// Acquires a frame as fresh as "Cache-Control" asks for, NULL on failure
+static capture_frame_t *acquire_for(httpd_req_t *req);
+
+// Switches to a profile and acquires a frame captured with it, see acquire_for
+static capture_frame_t *acquire_profile(httpd_req_t *req, const capture_profile_t *profile);
+
+// Checks "If-None-Match" against the ETag of the frame about to be sent
+static int etag_matches(httpd_req_t *req, const char *etag);
+
+// Checks whether "Accept" asks for the binary frame format
+static int accepts_frame(httpd_req_t *req);
+
+// Answers 503 with Retry-After while the camera is still being set up, returns 1 if it did
+static int camera_pending(httpd_req_t *req);
+
+#ifdef CONFIG_MOTION_GATE
+// Reads the scene version of "?since=", -1 if absent
+static int64_t parse_since(httpd_req_t *req);
+
+// Sets X-Scene-Version, scene has to last until the response is sent, returns 1 if it answered 204 to "?since="
+static int scene_unchanged(httpd_req_t *req, uint32_t version, char *scene, size_t len);
+#endif
+
+#ifdef CONFIG_SYNC_CAPTURE
+// Reads the frame sequence number of "?seq=", -1 if absent
+static int64_t parse_seq(httpd_req_t *req);
+
+// Sends a frame latched by a synchronized capture
+static esp_err_t send_snapshot(httpd_req_t *req, uint32_t seq);
+#endif
+
 // Creates an IPV4 multicast socket for receiving and sending messages
 static int create_multicast_ipv4_socket();
 
@@ -42,23 +110,93 @@ static void mcast_worker_task(void *pvParameters);
 // Registers to multicast group to receive messages
 static int register_multicast_ipv4_group(int sock);
 
-// Handles received multicast message
-static int handle_mulmsg(int sock, mulmsg *message, const char *address);
+// Sending side of the multicast socket with its destination resolved once
+typedef struct {
+    int sock;
+    struct sockaddr_in group;   // CONFIG_MULTICAST_ADDR:CONFIG_MULTICAST_PORT
+    int64_t log_after;          // esp_timer time the next send may be logged at
+    uint32_t unlogged;          // sends not logged since the last log line
+} mcast_sender_t;
+
+// Binds the sender to a socket and resolves the group address
+static int multicast_sender_init(mcast_sender_t *sender, int sock);
+
+// Longest the multicast task sleeps before checking for a new address
+#define MCAST_POLL_MS 500
+
+// Milliseconds since boot, the clock of the handshake
+static uint32_t mcast_now(void);
+
+// Sends "Are You There?" to the group
+static int multicast_request(mcast_sender_t *sender);
+
+// Handles received multicast message, replies go to dest
+static int handle_mulmsg(mcast_sender_t *sender, mulmsg *message, const struct sockaddr_in *dest);
+
+// Sends a message of len bytes starting with the given header to dest, or the group if dest is NULL
+static int multicast_send(mcast_sender_t *sender, mulmsg *message, int len, const struct sockaddr_in *dest);
+
+#ifdef CONFIG_MULTICAST_V2
+// Sends the v2 capability announcement of this station
+static int multicast_announce(mcast_sender_t *sender, const struct sockaddr_in *dest);
+
+#ifdef CONFIG_MOTION_EVENTS
+// Tells the group that the scene changed
+static int multicast_scene(mcast_sender_t *sender, uint32_t version);
+#endif
+
+// Logs the records of a received v2 message
+static void log_mulmsg2(mulmsg2 *message);
 
-// Sends a multicast message via socket
-static int multicast_send(int sock, mulmsg *message, const char *address);
+// Applies the clock and capture records of a controller message received at local time received
+static void handle_mulmsg2(mulmsg2 *message, int64_t received, int answered);
+
+#ifdef CONFIG_SYNC_CAPTURE
+// Tells the controller which frame a synchronized capture latched
+static int multicast_captured(mcast_sender_t *sender, const snapshot_result_t *result);
+#endif
+#endif
 //handle the leds
 static esp_err_t start_led_httpd_handler(httpd_req_t *req);
 
+// Switches all LEDs off
+static esp_err_t stop_led_httpd_handler(httpd_req_t *req);
+
+// Handles HTTP POST: "LED effects" request, replaces the effects played on the device
+static esp_err_t led_effects_httpd_handler(httpd_req_t *req);
+
+// Reads "?brightness=0..255" and rebuilds the colour correction of binary updates if it changed
+static esp_err_t update_led_lut(httpd_req_t *req);
+
 
 // Logger tag name
 static const char *TAG = "LMS";
+// MJPEG stream server, runs next to the main server on its own task
+static httpd_handle_t stream_server = NULL;
+// Keep-alive connections of both servers
+static session_table_t http_sessions;
+static session_table_t stream_sessions;
+// Port of the main server, announced via multicast
+static uint16_t http_port = 0;
 // FreeRTOS event group to signal when we are connected & ready to make a request
+// (BIT0) and when a new address has to be announced (BIT1)
 static EventGroupHandle_t wifi_event_group;
-
-#ifdef CONFIG_MULTICAST_HANDSHAKE
-static int handshakeDone = 0;
+// Handshake with the multicast controller, only touched by the multicast task
+static handshake mcast_handshake;
+// Controller clock estimated from the handshake and the time of the pending request, only touched by the multicast task
+static clocksync mcast_clock;
+static int64_t mcast_request_us;
+
+// LED colours binary updates are applied to and the copy an update is parsed into, only touched by the HTTP server task
+static struct led_state pending_state;
+static struct led_state parsed_state;
+#ifdef CONFIG_RATE_CONTROL
+// Picks the profile of /jpg requests without q or size, only touched by the HTTP server task
+static ratectl_t jpg_rate;
 #endif
+// Gamma and brightness correction of binary updates, rebuilt when the brightness changes
+static uint8_t led_lut[256];
+static int led_lut_brightness = -1;
 
 // Camera config
 static camera_config_t camera_config = {
@@ -89,7 +227,7 @@ static camera_config_t camera_config = {
         .frame_size = FRAMESIZE_UXGA,   //QQVGA-UXGA Do not use sizes above QVGA when not JPEG
 
         .jpeg_quality = 12, //0-63 lower number means higher quality
-        .fb_count = 1       //if more than one, i2s runs in continuous mode. Use only with JPEG
+        .fb_count = CAPTURE_FB_COUNT    //if more than one, i2s runs in continuous mode. Use only with JPEG
 };
 
 // HTTP GET service definition: "Image"
@@ -99,6 +237,20 @@ static httpd_uri_t uri_handler_jpg = {
         .handler = jpg_httpd_handler
 };
 
+// HTTP GET service definition: "Frame"
+static httpd_uri_t uri_handler_frame = {
+        .uri = "/frame.bin",
+        .method = HTTP_GET,
+        .handler = frame_httpd_handler
+};
+
+// HTTP GET service definition: "Stream"
+static httpd_uri_t uri_handler_stream = {
+        .uri = "/stream",
+        .method = HTTP_GET,
+        .handler = stream_httpd_handler
+};
+
 static httpd_uri_t uri_handler_start_leds = {
         .uri = "/start_led",
         .method = HTTP_POST,
@@ -111,16 +263,80 @@ static httpd_uri_t uri_handler_stop_leds = {
         .handler = stop_led_httpd_handler
 };
 
+// HTTP POST service definition: "LED effects"
+static httpd_uri_t uri_handler_led_effects = {
+        .uri = "/led_effects",
+        .method = HTTP_POST,
+        .handler = led_effects_httpd_handler
+};
+
+// HTTP GET service definition: "Metrics"
+static httpd_uri_t uri_handler_metrics = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_httpd_handler
+};
+
 // Initializes the flash driver
 void init_flash() {
     ESP_LOGI(TAG, "Initializing Flash...");
-    ESP_ERROR_CHECK(nvs_flash_init());
+    esp_err_t res = nvs_flash_init();
+
+    // A full partition or one written by a newer layout is erased, the WiFi driver needs NVS
+    if (res == ESP_ERR_NVS_NO_FREE_PAGES || res == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "Erasing NVS partition");
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        res = nvs_flash_init();
+    }
+
+    ESP_ERROR_CHECK(res);
 }
 
 // Initializes the camera driver
 void init_camera() {
     ESP_LOGI(TAG, "Initializing Camera...");
     ESP_ERROR_CHECK(esp_camera_init(&camera_config));
+    // Reserved right after the driver's frame buffers, so a budget that does not fit stops the boot here
+    ESP_ERROR_CHECK(membudget_init());
+    capture_profile_t profile = {
+            .framesize = camera_config.frame_size,
+            .quality = camera_config.jpeg_quality,
+    };
+    ESP_ERROR_CHECK(capture_init(&profile));
+#ifdef CONFIG_RATE_CONTROL
+    ratectl_init(&jpg_rate, &profile);
+#endif
+#ifdef CONFIG_MOTION_GATE
+    ESP_ERROR_CHECK(motion_init());
+#endif
+#ifdef CONFIG_SYNC_CAPTURE
+    ESP_ERROR_CHECK(snapshot_init());
+#endif
+#ifdef CONFIG_PUSH_MODE
+    ESP_ERROR_CHECK(push_init());
+#endif
+}
+
+// Stack of the task setting up the camera at boot
+#define CAMERA_INIT_STACK 4096
+
+// Sets up the camera and everything depending on it, then ends the task
+static void camera_init_task(void *pvParameters) {
+    init_camera();
+    boot_done(BOOT_CAMERA);
+    vTaskDelete(NULL);
+}
+
+// Initializes the camera driver on a task of its own, BOOT_CAMERA is done once frames can be captured
+void start_camera() {
+    boot_begin(BOOT_CAMERA);
+    xTaskCreatePinnedToCore(&camera_init_task, "camera_init_task", CAMERA_INIT_STACK, NULL,
+                            CONFIG_CAPTURE_TASK_PRIORITY, NULL, CONFIG_CAPTURE_TASK_CORE);
+}
+
+// Starts the HTTP servers, requests needing the camera are answered with 503 until it is ready
+void start_http(httpd_handle_t *server) {
+    *server = start_webserver();
 }
 
 // Initializes the wifi driver
@@ -145,9 +361,11 @@ void init_wifi(httpd_handle_t *arg) {
     ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+    boot_begin(BOOT_NETWORK);
     ESP_ERROR_CHECK(esp_wifi_start());
 
-    xTaskCreate(&mcast_worker_task, "mcast_task", 4096, NULL, 5, NULL);
+    xTaskCreatePinnedToCore(&mcast_worker_task, "mcast_task", CONFIG_MCAST_TASK_STACK, NULL,
+                            CONFIG_MCAST_TASK_PRIORITY, NULL, CONFIG_MCAST_TASK_CORE);
 }
 
 // Handles WiFi status changes and manages webserver execution
@@ -163,26 +381,25 @@ static esp_err_t event_handler(void *ctx, system_event_t *event) {
         case SYSTEM_EVENT_STA_GOT_IP: {
             ESP_LOGI(TAG, "SYSTEM_EVENT_STA_GOT_IP");
             ESP_LOGI(TAG, "Got IP: '%s'", ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
+            boot_done(BOOT_NETWORK);
 
-            /* Start the web server */
-            if (*server == NULL) {
+            /* Retry starting the web server if it failed at boot */
+            if (*server == NULL && boot_is_done(BOOT_HTTP)) {
                 *server = start_webserver();
-                xEventGroupSetBits(wifi_event_group, BIT0);
             }
 
+            xEventGroupSetBits(wifi_event_group, BIT0);
+
+            // Announce the (possibly new) address right away instead of waiting for the backoff
+            xEventGroupSetBits(wifi_event_group, BIT1);
+
             break;
         }
         case SYSTEM_EVENT_STA_DISCONNECTED: {
             ESP_LOGI(TAG, "SYSTEM_EVENT_STA_DISCONNECTED");
-            ESP_ERROR_CHECK(esp_wifi_connect());
-
-            /* Stop the web server */
-            if (*server) {
-                xEventGroupClearBits(wifi_event_group, BIT0);
-                stop_webserver(*server);
-                *server = NULL;
-            }
 
+            // The servers keep running, so clients reconnect to them as soon as the link is back
+            xEventGroupClearBits(wifi_event_group, BIT0);
             esp_wifi_connect();
             break;
         }
@@ -198,15 +415,46 @@ static esp_err_t event_handler(void *ctx, system_event_t *event) {
 static httpd_handle_t start_webserver(void) {
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.task_priority = CONFIG_HTTP_TASK_PRIORITY;
+    config.stack_size = CONFIG_HTTP_TASK_STACK;
+    config.max_open_sockets = CONFIG_HTTP_MAX_SOCKETS;
+    session_config(&config, &http_sessions, CONFIG_HTTP_IDLE_TIMEOUT_S * 1000);
 
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
+    http_port = config.server_port;
 
     if (httpd_start(&server, &config) == ESP_OK) {
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
         httpd_register_uri_handler(server, &uri_handler_jpg);
+        httpd_register_uri_handler(server, &uri_handler_frame);
         httpd_register_uri_handler(server, &uri_handler_start_leds);
         httpd_register_uri_handler(server, &uri_handler_stop_leds);
+        httpd_register_uri_handler(server, &uri_handler_led_effects);
+        httpd_register_uri_handler(server, &uri_handler_metrics);
+        session_start(&http_sessions, server);
+
+        // Streams are served by tasks of their own, their server only hands the connections over
+        config.server_port = CONFIG_STREAM_PORT;
+        config.ctrl_port += 1;
+        config.max_open_sockets = CONFIG_STREAM_MAX_SOCKETS;
+        session_config(&config, &stream_sessions, CONFIG_HTTP_IDLE_TIMEOUT_S * 1000);
+        // A running stream is never purged for a new client, which is refused instead
+        config.lru_purge_enable = false;
+        ESP_LOGI(TAG, "Starting stream server on port: '%d'", config.server_port);
+
+        if (httpd_start(&stream_server, &config) != ESP_OK) {
+            ESP_LOGE(TAG, "Error starting stream server!");
+            stream_server = NULL;
+        } else if (stream_init(stream_server) != ESP_OK) {
+            ESP_LOGE(TAG, "Error starting stream tasks!");
+            httpd_stop(stream_server);
+            stream_server = NULL;
+        } else {
+            httpd_register_uri_handler(stream_server, &uri_handler_stream);
+            session_start(&stream_sessions, stream_server);
+        }
+
         return server;
     }
 
@@ -214,77 +462,781 @@ static httpd_handle_t start_webserver(void) {
     return NULL;
 }
 
-// Stops the HTTP daemon server
-static void stop_webserver(httpd_handle_t server) {
-    httpd_stop(server);
-}
-
 // Handles HTTP GET: "Image" request
 static esp_err_t jpg_httpd_handler(httpd_req_t *req) {
-    camera_fb_t *fb = NULL;
+    capture_frame_t *frame = NULL;
     esp_err_t res = ESP_OK;
     size_t fb_len = 0;
+    capture_profile_t profile;
+    roi_t roi;
+    char etag[16];
     int64_t fr_start = esp_timer_get_time();
 
-    fb = esp_camera_fb_get();
+    if (accepts_frame(req)) {
+        return frame_httpd_handler(req);
+    }
+
+    session_touch(req);
+
+    if (camera_pending(req)) {
+        return ESP_OK;
+    }
+
+#ifdef CONFIG_SYNC_CAPTURE
+    // Frames of synchronized captures are fetched by the sequence number the station announced
+    int64_t latched = parse_seq(req);
+
+    if (latched >= 0) {
+        return send_snapshot(req, latched);
+    }
+#endif
 
-    if (!fb) {
+    const capture_profile_t *defaults = NULL;
+#ifdef CONFIG_RATE_CONTROL
+    // Only /jpg follows the rate controller, the other endpoints keep the boot profile
+    defaults = &jpg_rate.profile;
+#endif
+
+    if (parse_capture_profile(req, defaults, &profile) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid size or q");
+        return ESP_FAIL;
+    }
+
+    esp_err_t has_roi = parse_roi(req, &roi);
+
+    if (has_roi == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid roi or scale");
+        return ESP_FAIL;
+    }
+
+#ifdef CONFIG_MOTION_GATE
+    char scene[12];
+#ifdef CONFIG_CAPTURE_PIPELINE
+    // Pollers pass the last scene version they saw and skip the capture and transfer while nothing moved
+    if (scene_unchanged(req, motion_get_version(), scene, sizeof(scene))) {
+        return ESP_OK;
+    }
+#endif
+#endif
+
+    int64_t cap_start = esp_timer_get_time();
+    frame = acquire_profile(req, &profile);
+    metrics_record(METRIC_CAPTURE, esp_timer_get_time() - cap_start);
+
+    if (!frame) {
         ESP_LOGE(TAG, "Camera capture failed");
+        metrics_count(METRIC_CAPTURE_FAILURES, 1);
         httpd_resp_send_500(req);
         return ESP_FAIL;
     }
 
-    res = httpd_resp_set_type(req, "image/jpeg");
+#if defined(CONFIG_MOTION_GATE) && !defined(CONFIG_CAPTURE_PIPELINE)
+    // Nothing analyzes frames in the background without the pipeline, so the frames of pollers are and only
+    // their transfer is skipped
+    uint32_t version = parse_since(req) >= 0 ? motion_analyze(frame) : motion_get_version();
 
-    if (res == ESP_OK) {
-        res = httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    if (scene_unchanged(req, version, scene, sizeof(scene))) {
+        capture_release(frame);
+        return ESP_OK;
     }
+#endif
+
+    // The frame sequence number identifies the image, clients revalidate with If-None-Match
+    snprintf(etag, sizeof(etag), "\"%u\"", frame->seq);
+    res = httpd_resp_set_hdr(req, "ETag", etag);
 
     if (res == ESP_OK) {
-        fb_len = fb->len;
-        res = httpd_resp_send(req, (const char *) fb->buf, fb->len);
+        res = httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
     }
 
-    esp_camera_fb_return(fb);
+    if (res == ESP_OK && etag_matches(req, etag)) {
+        res = httpd_resp_set_status(req, "304 Not Modified");
+
+        if (res == ESP_OK) {
+            res = httpd_resp_send(req, NULL, 0);
+        }
+    } else {
+        if (res == ESP_OK) {
+            res = httpd_resp_set_type(req, "image/jpeg");
+        }
+
+        if (res == ESP_OK) {
+            res = httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+        }
+
+        if (res == ESP_OK && has_roi == ESP_OK) {
+            int64_t send_start = esp_timer_get_time();
+            res = send_roi(req, frame, &roi, &fb_len);
+            metrics_record(METRIC_ROI, esp_timer_get_time() - send_start);
+        } else if (res == ESP_OK) {
+            int64_t send_start = esp_timer_get_time();
+            fb_len = frame->fb->len;
+            res = httpd_resp_send(req, (const char *) frame->fb->buf, frame->fb->len);
+            int64_t send_end = esp_timer_get_time();
+            metrics_record(METRIC_SEND, send_end - send_start);
+#ifdef CONFIG_RATE_CONTROL
+            // Frames captured for an explicit q or size do not count, the next default request switches the sensor
+            if (res == ESP_OK) {
+                ratectl_observe(&jpg_rate, &frame->profile, fb_len, send_end - send_start, send_end);
+            }
+#endif
+        }
+
+        if (res == ESP_OK) {
+            metrics_count(METRIC_SEND_BYTES, fb_len);
+        } else {
+            metrics_count(METRIC_SEND_FAILURES, 1);
+        }
+    }
+
+    uint32_t seq = frame->seq;
+    capture_profile_t sent = frame->profile;
+    capture_release(frame);
+
+    capture_stats_t stats;
+    capture_get_stats(&stats);
 
     int64_t fr_end = esp_timer_get_time();
-    ESP_LOGI(TAG, "JPG: %uKB %ums", (uint32_t) (fb_len / 1024), (uint32_t) ((fr_end - fr_start) / 1000));
+    ESP_LOGI(TAG, "JPG %s q%d: %uKB %ums #%u (cache %u hits, %u misses, %u shared)",
+             capture_framesize_name(sent.framesize), sent.quality, (uint32_t) (fb_len / 1024),
+             (uint32_t) ((fr_end - fr_start) / 1000), seq, stats.hits, stats.misses, stats.shares);
     return res;
 }
 
+// Handles HTTP GET: "Frame" request, the binary capture + metadata format
+static esp_err_t frame_httpd_handler(httpd_req_t *req) {
+    capture_profile_t profile;
+
+    session_touch(req);
+
+    if (camera_pending(req)) {
+        return ESP_OK;
+    }
+
+    if (parse_capture_profile(req, NULL, &profile) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid size or q");
+        return ESP_FAIL;
+    }
+
+    int64_t cap_start = esp_timer_get_time();
+    capture_frame_t *frame = acquire_profile(req, &profile);
+    int64_t send_start = esp_timer_get_time();
+    metrics_record(METRIC_CAPTURE, send_start - cap_start);
+
+    if (!frame) {
+        metrics_count(METRIC_CAPTURE_FAILURES, 1);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    // The response is written to the socket directly, httpd only parsed the request
+    esp_err_t res = frame_send(httpd_req_to_sockfd(req), frame);
+
+    if (res == ESP_OK) {
+        metrics_record(METRIC_SEND, esp_timer_get_time() - send_start);
+        metrics_count(METRIC_SEND_BYTES, sizeof(frame_header_t) + frame->fb->len);
+    } else {
+        metrics_count(METRIC_SEND_FAILURES, 1);
+    }
+
+    capture_release(frame);
+    return res;
+}
+
+// Reads the capture profile from the query string, defaults to the given profile or the boot profile if NULL
+static esp_err_t parse_capture_profile(httpd_req_t *req, const capture_profile_t *defaults,
+                                       capture_profile_t *profile) {
+    char query[64];
+    char value[8];
+
+    if (defaults != NULL) {
+        *profile = *defaults;
+    } else {
+        profile->framesize = camera_config.frame_size;
+        profile->quality = camera_config.jpeg_quality;
+    }
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+        return ESP_OK;
+    }
+
+    // e.g. /jpg?size=vga&q=20
+    if (httpd_query_key_value(query, "size", value, sizeof(value)) == ESP_OK) {
+        profile->framesize = capture_framesize_from_name(value);
+
+        // Frame buffers are allocated for the boot frame size
+        if (profile->framesize == FRAMESIZE_INVALID || profile->framesize > camera_config.frame_size) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (httpd_query_key_value(query, "q", value, sizeof(value)) == ESP_OK) {
+        profile->quality = atoi(value);
+
+        if (profile->quality < 4 || profile->quality > 63) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Handles HTTP GET: "Stream" request, hands the connection to a stream task
+static esp_err_t stream_httpd_handler(httpd_req_t *req) {
+    char query[128];
+    int fps = CONFIG_STREAM_MAX_FPS;
+
+    session_touch(req);
+
+    if (camera_pending(req)) {
+        return ESP_OK;
+    }
+
+    // Optional per-client frame rate cap, e.g. /stream?fps=5
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        char value[8];
+
+        if (httpd_query_key_value(query, "fps", value, sizeof(value)) == ESP_OK) {
+            fps = MAX(1, MIN(atoi(value), CONFIG_STREAM_MAX_FPS));
+        }
+    }
+
+    // The stream task writes the response, the server task is free for the next client right away
+    if (stream_start(req, fps) == ESP_OK) {
+        return ESP_OK;
+    }
+
+    const char resp[] = "Too many streams";
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "5");
+    httpd_resp_send(req, resp, strlen(resp));
+    return ESP_FAIL;
+}
+
 static esp_err_t start_led_httpd_handler(httpd_req_t *req) {
 
     char buf[100];
 
+    session_touch(req);
+
     int ret = 0;
-    ret = req->content_len;
     int remaining = req->content_len;
-    struct led_state new_state;
+    int received = 0;
+    int binary = 0;
+    int64_t led_start = esp_timer_get_time();
+    ledmsg_parser parser;
+
+    // Binary bodies may be dimmed with /start_led?brightness=0..255
+    if (update_led_lut(req) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Query too long");
+        return ESP_FAIL;
+    }
 
     while (remaining > 0) {
-        if ((ret = httpd_req_recv(req, buf,
-                                  MIN(remaining, sizeof(buf)))) <= 0) {
+        // Hex digits are collected at the start of buf, binary chunks always overwrite it
+        int offset = binary ? 0 : MIN(received, 8);
+
+        if ((ret = httpd_req_recv(req, buf + offset,
+                                  MIN(remaining, sizeof(buf) - offset - 1))) <= 0) {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
                 continue;
             }
+
+            return ESP_FAIL;
+        }
+
+        // Parsed into a copy, so a broken update leaves the LEDs as they are
+        if (received == 0 && ledmsg_isBinary(buf[0])) {
+            binary = 1;
+            parsed_state = pending_state;
+            ledmsg_init(&parser, &parsed_state, led_lut);
+        }
+
+        // Binary records are decoded straight from the receive buffer
+        if (binary) {
+            ledmsg_feed(&parser, (const uint8_t *) buf, ret);
         }
+
+        received += ret;
         remaining -= ret;
     }
 
-    if (ret == 8) {
+    if (binary) {
+        if (ledmsg_finish(&parser) != 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Malformed LED update");
+            return ESP_FAIL;
+        }
+
+        pending_state = parsed_state;
+    } else if (received == 8) {
         int color;
+        buf[8] = 0;
         sscanf(buf, "%x", &color);
+        // The legacy digits are the green first word of the original strip
+        color = ((color & 0xFF00) << 8) | ((color >> 8) & 0xFF00) | (color & 0xFF);
 
         for (int led = 0; led < NUM_LEDS; led++) {
-            new_state.leds[led] = color;
+            pending_state.leds[led] = color;
         }
+    } else {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected 8 hex digits or a binary update");
+        return ESP_FAIL;
     }
-    write_leds(new_state);
+
+    write_leds(&pending_state);
     const char resp[] = "200 OK";
     httpd_resp_send(req, resp, strlen(resp));
+
+    ESP_LOGI(TAG, "LED: %dB %uus", received, (uint32_t) (esp_timer_get_time() - led_start));
+    return ESP_OK;
+}
+
+// Passes metrics text on as one HTTP chunk
+static int metrics_send_chunk(void *ctx, const char *data, size_t len) {
+    return httpd_resp_send_chunk((httpd_req_t *) ctx, data, len) == ESP_OK ? 0 : -1;
+}
+
+// Appends the figures of the camera and the modules depending on it in Prometheus text format
+static void write_capture_metrics(metrics_writer_t *writer) {
+    capture_stats_t stats;
+
+    capture_get_stats(&stats);
+    metrics_printf(writer, "# TYPE esp32cam_capture_cache_total counter\n");
+    metrics_printf(writer, "esp32cam_capture_cache_total{result=\"hit\"} %u\n", stats.hits);
+    metrics_printf(writer, "esp32cam_capture_cache_total{result=\"miss\"} %u\n", stats.misses);
+    metrics_printf(writer, "# TYPE esp32cam_capture_shares_total counter\nesp32cam_capture_shares_total %u\n",
+                   stats.shares);
+    metrics_printf(writer, "# TYPE esp32cam_frame_seq gauge\nesp32cam_frame_seq %u\n", stats.last_seq);
+
+#ifdef CONFIG_MOTION_GATE
+    motion_stats_t motion;
+
+    motion_get_stats(&motion);
+    metrics_printf(writer, "# TYPE esp32cam_scene_version gauge\nesp32cam_scene_version %u\n", motion.version);
+    metrics_printf(writer, "# TYPE esp32cam_motion_frames_total counter\nesp32cam_motion_frames_total %u\n",
+                   motion.frames);
+    metrics_printf(writer, "# TYPE esp32cam_motion_changed_cells gauge\nesp32cam_motion_changed_cells %u\n",
+                   motion.changed_cells);
+#endif
+#ifdef CONFIG_RATE_CONTROL
+    metrics_printf(writer, "# TYPE esp32cam_rate_quality gauge\nesp32cam_rate_quality{size=\"%s\"} %d\n",
+                   capture_framesize_name(jpg_rate.profile.framesize), jpg_rate.profile.quality);
+    metrics_printf(writer, "# TYPE esp32cam_rate_frame_bytes gauge\nesp32cam_rate_frame_bytes %.0f\n",
+                   jpg_rate.frame_bytes);
+    metrics_printf(writer, "# TYPE esp32cam_rate_budget_bytes gauge\nesp32cam_rate_budget_bytes %.0f\n",
+                   ratectl_budget(&jpg_rate));
+    metrics_printf(writer, "# TYPE esp32cam_rate_changes_total counter\nesp32cam_rate_changes_total %u\n",
+                   jpg_rate.changes);
+#endif
+#ifdef CONFIG_PUSH_MODE
+    push_stats_t push;
+
+    push_get_stats(&push);
+    metrics_printf(writer, "# TYPE esp32cam_push_frames_total counter\n");
+    metrics_printf(writer, "esp32cam_push_frames_total{result=\"queued\"} %u\n", push.queued);
+    metrics_printf(writer, "esp32cam_push_frames_total{result=\"sent\"} %u\n", push.sent);
+    metrics_printf(writer, "esp32cam_push_frames_total{result=\"dropped\"} %u\n", push.dropped);
+    metrics_printf(writer, "# TYPE esp32cam_push_bytes_total counter\nesp32cam_push_bytes_total %llu\n",
+                   (unsigned long long) push.bytes);
+    metrics_printf(writer, "# TYPE esp32cam_push_connects_total counter\nesp32cam_push_connects_total %u\n",
+                   push.connects);
+    metrics_printf(writer, "# TYPE esp32cam_push_connected gauge\nesp32cam_push_connected %d\n", push.connected);
+    metrics_printf(writer, "# TYPE esp32cam_push_queue_depth gauge\nesp32cam_push_queue_depth %u\n", push.depth);
+    metrics_printf(writer, "# TYPE esp32cam_push_queue_depth_max gauge\nesp32cam_push_queue_depth_max %u\n",
+                   push.max_depth);
+#endif
+    membudget_write_metrics(writer);
+}
+
+// HTTP GET handler: returns the hot path metrics as Prometheus text
+static esp_err_t metrics_httpd_handler(httpd_req_t *req) {
+    metrics_writer_t writer;
+
+    session_touch(req);
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    metrics_writer_init(&writer, metrics_send_chunk, req);
+    metrics_write_all(&writer);
+
+    // Written by the multicast task, a torn read only skews a single scrape
+    metrics_printf(&writer, "# TYPE esp32cam_mcast_linked gauge\nesp32cam_mcast_linked %d\n",
+                   handshake_isLinked(&mcast_handshake));
+    metrics_printf(&writer, "# TYPE esp32cam_mcast_links_total counter\nesp32cam_mcast_links_total %u\n",
+                   mcast_handshake.links);
+    metrics_printf(&writer, "# TYPE esp32cam_mcast_losses_total counter\nesp32cam_mcast_losses_total %u\n",
+                   mcast_handshake.losses);
+    metrics_printf(&writer, "# TYPE esp32cam_mcast_time_to_link_seconds gauge\n"
+                            "esp32cam_mcast_time_to_link_seconds %.3f\n", mcast_handshake.timeToLink / 1e3);
+    metrics_printf(&writer, "# TYPE esp32cam_clock_offset_seconds gauge\nesp32cam_clock_offset_seconds %.6f\n",
+                   mcast_clock.offset / 1e6);
+    metrics_printf(&writer, "# TYPE esp32cam_clock_rtt_seconds gauge\nesp32cam_clock_rtt_seconds %.6f\n",
+                   mcast_clock.rtt / 1e6);
+
+    // Served during boot as well, the capture figures follow once the camera is ready
+    if (boot_is_done(BOOT_CAMERA)) {
+        write_capture_metrics(&writer);
+    }
+
+    boot_write_metrics(&writer);
+    metrics_write_tasks(&writer);
+
+    if (metrics_writer_finish(&writer) != 0) {
+        return ESP_FAIL;
+    }
+
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// Switches all LEDs off
+static esp_err_t stop_led_httpd_handler(httpd_req_t *req) {
+    session_touch(req);
+    memset(&pending_state, 0, sizeof(pending_state));
+    led_set_effects(NULL, 0);
+    write_leds(&pending_state);
+
+    const char resp[] = "200 OK";
+    httpd_resp_send(req, resp, strlen(resp));
+    return ESP_OK;
+}
+
+// Reads "?brightness=0..255" and rebuilds the colour correction of binary updates if it changed
+// A query or value that does not fit fails with ESP_ERR_INVALID_SIZE instead of falling back to full brightness
+static esp_err_t update_led_lut(httpd_req_t *req) {
+    char query[128];
+    char value[8];
+    int brightness = 255;
+    size_t query_len = httpd_req_get_url_query_len(req);
+
+    if (query_len >= sizeof(query)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (query_len > 0 && httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        esp_err_t res = httpd_query_key_value(query, "brightness", value, sizeof(value));
+
+        if (res == ESP_ERR_HTTPD_RESULT_TRUNC) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        if (res == ESP_OK) {
+            brightness = MAX(0, MIN(atoi(value), 255));
+        }
+    }
+
+    if (brightness != led_lut_brightness) {
+        ledmsg_buildLut(led_lut, brightness);
+        led_lut_brightness = brightness;
+    }
+
     return ESP_OK;
 }
 
+// Handles HTTP POST: "LED effects" request, replaces the effects played on the device
+static esp_err_t led_effects_httpd_handler(httpd_req_t *req) {
+    uint8_t body[ANIM_MAX_EFFECTS * ANIM_RECORD_LEN];
+    anim_effect_t effects[ANIM_MAX_EFFECTS];
+    int received = 0;
+
+    session_touch(req);
+
+    if (req->content_len > sizeof(body)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many effects");
+        return ESP_FAIL;
+    }
+
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, (char *) body + received, req->content_len - received);
+
+        if (ret <= 0) {
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                continue;
+            }
+
+            return ESP_FAIL;
+        }
+
+        received += ret;
+    }
+
+    if (update_led_lut(req) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Query too long");
+        return ESP_FAIL;
+    }
+
+    int count = anim_parse(body, received, led_lut, NUM_LEDS, effects);
+
+    if (count < 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Malformed effects");
+        return ESP_FAIL;
+    }
+
+    // Played by the LED task from now on, the controller does not need to send anything else
+    led_set_effects(effects, count);
+    const char resp[] = "200 OK";
+    httpd_resp_send(req, resp, strlen(resp));
+
+    ESP_LOGI(TAG, "LED effects: %d", count);
+    return ESP_OK;
+}
+
+// Reads the optional region of interest from the query string
+static esp_err_t parse_roi(httpd_req_t *req, roi_t *roi) {
+    char query[128];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // e.g. /jpg?roi=800,600,640,480&scale=2
+    return roi_parse(query, roi);
+}
+
+// Output of a re-encoded region on its way to the client
+typedef struct {
+    httpd_req_t *req;
+    size_t sent;
+} roi_output_t;
+
+// Passes re-encoded JPEG data on as one HTTP chunk
+static size_t roi_send_chunk(void *arg, size_t index, const void *data, size_t len) {
+    roi_output_t *out = (roi_output_t *) arg;
+
+    if (httpd_resp_send_chunk(out->req, (const char *) data, len) != ESP_OK) {
+        return 0;
+    }
+
+    out->sent += len;
+    return len;
+}
+
+// Sends the region of interest of a frame as a chunked JPEG
+static esp_err_t send_roi(httpd_req_t *req, const capture_frame_t *frame, const roi_t *roi, size_t *sent) {
+    roi_output_t out = {
+            .req = req,
+            .sent = 0,
+    };
+    esp_err_t res = roi_encode(frame->fb, roi, CONFIG_ROI_QUALITY, roi_send_chunk, &out);
+
+    *sent = out.sent;
+
+    if (res == ESP_ERR_INVALID_ARG || res == ESP_ERR_INVALID_SIZE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Region outside of the frame or too large");
+        return ESP_FAIL;
+    } else if (res != ESP_OK) {
+        // Nothing can be reported once the first chunk is out
+        if (out.sent == 0) {
+            httpd_resp_send_500(req);
+        }
+
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "ROI %d,%d %dx%d /%d: %uKB of %uKB", roi->x, roi->y, roi->w, roi->h, 1 << roi->scale,
+             (uint32_t) (out.sent / 1024), (uint32_t) (frame->fb->len / 1024));
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// Reads the acceptable frame age from "Cache-Control", defaults to CONFIG_CAPTURE_MAX_AGE_MS, 0 for a new frame
+static int64_t parse_max_age(httpd_req_t *req) {
+    char value[32];
+
+    if (httpd_req_get_hdr_value_str(req, "Cache-Control", value, sizeof(value)) == ESP_OK) {
+        const char *max_age = strstr(value, "max-age=");
+
+        if (strstr(value, "no-cache") != NULL) {
+            return 0;
+        } else if (max_age != NULL) {
+            return atoi(max_age + strlen("max-age=")) * 1000000LL;
+        }
+    }
+
+    return CONFIG_CAPTURE_MAX_AGE_MS * 1000LL;
+}
+
+// Acquires a frame as fresh as "Cache-Control" asks for, NULL on failure
+static capture_frame_t *acquire_for(httpd_req_t *req) {
+    int64_t max_age = parse_max_age(req);
+
+    // A reload sends "no-cache" or "max-age=0", it gets the next frame completed after the request arrived
+    if (max_age <= 0) {
+        return capture_acquire_after(capture_last_seq());
+    }
+
+    return capture_acquire(max_age);
+}
+
+// Attempts at a frame of the requested profile while other clients switch the sensor to theirs
+#define PROFILE_ATTEMPTS 3
+
+// Switches to a profile and acquires a frame captured with it, see acquire_for
+static capture_frame_t *acquire_profile(httpd_req_t *req, const capture_profile_t *profile) {
+    capture_frame_t *frame = NULL;
+
+    for (int attempt = 0; attempt < PROFILE_ATTEMPTS; attempt++) {
+        capture_release(frame);
+
+        if (capture_set_profile(profile) != ESP_OK) {
+            return NULL;
+        }
+
+        frame = acquire_for(req);
+
+        if (frame == NULL || (frame->profile.framesize == profile->framesize
+                && frame->profile.quality == profile->quality)) {
+            return frame;
+        }
+    }
+
+    // Clients keep asking for different profiles, this one gets whatever was captured last
+    ESP_LOGW(TAG, "Profile %s q%d taken over by another client", capture_framesize_name(profile->framesize),
+             profile->quality);
+    return frame;
+}
+
+// Checks "If-None-Match" against the ETag of the frame about to be sent
+static int etag_matches(httpd_req_t *req, const char *etag) {
+    char value[96];
+    size_t etag_len = strlen(etag);
+    esp_err_t res = httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value));
+
+    // Caches list the tags of all their copies, a tag cut short by a long list never matches
+    if (res != ESP_OK && res != ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return 0;
+    }
+
+    // e.g. W/"41", "42" or *, the weak comparison of If-None-Match ignores the W/ prefix
+    for (const char *tag = value; *tag != '\0';) {
+        tag += strspn(tag, " \t,");
+
+        if (strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+        }
+
+        if (*tag == '*') {
+            return 1;
+        }
+
+        const char *end = *tag == '"' ? strchr(tag + 1, '"') : NULL;
+
+        if (end == NULL) {
+            // Not a quoted tag, skip to the next one
+            tag += strcspn(tag, ",");
+            continue;
+        }
+
+        if ((size_t) (end + 1 - tag) == etag_len && strncmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+
+        tag = end + 1;
+    }
+
+    return 0;
+}
+
+// Checks whether "Accept" asks for the binary frame format
+static int accepts_frame(httpd_req_t *req) {
+    char value[64];
+    esp_err_t res = httpd_req_get_hdr_value_str(req, "Accept", value, sizeof(value));
+
+    // Long browser lists are cut short, machine clients send just the one type
+    if (res != ESP_OK && res != ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return 0;
+    }
+
+    return strstr(value, FRAME_CONTENT_TYPE) != NULL;
+}
+
+// Answers 503 with Retry-After while the camera is still being set up, returns 1 if it did
+static int camera_pending(httpd_req_t *req) {
+    if (boot_is_done(BOOT_CAMERA)) {
+        return 0;
+    }
+
+    const char resp[] = "Camera starting";
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    httpd_resp_send(req, resp, strlen(resp));
+    return 1;
+}
+
+#ifdef CONFIG_MOTION_GATE
+// Reads the scene version of "?since=", -1 if absent
+static int64_t parse_since(httpd_req_t *req) {
+    char query[128];
+    char value[12];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK
+            || httpd_query_key_value(query, "since", value, sizeof(value)) != ESP_OK) {
+        return -1;
+    }
+
+    return strtoul(value, NULL, 10);
+}
+
+// Sets X-Scene-Version, scene has to last until the response is sent, returns 1 if it answered 204 to "?since="
+static int scene_unchanged(httpd_req_t *req, uint32_t version, char *scene, size_t len) {
+    snprintf(scene, len, "%u", version);
+    httpd_resp_set_hdr(req, "X-Scene-Version", scene);
+
+    if (parse_since(req) != version) {
+        return 0;
+    }
+
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_status(req, "204 No Content");
+    ESP_LOGI(TAG, "JPG unchanged scene %u", version);
+    httpd_resp_send(req, NULL, 0);
+    return 1;
+}
+#endif
+
+#ifdef CONFIG_SYNC_CAPTURE
+// Reads the frame sequence number of "?seq=", -1 if absent
+static int64_t parse_seq(httpd_req_t *req) {
+    char query[128];
+    char value[12];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK
+            || httpd_query_key_value(query, "seq", value, sizeof(value)) != ESP_OK) {
+        return -1;
+    }
+
+    return strtoul(value, NULL, 10);
+}
+
+// Sends a frame latched by a synchronized capture
+static esp_err_t send_snapshot(httpd_req_t *req, uint32_t seq) {
+    snapshot_t *snapshot = snapshot_get(seq);
+    char etag[16];
+    char skew[12];
+
+    if (snapshot == NULL) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Frame not latched");
+        return ESP_FAIL;
+    }
+
+    snprintf(etag, sizeof(etag), "\"%u\"", snapshot->seq);
+    snprintf(skew, sizeof(skew), "%d", snapshot->skew);
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "X-Capture-Skew-Us", skew);
+
+    int64_t send_start = esp_timer_get_time();
+    esp_err_t res = httpd_resp_send(req, (const char *) snapshot->buf, snapshot->len);
+
+    if (res == ESP_OK) {
+        metrics_record(METRIC_SEND, esp_timer_get_time() - send_start);
+        metrics_count(METRIC_SEND_BYTES, snapshot->len);
+    } else {
+        metrics_count(METRIC_SEND_FAILURES, 1);
+    }
+
+    ESP_LOGI(TAG, "JPG capture %u: %uKB #%u", snapshot->id, (uint32_t) (snapshot->len / 1024), seq);
+    snapshot_put(snapshot);
+    return res;
+}
+#endif
+
 // Creates an IPV4 multicast socket for receiving and sending messages
 static int create_multicast_ipv4_socket() {
     struct sockaddr_in saddr = {0};
@@ -409,6 +1361,9 @@ static int register_multicast_ipv4_group(int sock) {
 
 // Multicast working task handling receiving and sending messages
 static void mcast_worker_task(void *pvParameters) {
+    handshake_init(&mcast_handshake, esp_random());
+    clocksync_init(&mcast_clock);
+
     while (1) {
         // Wait for the ip address to be set
         ESP_LOGI(TAG, "Waiting for AP connection...");
@@ -419,26 +1374,71 @@ static void mcast_worker_task(void *pvParameters) {
 
         if (sock < 0) {
             ESP_LOGE(TAG, "Failed to create IPV4 multicast socket");
-            vTaskDelay(5 / portTICK_PERIOD_MS);
+            vTaskDelay(handshake_failed(&mcast_handshake) / portTICK_PERIOD_MS);
             continue;
         }
 
         // set destination multicast addresses
-        struct sockaddr_in sdestv4 = {
-                .sin_family = PF_INET,
-                .sin_port = htons(CONFIG_MULTICAST_PORT),
-        };
+        mcast_sender_t sender;
 
-        inet_aton(CONFIG_MULTICAST_ADDR, &sdestv4.sin_addr.s_addr);
+        if (multicast_sender_init(&sender, sock) < 0) {
+            close(sock);
+            vTaskDelay(handshake_failed(&mcast_handshake) / portTICK_PERIOD_MS);
+            continue;
+        }
 
-        // Loop waiting for UDP received, and sending UDP packets if we don't see any.
+        // Loop waiting for UDP received, and sending requests whenever the handshake asks for one
 #ifdef CONFIG_MULTICAST_HANDSHAKE
-        handshakeDone = 0;
+        xEventGroupClearBits(wifi_event_group, BIT1);
+        handshake_start(&mcast_handshake, mcast_now());
+#endif
+#if defined(CONFIG_MULTICAST_V2) && defined(CONFIG_MOTION_EVENTS)
+        uint32_t scene = motion_get_version();
 #endif
         for (int state = 1; state > 0;) {
+            uint32_t now = mcast_now();
+
+#ifdef CONFIG_MULTICAST_HANDSHAKE
+            if (xEventGroupClearBits(wifi_event_group, BIT1) & BIT1) {
+                handshake_start(&mcast_handshake, now);
+            }
+
+            if (handshake_poll(&mcast_handshake, now)) {
+                state = multicast_request(&sender);
+
+                if (state <= 0) {
+                    break;
+                }
+            }
+#endif
+#if defined(CONFIG_MULTICAST_V2) && defined(CONFIG_MOTION_EVENTS)
+            // Polled, so change events go out at most MCAST_POLL_MS late
+            if (motion_get_version() != scene) {
+                scene = motion_get_version();
+                state = multicast_scene(&sender, scene);
+
+                if (state <= 0) {
+                    break;
+                }
+            }
+#endif
+#if defined(CONFIG_MULTICAST_V2) && defined(CONFIG_SYNC_CAPTURE)
+            // Polled as well, the controller fetches latched frames whenever it likes
+            snapshot_result_t captured;
+
+            while (state > 0 && boot_is_done(BOOT_CAMERA) && snapshot_poll_result(&captured)) {
+                state = multicast_captured(&sender, &captured);
+            }
+
+            if (state <= 0) {
+                break;
+            }
+#endif
+
+            uint32_t wait = MIN(handshake_timeout(&mcast_handshake, now), MCAST_POLL_MS);
             struct timeval tv = {
-                    .tv_sec = 3/*0*/,
-                    .tv_usec = 0,
+                    .tv_sec = wait / 1000,
+                    .tv_usec = (wait % 1000) * 1000,
             };
 
             fd_set rfds;
@@ -446,7 +1446,7 @@ static void mcast_worker_task(void *pvParameters) {
             FD_SET(sock, &rfds);
 
             int selected = select(sock + 1, &rfds, NULL, NULL, &tv);
-            char buffer[MULMSG_LEN];
+            char buffer[MULMSG2_MAX_LEN];
 
             if (selected < 0) {
                 ESP_LOGE(TAG, "Select failed: errno %d", errno);
@@ -455,11 +1455,11 @@ static void mcast_worker_task(void *pvParameters) {
             } else if (selected > 0) {
                 if (FD_ISSET(sock, &rfds)) {
                     // Incoming datagram received
-                    char raddr_name[32] = {0};
                     struct sockaddr_in6 raddr; // Large enough for both IPV4 or IPV6
                     socklen_t socklen = sizeof(raddr);
 
                     int len = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &raddr, &socklen);
+                    int64_t received = esp_timer_get_time();
 
                     if (len < 0) {
                         ESP_LOGE(TAG, "Multicast recvfrom failed: errno %d", errno);
@@ -467,13 +1467,19 @@ static void mcast_worker_task(void *pvParameters) {
                         break;
                     }
 
-                    // Get the sender's address as a string
-                    if (raddr.sin6_family == PF_INET) {
-                        inet_ntoa_r(((struct sockaddr_in *) &raddr)->sin_addr.s_addr, raddr_name,
-                                    sizeof(raddr_name) - 1);
+                    if (raddr.sin6_family != PF_INET) {
+                        continue;
                     }
 
+                    // Replies go to the sender's address on the multicast port
+                    struct sockaddr_in rdest = *(struct sockaddr_in *) &raddr;
+                    rdest.sin_port = htons(CONFIG_MULTICAST_PORT);
+
+#ifdef CONFIG_MULTICAST_DEBUG
+                    char raddr_name[32] = {0};
+                    inet_ntoa_r(rdest.sin_addr.s_addr, raddr_name, sizeof(raddr_name) - 1);
                     ESP_LOGI(TAG, "Received %d bytes from %s", len, raddr_name);
+#endif
 #ifdef CONFIG_MULTICAST_DEBUG
                     switch (len) {
                     	case 0: break;
@@ -482,60 +1488,109 @@ static void mcast_worker_task(void *pvParameters) {
                     }
 #endif
 
-                    mulmsg *msg = mulmsg_create(buffer, MULMSG_LEN);
-                    state = handle_mulmsg(sock, msg, raddr_name);
-                    mulmsg_destroy(msg);
+#ifdef CONFIG_MULTICAST_V2
+                    mulmsg2 msg2;
+                    int is_v2 = mulmsg2_parse(&msg2, buffer, len) == 0;
+
+                    if (is_v2) {
+                        log_mulmsg2(&msg2);
+                    }
+#endif
+
+                    // v2 messages start with their legacy equivalent
+                    mulmsg *msg = mulmsg_wrap(buffer, len);
+
+                    if (msg == 0) {
+                        continue;
+                    }
+
+                    if (mulmsg_getSource(msg) != 0) {
+                        int pending = mcast_handshake.requestPending;
+
+                        if (handshake_received(&mcast_handshake, mcast_now(), mulmsg_getAlive(msg))) {
+                            ESP_LOGI(TAG, "Linked to controller after %ums, rtt %ums (%u links, %u lost)",
+                                     mcast_handshake.timeToLink, mcast_handshake.rtt,
+                                     mcast_handshake.links, mcast_handshake.losses);
+                        }
+
+                        int answered = pending && !mcast_handshake.requestPending;
+
+                        if (answered) {
+                            metrics_record(METRIC_MCAST_RTT, mcast_handshake.rtt * 1000);
+                        }
+#ifdef CONFIG_MULTICAST_V2
+                        if (is_v2) {
+                            handle_mulmsg2(&msg2, received, answered);
+                        }
+#endif
+                    }
+
+                    state = handle_mulmsg(&sender, msg, &rdest);
                 }
             }
-#ifdef CONFIG_MULTICAST_HANDSHAKE
-			else if (handshakeDone == 0) {
-				// Timeout passed with no incoming data, so send "Are You There?"
-				mulmsg* msg = mulmsg_create(buffer, MULMSG_LEN);
-
-				if (msg != 0) {
-					mulmsg_setSource(msg, 0);
-					mulmsg_setAlive(msg, 0);
-					mulmsg_setDeviceId(msg, CONFIG_DEVICE_ID);
-					state = multicast_send(sock, msg, CONFIG_MULTICAST_ADDR);
-					mulmsg_destroy(msg);
-				}
-			}
-#endif
         }
 
         ESP_LOGE(TAG, "Shutting down socket and restarting...");
         shutdown(sock, 0);
         close(sock);
+        vTaskDelay(handshake_failed(&mcast_handshake) / portTICK_PERIOD_MS);
     }
 }
 
+// Milliseconds since boot, the clock of the handshake
+static uint32_t mcast_now(void) {
+    return (uint32_t) (esp_timer_get_time() / 1000);
+}
+
+// Sends "Are You There?" to the group
+static int multicast_request(mcast_sender_t* sender) {
+	char request[MULMSG_LEN] = {0};
+	mulmsg* msg = mulmsg_wrap(request, MULMSG_LEN);
+
+	mulmsg_setSource(msg, 0);
+	mulmsg_setAlive(msg, 0);
+	mulmsg_setDeviceId(msg, CONFIG_DEVICE_ID);
+
+	// The answer is a clock sample if the controller stamps it
+	mcast_request_us = esp_timer_get_time();
+	return multicast_send(sender, msg, MULMSG_LEN, NULL);
+}
+
 // Handles received multicast message
-static int handle_mulmsg(int sock, mulmsg* message, const char* address) {
-	if (sock == 0 || message == 0 || address == 0) {
+static int handle_mulmsg(mcast_sender_t* sender, mulmsg* message, const struct sockaddr_in* dest) {
+	if (sender == 0 || message == 0 || dest == 0) {
 		ESP_LOGE(TAG, "Failed to handle multicast message!");
 		return -1;
 	}
 
 	int err = 1;	// >0 -> success
+	char response[MULMSG_LEN] = {0};
+	mulmsg* reply = mulmsg_wrap(response, MULMSG_LEN);
 
 	if (mulmsg_getSource(message) != 0) {
 		if (mulmsg_getAlive(message) == 0) {
 			// send client 'Here I Am!' on server 'Are You There?'
-			mulmsg_setSource(message, 0);
-			mulmsg_setAlive(message, 1);
-			mulmsg_setDeviceId(message, CONFIG_DEVICE_ID);
-			err = multicast_send(sock, message, address);
+			mulmsg_setSource(reply, 0);
+			mulmsg_setAlive(reply, 1);
+			mulmsg_setDeviceId(reply, CONFIG_DEVICE_ID);
+			err = multicast_send(sender, reply, MULMSG_LEN, dest);
+#ifdef CONFIG_MULTICAST_V2
+			if (err > 0) {
+				err = multicast_announce(sender, dest);
+			}
+#endif
 		} else {
 #ifdef CONFIG_MULTICAST_HANDSHAKE
 			// send client 'Here I Am!' on server 'Here I Am!'
-			mulmsg_setSource(message, 0);
-			mulmsg_setAlive(message, 1);
-			mulmsg_setDeviceId(message, CONFIG_DEVICE_ID);
-			err = multicast_send(sock, message, address);
-
-            if (err > 0) {
-                handshakeDone = 1;
-            }
+			mulmsg_setSource(reply, 0);
+			mulmsg_setAlive(reply, 1);
+			mulmsg_setDeviceId(reply, CONFIG_DEVICE_ID);
+			err = multicast_send(sender, reply, MULMSG_LEN, dest);
+#ifdef CONFIG_MULTICAST_V2
+			if (err > 0) {
+				err = multicast_announce(sender, dest);
+			}
+#endif
 #endif
         }
     }
@@ -543,16 +1598,202 @@ static int handle_mulmsg(int sock, mulmsg* message, const char* address) {
     return err;
 }
 
-// Sends a multicast message via socket
-static int multicast_send(int sock, mulmsg* message, const char* address) {
+#ifdef CONFIG_MULTICAST_V2
+// Sends the v2 capability announcement of this station
+static int multicast_announce(mcast_sender_t* sender, const struct sockaddr_in* dest) {
+	char buffer[MULMSG2_MAX_LEN];
+	mulmsg2 message;
+	tcpip_adapter_ip_info_t ip_info = { 0 };
+	capture_profile_t profile;
+	capture_stats_t stats;
+
+	tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info);
+
+	mulmsg2_init(&message, buffer, sizeof(buffer));
+	mulmsg_setSource(mulmsg2_header(&message), 0);
+	mulmsg_setAlive(mulmsg2_header(&message), 1);
+	mulmsg_setDeviceId(mulmsg2_header(&message), CONFIG_DEVICE_ID);
+
+	mulmsg2_put(&message, MULMSG2_IPV4, &ip_info.ip.addr, 4);
+	mulmsg2_putU16(&message, MULMSG2_HTTP_PORT, http_port);
+	mulmsg2_putU16(&message, MULMSG2_STREAM_PORT, CONFIG_STREAM_PORT);
+
+	// Stations announce themselves before the camera is up, the capture records follow in later announcements
+	if (boot_is_done(BOOT_CAMERA)) {
+		capture_get_profile(&profile);
+		capture_get_stats(&stats);
+
+		unsigned char settings[2] = { profile.framesize, profile.quality };
+
+		mulmsg2_put(&message, MULMSG2_PROFILE, settings, sizeof(settings));
+		mulmsg2_putU32(&message, MULMSG2_FRAME_SEQ, stats.last_seq);
+	}
+
+	mulmsg2_putU16(&message, MULMSG2_LED_COUNT, NUM_LEDS);
+#ifdef CONFIG_MOTION_GATE
+	mulmsg2_putU32(&message, MULMSG2_SCENE_VERSION, motion_get_version());
+#endif
+
+	return multicast_send(sender, mulmsg2_header(&message), mulmsg2_length(&message), dest);
+}
+
+#ifdef CONFIG_MOTION_EVENTS
+// Tells the group that the scene changed
+static int multicast_scene(mcast_sender_t* sender, uint32_t version) {
+	char buffer[MULMSG2_MAX_LEN];
+	mulmsg2 message;
+	motion_stats_t stats;
+
+	motion_get_stats(&stats);
+
+	mulmsg2_init(&message, buffer, sizeof(buffer));
+	mulmsg_setSource(mulmsg2_header(&message), 0);
+	mulmsg_setAlive(mulmsg2_header(&message), 1);
+	mulmsg_setDeviceId(mulmsg2_header(&message), CONFIG_DEVICE_ID);
+
+	mulmsg2_putU32(&message, MULMSG2_SCENE_VERSION, version);
+	mulmsg2_putU32(&message, MULMSG2_FRAME_SEQ, stats.seq);
+
+	return multicast_send(sender, mulmsg2_header(&message), mulmsg2_length(&message), NULL);
+}
+#endif
+
+// Logs the records of a received v2 message
+static void log_mulmsg2(mulmsg2* message) {
+#ifdef CONFIG_MULTICAST_DEBUG
+	unsigned char type;
+	unsigned char len;
+	const unsigned char* value;
+
+	while (mulmsg2_next(message, &type, &value, &len)) {
+		ESP_LOGI(TAG, "RCV v2 record %02x, %d bytes", type, len);
+	}
+#endif
+}
+
+// Applies the clock and capture records of a controller message received at local time received
+static void handle_mulmsg2(mulmsg2* message, int64_t received, int answered) {
+	unsigned char type;
+	unsigned char len;
+	const unsigned char* value;
+#ifdef CONFIG_SYNC_CAPTURE
+	int capture = 0;
+	int addressed = 1;
+	uint32_t captureId = 0;
+	int64_t captureAt = 0;
+#endif
+
+	mulmsg2_rewind(message);
+
+	while (mulmsg2_next(message, &type, &value, &len)) {
+		switch (type) {
+			case MULMSG2_CLOCK:
+				// Only the answer to our own request tells how long it was underway
+				if (len == 8 && answered) {
+					clocksync_sample(&mcast_clock, mcast_request_us, received, mulmsg2_getU64(value));
+				}
+				break;
+#ifdef CONFIG_SYNC_CAPTURE
+
+			case MULMSG2_CAPTURE_AT:
+				if (len == 12) {
+					capture = 1;
+					captureId = mulmsg2_getU32(value);
+					captureAt = mulmsg2_getU64(value + 4);
+				}
+				break;
+
+			case MULMSG2_DEVICE_IDS:
+				addressed = 0;
+
+				for (int i = 0; i + 1 < len; i += 2) {
+					if (mulmsg2_getU16(value + i) == CONFIG_DEVICE_ID) {
+						addressed = 1;
+					}
+				}
+				break;
+#endif
+		}
+	}
+
+#ifdef CONFIG_SYNC_CAPTURE
+	if (!capture || !addressed) {
+		return;
+	}
+
+	// Discovery does not wait for the camera, only capture commands do
+	if (!boot_is_done(BOOT_CAMERA)) {
+		ESP_LOGE(TAG, "Capture %u refused, camera starting", captureId);
+		return;
+	}
+
+	if (!clocksync_isValid(&mcast_clock)) {
+		ESP_LOGE(TAG, "Capture %u refused, controller clock unknown", captureId);
+		return;
+	}
+
+	int64_t at = clocksync_toLocal(&mcast_clock, captureAt);
+
+	if (snapshot_schedule(captureId, at) != ESP_OK) {
+		ESP_LOGE(TAG, "Capture %u refused, due in %dms", captureId, (int) ((at - esp_timer_get_time()) / 1000));
+		return;
+	}
+
+	ESP_LOGI(TAG, "Capture %u due in %dms (clock offset %lldus, rtt %uus)", captureId,
+			(int) ((at - esp_timer_get_time()) / 1000), (long long) mcast_clock.offset, mcast_clock.rtt);
+#endif
+}
+
+#ifdef CONFIG_SYNC_CAPTURE
+// Tells the controller which frame a synchronized capture latched
+static int multicast_captured(mcast_sender_t* sender, const snapshot_result_t* result) {
+	char buffer[MULMSG2_MAX_LEN];
+	mulmsg2 message;
+	unsigned char captured[12];
+
+	for (int i = 0; i < 4; i++) {
+		captured[i] = (result->id >> (8 * i)) & 0xff;
+		captured[4 + i] = (result->seq >> (8 * i)) & 0xff;
+		captured[8 + i] = ((uint32_t) result->skew >> (8 * i)) & 0xff;
+	}
+
+	mulmsg2_init(&message, buffer, sizeof(buffer));
+	mulmsg_setSource(mulmsg2_header(&message), 0);
+	mulmsg_setAlive(mulmsg2_header(&message), 1);
+	mulmsg_setDeviceId(mulmsg2_header(&message), CONFIG_DEVICE_ID);
+
+	mulmsg2_put(&message, MULMSG2_CAPTURED, captured, sizeof(captured));
+	mulmsg2_putU64(&message, MULMSG2_CLOCK, clocksync_toRemote(&mcast_clock, esp_timer_get_time()));
+
+	return multicast_send(sender, mulmsg2_header(&message), mulmsg2_length(&message), NULL);
+}
+#endif
+#endif
+
+// Binds the sender to a socket and resolves the group address
+static int multicast_sender_init(mcast_sender_t* sender, int sock) {
+	memset(sender, 0, sizeof(*sender));
+	sender->sock = sock;
+	sender->group.sin_family = PF_INET;
+	sender->group.sin_port = htons(CONFIG_MULTICAST_PORT);
+
+	if (inet_aton(CONFIG_MULTICAST_ADDR, &sender->group.sin_addr.s_addr) == 0) {
+		ESP_LOGE(TAG, "Invalid multicast address %s", CONFIG_MULTICAST_ADDR);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Sends a message of len bytes starting with the given header to dest, or the group if dest is NULL
+static int multicast_send(mcast_sender_t* sender, mulmsg* message, int len, const struct sockaddr_in* dest) {
 	const char* data = mulmsg_unwrap(message);
 
-	if (sock == 0 || data == 0 || address == 0) {
+	if (sender == 0 || sender->sock == 0 || data == 0) {
 		ESP_LOGE(TAG, "Failed to send multicast message!");
 		return -1;
 	}
 
-	char addrbuf[32] = {0};
 	unsigned int deviceId = mulmsg_getDeviceId(message);
 
 	if (deviceId > DEVICEID_MAX) {
@@ -560,33 +1801,34 @@ static int multicast_send(int sock, mulmsg* message, const char* address) {
 		return -1;
 	}
 
-	struct addrinfo* res;
-	struct addrinfo hints = {
-		.ai_flags = AI_PASSIVE,
-		.ai_socktype = SOCK_DGRAM,
-		.ai_family = PF_INET
-	};
-
-	int err = getaddrinfo(address, NULL, &hints, &res);
-
-	if (err < 0) {
-		ESP_LOGE(TAG, "Failed getaddrinfo() for IP destination address. error: %d", err);
-		return err;
+	if (dest == 0) {
+		dest = &sender->group;
 	}
 
-	((struct sockaddr_in*) res->ai_addr)->sin_port = htons(CONFIG_MULTICAST_PORT);
-	inet_ntoa_r(((struct sockaddr_in*) res->ai_addr)->sin_addr, addrbuf, sizeof(addrbuf) - 1);
+	// Log at most once a second, the handshake alone sends every few seconds per station
+	int64_t now = esp_timer_get_time();
 
-	ESP_LOGI(TAG, "Sending to IPV4 address %s:%d...", addrbuf, CONFIG_MULTICAST_PORT);
+	if (now >= sender->log_after) {
+		char addrbuf[32] = {0};
+		inet_ntoa_r(dest->sin_addr, addrbuf, sizeof(addrbuf) - 1);
+		ESP_LOGI(TAG, "Sending to IPV4 address %s:%d... (%u unlogged)", addrbuf, ntohs(dest->sin_port),
+				sender->unlogged);
 #ifdef CONFIG_MULTICAST_DEBUG
-	ESP_LOGI(TAG, "SND %02x %02x", data[0], data[1]); 	// hint: MULMSG_LEN confirmed
+		ESP_LOGI(TAG, "SND %02x %02x", data[0], data[1]); 	// hint: MULMSG_LEN confirmed
 #endif
+		sender->log_after = now + 1000000;
+		sender->unlogged = 0;
+	} else {
+		sender->unlogged++;
+	}
 
-	err = sendto(sock, data, MULMSG_LEN, 0, res->ai_addr, res->ai_addrlen);
-	freeaddrinfo(res);
+	int err = sendto(sender->sock, data, len, 0, (const struct sockaddr*) dest, sizeof(*dest));
 
 	if (err < 0) {
 		ESP_LOGE(TAG, "Failed sendto() data. errno: %d", errno);
+		metrics_count(METRIC_MCAST_FAILURES, 1);
+	} else {
+		metrics_count(METRIC_MCAST_BYTES, err);
 	}
 
 	return err;
@@ -14,7 +14,11 @@
 void init_flash();
 // Initializes the camera driver
 void init_camera();
+// Initializes the camera driver on a task of its own, BOOT_CAMERA is done once frames can be captured
+void start_camera();
 // Initializes the wifi driver
 void init_wifi(httpd_handle_t* arg);
+// Starts the HTTP servers, requests needing the camera are answered with 503 until it is ready
+void start_http(httpd_handle_t* server);
 
 #endif /* MAIN_REST_H_ */
@@ -0,0 +1,135 @@
+/*
+ * roi.c
+ *
+ *  Region of interest crop and downscale of captured frames.
+ */
+
+#include "roi.h"
+#include "capture.h"
+#include "membudget.h"
+#include <esp_log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <esp_http_server.h>
+
+// Decoder state of one roi_encode call
+typedef struct {
+    int x;              // region in downscaled pixels
+    int y;
+    int w;
+    int h;
+    int done;           // all rows of the region are decoded
+} roi_job_t;
+
+// Logger tag name
+static const char *TAG = "ROI";
+// RGB888 pixels of the region, allocated in PSRAM on first use and kept
+static uint8_t *scratch = NULL;
+
+// Reads "roi=x,y,w,h" and the optional "scale=1|2|4|8" from a query string, ESP_ERR_NOT_FOUND without roi
+esp_err_t roi_parse(const char *query, roi_t *roi) {
+    char value[32];
+    char end;
+
+    if (query == NULL || httpd_query_key_value(query, "roi", value, sizeof(value)) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (sscanf(value, "%d,%d,%d,%d%c", &roi->x, &roi->y, &roi->w, &roi->h, &end) != 4
+            || roi->x < 0 || roi->y < 0 || roi->w <= 0 || roi->h <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    roi->scale = JPG_SCALE_NONE;
+
+    if (httpd_query_key_value(query, "scale", value, sizeof(value)) == ESP_OK) {
+        switch (atoi(value)) {
+            case 1: roi->scale = JPG_SCALE_NONE; break;
+            case 2: roi->scale = JPG_SCALE_2X; break;
+            case 4: roi->scale = JPG_SCALE_4X; break;
+            case 8: roi->scale = JPG_SCALE_8X; break;
+            default: return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Copies the part of a decoded block inside the region, stops the decoder after the last one
+static bool roi_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    roi_job_t *job = (roi_job_t *) arg;
+
+    // Start and end of the image
+    if (data == NULL) {
+        return true;
+    }
+
+    int x0 = MAX(x, job->x);
+    int x1 = MIN(x + w, job->x + job->w);
+    int y0 = MAX(y, job->y);
+    int y1 = MIN(y + h, job->y + job->h);
+
+    // The decoder hands out RGB, fmt2jpg takes BGR like everything else in esp32-camera
+    for (int row = y0; x0 < x1 && row < y1; row++) {
+        const uint8_t *src = data + ((row - y) * w + (x0 - x)) * 3;
+        uint8_t *dst = scratch + ((row - job->y) * job->w + (x0 - job->x)) * 3;
+
+        for (int i = 0; i < (x1 - x0) * 3; i += 3) {
+            dst[i] = src[i + 2];
+            dst[i + 1] = src[i + 1];
+            dst[i + 2] = src[i];
+        }
+    }
+
+    // Blocks come row by row from the left, the one covering the bottom right corner is the last one needed
+    if (y + h >= job->y + job->h && x + w >= job->x + job->w) {
+        job->done = 1;
+        return false;
+    }
+
+    return true;
+}
+
+// Crops, downscales and re-encodes a JPEG frame, the output is passed to cb in pieces
+esp_err_t roi_encode(const camera_fb_t *fb, const roi_t *roi, int quality, jpg_out_cb cb, void *arg) {
+    roi_job_t job = {
+            .x = roi->x >> roi->scale,
+            .y = roi->y >> roi->scale,
+            .w = roi->w >> roi->scale,
+            .h = roi->h >> roi->scale,
+    };
+
+    // Compared by subtraction, x + w may overflow for large query values
+    if (roi->x >= fb->width || roi->w > fb->width - roi->x || roi->y >= fb->height || roi->h > fb->height - roi->y
+            || job.w == 0 || job.h == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (job.w * job.h > CONFIG_ROI_MAX_PIXELS) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (scratch == NULL) {
+        scratch = membudget_alloc(MEM_ROI, CONFIG_ROI_MAX_PIXELS * 3);
+
+        if (scratch == NULL) {
+            ESP_LOGE(TAG, "No memory for a %d pixel region", CONFIG_ROI_MAX_PIXELS);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    // Stopping the decoder early makes it report a failure, only a region cut short is one
+    capture_decode(fb, roi->scale, roi_write, &job);
+
+    if (!job.done) {
+        ESP_LOGE(TAG, "Failed to decode frame");
+        return ESP_FAIL;
+    }
+
+    if (!fmt2jpg_cb(scratch, job.w * job.h * 3, job.w, job.h, PIXFORMAT_RGB888, quality, cb, arg)) {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,32 @@
+/*
+ * roi.h
+ *
+ *  Region of interest crop and downscale of captured frames.
+ */
+
+#ifndef MAIN_ROI_H_
+#define MAIN_ROI_H_
+
+#include "settings.h"
+#include <esp_camera.h>
+#include <esp_err.h>
+#include <esp_jpg_decode.h>
+#include <img_converters.h>
+
+// Region of a frame in full resolution pixels, sent downscaled by 2^scale
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    jpg_scale_t scale;
+} roi_t;
+
+// Reads "roi=x,y,w,h" and the optional "scale=1|2|4|8" from a query string, ESP_ERR_NOT_FOUND without roi
+esp_err_t roi_parse(const char *query, roi_t *roi);
+
+// Crops, downscales and re-encodes a JPEG frame, the output is passed to cb in pieces
+// Only decodes the frame up to the last MCU row of the region, must not be called concurrently
+esp_err_t roi_encode(const camera_fb_t *fb, const roi_t *roi, int quality, jpg_out_cb cb, void *arg);
+
+#endif /* MAIN_ROI_H_ */
@@ -0,0 +1,168 @@
+/*
+ * session.c
+ *
+ *  Keep-alive session tracking of the HTTP servers.
+ */
+
+#include "session.h"
+#include "metrics.h"
+#include <esp_log.h>
+#include <lwip/sockets.h>
+
+// TCP keepalive probing of silent peers
+#define SESSION_KEEPIDLE_S  5
+#define SESSION_KEEPINTVL_S 2
+#define SESSION_KEEPCNT     3
+
+// Logger tag name
+static const char *TAG = "SES";
+
+// Milliseconds since boot
+static uint32_t session_now(void) {
+    return (uint32_t) (esp_timer_get_time() / 1000);
+}
+
+// Finds the entry of a socket, or a free one for fd -1
+static session_entry_t *session_find(session_table_t *table, int fd) {
+    for (int i = 0; i < SESSION_MAX; i++) {
+        if (table->entries[i].fd == fd) {
+            return &table->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Tunes a new connection and starts tracking it
+static esp_err_t session_open(httpd_handle_t hd, int sockfd) {
+    session_table_t *table = (session_table_t *) httpd_get_global_user_ctx(hd);
+    session_entry_t *entry = session_find(table, -1);
+    int on = 1;
+    int idle = SESSION_KEEPIDLE_S;
+    int interval = SESSION_KEEPINTVL_S;
+    int count = SESSION_KEEPCNT;
+
+    // Small responses like the LED acknowledgement go out without waiting for more data
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // Peers gone with a WiFi drop are noticed within ~11s instead of occupying the socket
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+
+    if (entry != NULL) {
+        entry->fd = sockfd;
+        entry->last_active = session_now();
+        entry->detach = NULL;
+    }
+
+    metrics_count(METRIC_HTTP_SESSIONS, 1);
+    return ESP_OK;
+}
+
+// Stops tracking a closed connection, the server closes the socket itself
+static void session_close(httpd_handle_t hd, int sockfd) {
+    session_table_t *table = (session_table_t *) httpd_get_global_user_ctx(hd);
+    session_entry_t *entry = session_find(table, sockfd);
+
+    if (entry != NULL) {
+        // The task writing to a handed off connection lets go of it before the socket is closed
+        if (entry->detach != NULL) {
+            entry->detach(sockfd, entry->detach_arg);
+            entry->detach = NULL;
+        }
+
+        entry->fd = -1;
+    }
+}
+
+// The tables are static, nothing to free when a server stops
+static void session_table_free(void *ctx) {
+}
+
+// Closes connections idle for too long, runs on the server task
+static void session_sweep(void *arg) {
+    session_table_t *table = (session_table_t *) arg;
+    uint32_t now = session_now();
+
+    for (int i = 0; i < SESSION_MAX; i++) {
+        session_entry_t *entry = &table->entries[i];
+
+        // Handed off connections carry no requests but are busy
+        if (entry->fd >= 0 && entry->detach == NULL && now - entry->last_active > table->idle_ms) {
+            ESP_LOGD(TAG, "Closing idle socket %d", entry->fd);
+            httpd_sess_trigger_close(table->server, entry->fd);
+            metrics_count(METRIC_HTTP_IDLE_CLOSES, 1);
+            // Not reused before session_close, but not closed twice either
+            entry->last_active = now;
+        }
+    }
+}
+
+// Hands the sweep over to the server task owning the table
+static void session_sweep_timer(void *arg) {
+    session_table_t *table = (session_table_t *) arg;
+
+    httpd_queue_work(table->server, session_sweep, table);
+}
+
+// Sets up a server config to track its connections in table, closing them after idle_ms without requests
+void session_config(httpd_config_t *config, session_table_t *table, uint32_t idle_ms) {
+    for (int i = 0; i < SESSION_MAX; i++) {
+        table->entries[i].fd = -1;
+    }
+
+    table->server = NULL;
+    table->idle_ms = idle_ms;
+
+    // A new client replaces the least recently used connection instead of being refused
+    config->lru_purge_enable = true;
+    config->open_fn = session_open;
+    config->close_fn = session_close;
+    config->global_user_ctx = table;
+    config->global_user_ctx_free_fn = session_table_free;
+}
+
+// Starts closing idle connections of a started server
+esp_err_t session_start(session_table_t *table, httpd_handle_t server) {
+    esp_timer_create_args_t args = {
+            .callback = session_sweep_timer,
+            .arg = table,
+            .name = "session_sweep",
+    };
+
+    table->server = server;
+
+    if (table->sweep_timer == NULL && esp_timer_create(&args, &table->sweep_timer) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_timer_stop(table->sweep_timer);
+    return esp_timer_start_periodic(table->sweep_timer, table->idle_ms * 1000ULL / 2);
+}
+
+// Marks the connection of a request as active
+void session_touch(httpd_req_t *req) {
+    session_table_t *table = (session_table_t *) httpd_get_global_user_ctx(req->handle);
+    session_entry_t *entry = session_find(table, httpd_req_to_sockfd(req));
+
+    if (entry != NULL) {
+        entry->last_active = session_now();
+    }
+
+    metrics_count(METRIC_HTTP_REQUESTS, 1);
+}
+
+// Hands the connection of a request to another task, it is not closed as idle and detach is called when it closes
+esp_err_t session_hand_off(httpd_req_t *req, session_detach_fn detach, void *arg) {
+    session_table_t *table = (session_table_t *) httpd_get_global_user_ctx(req->handle);
+    session_entry_t *entry = session_find(table, httpd_req_to_sockfd(req));
+
+    if (entry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    entry->detach = detach;
+    entry->detach_arg = arg;
+    return ESP_OK;
+}
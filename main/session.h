@@ -0,0 +1,54 @@
+/*
+ * session.h
+ *
+ *  Keep-alive session tracking of the HTTP servers.
+ *
+ *  Persistent connections are tuned when they are opened (no Nagle,
+ *  TCP keepalive probes) and closed once idle for too long, so the
+ *  controller's poll loop can reuse its connections while dead peers
+ *  do not occupy the few sockets of a server.
+ */
+
+#ifndef MAIN_SESSION_H_
+#define MAIN_SESSION_H_
+
+#include "settings.h"
+#include <esp_http_server.h>
+#include <esp_timer.h>
+#include <stdint.h>
+#include <sys/param.h>
+
+#define SESSION_MAX MAX(CONFIG_HTTP_MAX_SOCKETS, CONFIG_STREAM_MAX_SOCKETS)
+
+// Called on the server task when a connection handed to another task closes, before its socket is closed
+typedef void (*session_detach_fn)(int fd, void *arg);
+
+// Open connection of a server
+typedef struct {
+    int fd;                 // -1 if unused
+    uint32_t last_active;   // ms since boot of the last request
+    session_detach_fn detach; // set while another task writes to the connection
+    void *detach_arg;
+} session_entry_t;
+
+// Connections of one server, only touched by that server's task
+typedef struct {
+    httpd_handle_t server;
+    esp_timer_handle_t sweep_timer;
+    uint32_t idle_ms;
+    session_entry_t entries[SESSION_MAX];
+} session_table_t;
+
+// Sets up a server config to track its connections in table, closing them after idle_ms without requests
+void session_config(httpd_config_t *config, session_table_t *table, uint32_t idle_ms);
+
+// Starts closing idle connections of a started server
+esp_err_t session_start(session_table_t *table, httpd_handle_t server);
+
+// Marks the connection of a request as active
+void session_touch(httpd_req_t *req);
+
+// Hands the connection of a request to another task, it is not closed as idle and detach is called when it closes
+esp_err_t session_hand_off(httpd_req_t *req, session_detach_fn detach, void *arg);
+
+#endif /* MAIN_SESSION_H_ */
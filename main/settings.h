@@ -15,5 +15,59 @@
 //#define CONFIG_MULTICAST_PORT 	   1900
 #define CONFIG_MULTICAST_HANDSHAKE
 #define CONFIG_MULTICAST_DEBUG
+#define CONFIG_MULTICAST_V2                // announce capabilities with v2 messages
+
+#define CONFIG_CAPTURE_PIPELINE            // producer task keeps the newest frame ready
+#define CONFIG_CAPTURE_FB_COUNT    3       // frame buffers in PSRAM when pipelined
+#define CONFIG_CAPTURE_MAX_AGE_MS  250     // freshness window, older frames are never served
+
+#define CONFIG_STREAM_PORT         81      // separate server so /stream does not block /jpg
+#define CONFIG_STREAM_MAX_FPS      10      // upper bound for the per-client ?fps= cap
+#define CONFIG_STREAM_MAX_CLIENTS  2       // streams served at the same time, each holds a frame buffer while sending
+#define CONFIG_STREAM_SEND_TIMEOUT_S 5     // a stream client taking nothing for this long is disconnected
+
+#define CONFIG_ROI_MAX_PIXELS      (640 * 480) // largest /jpg?roi= output, sizes the PSRAM scratch buffer
+#define CONFIG_ROI_QUALITY         80      // 1-100 JPEG quality of cropped images, higher is better
+
+#define CONFIG_MOTION_GATE                 // track scene changes, /jpg?since=N answers 204 while unchanged
+#define CONFIG_MOTION_EVENTS               // send a multicast v2 message on every scene change
+#define CONFIG_MOTION_INTERVAL_MS  500     // how often the newest frame is checked for changes
+#define CONFIG_MOTION_LUMA_THRESHOLD 12    // 0-255 mean luma difference of a changed grid cell
+#define CONFIG_MOTION_MIN_CELLS    8       // changed cells of the 32x24 grid that make a scene change
+
+#define CONFIG_SYNC_CAPTURE                // latch frames at times the controller sends via multicast v2
+#define CONFIG_SNAPSHOT_SLOTS      4       // latched frames kept in PSRAM for /jpg?seq=
+#define CONFIG_SNAPSHOT_MAX_AHEAD_MS 10000 // captures scheduled further ahead are refused
+
+//#define CONFIG_PUSH_MODE                 // stream frames to a collector over a connection the station opens
+#define CONFIG_PUSH_COLLECTOR_ADDR "192.168.1.10"
+#define CONFIG_PUSH_COLLECTOR_PORT 5005
+#define CONFIG_PUSH_FPS            5       // frames pushed per second at most
+#define CONFIG_PUSH_QUEUE_FRAMES   4       // frames waiting in PSRAM, the oldest is dropped when full
+#define CONFIG_PUSH_RETRY_MS       2000    // pause before reconnecting to the collector
+
+#define CONFIG_MEM_SNAPSHOT_KB     1024    // PSRAM reserved at boot for latched frames
+#define CONFIG_MEM_PUSH_KB         768     // PSRAM reserved at boot for the push queue, queue + 2 frames
+
+//#define CONFIG_RATE_CONTROL              // adapt the quality of /jpg without q= to the budgets below
+#define CONFIG_RATE_TARGET_KB      64      // KB per frame, 0 for no limit
+#define CONFIG_RATE_TARGET_KBPS    0       // KB/s of all /jpg frames together, 0 for no limit
+#define CONFIG_RATE_MAX_SEND_MS    0       // send time of a frame at the throughput seen lately, 0 for no limit
+#define CONFIG_RATE_MIN_Q          10      // best quality the controller goes up to
+#define CONFIG_RATE_MAX_Q          40      // worst quality it goes down to
+//#define CONFIG_RATE_FRAMESIZE            // lower the frame size once CONFIG_RATE_MAX_Q is not enough
+#define CONFIG_RATE_HYSTERESIS_PCT 15      // margin below the budget that is kept without raising the quality
+#define CONFIG_RATE_SETTLE_FRAMES  4       // frames of a new profile observed before the next change
+
+#define CONFIG_HTTP_MAX_SOCKETS    4       // parallel /jpg clients, each server also needs 3 of LWIP_MAX_SOCKETS
+#define CONFIG_STREAM_MAX_SOCKETS  (CONFIG_STREAM_MAX_CLIENTS + 1) // one more to answer 503 beyond the streams
+#define CONFIG_HTTP_IDLE_TIMEOUT_S 30      // keep-alive connections without a request for this long are closed
+
+// LED strips driven in parallel, one RMT channel each: X(channel, GPIO, LEDs, colour order)
+// LEDs are numbered strip after strip, every LED takes 192B of RMT items
+#define CONFIG_LED_STRIPS(X) \
+        X(RMT_CHANNEL_0, 14, 50, LED_ORDER_GRB)
+#define CONFIG_LED_BUFFER_KB       16      // internal RAM for the RMT items of all strips, checked at compile time
+#define CONFIG_ANIM_FPS            30      // frame rate of LED effects, timed by esp_timer
 
 #endif /* MAIN_SETTINGS_H_ */
@@ -0,0 +1,203 @@
+/*
+ * snapshot.c
+ *
+ *  Frames latched at a time agreed on with the controller.
+ */
+
+#include "snapshot.h"
+#include "membudget.h"
+#include "metrics.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define SNAPSHOT_RESULTS 4
+
+// Logger tag name
+static const char *TAG = "SNP";
+// Guards the slots and the pending capture
+static SemaphoreHandle_t snapshot_lock;
+static snapshot_t slots[CONFIG_SNAPSHOT_SLOTS];
+// Capture the timer is armed for
+static uint32_t pending_id;
+static int64_t pending_at;
+static esp_timer_handle_t snapshot_timer;
+static TaskHandle_t snapshot_task_handle;
+// Latched captures the multicast task has not reported yet
+static QueueHandle_t results;
+
+// Latching task
+static void snapshot_task(void *pvParameters);
+
+// Wakes the latching task at the agreed time, runs on the esp_timer task
+static void snapshot_timer_fired(void *arg) {
+    xTaskNotifyGive(snapshot_task_handle);
+}
+
+// Starts the latching task, requires an initialized capture module
+esp_err_t snapshot_init(void) {
+    esp_timer_create_args_t args = {
+            .callback = snapshot_timer_fired,
+            .name = "snapshot",
+    };
+
+    snapshot_lock = xSemaphoreCreateMutex();
+    results = xQueueCreate(SNAPSHOT_RESULTS, sizeof(snapshot_result_t));
+
+    if (snapshot_lock == NULL || results == NULL || esp_timer_create(&args, &snapshot_timer) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreatePinnedToCore(&snapshot_task, "snapshot_task", CONFIG_SNAPSHOT_TASK_STACK, NULL,
+                                CONFIG_SNAPSHOT_TASK_PRIORITY, &snapshot_task_handle,
+                                CONFIG_SNAPSHOT_TASK_CORE) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+// Latches a frame at the given esp_timer time in us, replacing a capture not due yet
+esp_err_t snapshot_schedule(uint32_t id, int64_t at) {
+    int64_t delay = at - esp_timer_get_time();
+
+    if (delay > CONFIG_SNAPSHOT_MAX_AHEAD_MS * 1000LL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    esp_timer_stop(snapshot_timer);
+    pending_id = id;
+    pending_at = at;
+    xSemaphoreGive(snapshot_lock);
+
+    // A command arriving late is latched right away, its skew tells the controller
+    return esp_timer_start_once(snapshot_timer, delay > 0 ? delay : 1);
+}
+
+// Takes the next latched capture not reported yet, returns 0 if there is none
+int snapshot_poll_result(snapshot_result_t *result) {
+    return xQueueReceive(results, result, 0) == pdPASS;
+}
+
+// Returns the latched frame with the given sequence number or NULL
+snapshot_t *snapshot_get(uint32_t seq) {
+    snapshot_t *found = NULL;
+
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+
+    for (int i = 0; i < CONFIG_SNAPSHOT_SLOTS; i++) {
+        if (seq != 0 && slots[i].seq == seq) {
+            found = &slots[i];
+            found->refs++;
+            break;
+        }
+    }
+
+    xSemaphoreGive(snapshot_lock);
+    return found;
+}
+
+// Hands a frame obtained by snapshot_get back
+void snapshot_put(snapshot_t *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+    snapshot->refs--;
+    xSemaphoreGive(snapshot_lock);
+}
+
+// Picks the oldest slot nobody is reading and marks it as being written, caller holds the lock
+static snapshot_t *slot_claim(void) {
+    snapshot_t *oldest = NULL;
+
+    for (int i = 0; i < CONFIG_SNAPSHOT_SLOTS; i++) {
+        if (slots[i].refs == 0 && (oldest == NULL || slots[i].timestamp < oldest->timestamp)) {
+            oldest = &slots[i];
+        }
+    }
+
+    if (oldest != NULL) {
+        oldest->seq = 0;
+        oldest->refs = 1;
+    }
+
+    return oldest;
+}
+
+// Copies a frame into a claimed slot, growing its buffer if needed
+static esp_err_t slot_fill(snapshot_t *slot, const capture_frame_t *frame) {
+    if (slot->size < frame->fb->len) {
+        membudget_free(MEM_SNAPSHOT, slot->buf);
+        slot->buf = membudget_alloc(MEM_SNAPSHOT, frame->fb->len);
+        slot->size = slot->buf != NULL ? frame->fb->len : 0;
+
+        if (slot->buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    memcpy(slot->buf, frame->fb->buf, frame->fb->len);
+    slot->len = frame->fb->len;
+    slot->timestamp = frame->timestamp;
+    slot->profile = frame->profile;
+    return ESP_OK;
+}
+
+// Latching task
+static void snapshot_task(void *pvParameters) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+        uint32_t id = pending_id;
+        int64_t at = pending_at;
+        xSemaphoreGive(snapshot_lock);
+
+        // The first frame completed from now on, so every station picks the one exposed around the same time
+        capture_frame_t *frame = capture_acquire_after(capture_last_seq());
+
+        if (frame == NULL) {
+            metrics_count(METRIC_SNAPSHOT_FAILURES, 1);
+            continue;
+        }
+
+        xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+        snapshot_t *slot = slot_claim();
+        xSemaphoreGive(snapshot_lock);
+
+        esp_err_t res = slot != NULL ? slot_fill(slot, frame) : ESP_ERR_NO_MEM;
+        snapshot_result_t result = {
+                .id = id,
+                .seq = frame->seq,
+                .skew = (int32_t) (frame->timestamp - at),
+        };
+
+        capture_release(frame);
+
+        if (slot != NULL) {
+            xSemaphoreTake(snapshot_lock, portMAX_DELAY);
+            slot->id = id;
+            slot->skew = result.skew;
+            slot->seq = res == ESP_OK ? result.seq : 0;
+            slot->refs--;
+            xSemaphoreGive(snapshot_lock);
+        }
+
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "No slot for capture %u", id);
+            metrics_count(METRIC_SNAPSHOT_FAILURES, 1);
+            continue;
+        }
+
+        metrics_record(METRIC_SNAPSHOT_SKEW, result.skew > 0 ? result.skew : -result.skew);
+        xQueueSend(results, &result, 0);
+        ESP_LOGI(TAG, "Capture %u latched frame #%u, %dus after the agreed time", id, result.seq, result.skew);
+    }
+}
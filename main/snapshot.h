@@ -0,0 +1,57 @@
+/*
+ * snapshot.h
+ *
+ *  Frames latched at a time agreed on with the controller.
+ *
+ *  The controller asks a group of stations to capture at the same
+ *  instant. Each station copies the first frame completed at or after
+ *  that time into one of CONFIG_SNAPSHOT_SLOTS PSRAM slots, so it does
+ *  not hold back the capture pipeline, and keeps it there until the
+ *  controller fetches it by its sequence number.
+ */
+
+#ifndef MAIN_SNAPSHOT_H_
+#define MAIN_SNAPSHOT_H_
+
+#include "settings.h"
+#include "capture.h"
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame copied out of the capture pipeline
+typedef struct {
+    uint8_t *buf;           // JPEG in PSRAM
+    size_t size;            // allocated bytes
+    size_t len;
+    uint32_t id;            // capture id chosen by the controller
+    uint32_t seq;           // frame sequence number, 0 while the slot is written
+    int64_t timestamp;      // esp_timer time of capture completion in us
+    int32_t skew;           // us the frame completed after the agreed time
+    capture_profile_t profile;
+    int refs;
+} snapshot_t;
+
+// Latched capture to be reported to the controller
+typedef struct {
+    uint32_t id;
+    uint32_t seq;
+    int32_t skew;
+} snapshot_result_t;
+
+// Starts the latching task, requires an initialized capture module
+esp_err_t snapshot_init(void);
+
+// Latches a frame at the given esp_timer time in us, replacing a capture not due yet
+esp_err_t snapshot_schedule(uint32_t id, int64_t at);
+
+// Takes the next latched capture not reported yet, returns 0 if there is none
+int snapshot_poll_result(snapshot_result_t *result);
+
+// Returns the latched frame with the given sequence number or NULL
+snapshot_t *snapshot_get(uint32_t seq);
+
+// Hands a frame obtained by snapshot_get back
+void snapshot_put(snapshot_t *snapshot);
+
+#endif /* MAIN_SNAPSHOT_H_ */
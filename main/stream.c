@@ -0,0 +1,255 @@
+/*
+ * stream.c
+ *
+ *  MJPEG streams of the stream server, each served by a task of its own.
+ */
+
+#include "stream.h"
+#include "capture.h"
+#include "frame.h"
+#include "metrics.h"
+#include "session.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <sys/param.h>
+#include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// Response head, the parts follow until the connection closes
+static const char STREAM_HEAD[] = "HTTP/1.1 200 OK\r\n"
+        "Content-Type: " STREAM_CONTENT_TYPE "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n\r\n";
+static const char *STREAM_PART = "\r\n--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+
+// Connection of a stream task
+typedef struct {
+    TaskHandle_t task;
+    SemaphoreHandle_t lock;     // held by the task while it writes to fd
+    int fd;                     // -1 while the task is free
+    int fps;
+    int closed;                 // the server closed fd, the task must not write to it anymore
+} stream_slot_t;
+
+// Logger tag name
+static const char *TAG = "STR";
+// Guards handing out the slots
+static SemaphoreHandle_t stream_lock;
+static stream_slot_t slots[CONFIG_STREAM_MAX_CLIENTS];
+// Server the connections belong to
+static httpd_handle_t stream_server;
+
+// Sends the newest frames to the connection of a slot until it fails
+static void stream_task(void *pvParameters);
+
+// Creates the stream tasks, a no-op if they are running already
+esp_err_t stream_init(httpd_handle_t server) {
+    stream_server = server;
+
+    if (stream_lock != NULL) {
+        return ESP_OK;
+    }
+
+    stream_lock = xSemaphoreCreateMutex();
+
+    if (stream_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CONFIG_STREAM_MAX_CLIENTS; i++) {
+        char name[16];
+
+        slots[i].fd = -1;
+        slots[i].lock = xSemaphoreCreateMutex();
+        snprintf(name, sizeof(name), "stream_task_%d", i);
+
+        if (slots[i].lock == NULL
+                || xTaskCreatePinnedToCore(&stream_task, name, CONFIG_STREAM_TASK_STACK, &slots[i],
+                                           CONFIG_STREAM_TASK_PRIORITY, &slots[i].task,
+                                           CONFIG_STREAM_TASK_CORE) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    return ESP_OK;
+}
+
+// Lets go of a connection the server closes, runs on the server task before the socket is closed
+static void stream_detach(int fd, void *arg) {
+    stream_slot_t *slot = (stream_slot_t *) arg;
+
+    // Waits for a write in progress, the closing peer makes it fail right away
+    xSemaphoreTake(slot->lock, portMAX_DELAY);
+    slot->closed = 1;
+    xSemaphoreGive(slot->lock);
+
+    xTaskNotifyGive(slot->task);
+}
+
+// Hands the connection of a /stream request to a free stream task, ESP_ERR_NOT_FOUND if all are busy
+esp_err_t stream_start(httpd_req_t *req, int fps) {
+    int fd = httpd_req_to_sockfd(req);
+    stream_slot_t *slot = NULL;
+    struct timeval timeout = { .tv_sec = CONFIG_STREAM_SEND_TIMEOUT_S };
+
+    if (stream_lock == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+
+    for (int i = 0; i < CONFIG_STREAM_MAX_CLIENTS && slot == NULL; i++) {
+        if (slots[i].fd < 0) {
+            slot = &slots[i];
+        }
+    }
+
+    if (slot == NULL || session_hand_off(req, stream_detach, slot) != ESP_OK) {
+        xSemaphoreGive(stream_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    slot->fd = fd;
+    slot->fps = fps;
+    slot->closed = 0;
+    xSemaphoreGive(stream_lock);
+
+    // A reader taking nothing for this long is dropped instead of holding its frame buffer
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    xTaskNotifyGive(slot->task);
+    return ESP_OK;
+}
+
+// Writes to the connection of a slot unless the server closed it meanwhile
+static esp_err_t stream_write(stream_slot_t *slot, struct iovec *iov, int count) {
+    esp_err_t res = ESP_FAIL;
+
+    xSemaphoreTake(slot->lock, portMAX_DELAY);
+
+    if (!slot->closed) {
+        res = frame_writev(slot->fd, iov, count);
+    }
+
+    xSemaphoreGive(slot->lock);
+    return res;
+}
+
+// Returns whether the server closed the connection of a slot
+static int stream_closed(stream_slot_t *slot) {
+    xSemaphoreTake(slot->lock, portMAX_DELAY);
+    int closed = slot->closed;
+    xSemaphoreGive(slot->lock);
+    return closed;
+}
+
+// Sends the newest frames at up to the frame rate of the slot until a write fails
+static void stream_serve(stream_slot_t *slot) {
+    char part[128];
+    uint32_t last_seq = 0;
+    uint32_t frames = 0;
+    uint32_t dropped = 0;
+    uint32_t overhead = 0;
+    int64_t interval = 1000000 / slot->fps;
+    int64_t st_start = esp_timer_get_time();
+    int64_t next_due = st_start;
+    struct iovec head = { .iov_base = (void *) STREAM_HEAD, .iov_len = sizeof(STREAM_HEAD) - 1 };
+    esp_err_t res = stream_write(slot, &head, 1);
+
+    ESP_LOGI(TAG, "Stream on socket %d started at up to %d fps", slot->fd, slot->fps);
+
+    while (res == ESP_OK) {
+        int64_t now = esp_timer_get_time();
+
+        // stream_detach wakes the task early, a client leaving frees its slot right away
+        if (now < next_due) {
+            ulTaskNotifyTake(pdTRUE, MAX(1, (next_due - now) / 1000 / portTICK_PERIOD_MS));
+        }
+
+        if (stream_closed(slot)) {
+            break;
+        }
+
+        next_due = MAX(next_due + interval, esp_timer_get_time());
+
+        // Always take the newest frame, whatever was captured meanwhile is dropped for this client
+        // The delay is rounded to ticks, a client woken before the next frame waits for it instead of a repeat
+        int64_t cap_start = esp_timer_get_time();
+        capture_frame_t *frame = last_seq == 0 ? capture_acquire(interval) : capture_acquire_after(last_seq);
+
+        int64_t send_start = esp_timer_get_time();
+        metrics_record(METRIC_CAPTURE, send_start - cap_start);
+
+        if (!frame) {
+            metrics_count(METRIC_CAPTURE_FAILURES, 1);
+            break;
+        }
+
+        if (last_seq != 0) {
+            dropped += frame->seq - last_seq - 1;
+            metrics_count(METRIC_STREAM_DROPS, frame->seq - last_seq - 1);
+        }
+
+        last_seq = frame->seq;
+
+        // Only the part header is formatted, the JPEG goes out straight from the frame buffer
+        int part_len = snprintf(part, sizeof(part), STREAM_PART, frame->fb->len);
+        struct iovec iov[] = {
+                { .iov_base = part, .iov_len = part_len },
+                { .iov_base = frame->fb->buf, .iov_len = frame->fb->len },
+        };
+
+        res = stream_write(slot, iov, sizeof(iov) / sizeof(iov[0]));
+
+        if (res == ESP_OK) {
+            metrics_record(METRIC_SEND, esp_timer_get_time() - send_start);
+            metrics_count(METRIC_SEND_BYTES, part_len + frame->fb->len);
+            frames++;
+            overhead += part_len;
+        } else {
+            metrics_count(METRIC_SEND_FAILURES, 1);
+        }
+
+        capture_release(frame);
+    }
+
+    int64_t st_ms = MAX(1, (esp_timer_get_time() - st_start) / 1000);
+    ESP_LOGI(TAG, "Stream ended: %u frames in %ums (%u.%01u fps), %u dropped, %uB headers per frame, 0B copied",
+             frames, (uint32_t) st_ms, (uint32_t) (frames * 1000 / st_ms), (uint32_t) (frames * 10000 / st_ms % 10),
+             dropped, frames ? overhead / frames : 0);
+}
+
+// Sends the newest frames to the connection of a slot until it fails
+static void stream_task(void *pvParameters) {
+    stream_slot_t *slot = (stream_slot_t *) pvParameters;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Also woken by the close of the previous connection
+        xSemaphoreTake(stream_lock, portMAX_DELAY);
+        int fd = slot->fd;
+        xSemaphoreGive(stream_lock);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        stream_serve(slot);
+
+        // The socket may only be reused once the server closed it and stream_detach ran
+        if (!stream_closed(slot)) {
+            httpd_sess_trigger_close(stream_server, fd);
+        }
+
+        while (!stream_closed(slot)) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+
+        xSemaphoreTake(stream_lock, portMAX_DELAY);
+        slot->fd = -1;
+        xSemaphoreGive(stream_lock);
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * stream.h
+ *
+ *  MJPEG streams of the stream server, each served by a task of its own.
+ *
+ *  The /stream handler hands its connection to one of
+ *  CONFIG_STREAM_MAX_CLIENTS stream tasks and returns, so the server
+ *  task is free for the next client. A stream task sends the newest
+ *  frame at up to the frame rate its client asked for, straight from
+ *  the frame buffer. Frames completed while the client still receives
+ *  the previous one are skipped for that client only, so a slow reader
+ *  gets fewer frames while the camera and the other streams keep their
+ *  pace. A reader that takes nothing for CONFIG_STREAM_SEND_TIMEOUT_S
+ *  is disconnected.
+ */
+
+#ifndef MAIN_STREAM_H_
+#define MAIN_STREAM_H_
+
+#include "settings.h"
+#include <esp_err.h>
+#include <esp_http_server.h>
+
+#define STREAM_BOUNDARY "123456789000000000000987654321"
+#define STREAM_CONTENT_TYPE "multipart/x-mixed-replace;boundary=" STREAM_BOUNDARY
+
+// Creates the stream tasks, a no-op if they are running already
+esp_err_t stream_init(httpd_handle_t server);
+
+// Hands the connection of a /stream request to a free stream task, ESP_ERR_NOT_FOUND if all are busy
+// Nothing has been sent on the connection when it fails, the handler answers itself
+esp_err_t stream_start(httpd_req_t *req, int fps);
+
+#endif /* MAIN_STREAM_H_ */